@@ -0,0 +1,194 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phenom/defs.h"
+#include "phenom/memory.h"
+#include "phenom/sysutil.h"
+
+/* Arena allocator.
+ * Allocations are carved from the front of the most recently added chunk.
+ * Requests that are large relative to the chunk size get a chunk of their
+ * own that is linked in behind the current chunk, so that the space left
+ * in the current chunk is not wasted. */
+
+#define ARENA_ALIGN         16
+#define ARENA_DEFAULT_CHUNK 8192
+
+struct arena_chunk {
+  struct arena_chunk *next;
+  uint64_t size;
+} __attribute__((aligned(ARENA_ALIGN)));
+
+struct ph_arena {
+  ph_memtype_t mt;
+  uint32_t chunk_size;
+  struct arena_chunk *chunks;
+  char *cursor, *end;
+  uint64_t bytes;
+};
+
+static ph_memtype_t mt_arena;
+static struct ph_memtype_def arena_def = {
+  "arena", "arena", sizeof(ph_arena_t), PH_MEM_FLAGS_ZERO
+};
+
+static void arena_init(void)
+{
+  mt_arena = ph_memtype_register(&arena_def);
+}
+PH_LIBRARY_INIT_PRI(arena_init, 0, 5)
+
+static inline uint64_t arena_round(uint64_t size)
+{
+  return (size + ARENA_ALIGN - 1) & ~((uint64_t)ARENA_ALIGN - 1);
+}
+
+static inline char *chunk_data(struct arena_chunk *chunk)
+{
+  return (char*)(chunk + 1);
+}
+
+ph_arena_t *ph_arena_new(ph_memtype_t memtype, uint32_t chunk_size)
+{
+  ph_arena_t *arena;
+
+  if (chunk_size == 0) {
+    chunk_size = ARENA_DEFAULT_CHUNK;
+  }
+  if (chunk_size < 4 * sizeof(struct arena_chunk)) {
+    chunk_size = 4 * sizeof(struct arena_chunk);
+  }
+
+  arena = ph_mem_alloc(mt_arena);
+  if (!arena) {
+    return NULL;
+  }
+
+  arena->mt = memtype;
+  arena->chunk_size = chunk_size;
+
+  return arena;
+}
+
+static struct arena_chunk *new_chunk(ph_arena_t *arena, uint64_t size)
+{
+  struct arena_chunk *chunk;
+
+  chunk = ph_mem_alloc_size(arena->mt, size);
+  if (!chunk) {
+    return NULL;
+  }
+  chunk->size = size;
+  return chunk;
+}
+
+void *ph_arena_alloc(ph_arena_t *arena, uint64_t size)
+{
+  struct arena_chunk *chunk;
+  uint64_t avail = arena->chunk_size - sizeof(*chunk);
+  char *res;
+
+  size = arena_round(size ? size : 1);
+
+  if (ph_likely(size <= (uint64_t)(arena->end - arena->cursor))) {
+    res = arena->cursor;
+    arena->cursor += size;
+    arena->bytes += size;
+    return res;
+  }
+
+  if (size > avail / 4 && arena->chunks) {
+    // Big enough that starting a new chunk for it would throw away
+    // a meaningful amount of the current one; give it its own chunk
+    chunk = new_chunk(arena, sizeof(*chunk) + size);
+    if (!chunk) {
+      return NULL;
+    }
+    chunk->next = arena->chunks->next;
+    arena->chunks->next = chunk;
+    arena->bytes += size;
+    return chunk_data(chunk);
+  }
+
+  chunk = new_chunk(arena, sizeof(*chunk) + MAX(size, avail));
+  if (!chunk) {
+    return NULL;
+  }
+  chunk->next = arena->chunks;
+  arena->chunks = chunk;
+
+  res = chunk_data(chunk);
+  arena->cursor = res + size;
+  arena->end = (char*)chunk + chunk->size;
+  arena->bytes += size;
+
+  return res;
+}
+
+void *ph_arena_memdup(ph_arena_t *arena, const void *buf, uint64_t size)
+{
+  void *res = ph_arena_alloc(arena, size);
+
+  if (res) {
+    memcpy(res, buf, size);
+  }
+  return res;
+}
+
+void ph_arena_reset(ph_arena_t *arena)
+{
+  struct arena_chunk *chunk, *next, *keep = NULL;
+
+  for (chunk = arena->chunks; chunk; chunk = next) {
+    next = chunk->next;
+
+    if (!keep && chunk->size == arena->chunk_size) {
+      keep = chunk;
+      continue;
+    }
+    ph_mem_free(arena->mt, chunk);
+  }
+
+  arena->chunks = keep;
+  arena->bytes = 0;
+  if (keep) {
+    keep->next = NULL;
+    arena->cursor = chunk_data(keep);
+    arena->end = (char*)keep + keep->size;
+  } else {
+    arena->cursor = NULL;
+    arena->end = NULL;
+  }
+}
+
+void ph_arena_destroy(ph_arena_t *arena)
+{
+  struct arena_chunk *chunk, *next;
+
+  for (chunk = arena->chunks; chunk; chunk = next) {
+    next = chunk->next;
+    ph_mem_free(arena->mt, chunk);
+  }
+  ph_mem_free(mt_arena, arena);
+}
+
+uint64_t ph_arena_bytes(ph_arena_t *arena)
+{
+  return arena->bytes;
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -62,7 +62,8 @@ static ph_memtype_def_t defs[] = {
   { "buffer", "64k", 64*1024, 0 },
   { "buffer", "vsize", 0, 0 },
   { "buffer", "queue", sizeof(ph_bufq_t), PH_MEM_FLAGS_ZERO },
-  { "buffer", "queue_ent", sizeof(struct ph_bufq_ent), PH_MEM_FLAGS_ZERO },
+  { "buffer", "queue_ent", sizeof(struct ph_bufq_ent),
+    PH_MEM_FLAGS_ZERO|PH_MEM_FLAGS_SLAB },
 };
 
 static struct {
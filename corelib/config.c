@@ -15,13 +15,24 @@
  */
 #include "phenom/configuration.h"
 #include <ck_rwlock.h>
+#include <ck_spinlock.h>
 #include "phenom/stream.h"
 #include "phenom/json.h"
 #include "phenom/log.h"
 #include "phenom/printf.h"
+#include "corelib/memprof.h"
+#include "corelib/lockprof.h"
 
 static ph_variant_t *global_config = NULL;
 static ck_rwlock_t lock = CK_RWLOCK_INITIALIZER;
+static struct ph_lock_class config_lock_class = PH_LOCK_CLASS_INIT("config");
+
+// Bumped each time the configuration is replaced.  Starts above the
+// zero of a fresh handle, so that its first use queries
+static uint32_t config_gen = 1;
+static ck_spinlock_t handle_lock = CK_SPINLOCK_INITIALIZER;
+static struct ph_lock_class handle_lock_class =
+  PH_LOCK_CLASS_INIT("config_handle");
 
 void ph_config_set_global(ph_variant_t *cfg)
 {
@@ -30,10 +41,11 @@ void ph_config_set_global(ph_variant_t *cfg)
   // global_conf will take a ref on cfg
   ph_var_addref(cfg);
 
-  ck_rwlock_write_lock(&lock);
+  ph_rwlock_write_lock(&lock, &config_lock_class);
   {
     old = ck_pr_load_ptr(&global_config);
     ck_pr_store_ptr(&global_config, cfg);
+    ck_pr_inc_32(&config_gen);
   }
   ck_rwlock_write_unlock(&lock);
 
@@ -41,13 +53,17 @@ void ph_config_set_global(ph_variant_t *cfg)
     // We took the ref owned by global_config
     ph_var_delref(old);
   }
+
+  ph_mem_configure_limits();
+  ph_mem_prof_configure();
+  ph_lock_prof_configure();
 }
 
 ph_variant_t *ph_config_get_global(void)
 {
   ph_variant_t *ref;
 
-  ck_rwlock_read_lock(&lock);
+  ph_rwlock_read_lock(&lock, &config_lock_class);
   ref = ck_pr_load_ptr(&global_config);
   if (ref) {
     ph_var_addref(ref);
@@ -73,6 +89,143 @@ ph_variant_t *ph_config_query(const char *query)
   return val;
 }
 
+// The part of a handle that is covered by its seqno
+struct handle_val {
+  uint32_t gen;
+  bool is_int;
+  bool is_double;
+  int64_t ival;
+  double dval;
+};
+
+static inline void handle_load(ph_config_handle_t *h, struct handle_val *val)
+{
+  uint32_t vers;
+
+  do {
+    for (;;) {
+      vers = ck_pr_load_32(&h->seqno);
+      if ((vers & 1) == 0) {
+        break;
+      }
+      ck_pr_stall();
+    }
+    ck_pr_fence_load();
+
+    val->gen = h->gen;
+    val->is_int = h->is_int;
+    val->is_double = h->is_double;
+    val->ival = h->ival;
+    val->dval = h->dval;
+
+    ck_pr_fence_load();
+  } while (ck_pr_load_32(&h->seqno) != vers);
+}
+
+// Repeats the query of a stale handle and returns the fresh value
+static void handle_refresh(ph_config_handle_t *h, struct handle_val *val)
+{
+  ph_variant_t *g, *v = NULL;
+  ph_var_path_t *path;
+
+  // Compiling and walking the path allocate, so do that before taking
+  // handle_lock; a thread that loses the race to compile frees its copy
+  path = ck_pr_load_ptr(&h->path);
+  if (!path) {
+    path = ph_var_path_compile(h->query);
+    if (path && !ck_pr_cas_ptr(&h->path, NULL, path)) {
+      ph_var_path_free(path);
+      path = ck_pr_load_ptr(&h->path);
+    }
+  }
+
+  ph_rwlock_read_lock(&lock, &config_lock_class);
+  val->gen = ck_pr_load_32(&config_gen);
+  g = ck_pr_load_ptr(&global_config);
+  if (g) {
+    ph_var_addref(g);
+  }
+  ck_rwlock_read_unlock(&lock);
+
+  if (g && path) {
+    v = ph_var_path_get(g, path);
+  }
+  val->is_int = v && ph_var_is_int(v);
+  val->ival = val->is_int ? ph_var_int_val(v) : 0;
+  val->is_double = v && ph_var_is_double(v);
+  val->dval = val->is_double ? ph_var_double_val(v) : 0;
+
+  if (g) {
+    ph_var_delref(g);
+  }
+
+  // Serializes the stores, so that a slow refresh can't overwrite the
+  // value that a faster one took from a newer configuration
+  ph_spinlock_lock(&handle_lock, &handle_lock_class);
+  if ((int32_t)(val->gen - h->gen) > 0) {
+    // Readers retry while the sequence number is odd, so that they
+    // never mix fields from two configurations
+    ck_pr_store_32(&h->seqno, h->seqno + 1);
+    ck_pr_fence_store();
+
+    h->gen = val->gen;
+    h->is_int = val->is_int;
+    h->ival = val->ival;
+    h->is_double = val->is_double;
+    h->dval = val->dval;
+
+    ck_pr_fence_store();
+    ck_pr_store_32(&h->seqno, h->seqno + 1);
+  } else {
+    // Someone else already stored something at least as new
+    val->gen = h->gen;
+    val->is_int = h->is_int;
+    val->is_double = h->is_double;
+    val->ival = h->ival;
+    val->dval = h->dval;
+  }
+  ck_spinlock_unlock(&handle_lock);
+}
+
+static inline void handle_get(ph_config_handle_t *h, struct handle_val *val)
+{
+  handle_load(h, val);
+  if (ph_unlikely(val->gen != ck_pr_load_32(&config_gen))) {
+    handle_refresh(h, val);
+  }
+}
+
+int64_t ph_config_handle_int(ph_config_handle_t *h, int64_t defval)
+{
+  struct handle_val val;
+
+  handle_get(h, &val);
+  if (!val.is_int) {
+    return defval;
+  }
+  return val.ival;
+}
+
+double ph_config_handle_double(ph_config_handle_t *h, double defval)
+{
+  struct handle_val val;
+
+  handle_get(h, &val);
+  if (!val.is_double) {
+    return defval;
+  }
+  return val.dval;
+}
+
+void ph_config_handle_destroy(ph_config_handle_t *h)
+{
+  if (h->path) {
+    ph_var_path_free(h->path);
+    h->path = NULL;
+  }
+  h->gen = 0;
+}
+
 int64_t ph_config_queryf_int(int64_t defval, const char *query, ...)
 {
   char expanded[1024];
@@ -28,11 +28,20 @@
  * counter updates to proceed uncontested for any given thread.
  *
  * For each defined counter scope, each thread maintains a block
- * of counter values.  The counter block is protected by a seqlock;
+ * of counter values.  Scopes are assigned dense integer ids and each
+ * thread keeps a table of its blocks indexed by that id, so locating
+ * the block on the update path is a single array load.
+ * The counter block is protected by a seqlock;
  * a stat read operation will walk the counter blocks for each
  * thread and sum them into the stat structure that is to be
  * returned.
  *
+ * When a thread exits, the values in its blocks are folded into a
+ * per-scope baseline and the blocks are released; readers start from
+ * the baseline and add the blocks of the live threads.  Folding bumps
+ * a global sequence number so that a reader that raced with it can
+ * retry rather than count a block twice or not at all.
+ *
  * Because we may increment and decrement across threads, the value
  * of any given counter on any given thread at a certain point in
  * time may be negative even though the total is positive.
@@ -50,9 +59,17 @@ CK_STACK_CONTAINER(ph_thread_t,
 static ck_hs_t ph_counter_scope_map;
 static ck_spinlock_t scope_map_lock = CK_SPINLOCK_INITIALIZER;
 
-/** atomic scope identifier */
+/** atomic scope identifier.
+ * Ids are handed out sequentially and are not reused, which keeps the
+ * per-thread block tables compact for the long-lived scopes that we
+ * expect applications to define. */
 static uint32_t next_scope_id = 0;
 
+/** serializes folding of exited threads; fold_seqno is odd while
+ * a fold is in progress */
+static ck_spinlock_t fold_lock = CK_SPINLOCK_INITIALIZER;
+static uint32_t fold_seqno = 0;
+
 /** We need to allocate space for our epoch-based SMR to manage its stack
  * of outstanding allocations. Since that data is not managed by the caller
  * of the allocation, but by the SMR manager itself, we don't provide that
@@ -101,17 +118,48 @@ static struct ck_malloc hs_allocator = {
 
 // Brute force tear down to make valgrind happy.
 // This is only invoked at the end of the process.
+static void free_block(struct ph_counter_block *block)
+{
+  int i;
+
+  if (block->hists) {
+    for (i = 0; i < block->scope->num_slots; i++) {
+      free(block->hists[i]);
+    }
+    free(block->hists);
+  }
+  free(block);
+}
+
+static void free_scope(ph_counter_scope_t *scope)
+{
+  int i;
+
+  for (i = 0; i < scope->next_slot && i < scope->num_slots; i++) {
+    free(scope->slot_names[i]);
+    free(scope->hist_defs[i]);
+    free(scope->base_hists[i]);
+  }
+  free(scope);
+}
+
 void ph_counter_tear_down_thread(ph_thread_t *thr)
 {
-  ck_hs_iterator_t hiter;
-  struct ph_counter_block *block;
+  struct ph_counter_block_table *tab = thr->counter_blocks;
+  uint32_t i;
+
+  if (!tab) {
+    return;
+  }
 
-  ck_hs_iterator_init(&hiter);
-  while (ck_hs_next(&thr->counter_hs, &hiter, (void**)(void*)&block)) {
-    free(block);
+  for (i = 0; i < tab->size; i++) {
+    if (tab->blocks[i]) {
+      free_block(tab->blocks[i]);
+    }
   }
 
-  ck_hs_destroy(&thr->counter_hs);
+  free(tab);
+  thr->counter_blocks = NULL;
 }
 
 /* Tear things down and make valgrind happy that we didn't leak */
@@ -123,11 +171,7 @@ static void counter_destroy(void)
 
   ck_hs_iterator_init(&iter);
   while (ck_hs_next(&ph_counter_scope_map, &iter, (void**)(void*)&scope)) {
-    int i;
-    for (i = 0; i < scope->next_slot; i++) {
-      free(scope->slot_names[i]);
-    }
-    free(scope);
+    free_scope(scope);
   }
 
   ck_hs_destroy(&ph_counter_scope_map);
@@ -154,11 +198,10 @@ static unsigned long scope_map_hash(const void *key, // NOLINT(runtime/int)
     unsigned long seed) // NOLINT(runtime/int)
 {
   const ph_counter_scope_t *sk = key;
-  uint64_t h[2];
 
-  ph_hash_bytes_murmur(sk->full_scope_name, strlen(sk->full_scope_name),
-      seed, h);
-  return h[0];
+  // ph_hash_bytes is already seeded per process, and better than lrand48
+  ph_unused_parameter(seed);
+  return ph_hash_bytes(sk->full_scope_name, strlen(sk->full_scope_name));
 }
 
 /* If you see this trigger, it means that our definition of the counter
@@ -217,21 +260,6 @@ const char *ph_counter_scope_get_name(
   return scope->full_scope_name;
 }
 
-static bool scope_id_compare(const void *a, const void *b)
-{
-  uint32_t A = *(uint32_t*)a;
-  uint32_t B = *(uint32_t*)b;
-  return A == B;
-}
-
-static unsigned long scope_id_hash(const void *key, // NOLINT(runtime/int)
-    unsigned long seed) // NOLINT(runtime/int)
-{
-  ph_unused_parameter(seed);
-
-  return 1 + *(uint32_t*)key;
-}
-
 ph_counter_scope_t *ph_counter_scope_define(
     ph_counter_scope_t *parent,
     const char *path,
@@ -257,24 +285,25 @@ ph_counter_scope_t *ph_counter_scope_define(
       // space for full name if different (len + NUL byte)
       (full_name_len ? full_name_len + 1 : 0) +
       // slot_names
-      ((max_counters - 1) * sizeof(char*)));
+      ((max_counters - 1) * sizeof(char*)) +
+      // hist_defs, base_hists, base_slots
+      (max_counters * (sizeof(struct ph_counter_hist_def*) +
+                       sizeof(struct ph_counter_hist*) + sizeof(int64_t))));
   if (!scope) {
     return NULL;
   }
 
-  // Want to ensure that we never end up with a 0 scope id,
-  // even if we roll; the CK hash routines don't support
-  // a 0 key in DIRECT mode.
-  do {
-    scope->scope_id = ck_pr_faa_32(&next_scope_id, 1);
-  } while (scope->scope_id == 0);
-  // pre-compute the hash value
-  scope->hash = scope_id_hash(&scope->scope_id, 0);
+  scope->scope_id = ck_pr_faa_32(&next_scope_id, 1);
 
   // caller owns this ref
   scope->refcnt = 1;
   scope->num_slots = max_counters;
-  scope->scope_name = (char*)&scope->slot_names[max_counters];
+  scope->hist_defs = (struct ph_counter_hist_def**)
+    &scope->slot_names[max_counters];
+  scope->base_hists = (struct ph_counter_hist**)
+    &scope->hist_defs[max_counters];
+  scope->base_slots = (int64_t*)&scope->base_hists[max_counters];
+  scope->scope_name = (char*)&scope->base_slots[max_counters];
   strcpy(scope->scope_name, path); // NOLINT(runtime/printf)
 
 
@@ -294,15 +323,8 @@ ph_counter_scope_t *ph_counter_scope_define(
   ck_spinlock_lock(&scope_map_lock);
   {
     if (ck_hs_get(&ph_counter_scope_map, hash, scope) != NULL) {
-      int i;
-
       ck_spinlock_unlock(&scope_map_lock);
-
-      for (i = 0; i < scope->next_slot; i++) {
-        free(scope->slot_names[i]);
-      }
-      free(scope);
-
+      free_scope(scope);
       return NULL;
     }
 
@@ -358,23 +380,17 @@ ph_counter_scope_t *ph_counter_scope_resolve(
 
 void ph_counter_scope_delref(ph_counter_scope_t *scope)
 {
-  int i;
-
   if (!ph_refcnt_del(&scope->refcnt)) {
     return;
   }
 
-  for (i = 0; i < scope->next_slot; i++) {
-    free(scope->slot_names[i]);
-  }
-
   ck_spinlock_lock(&scope_map_lock);
   {
     uint64_t hash;
 
     hash = CK_HS_HASH(&ph_counter_scope_map, scope_map_hash, scope);
     ck_hs_remove(&ph_counter_scope_map, hash, scope);
-    free(scope);
+    free_scope(scope);
   }
   ck_spinlock_unlock(&scope_map_lock);
 }
@@ -419,46 +435,203 @@ bool ph_counter_scope_register_counter_block(
   return true;
 }
 
+#define COUNTER_TABLE_MIN 32
+
+static struct ph_counter_block_table *alloc_block_table(uint32_t size)
+{
+  return calloc(1, sizeof(struct ph_counter_block_table) +
+      ((size - 1) * sizeof(struct ph_counter_block*)));
+}
+
+#define HIST_DEFAULT_MAX       (INT64_C(1) << 36)
+#define HIST_DEFAULT_PRECISION 5
+#define HIST_MAX_PRECISION     10
+
+static inline uint32_t hist_bucket(const struct ph_counter_hist_def *def,
+    int64_t value)
+{
+  uint64_t v;
+  int shift;
+
+  if (value <= 0) {
+    return 0;
+  }
+  if (value > def->max_value) {
+    value = def->max_value;
+  }
+  v = value;
+  if (v < (UINT64_C(1) << def->precision)) {
+    return (uint32_t)v;
+  }
+
+  shift = (63 - __builtin_clzll(v)) - def->precision;
+  return ((uint32_t)(shift + 1) << def->precision) +
+    (uint32_t)((v >> shift) - (UINT64_C(1) << def->precision));
+}
+
+/* largest value that maps to the given bucket */
+static int64_t hist_bucket_upper(const struct ph_counter_hist_def *def,
+    uint32_t idx)
+{
+  uint32_t sub_count = 1u << def->precision;
+  int shift;
+
+  if (idx < sub_count) {
+    return idx;
+  }
+  shift = (idx >> def->precision) - 1;
+  return (int64_t)((((uint64_t)(idx & (sub_count - 1)) + sub_count + 1)
+        << shift) - 1);
+}
+
+uint8_t ph_counter_scope_register_histogram(
+    ph_counter_scope_t *scope,
+    const char *name,
+    const ph_counter_histogram_spec_t *spec)
+{
+  struct ph_counter_hist_def *def;
+  uint8_t slot;
+
+  def = calloc(1, sizeof(*def));
+  if (!def) {
+    return PH_COUNTER_INVALID;
+  }
+
+  def->max_value = spec && spec->max_value > 0 ?
+    spec->max_value : HIST_DEFAULT_MAX;
+  def->precision = spec && spec->precision ?
+    MIN(spec->precision, HIST_MAX_PRECISION) : HIST_DEFAULT_PRECISION;
+  def->num_buckets = hist_bucket(def, def->max_value) + 1;
+
+  slot = ph_counter_scope_register_counter(scope, name);
+  if (slot == PH_COUNTER_INVALID) {
+    free(def);
+    return PH_COUNTER_INVALID;
+  }
+
+  ck_pr_fence_store();
+  ck_pr_store_ptr(&scope->hist_defs[slot], def);
+  return slot;
+}
+
+bool ph_counter_scope_is_histogram(
+    ph_counter_scope_t *scope,
+    uint8_t offset)
+{
+  if (offset >= scope->num_slots) {
+    return false;
+  }
+  return ck_pr_load_ptr(&scope->hist_defs[offset]) != NULL;
+}
+
 void ph_counter_init_thread(ph_thread_t *thr)
 {
-  if (!ck_hs_init(&thr->counter_hs, CK_HS_MODE_SPMC|CK_HS_MODE_OBJECT,
-        scope_id_hash, scope_id_compare, &hs_allocator, 32, 0)) {
-    ph_panic("failed to init counter hash");
+  struct ph_counter_block_table *tab;
+  uint32_t size = COUNTER_TABLE_MIN;
+
+  while (size < ck_pr_load_32(&next_scope_id)) {
+    size *= 2;
+  }
+
+  tab = alloc_block_table(size);
+  if (!tab) {
+    ph_panic("failed to init counter block table");
+  }
+  tab->size = size;
+  thr->counter_blocks = tab;
+}
+
+/* Grow the table for the calling thread so that it can hold scope_id.
+ * Readers may still be looking at the old table, so it is retired
+ * through the epoch rather than freed immediately */
+static struct ph_counter_block_table *grow_block_table(ph_thread_t *me,
+    uint32_t scope_id)
+{
+  struct ph_counter_block_table *old = me->counter_blocks, *tab;
+  uint32_t size = old->size;
+
+  while (size <= scope_id) {
+    size *= 2;
   }
+
+  tab = alloc_block_table(size);
+  if (!tab) {
+    return NULL;
+  }
+  tab->size = size;
+  memcpy(tab->blocks, old->blocks, old->size * sizeof(old->blocks[0]));
+
+  ck_pr_fence_store();
+  ck_pr_store_ptr(&me->counter_blocks, tab);
+  ph_thread_epoch_defer(&old->entry, deferred_free);
+
+  return tab;
 }
 
-static ph_counter_block_t *get_block_for_scope(
+static ph_counter_block_t *make_block_for_scope(ph_thread_t *me,
     ph_counter_scope_t *scope)
 {
-  ph_thread_t *me = ph_thread_self();
-  struct ph_counter_block *block = NULL;
+  struct ph_counter_block_table *tab = me->counter_blocks;
+  struct ph_counter_block *block;
 
-  /* locate my counter block */
-  block = ck_hs_get(&me->counter_hs, scope->hash, &scope->scope_id);
-  if (ph_likely(block)) {
-    /* got it! */
-    return block;
+  if (scope->scope_id >= tab->size) {
+    tab = grow_block_table(me, scope->scope_id);
+    if (ph_unlikely(!tab)) {
+      return NULL;
+    }
   }
 
-  /* not present; we get to create it */
   block = calloc(1, sizeof(*block) +
       ((scope->num_slots - 1) * sizeof(int64_t)));
   if (ph_unlikely(!block)) {
     return NULL;
   }
-  /* the hash table owns this reference */
+  /* the table owns this reference */
   block->refcnt = 1;
   block->scope_id = scope->scope_id;
+  block->scope = scope;
 
-  if (ph_unlikely(!ck_hs_put(&me->counter_hs, scope->hash,
-          &block->scope_id))) {
-    free(block);
-    return NULL;
-  }
+  /* make the block contents visible before the block itself */
+  ck_pr_fence_store();
+  ck_pr_store_ptr(&tab->blocks[scope->scope_id], block);
 
   return block;
 }
 
+static inline ph_counter_block_t *get_block_for_scope(
+    ph_counter_scope_t *scope)
+{
+  ph_thread_t *me = ph_thread_self();
+  struct ph_counter_block_table *tab = me->counter_blocks;
+  struct ph_counter_block *block;
+
+  /* locate my counter block */
+  if (ph_likely(scope->scope_id < tab->size)) {
+    block = tab->blocks[scope->scope_id];
+    if (ph_likely(block != NULL)) {
+      return block;
+    }
+  }
+
+  /* not present; we get to create it */
+  return make_block_for_scope(me, scope);
+}
+
+/* Locate the block for scope in another thread.
+ * Must be called from within an epoch section */
+static inline ph_counter_block_t *find_block(ph_thread_t *thr,
+    ph_counter_scope_t *scope)
+{
+  struct ph_counter_block_table *tab;
+
+  tab = ck_pr_load_ptr(&thr->counter_blocks);
+  if (!tab || scope->scope_id >= tab->size) {
+    return NULL;
+  }
+  ck_pr_fence_load();
+  return ck_pr_load_ptr(&tab->blocks[scope->scope_id]);
+}
+
 void ph_counter_scope_add(
     ph_counter_scope_t *scope,
     uint8_t offset,
@@ -488,15 +661,110 @@ void ph_counter_block_delref(
     return;
   }
 
-  free(block);
+  free_block(block);
 }
 
-static inline uint32_t read_begin(ph_counter_block_t *block)
+/* Set up the storage for a histogram slot in the calling thread's
+ * block.  Publishes with a store fence so that readers never see
+ * partially initialized histograms */
+static struct ph_counter_hist *make_hist(ph_counter_block_t *block,
+    uint8_t offset)
+{
+  ph_counter_scope_t *scope = block->scope;
+  struct ph_counter_hist_def *def;
+  struct ph_counter_hist *hist;
+
+  if (offset >= scope->num_slots) {
+    return NULL;
+  }
+  def = ck_pr_load_ptr(&scope->hist_defs[offset]);
+  if (!def) {
+    return NULL;
+  }
+
+  if (!block->hists) {
+    struct ph_counter_hist **hists;
+
+    hists = calloc(scope->num_slots, sizeof(*hists));
+    if (!hists) {
+      return NULL;
+    }
+    ck_pr_fence_store();
+    ck_pr_store_ptr(&block->hists, hists);
+  }
+
+  hist = calloc(1, sizeof(*hist) +
+      ((def->num_buckets - 1) * sizeof(int64_t)));
+  if (!hist) {
+    return NULL;
+  }
+  hist->def = def;
+  hist->min = INT64_MAX;
+  hist->max = INT64_MIN;
+
+  ck_pr_fence_store();
+  ck_pr_store_ptr(&block->hists[offset], hist);
+  return hist;
+}
+
+void ph_counter_block_record(
+    ph_counter_block_t *block,
+    uint8_t offset,
+    int64_t value)
+{
+  struct ph_counter_hist *hist = NULL;
+
+  if (ph_likely(block->hists != NULL)) {
+    hist = block->hists[offset];
+  }
+  if (ph_unlikely(hist == NULL)) {
+    hist = make_hist(block, offset);
+    if (!hist) {
+      return;
+    }
+  }
+  if (value < 0) {
+    value = 0;
+  }
+
+  ck_pr_store_32(&block->seqno, block->seqno + 1);
+  ck_pr_fence_store();
+  block->slots[offset]++;
+  hist->buckets[hist_bucket(hist->def, value)]++;
+  hist->sum += value;
+  if (value < hist->min) {
+    hist->min = value;
+  }
+  if (value > hist->max) {
+    hist->max = value;
+  }
+  ck_pr_fence_store();
+  ck_pr_store_32(&block->seqno, block->seqno + 1);
+}
+
+void ph_counter_scope_record(
+    ph_counter_scope_t *scope,
+    uint8_t offset,
+    int64_t value)
+{
+  ph_counter_block_t *block = get_block_for_scope(scope);
+
+  if (ph_unlikely(!block)) return;
+  ph_counter_block_record(block, offset, value);
+}
+
+struct ph_counter_histogram {
+  struct ph_counter_hist_def def;
+  int64_t count, sum, min, max;
+  int64_t buckets[1];
+};
+
+static inline uint32_t seq_read_begin(uint32_t *seqno)
 {
   uint32_t ver;
 
   for (;;) {
-    ver = ck_pr_load_32(&block->seqno);
+    ver = ck_pr_load_32(seqno);
 
     if ((ver & 1) == 0) {
       ck_pr_fence_load();
@@ -507,10 +775,130 @@ static inline uint32_t read_begin(ph_counter_block_t *block)
   }
 }
 
+static inline bool seq_read_retry(uint32_t *seqno, uint32_t vers)
+{
+  ck_pr_fence_load();
+  return ck_pr_load_32(seqno) != vers;
+}
+
+static inline uint32_t read_begin(ph_counter_block_t *block)
+{
+  return seq_read_begin(&block->seqno);
+}
+
 static inline bool read_retry(ph_counter_block_t *block, uint32_t vers)
 {
+  return seq_read_retry(&block->seqno, vers);
+}
+
+static inline uint8_t slots_in_use(ph_counter_scope_t *scope)
+{
+  uint8_t n = ck_pr_load_8(&scope->next_slot);
+
+  return MIN(n, scope->num_slots);
+}
+
+/* Copy a consistent view of the first num_slots slots of a block */
+static inline void read_block_slots(struct ph_counter_block *block,
+    uint8_t num_slots, int64_t *dest)
+{
+  uint32_t vers;
+
+  do {
+    vers = read_begin(block);
+    memcpy(dest, block->slots, num_slots * sizeof(int64_t));
+  } while (read_retry(block, vers));
+}
+
+
+static struct ph_counter_histogram *alloc_histogram(
+    const struct ph_counter_hist_def *def)
+{
+  struct ph_counter_histogram *res;
+
+  res = malloc(sizeof(*res) + ((def->num_buckets - 1) * sizeof(int64_t)));
+  if (res) {
+    res->def = *def;
+  }
+  return res;
+}
+
+static void reset_histogram(struct ph_counter_histogram *res)
+{
+  res->count = 0;
+  res->sum = 0;
+  res->min = INT64_MAX;
+  res->max = INT64_MIN;
+  memset(res->buckets, 0, res->def.num_buckets * sizeof(int64_t));
+}
+
+static void finish_histogram(struct ph_counter_histogram *res)
+{
+  if (res->count == 0) {
+    res->min = 0;
+    res->max = 0;
+  }
+}
+
+static void merge_histogram(struct ph_counter_histogram *res,
+    int64_t count, const struct ph_counter_hist *hist,
+    const int64_t *buckets)
+{
+  uint32_t i;
+
+  res->count += count;
+  res->sum += hist->sum;
+  res->min = MIN(res->min, hist->min);
+  res->max = MAX(res->max, hist->max);
+  for (i = 0; i < res->def.num_buckets; i++) {
+    res->buckets[i] += buckets[i];
+  }
+}
+
+/* Accumulate a consistent view of one histogram slot of a block.
+ * scratch must be able to hold the buckets of the histogram */
+static void read_block_hist(struct ph_counter_block *block,
+    uint8_t offset, struct ph_counter_histogram *res, int64_t *scratch)
+{
+  struct ph_counter_hist **hists, *hist, local;
+  uint32_t vers;
+  int64_t count;
+
+  hists = ck_pr_load_ptr(&block->hists);
+  if (!hists) {
+    return;
+  }
+  ck_pr_fence_load();
+  hist = ck_pr_load_ptr(&hists[offset]);
+  if (!hist) {
+    return;
+  }
   ck_pr_fence_load();
-  return ck_pr_load_32(&block->seqno) != vers;
+
+  do {
+    vers = read_begin(block);
+    count = block->slots[offset];
+    local.sum = hist->sum;
+    local.min = hist->min;
+    local.max = hist->max;
+    memcpy(scratch, hist->buckets, res->def.num_buckets * sizeof(int64_t));
+  } while (read_retry(block, vers));
+
+  merge_histogram(res, count, &local, scratch);
+}
+
+/* Start from the totals of exited threads.
+ * Must be called inside a fold_seqno read section */
+static void read_base_hist(ph_counter_scope_t *scope, uint8_t offset,
+    struct ph_counter_histogram *res)
+{
+  struct ph_counter_hist *base;
+
+  reset_histogram(res);
+  base = ck_pr_load_ptr(&scope->base_hists[offset]);
+  if (base) {
+    merge_histogram(res, scope->base_slots[offset], base, base->buckets);
+  }
 }
 
 int64_t ph_counter_scope_get(
@@ -521,23 +909,34 @@ int64_t ph_counter_scope_get(
   ck_stack_entry_t *stack_entry;
   ph_thread_t *thr;
   struct ph_counter_block *block;
-  unsigned int vers;
+  unsigned int vers, fvers;
 
-  CK_STACK_FOREACH(&ph_thread_all_threads, stack_entry) {
-    thr = ph_thread_from_stack_entry(stack_entry);
-    /* locate counter block */
-    block = ck_hs_get(&thr->counter_hs, scope->hash, &scope->scope_id);
-    if (!block) {
-      continue;
-    }
+  if (offset >= scope->num_slots) {
+    return 0;
+  }
+
+  ph_thread_epoch_begin();
+  do {
+    fvers = seq_read_begin(&fold_seqno);
+    res = scope->base_slots[offset];
+
+    CK_STACK_FOREACH(&ph_thread_all_threads, stack_entry) {
+      thr = ph_thread_from_stack_entry(stack_entry);
+      /* locate counter block */
+      block = find_block(thr, scope);
+      if (!block) {
+        continue;
+      }
 
-    do {
-      vers = read_begin(block);
-      val = block->slots[offset];
-    } while (read_retry(block, vers));
+      do {
+        vers = read_begin(block);
+        val = block->slots[offset];
+      } while (read_retry(block, vers));
 
-    res += val;
-  }
+      res += val;
+    }
+  } while (seq_read_retry(&fold_seqno, fvers));
+  ph_thread_epoch_end();
 
   return res;
 }
@@ -552,45 +951,584 @@ uint8_t ph_counter_scope_get_view(
   ck_stack_entry_t *stack_entry;
   struct ph_counter_block *block;
   ph_thread_t *thr;
-  unsigned int vers;
+  unsigned int fvers;
   int64_t *local_slots;
 
-  if (num_slots > scope->num_slots) {
-    num_slots = scope->num_slots;
+  num_slots = MIN(num_slots, slots_in_use(scope));
+  local_slots = alloca(num_slots * sizeof(int64_t));
+
+  ph_thread_epoch_begin();
+  do {
+    fvers = seq_read_begin(&fold_seqno);
+    memcpy(slots, scope->base_slots, sizeof(*slots) * num_slots);
+
+    CK_STACK_FOREACH(&ph_thread_all_threads, stack_entry) {
+      thr = ph_thread_from_stack_entry(stack_entry);
+
+      /* locate counter block */
+      block = find_block(thr, scope);
+      if (!block) {
+        continue;
+      }
+
+      read_block_slots(block, num_slots, local_slots);
+      for (i = 0; i < num_slots; i++) {
+        slots[i] += local_slots[i];
+      }
+    }
+  } while (seq_read_retry(&fold_seqno, fvers));
+  ph_thread_epoch_end();
+
+  if (names) {
+    memcpy(names, scope->slot_names, num_slots * sizeof(char*));
+  }
+
+  return num_slots;
+}
+
+ph_counter_histogram_t *ph_counter_scope_get_histogram(
+    ph_counter_scope_t *scope,
+    uint8_t offset)
+{
+  struct ph_counter_hist_def *def;
+  struct ph_counter_histogram *res;
+  struct ph_counter_block *block;
+  ck_stack_entry_t *stack_entry;
+  ph_thread_t *thr;
+  unsigned int fvers;
+  int64_t *scratch;
+
+  if (offset >= scope->num_slots) {
+    return NULL;
   }
-  if (num_slots > scope->next_slot) {
-    num_slots = scope->next_slot;
+  def = ck_pr_load_ptr(&scope->hist_defs[offset]);
+  if (!def) {
+    return NULL;
   }
 
-  local_slots = alloca(num_slots * sizeof(int64_t));
-  memset(slots, 0, sizeof(*slots) * num_slots);
+  res = alloc_histogram(def);
+  scratch = malloc(def->num_buckets * sizeof(int64_t));
+  if (!res || !scratch) {
+    free(res);
+    free(scratch);
+    return NULL;
+  }
+
+  ph_thread_epoch_begin();
+  do {
+    fvers = seq_read_begin(&fold_seqno);
+    read_base_hist(scope, offset, res);
+
+    CK_STACK_FOREACH(&ph_thread_all_threads, stack_entry) {
+      thr = ph_thread_from_stack_entry(stack_entry);
+
+      block = find_block(thr, scope);
+      if (block) {
+        read_block_hist(block, offset, res, scratch);
+      }
+    }
+  } while (seq_read_retry(&fold_seqno, fvers));
+  ph_thread_epoch_end();
+
+  free(scratch);
+  finish_histogram(res);
+
+  return res;
+}
+
+static void fold_hist(ph_counter_scope_t *scope, uint8_t offset,
+    struct ph_counter_hist *hist)
+{
+  struct ph_counter_hist *base = scope->base_hists[offset];
+  uint32_t i;
+
+  if (!base) {
+    base = calloc(1, sizeof(*base) +
+        ((hist->def->num_buckets - 1) * sizeof(int64_t)));
+    if (!base) {
+      return;
+    }
+    base->def = hist->def;
+    base->min = INT64_MAX;
+    base->max = INT64_MIN;
+    ck_pr_fence_store();
+    ck_pr_store_ptr(&scope->base_hists[offset], base);
+  }
+
+  base->sum += hist->sum;
+  base->min = MIN(base->min, hist->min);
+  base->max = MAX(base->max, hist->max);
+  for (i = 0; i < hist->def->num_buckets; i++) {
+    base->buckets[i] += hist->buckets[i];
+  }
+}
+
+static void fold_block(struct ph_counter_block *block)
+{
+  ph_counter_scope_t *scope = block->scope;
+  uint8_t i, n = slots_in_use(scope);
+
+  for (i = 0; i < n; i++) {
+    scope->base_slots[i] += block->slots[i];
+    if (block->hists && block->hists[i]) {
+      fold_hist(scope, i, block->hists[i]);
+    }
+  }
+}
+
+/* epoch callback that drops the table's references on its blocks */
+static void retire_block_table(ck_epoch_entry_t *e)
+{
+  struct ph_counter_block_table *tab = (struct ph_counter_block_table*)e;
+  uint32_t i;
+
+  for (i = 0; i < tab->size; i++) {
+    if (tab->blocks[i]) {
+      ph_counter_block_delref(tab->blocks[i]);
+    }
+  }
+  free(tab);
+}
+
+void ph_counter_fold_thread(ph_thread_t *thr)
+{
+  struct ph_counter_block_table *tab = thr->counter_blocks, *fresh;
+  uint32_t i;
+
+  if (!tab) {
+    return;
+  }
+
+  // The record may be recycled by a new thread, so leave it with an
+  // empty table.  If we can't allocate one, the blocks simply remain
+  // visible to readers as before.
+  fresh = alloc_block_table(tab->size);
+  if (!fresh) {
+    return;
+  }
+  fresh->size = tab->size;
+
+  ck_spinlock_lock(&fold_lock);
+  ck_pr_store_32(&fold_seqno, fold_seqno + 1);
+  ck_pr_fence_store();
+
+  for (i = 0; i < tab->size; i++) {
+    if (tab->blocks[i]) {
+      fold_block(tab->blocks[i]);
+    }
+  }
+  ck_pr_store_ptr(&thr->counter_blocks, fresh);
+
+  ck_pr_fence_store();
+  ck_pr_store_32(&fold_seqno, fold_seqno + 1);
+  ck_spinlock_unlock(&fold_lock);
+
+  // Readers may still be looking at the blocks
+  ph_thread_epoch_defer(&tab->entry, retire_block_table);
+}
+
+int64_t ph_counter_histogram_count(ph_counter_histogram_t *hist)
+{
+  return hist->count;
+}
+
+int64_t ph_counter_histogram_sum(ph_counter_histogram_t *hist)
+{
+  return hist->sum;
+}
+
+int64_t ph_counter_histogram_min(ph_counter_histogram_t *hist)
+{
+  return hist->min;
+}
+
+int64_t ph_counter_histogram_max(ph_counter_histogram_t *hist)
+{
+  return hist->max;
+}
+
+int64_t ph_counter_histogram_percentile(ph_counter_histogram_t *hist,
+    double pct)
+{
+  double want;
+  int64_t rank, seen = 0, val;
+  uint32_t i;
+
+  if (hist->count == 0) {
+    return 0;
+  }
+
+  want = pct * (double)hist->count / 100.0;
+  rank = (int64_t)want;
+  if ((double)rank < want) {
+    rank++;
+  }
+  rank = MAX(rank, 1);
+  rank = MIN(rank, hist->count);
+
+  for (i = 0; i < hist->def.num_buckets; i++) {
+    seen += hist->buckets[i];
+    if (seen >= rank) {
+      break;
+    }
+  }
+  if (i == hist->def.num_buckets) {
+    return hist->max;
+  }
+
+  val = hist_bucket_upper(&hist->def, i);
+  val = MAX(val, hist->min);
+  return MIN(val, hist->max);
+}
+
+uint32_t ph_counter_histogram_num_buckets(ph_counter_histogram_t *hist)
+{
+  return hist->def.num_buckets;
+}
+
+int64_t ph_counter_histogram_bucket(ph_counter_histogram_t *hist,
+    uint32_t idx, int64_t *upper)
+{
+  if (idx >= hist->def.num_buckets) {
+    return 0;
+  }
+  if (upper) {
+    *upper = hist_bucket_upper(&hist->def, idx);
+  }
+  return hist->buckets[idx];
+}
+
+ph_counter_histogram_t *ph_counter_histogram_copy(
+    ph_counter_histogram_t *hist)
+{
+  struct ph_counter_histogram *res = alloc_histogram(&hist->def);
+
+  if (res) {
+    memcpy(res, hist, sizeof(*res) +
+        ((hist->def.num_buckets - 1) * sizeof(int64_t)));
+  }
+  return res;
+}
+
+bool ph_counter_histogram_subtract(ph_counter_histogram_t *hist,
+    ph_counter_histogram_t *prev)
+{
+  uint32_t i;
+
+  if (hist->def.num_buckets != prev->def.num_buckets ||
+      hist->def.precision != prev->def.precision) {
+    return false;
+  }
+
+  hist->count -= prev->count;
+  hist->sum -= prev->sum;
+  for (i = 0; i < hist->def.num_buckets; i++) {
+    hist->buckets[i] -= prev->buckets[i];
+  }
+  return true;
+}
+
+void ph_counter_histogram_free(ph_counter_histogram_t *hist)
+{
+  free(hist);
+}
+
+struct snapshot_scope {
+  ph_counter_scope_t *scope;
+  uint8_t num_slots;
+  int64_t *slots;
+  struct ph_counter_histogram **hists;
+};
+
+struct ph_counter_snapshot {
+  uint32_t num_scopes;
+  struct snapshot_scope *scopes;
+  // maps scope id to 1 + index in scopes, 0 if not present
+  uint32_t *by_id;
+  uint32_t id_limit;
+};
+
+static bool snapshot_add_scope(struct ph_counter_snapshot *snap,
+    ph_counter_scope_t *scope, uint32_t *alloc)
+{
+  struct snapshot_scope *ss;
+  struct ph_counter_hist_def *def;
+  uint8_t i;
+
+  if (snap->num_scopes == *alloc) {
+    uint32_t n = *alloc ? *alloc * 2 : 64;
+
+    ss = realloc(snap->scopes, n * sizeof(*ss));
+    if (!ss) {
+      return false;
+    }
+    snap->scopes = ss;
+    *alloc = n;
+  }
+
+  ss = &snap->scopes[snap->num_scopes];
+  memset(ss, 0, sizeof(*ss));
+  ss->scope = scope;
+  snap->num_scopes++;
+  snap->id_limit = MAX(snap->id_limit, scope->scope_id + 1);
 
-  CK_STACK_FOREACH(&ph_thread_all_threads, stack_entry) {
-    thr = ph_thread_from_stack_entry(stack_entry);
+  ss->num_slots = slots_in_use(scope);
+  ss->slots = calloc(MAX(ss->num_slots, 1), sizeof(int64_t));
+  ss->hists = calloc(MAX(ss->num_slots, 1), sizeof(*ss->hists));
+  if (!ss->slots || !ss->hists) {
+    return false;
+  }
+  for (i = 0; i < ss->num_slots; i++) {
+    def = ck_pr_load_ptr(&scope->hist_defs[i]);
+    if (def) {
+      ss->hists[i] = alloc_histogram(def);
+      if (!ss->hists[i]) {
+        return false;
+      }
+    }
+  }
 
-    /* locate counter block */
-    block = ck_hs_get(&thr->counter_hs, scope->hash, &scope->scope_id);
+  return true;
+}
+
+/* Accumulate everything one thread has into the snapshot */
+static void snapshot_thread(struct ph_counter_snapshot *snap,
+    ph_thread_t *thr, int64_t *scratch)
+{
+  struct ph_counter_block_table *tab;
+  struct ph_counter_block *block;
+  struct snapshot_scope *ss;
+  int64_t local_slots[PH_COUNTER_INVALID];
+  uint32_t id, n, idx;
+  uint8_t i;
+
+  tab = ck_pr_load_ptr(&thr->counter_blocks);
+  if (!tab) {
+    return;
+  }
+  n = MIN(tab->size, snap->id_limit);
+
+  for (id = 0; id < n; id++) {
+    block = ck_pr_load_ptr(&tab->blocks[id]);
     if (!block) {
       continue;
     }
+    idx = snap->by_id[id];
+    if (!idx) {
+      continue;
+    }
+    ck_pr_fence_load();
+    ss = &snap->scopes[idx - 1];
+
+    read_block_slots(block, ss->num_slots, local_slots);
+    for (i = 0; i < ss->num_slots; i++) {
+      ss->slots[i] += local_slots[i];
+      if (ss->hists[i]) {
+        read_block_hist(block, i, ss->hists[i], scratch);
+      }
+    }
+  }
+}
 
-    do {
-      vers = read_begin(block);
-      memcpy(local_slots, block->slots, num_slots * sizeof(int64_t));
-    } while (read_retry(block, vers));
+/* Fill in the values of the scopes that have been added to snap.
+ * Frees snap and returns NULL on allocation failure. */
+static ph_counter_snapshot_t *snapshot_capture(
+    struct ph_counter_snapshot *snap)
+{
+  ck_stack_entry_t *stack_entry;
+  uint32_t i, max_buckets = 1;
+  unsigned int fvers;
+  int64_t *scratch = NULL;
+  uint8_t s;
+
+  snap->by_id = calloc(MAX(snap->id_limit, 1), sizeof(uint32_t));
+  if (!snap->by_id) {
+    goto fail;
+  }
+  for (i = 0; i < snap->num_scopes; i++) {
+    struct snapshot_scope *ss = &snap->scopes[i];
 
-    for (i = 0; i < num_slots; i++) {
-      slots[i] += local_slots[i];
+    snap->by_id[ss->scope->scope_id] = i + 1;
+    for (s = 0; s < ss->num_slots; s++) {
+      if (ss->hists[s]) {
+        max_buckets = MAX(max_buckets, ss->hists[s]->def.num_buckets);
+      }
     }
   }
+  scratch = malloc(max_buckets * sizeof(int64_t));
+  if (!scratch) {
+    goto fail;
+  }
 
-  if (names) {
-    memcpy(names, scope->slot_names, num_slots * sizeof(char*));
+  ph_thread_epoch_begin();
+  do {
+    fvers = seq_read_begin(&fold_seqno);
+
+    for (i = 0; i < snap->num_scopes; i++) {
+      struct snapshot_scope *ss = &snap->scopes[i];
+
+      memcpy(ss->slots, ss->scope->base_slots,
+          ss->num_slots * sizeof(int64_t));
+      for (s = 0; s < ss->num_slots; s++) {
+        if (ss->hists[s]) {
+          read_base_hist(ss->scope, s, ss->hists[s]);
+        }
+      }
+    }
+
+    CK_STACK_FOREACH(&ph_thread_all_threads, stack_entry) {
+      snapshot_thread(snap, ph_thread_from_stack_entry(stack_entry),
+          scratch);
+    }
+  } while (seq_read_retry(&fold_seqno, fvers));
+  ph_thread_epoch_end();
+
+  free(scratch);
+
+  for (i = 0; i < snap->num_scopes; i++) {
+    for (s = 0; s < snap->scopes[i].num_slots; s++) {
+      if (snap->scopes[i].hists[s]) {
+        finish_histogram(snap->scopes[i].hists[s]);
+      }
+    }
   }
 
+  return snap;
+
+fail:
+  ph_counter_snapshot_free(snap);
+  return NULL;
+}
+
+// Takes ownership of the caller's reference on scope
+static bool snapshot_add_ref(struct ph_counter_snapshot *snap,
+    ph_counter_scope_t *scope, uint32_t *alloc)
+{
+  if (snapshot_add_scope(snap, scope, alloc)) {
+    return true;
+  }
+  // The scope belongs to the snapshot once it has been given a slot
+  if (snap->num_scopes == 0 ||
+      snap->scopes[snap->num_scopes - 1].scope != scope) {
+    ph_counter_scope_delref(scope);
+  }
+  return false;
+}
+
+ph_counter_snapshot_t *ph_counter_snapshot_all(void)
+{
+  struct ph_counter_snapshot *snap;
+  ph_counter_scope_iterator_t iter;
+  ph_counter_scope_t *scope;
+  uint32_t alloc = 0;
+
+  snap = calloc(1, sizeof(*snap));
+  if (!snap) {
+    return NULL;
+  }
+
+  ph_counter_scope_iterator_init(&iter);
+  while ((scope = ph_counter_scope_iterator_next(&iter)) != NULL) {
+    if (!snapshot_add_ref(snap, scope, &alloc)) {
+      ph_counter_snapshot_free(snap);
+      return NULL;
+    }
+  }
+
+  return snapshot_capture(snap);
+}
+
+ph_counter_snapshot_t *ph_counter_snapshot_scopes(
+    ph_counter_scope_t **scopes, uint32_t num_scopes)
+{
+  struct ph_counter_snapshot *snap;
+  uint32_t alloc = 0, i;
+
+  snap = calloc(1, sizeof(*snap));
+  if (!snap) {
+    return NULL;
+  }
+
+  for (i = 0; i < num_scopes; i++) {
+    ph_refcnt_add(&scopes[i]->refcnt);
+    if (!snapshot_add_ref(snap, scopes[i], &alloc)) {
+      ph_counter_snapshot_free(snap);
+      return NULL;
+    }
+  }
+
+  return snapshot_capture(snap);
+}
+
+uint32_t ph_counter_snapshot_num_scopes(ph_counter_snapshot_t *snap)
+{
+  return snap->num_scopes;
+}
+
+ph_counter_scope_t *ph_counter_snapshot_get_scope(
+    ph_counter_snapshot_t *snap, uint32_t idx)
+{
+  if (idx >= snap->num_scopes) {
+    return NULL;
+  }
+  return snap->scopes[idx].scope;
+}
+
+uint8_t ph_counter_snapshot_get_view(
+    ph_counter_snapshot_t *snap,
+    uint32_t idx,
+    uint8_t num_slots,
+    int64_t *slots,
+    const char **names)
+{
+  struct snapshot_scope *ss;
+
+  if (idx >= snap->num_scopes) {
+    return 0;
+  }
+  ss = &snap->scopes[idx];
+  num_slots = MIN(num_slots, ss->num_slots);
+
+  memcpy(slots, ss->slots, num_slots * sizeof(int64_t));
+  if (names) {
+    memcpy(names, ss->scope->slot_names, num_slots * sizeof(char*));
+  }
   return num_slots;
 }
 
+ph_counter_histogram_t *ph_counter_snapshot_get_histogram(
+    ph_counter_snapshot_t *snap,
+    uint32_t idx,
+    uint8_t offset)
+{
+  if (idx >= snap->num_scopes || offset >= snap->scopes[idx].num_slots) {
+    return NULL;
+  }
+  return snap->scopes[idx].hists[offset];
+}
+
+void ph_counter_snapshot_free(ph_counter_snapshot_t *snap)
+{
+  struct snapshot_scope *ss;
+  uint32_t i;
+  uint8_t s;
+
+  for (i = 0; i < snap->num_scopes; i++) {
+    ss = &snap->scopes[i];
+    if (ss->hists) {
+      for (s = 0; s < ss->num_slots; s++) {
+        free(ss->hists[s]);
+      }
+    }
+    free(ss->hists);
+    free(ss->slots);
+    ph_counter_scope_delref(ss->scope);
+  }
+  free(snap->scopes);
+  free(snap->by_id);
+  free(snap);
+}
+
 void ph_counter_scope_iterator_init(
     ph_counter_scope_iterator_t *iter)
 {
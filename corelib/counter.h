@@ -20,18 +20,53 @@
 struct ph_counter_scope {
   ph_refcnt_t refcnt;
   uint32_t scope_id;
-  unsigned long hash; // NOLINT(runtime/int)
 
   uint8_t num_slots, next_slot;
   /* points to just after slot_names */
   char *scope_name;
   char *full_scope_name;
 
+  /* num_slots elements; non-NULL for histogram slots */
+  struct ph_counter_hist_def **hist_defs;
+  /* totals folded in from the blocks of exited threads.
+   * num_slots elements each; modified under the fold lock */
+  int64_t *base_slots;
+  struct ph_counter_hist **base_hists;
+  /* set once the scope is tracked by the rate sampler */
+  struct ph_counter_rate *rate;
+
   /* variable size array; the remainder of this struct
    * holds num_slots elements */
   char *slot_names[1];
 };
 
+/* Bucketing for a histogram slot.
+ * Values below 2^precision each get a bucket of their own; above that,
+ * each power of two is split into 2^precision linear sub-buckets */
+struct ph_counter_hist_def {
+  int64_t max_value;
+  uint32_t num_buckets;
+  uint8_t precision;
+};
+
+/* Per-thread storage for a histogram slot.  The sample count lives
+ * in the block slot itself so that it shows up in the counter view */
+struct ph_counter_hist {
+  const struct ph_counter_hist_def *def;
+  int64_t sum, min, max;
+  int64_t buckets[1];
+};
+
+/* Each thread holds an array of pointers to its counter blocks,
+ * indexed by scope id.  Only the owning thread modifies it; when it
+ * needs to grow, a larger copy is published and the old one is
+ * retired via the epoch mechanism so that readers walking the
+ * threads can safely continue to use it. */
+struct ph_counter_block_table {
+  ck_epoch_entry_t entry;
+  uint32_t size;
+  struct ph_counter_block *blocks[1];
+};
 
 #endif
 
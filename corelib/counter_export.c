@@ -0,0 +1,452 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phenom/sysutil.h"
+#include "phenom/counter.h"
+#include "phenom/listener.h"
+#include "phenom/stream.h"
+#include "phenom/printf.h"
+#include "phenom/log.h"
+#include "corelib/counter.h"
+
+/* Exports counters to monitoring systems.
+ *
+ * The Prometheus exporter is a minimal HTTP server: it reads a request,
+ * writes the response and closes the connection.  Each scrape takes a
+ * single counter snapshot, so it costs one pass over the threads no
+ * matter how many scopes there are.
+ *
+ * The statsd pusher runs on a timer, snapshots the counters and sends
+ * the change since the previous push in as few datagrams as it can.
+ */
+
+#define METRIC_NAME_LEN 256
+
+// Seconds that a scrape connection may sit idle before we drop it
+#define PROM_IO_TIMEOUT 10
+
+/* Render "scope.slot" as a Prometheus metric name.
+ * Legal characters are [a-zA-Z0-9_:] and the first may not be a digit */
+static void prom_metric_name(char *buf, const char *scope, const char *slot)
+{
+  char *c;
+
+  ph_snprintf(buf, METRIC_NAME_LEN, "%s%s_%s",
+      (*scope >= '0' && *scope <= '9') ? "_" : "", scope, slot);
+
+  for (c = buf; *c; c++) {
+    if ((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') ||
+        (*c >= '0' && *c <= '9') || *c == '_' || *c == ':') {
+      continue;
+    }
+    *c = '_';
+  }
+}
+
+static void prom_write_histogram(ph_stream_t *stm, const char *name,
+    ph_counter_histogram_t *hist)
+{
+  uint32_t i, n = ph_counter_histogram_num_buckets(hist);
+  int64_t cumulative = 0, count, upper;
+
+  ph_stm_printf(stm, "# TYPE %s histogram\n", name);
+
+  // Emit every bucket, even the empty ones: Prometheus computes rates
+  // and quantiles per series, so a bucket that is missing from one
+  // scrape and present in the next would look like a counter reset
+  for (i = 0; i < n; i++) {
+    count = ph_counter_histogram_bucket(hist, i, &upper);
+    cumulative += count;
+    ph_stm_printf(stm, "%s_bucket{le=\"%" PRIi64 "\"} %" PRIi64 "\n",
+        name, upper, cumulative);
+  }
+
+  ph_stm_printf(stm,
+      "%s_bucket{le=\"+Inf\"} %" PRIi64 "\n"
+      "%s_sum %" PRIi64 "\n"
+      "%s_count %" PRIi64 "\n",
+      name, ph_counter_histogram_count(hist),
+      name, ph_counter_histogram_sum(hist),
+      name, ph_counter_histogram_count(hist));
+}
+
+bool ph_counter_write_prometheus(ph_stream_t *stm)
+{
+  ph_counter_snapshot_t *snap;
+  ph_counter_histogram_t *hist;
+  int64_t slots[PH_COUNTER_INVALID];
+  const char *names[PH_COUNTER_INVALID];
+  char name[METRIC_NAME_LEN];
+  const char *scope_name;
+  uint32_t i, n;
+  uint8_t s, num_slots;
+
+  snap = ph_counter_snapshot_all();
+  if (!snap) {
+    return false;
+  }
+
+  n = ph_counter_snapshot_num_scopes(snap);
+  for (i = 0; i < n; i++) {
+    scope_name = ph_counter_scope_get_name(
+        ph_counter_snapshot_get_scope(snap, i));
+
+    num_slots = ph_counter_snapshot_get_view(snap, i,
+        PH_COUNTER_INVALID, slots, names);
+
+    for (s = 0; s < num_slots; s++) {
+      prom_metric_name(name, scope_name, names[s]);
+
+      hist = ph_counter_snapshot_get_histogram(snap, i, s);
+      if (hist) {
+        prom_write_histogram(stm, name, hist);
+        continue;
+      }
+
+      // Counters may be decremented, so they aren't Prometheus counters
+      ph_stm_printf(stm, "# TYPE %s untyped\n%s %" PRIi64 "\n",
+          name, name, slots[s]);
+    }
+  }
+
+  ph_counter_snapshot_free(snap);
+  return true;
+}
+
+static void prom_respond(ph_sock_t *sock, ph_buf_t *req)
+{
+  const char *mem = (const char*)ph_buf_mem(req);
+  uint64_t len = ph_buf_len(req);
+
+  if ((len >= 13 && memcmp(mem, "GET /metrics ", 13) == 0) ||
+      (len >= 6 && memcmp(mem, "GET / ", 6) == 0)) {
+    ph_stm_printf(sock->stream,
+        "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Connection: close\r\n"
+        "\r\n");
+    if (!ph_counter_write_prometheus(sock->stream)) {
+      ph_stm_printf(sock->stream, "# failed to capture counters\n");
+    }
+    return;
+  }
+
+  ph_stm_printf(sock->stream,
+      "HTTP/1.0 404 Not Found\r\n"
+      "Content-Type: text/plain\r\n"
+      "Connection: close\r\n"
+      "\r\n"
+      "counters are served from /metrics\n");
+}
+
+static void prom_processor(ph_sock_t *sock, ph_iomask_t why, void *arg)
+{
+  ph_buf_t *req;
+
+  if (why & (PH_IOMASK_ERR|PH_IOMASK_TIME)) {
+done:
+    ph_sock_shutdown(sock, PH_SOCK_SHUT_RDWR);
+    ph_sock_free(sock);
+    return;
+  }
+  if (arg && (why & PH_IOMASK_WRITE) && ph_bufq_len(sock->wbuf) == 0) {
+    goto done;
+  }
+
+  if (arg == NULL && (why & PH_IOMASK_READ)) {
+    // We don't care about the headers, but we wait for all of them
+    // so that the client sees a well-behaved server
+    req = ph_sock_read_record(sock, "\r\n\r\n", 4);
+    if (!req) {
+      return;
+    }
+
+    sock->job.data = sock;
+    ph_sock_shutdown(sock, PH_SOCK_SHUT_RD);
+    prom_respond(sock, req);
+    ph_buf_delref(req);
+  }
+}
+
+static void prom_acceptor(ph_listener_t *lstn, ph_sock_t *sock)
+{
+  ph_unused_parameter(lstn);
+
+  sock->callback = prom_processor;
+  // Scrapers send their request straight away; don't let clients that
+  // connect and say nothing hold a socket for the default minute
+  sock->timeout_duration.tv_sec = PROM_IO_TIMEOUT;
+  sock->timeout_duration.tv_usec = 0;
+  ph_sock_enable(sock, true);
+}
+
+ph_result_t ph_counter_exporter_start(const ph_sockaddr_t *addr)
+{
+  ph_listener_t *lstn;
+  ph_result_t res;
+
+  lstn = ph_listener_new("counter-exporter", prom_acceptor);
+  if (!lstn) {
+    return PH_NOMEM;
+  }
+
+  res = ph_listener_bind(lstn, addr);
+  if (res != PH_OK) {
+    ph_socket_t fd = ph_listener_get_fd(lstn);
+    int err = errno;
+
+    // Never enabled, so nothing else can see the listener
+    lstn->job.fd = -1;
+    ph_job_free(&lstn->job);
+    if (fd != -1) {
+      close(fd);
+    }
+    errno = err;
+    return res;
+  }
+
+  ph_listener_enable(lstn, true);
+  return PH_OK;
+}
+
+/* statsd */
+
+// Fits in a single ethernet frame with room for the headers
+#define STATSD_MAX_PACKET 1400
+
+struct statsd_prev {
+  uint8_t num_slots;
+  int64_t *slots;
+  ph_counter_histogram_t **hists;
+};
+
+struct statsd_pusher {
+  ph_job_t job;
+  ph_socket_t fd;
+  ph_sockaddr_t addr;
+  uint32_t interval;
+  char *prefix;
+
+  // values as of the previous push, indexed by scope id
+  struct statsd_prev *prev;
+  uint32_t prev_size;
+
+  uint32_t pkt_len;
+  char pkt[STATSD_MAX_PACKET];
+};
+
+static void statsd_flush(struct statsd_pusher *sd)
+{
+  if (sd->pkt_len == 0) {
+    return;
+  }
+  // statsd is lossy by design; if the socket buffer is full, the
+  // datagram is dropped
+  sendto(sd->fd, sd->pkt, sd->pkt_len, 0, &sd->addr.sa.sa,
+      ph_sockaddr_socklen(&sd->addr));
+  sd->pkt_len = 0;
+}
+
+static void statsd_emit(struct statsd_pusher *sd, const char *scope,
+    const char *slot, const char *suffix, int64_t value, char type)
+{
+  char line[METRIC_NAME_LEN + 32];
+  int len;
+
+  len = ph_snprintf(line, sizeof(line), "%s%s%s.%s%s:%" PRIi64 "|%c\n",
+      sd->prefix ? sd->prefix : "", sd->prefix ? "." : "",
+      scope, slot, suffix, value, type);
+  if (len <= 0 || (uint32_t)len >= sizeof(line)) {
+    return;
+  }
+
+  if (sd->pkt_len + len > STATSD_MAX_PACKET) {
+    statsd_flush(sd);
+  }
+  memcpy(sd->pkt + sd->pkt_len, line, len);
+  sd->pkt_len += len;
+}
+
+static struct statsd_prev *statsd_get_prev(struct statsd_pusher *sd,
+    uint32_t scope_id, uint8_t num_slots)
+{
+  struct statsd_prev *prev;
+
+  if (scope_id >= sd->prev_size) {
+    uint32_t size = MAX(sd->prev_size * 2, scope_id + 1);
+
+    prev = realloc(sd->prev, size * sizeof(*prev));
+    if (!prev) {
+      return NULL;
+    }
+    memset(prev + sd->prev_size, 0,
+        (size - sd->prev_size) * sizeof(*prev));
+    sd->prev = prev;
+    sd->prev_size = size;
+  }
+
+  prev = &sd->prev[scope_id];
+  if (prev->num_slots < num_slots) {
+    int64_t *slots;
+    ph_counter_histogram_t **hists;
+
+    // Slots were registered since we last looked
+    slots = realloc(prev->slots, num_slots * sizeof(*slots));
+    if (!slots) {
+      return NULL;
+    }
+    prev->slots = slots;
+    hists = realloc(prev->hists, num_slots * sizeof(*hists));
+    if (!hists) {
+      return NULL;
+    }
+    prev->hists = hists;
+    memset(slots + prev->num_slots, 0,
+        (num_slots - prev->num_slots) * sizeof(*slots));
+    memset(hists + prev->num_slots, 0,
+        (num_slots - prev->num_slots) * sizeof(*hists));
+    prev->num_slots = num_slots;
+  }
+
+  return prev;
+}
+
+static void statsd_hist(struct statsd_pusher *sd, const char *scope,
+    const char *slot, ph_counter_histogram_t *hist,
+    ph_counter_histogram_t **prevp, bool emit)
+{
+  ph_counter_histogram_t *delta;
+
+  if (emit) {
+    delta = ph_counter_histogram_copy(hist);
+    if (delta && (!*prevp || ph_counter_histogram_subtract(delta, *prevp)) &&
+        ph_counter_histogram_count(delta) > 0) {
+      statsd_emit(sd, scope, slot, ".count",
+          ph_counter_histogram_count(delta), 'c');
+      statsd_emit(sd, scope, slot, ".p50",
+          ph_counter_histogram_percentile(delta, 50), 'g');
+      statsd_emit(sd, scope, slot, ".p99",
+          ph_counter_histogram_percentile(delta, 99), 'g');
+      statsd_emit(sd, scope, slot, ".p999",
+          ph_counter_histogram_percentile(delta, 99.9), 'g');
+    }
+    if (delta) {
+      ph_counter_histogram_free(delta);
+    }
+  }
+
+  if (*prevp) {
+    ph_counter_histogram_free(*prevp);
+  }
+  *prevp = ph_counter_histogram_copy(hist);
+}
+
+/* Compare the counters against the previous push, sending the changes
+ * if emit is true, and remember the current values */
+static void statsd_push(struct statsd_pusher *sd, bool emit)
+{
+  ph_counter_snapshot_t *snap;
+  ph_counter_scope_t *scope;
+  ph_counter_histogram_t *hist;
+  struct statsd_prev *prev;
+  int64_t slots[PH_COUNTER_INVALID];
+  const char *names[PH_COUNTER_INVALID];
+  uint32_t i, n;
+  uint8_t s, num_slots;
+
+  snap = ph_counter_snapshot_all();
+  if (!snap) {
+    return;
+  }
+
+  n = ph_counter_snapshot_num_scopes(snap);
+  for (i = 0; i < n; i++) {
+    scope = ph_counter_snapshot_get_scope(snap, i);
+    num_slots = ph_counter_snapshot_get_view(snap, i,
+        PH_COUNTER_INVALID, slots, names);
+
+    prev = statsd_get_prev(sd, scope->scope_id, num_slots);
+    if (!prev) {
+      continue;
+    }
+
+    for (s = 0; s < num_slots; s++) {
+      hist = ph_counter_snapshot_get_histogram(snap, i, s);
+      if (hist) {
+        statsd_hist(sd, scope->full_scope_name, names[s], hist,
+            &prev->hists[s], emit);
+      } else if (emit && slots[s] != prev->slots[s]) {
+        statsd_emit(sd, scope->full_scope_name, names[s], "",
+            slots[s] - prev->slots[s], 'c');
+      }
+      prev->slots[s] = slots[s];
+    }
+  }
+
+  ph_counter_snapshot_free(snap);
+  statsd_flush(sd);
+}
+
+static void statsd_tick(ph_job_t *job, ph_iomask_t why, void *data)
+{
+  struct statsd_pusher *sd = data;
+
+  ph_unused_parameter(why);
+
+  statsd_push(sd, true);
+  ph_job_set_timer_in_ms(job, sd->interval);
+}
+
+ph_result_t ph_counter_statsd_start(const ph_sockaddr_t *addr,
+    uint32_t interval_ms, const char *prefix)
+{
+  struct statsd_pusher *sd;
+
+  sd = calloc(1, sizeof(*sd));
+  if (!sd) {
+    return PH_NOMEM;
+  }
+
+  sd->addr = *addr;
+  sd->interval = interval_ms ? interval_ms : 10000;
+  if (prefix) {
+    sd->prefix = strdup(prefix);
+    if (!sd->prefix) {
+      free(sd);
+      return PH_NOMEM;
+    }
+  }
+
+  sd->fd = ph_socket_for_addr(addr, SOCK_DGRAM,
+      PH_SOCK_CLOEXEC|PH_SOCK_NONBLOCK);
+  if (sd->fd == -1) {
+    ph_log(PH_LOG_ERR, "statsd: failed to create socket: `Pe%d", errno);
+    free(sd->prefix);
+    free(sd);
+    return PH_ERR;
+  }
+
+  // The first push reports changes from now, not since startup
+  statsd_push(sd, false);
+
+  ph_job_init(&sd->job);
+  sd->job.callback = statsd_tick;
+  sd->job.data = sd;
+  return ph_job_set_timer_in_ms(&sd->job, sd->interval);
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -0,0 +1,296 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phenom/sysutil.h"
+#include "phenom/counter.h"
+#include "phenom/job.h"
+#include <ck_spinlock.h>
+#include "corelib/counter.h"
+
+/* Rate tracking.
+ * Tracked scopes have a ring of samples of their slot values, taken
+ * once per second by a timer job.  A rate is the difference between
+ * the newest sample and an older one divided by the time between them,
+ * so querying a rate never has to visit the per-thread blocks. */
+
+// One more than the longest window, as a window spans two samples
+#define RATE_SAMPLES (PH_COUNTER_RATE_WINDOW_MAX + 1)
+#define RATE_INTERVAL_MS 1000
+
+struct ph_counter_rate {
+  ph_counter_scope_t *scope;
+  struct ph_counter_rate *next;
+  ck_spinlock_t lock;
+  // index of the newest sample
+  uint32_t head;
+  uint32_t nsamples;
+  uint8_t num_slots;
+  // sample times in milliseconds, from the monotonic clock
+  int64_t when[RATE_SAMPLES];
+  // RATE_SAMPLES rows of num_slots values
+  int64_t values[1];
+};
+
+static struct ph_counter_rate *trackers = NULL;
+static ck_spinlock_t trackers_lock = CK_SPINLOCK_INITIALIZER;
+static ph_job_t rate_job;
+static uint32_t rate_started = 0;
+
+ph_result_t ph_counter_scope_track_rate(ph_counter_scope_t *scope)
+{
+  struct ph_counter_rate *rate;
+
+  rate = calloc(1, sizeof(*rate) +
+      ((RATE_SAMPLES * scope->num_slots) - 1) * sizeof(int64_t));
+  if (!rate) {
+    return PH_NOMEM;
+  }
+  ck_spinlock_init(&rate->lock);
+  rate->num_slots = scope->num_slots;
+  rate->scope = scope;
+
+  ck_spinlock_lock(&trackers_lock);
+  if (scope->rate) {
+    ck_spinlock_unlock(&trackers_lock);
+    free(rate);
+    return PH_OK;
+  }
+  // the tracker keeps the scope alive
+  ph_refcnt_add(&scope->refcnt);
+  rate->next = trackers;
+  trackers = rate;
+  ck_pr_fence_store();
+  ck_pr_store_ptr(&scope->rate, rate);
+  ck_spinlock_unlock(&trackers_lock);
+
+  return PH_OK;
+}
+
+static void record_sample(struct ph_counter_rate *rate, int64_t now,
+    uint8_t num_slots, const int64_t *values)
+{
+  int64_t *row;
+
+  ck_spinlock_lock(&rate->lock);
+  rate->head = rate->nsamples ? (rate->head + 1) % RATE_SAMPLES : 0;
+  rate->when[rate->head] = now;
+  row = rate->values + (rate->head * rate->num_slots);
+  memcpy(row, values, num_slots * sizeof(int64_t));
+  memset(row + num_slots, 0, (rate->num_slots - num_slots) * sizeof(int64_t));
+  if (rate->nsamples < RATE_SAMPLES) {
+    rate->nsamples++;
+  }
+  ck_spinlock_unlock(&rate->lock);
+}
+
+// Rates divide by the time between samples, so they need a clock that
+// doesn't jump when the wall clock is set
+static int64_t now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((int64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+void ph_counter_rate_sample(void)
+{
+  ph_counter_snapshot_t *snap;
+  ph_counter_scope_t *scope, **scopes;
+  struct ph_counter_rate *rate, *head;
+  int64_t values[PH_COUNTER_INVALID];
+  int64_t now;
+  uint32_t i, n;
+  uint8_t num_slots;
+
+  // Trackers are only ever pushed onto the front of the list, so the
+  // list behind the head that we load here doesn't change
+  head = ck_pr_load_ptr(&trackers);
+  if (!head) {
+    return;
+  }
+  ck_pr_fence_load();
+
+  for (n = 0, rate = head; rate; rate = rate->next) {
+    n++;
+  }
+  scopes = malloc(n * sizeof(*scopes));
+  if (!scopes) {
+    return;
+  }
+  for (n = 0, rate = head; rate; rate = rate->next) {
+    scopes[n++] = rate->scope;
+  }
+
+  // Only the tracked scopes; there may be many more that nobody
+  // asked for rates of
+  snap = ph_counter_snapshot_scopes(scopes, n);
+  free(scopes);
+  if (!snap) {
+    return;
+  }
+  now = now_ms();
+
+  n = ph_counter_snapshot_num_scopes(snap);
+  for (i = 0; i < n; i++) {
+    scope = ph_counter_snapshot_get_scope(snap, i);
+    rate = ck_pr_load_ptr(&scope->rate);
+    if (!rate) {
+      continue;
+    }
+
+    num_slots = ph_counter_snapshot_get_view(snap, i, rate->num_slots,
+        values, NULL);
+    record_sample(rate, now, num_slots, values);
+  }
+
+  ph_counter_snapshot_free(snap);
+}
+
+static void rate_tick(ph_job_t *job, ph_iomask_t why, void *data)
+{
+  ph_unused_parameter(why);
+  ph_unused_parameter(data);
+
+  ph_counter_rate_sample();
+  ph_job_set_timer_in_ms(job, RATE_INTERVAL_MS);
+}
+
+ph_result_t ph_counter_rate_start(void)
+{
+  ph_result_t res;
+
+  if (!ck_pr_cas_32(&rate_started, 0, 1)) {
+    return PH_OK;
+  }
+
+  res = ph_job_init(&rate_job);
+  if (res != PH_OK) {
+    return res;
+  }
+  rate_job.callback = rate_tick;
+  // take the first sample now so that rates are available after
+  // the first interval
+  ph_counter_rate_sample();
+  return ph_job_set_timer_in_ms(&rate_job, RATE_INTERVAL_MS);
+}
+
+static double compute_rate(struct ph_counter_rate *rate, uint8_t offset,
+    uint32_t window)
+{
+  uint32_t oldest;
+  int64_t dv, dt;
+
+  if (window == 0) {
+    window = 1;
+  }
+  ck_spinlock_lock(&rate->lock);
+  if (rate->nsamples < 2) {
+    ck_spinlock_unlock(&rate->lock);
+    return 0;
+  }
+  window = MIN(window, rate->nsamples - 1);
+  oldest = (rate->head + RATE_SAMPLES - window) % RATE_SAMPLES;
+  dv = rate->values[(rate->head * rate->num_slots) + offset] -
+    rate->values[(oldest * rate->num_slots) + offset];
+  dt = rate->when[rate->head] - rate->when[oldest];
+  ck_spinlock_unlock(&rate->lock);
+
+  if (dt <= 0) {
+    return 0;
+  }
+  return (double)dv * 1000.0 / (double)dt;
+}
+
+double ph_counter_scope_get_rate(
+    ph_counter_scope_t *scope,
+    uint8_t offset,
+    uint32_t window)
+{
+  struct ph_counter_rate *rate = ck_pr_load_ptr(&scope->rate);
+
+  if (!rate || offset >= rate->num_slots) {
+    return 0;
+  }
+  return compute_rate(rate, offset, window);
+}
+
+static int compare_rate_entry(const void *a, const void *b)
+{
+  const ph_counter_rate_entry_t *A = a, *B = b;
+  double ra = A->rate[1] < 0 ? -A->rate[1] : A->rate[1];
+  double rb = B->rate[1] < 0 ? -B->rate[1] : B->rate[1];
+
+  if (ra > rb) {
+    return -1;
+  }
+  if (ra < rb) {
+    return 1;
+  }
+  return 0;
+}
+
+uint32_t ph_counter_rate_top(ph_counter_rate_entry_t *entries,
+    uint32_t max_entries)
+{
+  static const uint32_t windows[3] = { 1, 10, 60 };
+  ph_counter_rate_entry_t *all = NULL, *grown;
+  struct ph_counter_rate *rate;
+  uint32_t n = 0, alloc = 0, w;
+  uint8_t s, in_use;
+
+  ck_spinlock_lock(&trackers_lock);
+  for (rate = trackers; rate; rate = rate->next) {
+    in_use = MIN(ph_counter_scope_get_num_slots(rate->scope),
+        ck_pr_load_8(&rate->scope->next_slot));
+
+    for (s = 0; s < in_use; s++) {
+      if (ph_counter_scope_is_histogram(rate->scope, s)) {
+        continue;
+      }
+      if (n == alloc) {
+        alloc = alloc ? alloc * 2 : 64;
+        grown = realloc(all, alloc * sizeof(*all));
+        if (!grown) {
+          goto out;
+        }
+        all = grown;
+      }
+      all[n].scope_name = rate->scope->full_scope_name;
+      all[n].slot_name = rate->scope->slot_names[s];
+      for (w = 0; w < 3; w++) {
+        all[n].rate[w] = compute_rate(rate, s, windows[w]);
+      }
+      if (all[n].rate[0] || all[n].rate[1] || all[n].rate[2]) {
+        n++;
+      }
+    }
+  }
+out:
+  ck_spinlock_unlock(&trackers_lock);
+
+  if (n) {
+    qsort(all, n, sizeof(*all), compare_rate_entry);
+    n = MIN(n, max_entries);
+    memcpy(entries, all, n * sizeof(*all));
+  }
+  free(all);
+
+  return n;
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -53,8 +53,8 @@ static void cmd_memory(ph_sock_t *sock)
   char name[29];
 
   ph_stm_printf(sock->stream,
-      "%28s %9s %9s %9s %9s %9s\r\n",
-      "WHAT", "BYTES", "OOM", "ALLOCS", "FREES", "REALLOC");
+      "%28s %9s %9s %9s %9s %9s %9s\r\n",
+      "WHAT", "BYTES", "OOM", "ALLOCS", "FREES", "REALLOC", "LIMIT");
 
   while (1) {
     int n, i;
@@ -73,10 +73,11 @@ static void cmd_memory(ph_sock_t *sock)
           "%9"PRIu64" "
           "%9"PRIu64" "
           "%9"PRIu64" "
+          "%9"PRIu64" "
           "\r\n",
           name,
           stats[i].bytes, stats[i].oom, stats[i].allocs,
-          stats[i].frees, stats[i].reallocs);
+          stats[i].frees, stats[i].reallocs, stats[i].hard_limit);
     }
 
     if ((uint32_t)n < sizeof(stats) / sizeof(stats[0])) {
@@ -91,6 +92,7 @@ struct counter_name_val {
   const char *scope_name;
   const char *name;
   int64_t val;
+  ph_counter_histogram_t *hist;
 };
 
 static int compare_counter_name_val(const void *a, const void *b)
@@ -108,13 +110,11 @@ static int compare_counter_name_val(const void *a, const void *b)
 // Query all counters except for memory counters.
 static void cmd_counters(ph_sock_t *sock)
 {
-#define NUM_SLOTS 64
-#define NUM_COUNTERS 2048
-  struct counter_name_val counter_data[NUM_COUNTERS];
-  int64_t view_slots[NUM_SLOTS];
-  const char *view_names[NUM_SLOTS];
-  ph_counter_scope_iterator_t iter;
-  uint32_t num_slots, i;
+  struct counter_name_val *counter_data;
+  int64_t view_slots[PH_COUNTER_INVALID];
+  const char *view_names[PH_COUNTER_INVALID];
+  ph_counter_snapshot_t *snap;
+  uint32_t num_slots, i, scope_idx, num_scopes, max_counters = 0;
   uint32_t n_counters = 0;
   uint32_t longest_name = 0;
   char name[69];
@@ -122,20 +122,37 @@ static void cmd_counters(ph_sock_t *sock)
   // Collect all counter data; it is returned in an undefined order.
   // For the sake of testing we want to order it, so we collect the data
   // and then sort it
-  ph_counter_scope_iterator_init(&iter);
-  ph_counter_scope_t *iter_scope;
-  while ((iter_scope = ph_counter_scope_iterator_next(&iter)) != NULL) {
+  snap = ph_counter_snapshot_all();
+  if (!snap) {
+    ph_stm_printf(sock->stream, "ERROR: unable to snapshot counters\r\n");
+    return;
+  }
+
+  num_scopes = ph_counter_snapshot_num_scopes(snap);
+  for (scope_idx = 0; scope_idx < num_scopes; scope_idx++) {
+    max_counters += ph_counter_scope_get_num_slots(
+        ph_counter_snapshot_get_scope(snap, scope_idx));
+  }
+  counter_data = malloc(MAX(max_counters, 1) * sizeof(*counter_data));
+  if (!counter_data) {
+    ph_stm_printf(sock->stream, "ERROR: out of memory\r\n");
+    ph_counter_snapshot_free(snap);
+    return;
+  }
+
+  for (scope_idx = 0; scope_idx < num_scopes; scope_idx++) {
+    ph_counter_scope_t *iter_scope;
     uint32_t slen;
 
+    iter_scope = ph_counter_snapshot_get_scope(snap, scope_idx);
     if (strncmp(ph_counter_scope_get_name(iter_scope), "memory/", 7) == 0) {
-      ph_counter_scope_delref(iter_scope);
       continue;
     }
 
     slen = strlen(ph_counter_scope_get_name(iter_scope));
 
-    num_slots = ph_counter_scope_get_view(iter_scope, NUM_SLOTS,
-        view_slots, view_names);
+    num_slots = ph_counter_snapshot_get_view(snap, scope_idx,
+        PH_COUNTER_INVALID, view_slots, view_names);
 
     for (i = 0; i < num_slots; i++) {
       uint32_t l = strlen(view_names[i]);
@@ -145,17 +162,9 @@ static void cmd_counters(ph_sock_t *sock)
         ph_counter_scope_get_name(iter_scope);
       counter_data[n_counters].name = view_names[i];
       counter_data[n_counters].val = view_slots[i];
+      counter_data[n_counters].hist =
+        ph_counter_snapshot_get_histogram(snap, scope_idx, i);
       n_counters++;
-
-      if (n_counters >= NUM_COUNTERS) {
-        break;
-      }
-    }
-
-    ph_counter_scope_delref(iter_scope);
-
-    if (n_counters >= NUM_COUNTERS) {
-      break;
     }
   }
 
@@ -166,23 +175,73 @@ static void cmd_counters(ph_sock_t *sock)
     ph_snprintf(name, sizeof(name), "%s/%s",
         counter_data[i].scope_name,
         counter_data[i].name);
-    ph_stm_printf(sock->stream, "%*s %16" PRIi64"\r\n",
+    ph_stm_printf(sock->stream, "%*s %16" PRIi64,
         longest_name,
         name, counter_data[i].val);
+    if (counter_data[i].hist) {
+      ph_counter_histogram_t *hist = counter_data[i].hist;
+
+      ph_stm_printf(sock->stream,
+          "  p50=%" PRIi64 " p99=%" PRIi64 " p999=%" PRIi64,
+          ph_counter_histogram_percentile(hist, 50),
+          ph_counter_histogram_percentile(hist, 99),
+          ph_counter_histogram_percentile(hist, 99.9));
+    }
+    ph_stm_printf(sock->stream, "\r\n");
   }
 
-  if (n_counters >= NUM_COUNTERS) {
+  free(counter_data);
+  ph_counter_snapshot_free(snap);
+}
+
+// The fastest moving counters of the scopes with rate tracking
+static void cmd_top(ph_sock_t *sock)
+{
+#define TOP_ENTRIES 32
+  ph_counter_rate_entry_t entries[TOP_ENTRIES];
+  uint32_t n, i;
+  char name[69];
+
+  n = ph_counter_rate_top(entries, TOP_ENTRIES);
+  if (n == 0) {
     ph_stm_printf(sock->stream,
-        "WARNING: too many counters to sort, output truncated\r\n");
+        "# no counter activity; are any scopes tracking rates?\r\n");
+    return;
+  }
+
+  ph_stm_printf(sock->stream, "%48s %12s %12s %12s\r\n",
+      "WHAT", "1s", "10s", "60s");
+  for (i = 0; i < n; i++) {
+    ph_snprintf(name, sizeof(name), "%s/%s",
+        entries[i].scope_name, entries[i].slot_name);
+    ph_stm_printf(sock->stream, "%48s %12.1f %12.1f %12.1f\r\n",
+        name, entries[i].rate[0], entries[i].rate[1], entries[i].rate[2]);
   }
 }
 
+static void cmd_heap(ph_sock_t *sock)
+{
+  if (ph_mem_prof_get_rate() == 0) {
+    ph_stm_printf(sock->stream,
+        "# heap sampling is disabled; set memory.sample_rate\n");
+  }
+  ph_mem_prof_dump(sock->stream);
+}
+
+static void cmd_locks(ph_sock_t *sock)
+{
+  ph_lock_prof_dump(sock->stream);
+}
+
 static struct {
   const char *name;
   console_cmd func;
 } funcs[] = {
   { "memory", cmd_memory },
   { "counters", cmd_counters },
+  { "heap", cmd_heap },
+  { "top", cmd_top },
+  { "locks", cmd_locks },
 };
 
 static void debug_con_processor(ph_sock_t *sock, ph_iomask_t why, void *arg)
@@ -80,6 +80,13 @@ static void collect_counter_scopes(gimli_proc_t proc)
     ascope = calloc(1, sizeof(*ascope) + (scope->next_slot * sizeof(int64_t)));
     ascope->scope = scope;
 
+    // Start from the totals folded in from threads that have exited;
+    // their blocks are gone, so the thread walk below won't see them
+    if (!gimli_read_mem(proc, (gimli_addr_t)scope->base_slots,
+          ascope->values, scope->next_slot * sizeof(int64_t))) {
+      memset(ascope->values, 0, scope->next_slot * sizeof(int64_t));
+    }
+
     scope->scope_name = gimli_read_string(proc,
         (gimli_addr_t)scope->scope_name);
 
@@ -112,30 +119,39 @@ static void collect_counter_scopes(gimli_proc_t proc)
   num_scopes = nscope;
 }
 
-// Walk each thread; walk the counter_hs there and accumulate a count
-// against the appropriate scope
+// Walk each thread; walk the counter block table there and accumulate
+// a count against the appropriate scope
 static void collect_counter_values(gimli_proc_t proc)
 {
-  uint32_t nthreads, i;
+  uint32_t nthreads, i, b;
   ph_thread_t *threads;
   struct ph_counter_block block;
+  struct ph_counter_block_table tab;
   struct agg_counter_scope *ascope;
   int64_t max_slots[255];
-  struct ph_gimli_ck_hs_iter hs_iter;
-  gimli_addr_t addr;
+  gimli_addr_t taddr, addr;
 
   threads = ph_gimli_get_threads(proc, &nthreads);
 
   for (i = 0; i < nthreads; i++) {
-    if (!ph_gimli_ck_hs_iter_init_from_map(proc,
-        (gimli_addr_t)threads[i].counter_hs.map, &hs_iter)) {
+    taddr = (gimli_addr_t)threads[i].counter_blocks;
+    if (!taddr || !gimli_read_mem(proc, taddr, &tab, sizeof(tab))) {
       continue;
     }
 
-    while (ph_gimli_ck_hs_iter_next(&hs_iter, &addr)) {
-      if (!gimli_read_mem(proc, addr, &block, sizeof(block))) {
+    for (b = 0; b < tab.size; b++) {
+      if (!gimli_read_mem(proc,
+            taddr + ph_offsetof(struct ph_counter_block_table, blocks) +
+            (b * sizeof(addr)), &addr, sizeof(addr))) {
         break;
       }
+      if (!addr) {
+        continue;
+      }
+
+      if (!gimli_read_mem(proc, addr, &block, sizeof(block))) {
+        continue;
+      }
 
       if (!gimli_hash_find_u64(scope_hash, block.scope_id, (void**)&ascope)) {
         continue;
@@ -153,8 +169,6 @@ static void collect_counter_values(gimli_proc_t proc)
         ascope->values[s] += max_slots[s];
       }
     }
-
-    ph_gimli_ck_hs_iter_destroy(&hs_iter);
   }
 }
 
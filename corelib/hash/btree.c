@@ -0,0 +1,691 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phenom/btree.h"
+#include "phenom/sysutil.h"
+#include "phenom/memory.h"
+#include "phenom/log.h"
+
+/* All nodes of a tree are the same size.  A node holds a count and an
+ * array of keys.  Leaves follow that with an array of values and are
+ * chained together in key order; interior nodes follow it with nkeys + 1
+ * child pointers.  Child i holds the keys that are not less than key
+ * i - 1 and less than key i.
+ *
+ * The keys in interior nodes are separators made with key_copy, so they
+ * remain valid after the leaf element they were taken from is deleted.
+ *
+ * Deletes don't rebalance; a node is removed only once it is empty.
+ * That keeps deletes cheap, at the cost of sparser nodes after heavy
+ * deletion.  Since nodes are only created by splitting full ones,
+ * growing the tree to height h still takes at least (cap / 2)^h
+ * inserts, so MAX_HEIGHT is out of reach. */
+
+#define NODE_SIZE 512
+#define MIN_CAP 4
+#define MAX_HEIGHT 48
+
+struct ph_btree_node {
+  uint32_t nkeys;
+  // leaves only
+  struct ph_btree_node *prev, *next;
+  char data[1];
+};
+
+// The nodes on the way down to a leaf, and which child was taken
+struct path {
+  struct ph_btree_node *node[MAX_HEIGHT];
+  uint32_t child[MAX_HEIGHT];
+};
+
+static ph_memtype_t mt_node;
+static struct ph_memtype_def node_def = {
+  "hashtable", "btree_node", 0, 0
+};
+
+static void init_btree(void)
+{
+  mt_node = ph_memtype_register(&node_def);
+}
+
+PH_LIBRARY_INIT_PRI(init_btree, 0, 5)
+
+static inline char *keyat(ph_btree_t *tree, struct ph_btree_node *n,
+    uint32_t i)
+{
+  return n->data + (i * tree->kdef->ksize);
+}
+
+static inline char *valat(ph_btree_t *tree, struct ph_btree_node *n,
+    uint32_t i)
+{
+  return n->data + tree->val_off + (i * tree->vdef->vsize);
+}
+
+static inline struct ph_btree_node **children(ph_btree_t *tree,
+    struct ph_btree_node *n)
+{
+  return (struct ph_btree_node**)(void*)(n->data + tree->child_off);
+}
+
+static inline int key_compare(ph_btree_t *tree, const void *a, const void *b)
+{
+  if (tree->kdef->key_compare) {
+    return tree->kdef->key_compare(a, b);
+  }
+  return memcmp(a, b, tree->kdef->ksize);
+}
+
+static inline bool key_copy(ph_btree_t *tree, const void *src,
+    void *dest, int flags)
+{
+  if (tree->kdef->key_copy && (flags & PH_HT_CLAIM_KEY) == 0) {
+    return tree->kdef->key_copy(src, dest);
+  }
+  memcpy(dest, src, tree->kdef->ksize);
+  return true;
+}
+
+static inline bool val_copy(ph_btree_t *tree, const void *src,
+    void *dest, int flags)
+{
+  if (tree->vdef->val_copy && (flags & PH_HT_CLAIM_VAL) == 0) {
+    return tree->vdef->val_copy(src, dest);
+  }
+  memcpy(dest, src, tree->vdef->vsize);
+  return true;
+}
+
+static inline void val_delete(ph_btree_t *tree, void *val)
+{
+  if (tree->vdef->val_delete) {
+    tree->vdef->val_delete(val);
+  }
+}
+
+static inline void key_delete(ph_btree_t *tree, void *key)
+{
+  if (tree->kdef->key_delete) {
+    tree->kdef->key_delete(key);
+  }
+}
+
+static inline uint32_t align_ptr(uint32_t n)
+{
+  return (n + sizeof(void*) - 1) & ~(uint32_t)(sizeof(void*) - 1);
+}
+
+ph_result_t ph_btree_init(ph_btree_t *tree,
+    const struct ph_ht_key_def *kdef,
+    const struct ph_ht_val_def *vdef)
+{
+  uint32_t hdr = offsetof(struct ph_btree_node, data);
+  uint32_t leaf_elem = kdef->ksize + vdef->vsize;
+  uint32_t inner_elem = kdef->ksize + sizeof(void*);
+  // room for the padding after the keys and the extra child pointer
+  uint32_t extra = 2 * sizeof(void*);
+  uint32_t size = NODE_SIZE;
+
+  // Big elements get bigger nodes, so that splits remain possible
+  if (size < hdr + extra + (MIN_CAP * MAX(leaf_elem, inner_elem))) {
+    size = hdr + extra + (MIN_CAP * MAX(leaf_elem, inner_elem));
+  }
+
+  tree->kdef = kdef;
+  tree->vdef = vdef;
+  tree->root = NULL;
+  tree->first = NULL;
+  tree->nelems = 0;
+  tree->height = 0;
+  tree->gen = 0;
+  tree->node_size = size;
+  tree->leaf_cap = (size - hdr - extra) / leaf_elem;
+  tree->inner_cap = (size - hdr - extra) / inner_elem;
+  tree->val_off = align_ptr(tree->leaf_cap * kdef->ksize);
+  tree->child_off = align_ptr(tree->inner_cap * kdef->ksize);
+
+  // two keys: the separator moving up a level and the one displacing it
+  tree->scratch = ph_mem_alloc_size(mt_node, 2 * kdef->ksize);
+  if (!tree->scratch) {
+    return PH_NOMEM;
+  }
+  return PH_OK;
+}
+
+static void free_subtree(ph_btree_t *tree, struct ph_btree_node *n,
+    uint32_t level)
+{
+  uint32_t i;
+
+  if (level == 0) {
+    for (i = 0; i < n->nkeys; i++) {
+      key_delete(tree, keyat(tree, n, i));
+      val_delete(tree, valat(tree, n, i));
+    }
+  } else {
+    for (i = 0; i <= n->nkeys; i++) {
+      free_subtree(tree, children(tree, n)[i], level - 1);
+    }
+    for (i = 0; i < n->nkeys; i++) {
+      key_delete(tree, keyat(tree, n, i));
+    }
+  }
+  ph_mem_free(mt_node, n);
+}
+
+void ph_btree_free_entries(ph_btree_t *tree)
+{
+  if (tree->root) {
+    free_subtree(tree, tree->root, tree->height);
+  }
+  tree->root = NULL;
+  tree->first = NULL;
+  tree->nelems = 0;
+  tree->height = 0;
+  tree->gen++;
+}
+
+void ph_btree_destroy(ph_btree_t *tree)
+{
+  ph_btree_free_entries(tree);
+  ph_mem_free(mt_node, tree->scratch);
+  tree->scratch = NULL;
+}
+
+static struct ph_btree_node *alloc_node(ph_btree_t *tree)
+{
+  struct ph_btree_node *n;
+
+  n = ph_mem_alloc_size(mt_node, tree->node_size);
+  if (!n) {
+    return NULL;
+  }
+  n->nkeys = 0;
+  n->prev = NULL;
+  n->next = NULL;
+  return n;
+}
+
+// Returns the first position in a leaf whose key is not less than key
+static uint32_t leaf_lower_bound(ph_btree_t *tree, struct ph_btree_node *n,
+    const void *key)
+{
+  uint32_t lo = 0, hi = n->nkeys, mid;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (key_compare(tree, keyat(tree, n, mid), key) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// Returns the child of an interior node whose range includes key
+static uint32_t inner_child(ph_btree_t *tree, struct ph_btree_node *n,
+    const void *key)
+{
+  uint32_t lo = 0, hi = n->nkeys, mid;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (key_compare(tree, key, keyat(tree, n, mid)) < 0) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return lo;
+}
+
+// Walks down to the leaf whose range includes key.  Records the way
+// there in path, if provided.
+static struct ph_btree_node *descend(ph_btree_t *tree, const void *key,
+    struct path *path)
+{
+  struct ph_btree_node *n = tree->root;
+  uint32_t d, i;
+
+  for (d = 0; d < tree->height; d++) {
+    i = inner_child(tree, n, key);
+    if (path) {
+      path->node[d] = n;
+      path->child[d] = i;
+    }
+    n = children(tree, n)[i];
+  }
+  return n;
+}
+
+static bool find_elem(ph_btree_t *tree, const void *key,
+    struct ph_btree_node **leafp, uint32_t *posp)
+{
+  struct ph_btree_node *leaf;
+  uint32_t pos;
+
+  if (!tree->root) {
+    return false;
+  }
+  leaf = descend(tree, key, NULL);
+  pos = leaf_lower_bound(tree, leaf, key);
+  if (pos == leaf->nkeys || key_compare(tree, keyat(tree, leaf, pos), key)) {
+    return false;
+  }
+  *leafp = leaf;
+  *posp = pos;
+  return true;
+}
+
+// Inserts a separator and the child to its right into an interior
+// node that has room for them.  i is the index of the child to the
+// left of the separator.
+static void inner_insert_at(ph_btree_t *tree, struct ph_btree_node *n,
+    uint32_t i, const char *sep, struct ph_btree_node *child)
+{
+  struct ph_btree_node **kids = children(tree, n);
+  uint32_t ksize = tree->kdef->ksize;
+
+  memmove(keyat(tree, n, i + 1), keyat(tree, n, i), (n->nkeys - i) * ksize);
+  memmove(kids + i + 2, kids + i + 1, (n->nkeys - i) * sizeof(*kids));
+  memcpy(keyat(tree, n, i), sep, ksize);
+  kids[i + 1] = child;
+  n->nkeys++;
+}
+
+/* Splits a full leaf in two and links the new right half into the tree,
+ * splitting full ancestors as needed.  Updates *leafp and *posp to the
+ * place where the element that didn't fit belongs. */
+static ph_result_t split_leaf(ph_btree_t *tree, struct path *path,
+    struct ph_btree_node **leafp, uint32_t *posp)
+{
+  struct ph_btree_node *spare[MAX_HEIGHT + 1];
+  struct ph_btree_node *leaf = *leafp, *right, *n, *child;
+  uint32_t ksize = tree->kdef->ksize, vsize = tree->vdef->vsize;
+  uint32_t need = 1, used = 0, mid, i;
+  char *sep = tree->scratch, *up = tree->scratch + ksize, *tmp;
+  int d;
+
+  // Allocate everything up front so that failure leaves the tree
+  // untouched: the new leaf, a node per full ancestor, and maybe a root
+  for (d = (int)tree->height - 1; d >= 0; d--) {
+    if (path->node[d]->nkeys < tree->inner_cap) {
+      break;
+    }
+    need++;
+  }
+  if (d < 0) {
+    need++;
+  }
+  for (i = 0; i < need; i++) {
+    spare[i] = alloc_node(tree);
+    if (!spare[i]) {
+      goto fail;
+    }
+  }
+
+  mid = tree->leaf_cap / 2;
+  if (!key_copy(tree, keyat(tree, leaf, mid), sep, PH_HT_COPY)) {
+    goto fail;
+  }
+  tree->gen++;
+
+  right = spare[used++];
+  right->nkeys = leaf->nkeys - mid;
+  memcpy(keyat(tree, right, 0), keyat(tree, leaf, mid), right->nkeys * ksize);
+  memcpy(valat(tree, right, 0), valat(tree, leaf, mid), right->nkeys * vsize);
+  leaf->nkeys = mid;
+  right->prev = leaf;
+  right->next = leaf->next;
+  if (leaf->next) {
+    leaf->next->prev = right;
+  }
+  leaf->next = right;
+
+  if (*posp > mid) {
+    *leafp = right;
+    *posp -= mid;
+  }
+
+  child = right;
+  for (d = (int)tree->height - 1; d >= 0; d--) {
+    n = path->node[d];
+    i = path->child[d];
+    if (n->nkeys < tree->inner_cap) {
+      inner_insert_at(tree, n, i, sep, child);
+      return PH_OK;
+    }
+
+    // The middle key moves up to the next level
+    right = spare[used++];
+    mid = tree->inner_cap / 2;
+    right->nkeys = n->nkeys - mid - 1;
+    memcpy(keyat(tree, right, 0), keyat(tree, n, mid + 1),
+        right->nkeys * ksize);
+    memcpy(children(tree, right), children(tree, n) + mid + 1,
+        (right->nkeys + 1) * sizeof(struct ph_btree_node*));
+    memcpy(up, keyat(tree, n, mid), ksize);
+    n->nkeys = mid;
+
+    if (i <= mid) {
+      inner_insert_at(tree, n, i, sep, child);
+    } else {
+      inner_insert_at(tree, right, i - mid - 1, sep, child);
+    }
+
+    tmp = sep;
+    sep = up;
+    up = tmp;
+    child = right;
+  }
+
+  n = spare[used++];
+  n->nkeys = 1;
+  memcpy(keyat(tree, n, 0), sep, ksize);
+  children(tree, n)[0] = tree->root;
+  children(tree, n)[1] = child;
+  tree->root = n;
+  tree->height++;
+  return PH_OK;
+
+fail:
+  while (i-- > 0) {
+    ph_mem_free(mt_node, spare[i]);
+  }
+  return PH_NOMEM;
+}
+
+/* Removes the element at pos from a leaf, without deleting its key or
+ * value, then removes any nodes left empty */
+static void remove_elem(ph_btree_t *tree, struct path *path,
+    struct ph_btree_node *leaf, uint32_t pos)
+{
+  uint32_t ksize = tree->kdef->ksize, vsize = tree->vdef->vsize;
+  struct ph_btree_node *n, *gone = leaf, **kids;
+  uint32_t i, k;
+  int d;
+
+  memmove(keyat(tree, leaf, pos), keyat(tree, leaf, pos + 1),
+      (leaf->nkeys - pos - 1) * ksize);
+  memmove(valat(tree, leaf, pos), valat(tree, leaf, pos + 1),
+      (leaf->nkeys - pos - 1) * vsize);
+  leaf->nkeys--;
+  tree->nelems--;
+  tree->gen++;
+
+  if (leaf->nkeys) {
+    return;
+  }
+
+  if (leaf->prev) {
+    leaf->prev->next = leaf->next;
+  } else {
+    tree->first = leaf->next;
+  }
+  if (leaf->next) {
+    leaf->next->prev = leaf->prev;
+  }
+
+  for (d = (int)tree->height - 1; d >= 0; d--) {
+    ph_mem_free(mt_node, gone);
+    n = path->node[d];
+    i = path->child[d];
+    if (n->nkeys == 0) {
+      // that was its only child
+      gone = n;
+      continue;
+    }
+
+    // Child i's range merges into that of a neighbor, along with
+    // the separator between them
+    k = i > 0 ? i - 1 : 0;
+    key_delete(tree, keyat(tree, n, k));
+    memmove(keyat(tree, n, k), keyat(tree, n, k + 1),
+        (n->nkeys - k - 1) * ksize);
+    kids = children(tree, n);
+    memmove(kids + i, kids + i + 1, (n->nkeys - i) * sizeof(*kids));
+    n->nkeys--;
+    gone = NULL;
+    break;
+  }
+
+  if (gone) {
+    // The tree is now empty
+    ph_mem_free(mt_node, gone);
+    tree->root = NULL;
+    tree->first = NULL;
+    tree->height = 0;
+    return;
+  }
+
+  // A root with only one child is redundant
+  while (tree->height && tree->root->nkeys == 0) {
+    n = tree->root;
+    tree->root = children(tree, n)[0];
+    ph_mem_free(mt_node, n);
+    tree->height--;
+  }
+}
+
+ph_result_t ph_btree_insert(ph_btree_t *tree, void *key, void *value,
+    int flags)
+{
+  uint32_t ksize = tree->kdef->ksize, vsize = tree->vdef->vsize;
+  struct ph_btree_node *leaf;
+  struct path path;
+  ph_result_t res;
+  uint32_t pos;
+
+  if (!tree->root) {
+    tree->root = alloc_node(tree);
+    if (!tree->root) {
+      return PH_NOMEM;
+    }
+    tree->first = tree->root;
+  }
+
+  leaf = descend(tree, key, &path);
+  pos = leaf_lower_bound(tree, leaf, key);
+
+  if (pos < leaf->nkeys &&
+      key_compare(tree, keyat(tree, leaf, pos), key) == 0) {
+    if ((flags & PH_HT_REPLACE) == 0) {
+      return PH_EXISTS;
+    }
+
+    val_delete(tree, valat(tree, leaf, pos));
+    if (!val_copy(tree, value, valat(tree, leaf, pos), flags)) {
+      key_delete(tree, keyat(tree, leaf, pos));
+      remove_elem(tree, &path, leaf, pos);
+      return PH_ERR;
+    }
+
+    // As in ph_ht_insert(), a claimed key is not needed here but the
+    // caller is no longer tracking it
+    if (flags & PH_HT_CLAIM_KEY) {
+      key_delete(tree, key);
+    }
+    return PH_OK;
+  }
+
+  if (leaf->nkeys == tree->leaf_cap) {
+    res = split_leaf(tree, &path, &leaf, &pos);
+    if (res != PH_OK) {
+      return res;
+    }
+  }
+
+  memmove(keyat(tree, leaf, pos + 1), keyat(tree, leaf, pos),
+      (leaf->nkeys - pos) * ksize);
+  memmove(valat(tree, leaf, pos + 1), valat(tree, leaf, pos),
+      (leaf->nkeys - pos) * vsize);
+
+  if (!key_copy(tree, key, keyat(tree, leaf, pos), flags)) {
+    goto undo;
+  }
+  if (!val_copy(tree, value, valat(tree, leaf, pos), flags)) {
+    if ((flags & PH_HT_CLAIM_KEY) == 0) {
+      key_delete(tree, keyat(tree, leaf, pos));
+    }
+    goto undo;
+  }
+
+  leaf->nkeys++;
+  tree->nelems++;
+  tree->gen++;
+  return PH_OK;
+
+undo:
+  memmove(keyat(tree, leaf, pos), keyat(tree, leaf, pos + 1),
+      (leaf->nkeys - pos) * ksize);
+  memmove(valat(tree, leaf, pos), valat(tree, leaf, pos + 1),
+      (leaf->nkeys - pos) * vsize);
+  return PH_ERR;
+}
+
+ph_result_t ph_btree_set(ph_btree_t *tree, void *key, void *value)
+{
+  return ph_btree_insert(tree, key, value, PH_HT_NO_REPLACE|PH_HT_COPY);
+}
+
+ph_result_t ph_btree_replace(ph_btree_t *tree, void *key, void *value)
+{
+  return ph_btree_insert(tree, key, value, PH_HT_REPLACE|PH_HT_COPY);
+}
+
+void *ph_btree_get(ph_btree_t *tree, const void *key)
+{
+  struct ph_btree_node *leaf;
+  uint32_t pos;
+
+  if (!find_elem(tree, key, &leaf, &pos)) {
+    return NULL;
+  }
+  return valat(tree, leaf, pos);
+}
+
+ph_result_t ph_btree_lookup(ph_btree_t *tree, const void *key, void *val,
+    bool copy)
+{
+  struct ph_btree_node *leaf;
+  uint32_t pos;
+
+  if (!find_elem(tree, key, &leaf, &pos)) {
+    return PH_NOENT;
+  }
+  if (!val_copy(tree, valat(tree, leaf, pos), val,
+        copy ? PH_HT_COPY_VAL : PH_HT_CLAIM_VAL)) {
+    return PH_ERR;
+  }
+  return PH_OK;
+}
+
+ph_result_t ph_btree_del(ph_btree_t *tree, const void *key)
+{
+  struct ph_btree_node *leaf;
+  struct path path;
+  uint32_t pos;
+
+  if (!tree->root) {
+    return PH_NOENT;
+  }
+  leaf = descend(tree, key, &path);
+  pos = leaf_lower_bound(tree, leaf, key);
+  if (pos == leaf->nkeys || key_compare(tree, keyat(tree, leaf, pos), key)) {
+    return PH_NOENT;
+  }
+
+  key_delete(tree, keyat(tree, leaf, pos));
+  val_delete(tree, valat(tree, leaf, pos));
+  remove_elem(tree, &path, leaf, pos);
+  return PH_OK;
+}
+
+uint32_t ph_btree_size(ph_btree_t *tree)
+{
+  return tree->nelems;
+}
+
+static inline bool iter_yield(ph_btree_t *tree, ph_btree_iter_t *iter,
+    void **key, void **val)
+{
+  if (key) {
+    *key = keyat(tree, iter->node, iter->pos);
+  }
+  if (val) {
+    *val = valat(tree, iter->node, iter->pos);
+  }
+  return true;
+}
+
+bool ph_btree_iter_first(ph_btree_t *tree, ph_btree_iter_t *iter,
+    void **key, void **val)
+{
+  // Only an empty root can be an empty leaf
+  if (!tree->first || tree->first->nkeys == 0) {
+    iter->node = NULL;
+    return false;
+  }
+  iter->node = tree->first;
+  iter->pos = 0;
+  return iter_yield(tree, iter, key, val);
+}
+
+bool ph_btree_lower_bound(ph_btree_t *tree, ph_btree_iter_t *iter,
+    const void *key, void **keyp, void **valp)
+{
+  struct ph_btree_node *leaf;
+  uint32_t pos;
+
+  iter->node = NULL;
+  if (!tree->root) {
+    return false;
+  }
+  leaf = descend(tree, key, NULL);
+  pos = leaf_lower_bound(tree, leaf, key);
+  if (pos == leaf->nkeys) {
+    // everything in the next leaf is at least the separator that
+    // sent us here, which is greater than key
+    leaf = leaf->next;
+    pos = 0;
+    if (!leaf) {
+      return false;
+    }
+  }
+  iter->node = leaf;
+  iter->pos = pos;
+  return iter_yield(tree, iter, keyp, valp);
+}
+
+bool ph_btree_iter_next(ph_btree_t *tree, ph_btree_iter_t *iter,
+    void **key, void **val)
+{
+  if (!iter->node) {
+    return false;
+  }
+  if (++iter->pos == iter->node->nkeys) {
+    iter->node = iter->node->next;
+    iter->pos = 0;
+    if (!iter->node) {
+      return false;
+    }
+  }
+  return iter_yield(tree, iter, key, val);
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -0,0 +1,351 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phenom/cht.h"
+#include "phenom/sysutil.h"
+#include "phenom/memory.h"
+#include "phenom/log.h"
+
+/* The table is a ck_hs of pointers to entries.  ck_hs is single
+ * producer, multi-consumer: writers hold cht->lock and readers need
+ * only be in an epoch.  Entries and the ck_hs maps are reclaimed via
+ * ph_thread_epoch_defer() once they are unlinked. */
+
+struct cht_entry {
+  ck_epoch_entry_t epoch;
+  uint32_t hash;
+  // The defs are kept here because ck_hs callbacks and deferred
+  // frees have no other way to reach them
+  const struct ph_ht_key_def *kdef;
+  const struct ph_ht_val_def *vdef;
+  // points at the key in data, or at the caller's key when searching
+  const void *key;
+  /* key followed by value; pointer aligned */
+  char data[1];
+};
+
+static ph_memtype_t mt_entry, mt_map;
+static struct ph_memtype_def defs[] = {
+  { "hashtable", "cht_entry", 0, 0 },
+  { "hashtable", "cht_map", 0, 0 },
+};
+
+static void init_cht(void)
+{
+  mt_entry = ph_memtype_register_block(sizeof(defs) / sizeof(defs[0]),
+      defs, NULL);
+  mt_map = mt_entry + 1;
+}
+
+PH_LIBRARY_INIT_PRI(init_cht, 0, 5)
+
+// As in the counter subsystem, the epoch entry for a retired map lives
+// just in front of the region that ck_hs sees
+static void *map_malloc(size_t size)
+{
+  ck_epoch_entry_t *e;
+
+  e = ph_mem_alloc_size(mt_map, sizeof(*e) + size);
+  if (e == NULL) {
+    return NULL;
+  }
+
+  return e + 1;
+}
+
+static void deferred_map_free(ck_epoch_entry_t *e)
+{
+  ph_mem_free(mt_map, e);
+}
+
+static void map_free(void *p, size_t b, bool r)
+{
+  ck_epoch_entry_t *e = p;
+
+  ph_unused_parameter(b);
+  if (e == NULL) {
+    return;
+  }
+
+  e--;
+
+  if (r) {
+    ph_thread_epoch_defer(e, deferred_map_free);
+  } else {
+    ph_mem_free(mt_map, e);
+  }
+}
+
+static struct ck_malloc map_allocator = {
+  .malloc = map_malloc,
+  .free = map_free
+};
+
+static inline void *entry_val(struct cht_entry *e)
+{
+  return e->data + e->kdef->ksize;
+}
+
+static unsigned long entry_hash(const void *p, // NOLINT(runtime/int)
+    unsigned long seed) // NOLINT(runtime/int)
+{
+  const struct cht_entry *e = p;
+
+  ph_unused_parameter(seed);
+  return e->hash;
+}
+
+static bool entry_compare(const void *a, const void *b)
+{
+  const struct cht_entry *A = a, *B = b;
+
+  if (A->kdef->key_compare) {
+    return A->kdef->key_compare(A->key, B->key) == 0;
+  }
+  return memcmp(A->key, B->key, A->kdef->ksize) == 0;
+}
+
+ph_result_t ph_cht_init(ph_cht_t *cht, uint32_t size_hint,
+    const struct ph_ht_key_def *kdef,
+    const struct ph_ht_val_def *vdef)
+{
+  cht->kdef = kdef;
+  cht->vdef = vdef;
+
+  if (!ck_hs_init(&cht->hs, CK_HS_MODE_SPMC | CK_HS_MODE_OBJECT,
+        entry_hash, entry_compare, &map_allocator,
+        size_hint < 8 ? 8 : size_hint, 0)) {
+    return PH_NOMEM;
+  }
+  pthread_mutex_init(&cht->lock, NULL);
+
+  return PH_OK;
+}
+
+static void free_entry(struct cht_entry *e)
+{
+  if (e->kdef->key_delete) {
+    e->kdef->key_delete(e->data);
+  }
+  if (e->vdef->val_delete) {
+    e->vdef->val_delete(entry_val(e));
+  }
+  ph_mem_free(mt_entry, e);
+}
+
+static void deferred_entry_free(ck_epoch_entry_t *epoch)
+{
+  free_entry(ph_container_of(epoch, struct cht_entry, epoch));
+}
+
+// Frees an entry that never made it into the table.  Only the parts
+// that it copied are deleted; claimed keys and values still belong
+// to the caller.
+static void discard_entry(struct cht_entry *e, int flags)
+{
+  if (e->kdef->key_delete && (flags & PH_HT_CLAIM_KEY) == 0) {
+    e->kdef->key_delete(e->data);
+  }
+  if (e->vdef->val_delete && (flags & PH_HT_CLAIM_VAL) == 0) {
+    e->vdef->val_delete(entry_val(e));
+  }
+  ph_mem_free(mt_entry, e);
+}
+
+static struct cht_entry *make_entry(ph_cht_t *cht, void *key, void *value,
+    int flags)
+{
+  struct cht_entry *e;
+
+  e = ph_mem_alloc_size(mt_entry, offsetof(struct cht_entry, data) +
+      cht->kdef->ksize + cht->vdef->vsize);
+  if (!e) {
+    return NULL;
+  }
+  e->kdef = cht->kdef;
+  e->vdef = cht->vdef;
+  e->key = e->data;
+  e->hash = cht->kdef->hash_func(key);
+
+  if (cht->kdef->key_copy && (flags & PH_HT_CLAIM_KEY) == 0) {
+    if (!cht->kdef->key_copy(key, e->data)) {
+      ph_mem_free(mt_entry, e);
+      return NULL;
+    }
+  } else {
+    memcpy(e->data, key, cht->kdef->ksize);
+  }
+
+  if (cht->vdef->val_copy && (flags & PH_HT_CLAIM_VAL) == 0) {
+    if (!cht->vdef->val_copy(value, entry_val(e))) {
+      if (cht->kdef->key_delete && (flags & PH_HT_CLAIM_KEY) == 0) {
+        cht->kdef->key_delete(e->data);
+      }
+      ph_mem_free(mt_entry, e);
+      return NULL;
+    }
+  } else {
+    memcpy(entry_val(e), value, cht->vdef->vsize);
+  }
+
+  return e;
+}
+
+ph_result_t ph_cht_insert(ph_cht_t *cht, void *key, void *value, int flags)
+{
+  struct cht_entry *e, *prev = NULL;
+  ph_result_t res = PH_OK;
+
+  e = make_entry(cht, key, value, flags);
+  if (!e) {
+    return PH_ERR;
+  }
+
+  pthread_mutex_lock(&cht->lock);
+  if (flags & PH_HT_REPLACE) {
+    if (!ck_hs_set(&cht->hs, e->hash, e, (void**)(void*)&prev)) {
+      res = PH_NOMEM;
+    }
+  } else if (!ck_hs_put(&cht->hs, e->hash, e)) {
+    res = ck_hs_get(&cht->hs, e->hash, e) ? PH_EXISTS : PH_NOMEM;
+  }
+  pthread_mutex_unlock(&cht->lock);
+
+  if (res != PH_OK) {
+    discard_entry(e, flags);
+    return res;
+  }
+
+  if (prev) {
+    // Unlike ph_ht_insert(), the new entry keeps the key we were given
+    // and the old key goes away along with the old entry
+    ph_thread_epoch_defer(&prev->epoch, deferred_entry_free);
+  }
+  return PH_OK;
+}
+
+ph_result_t ph_cht_set(ph_cht_t *cht, void *key, void *value)
+{
+  return ph_cht_insert(cht, key, value, PH_HT_NO_REPLACE|PH_HT_COPY);
+}
+
+ph_result_t ph_cht_replace(ph_cht_t *cht, void *key, void *value)
+{
+  return ph_cht_insert(cht, key, value, PH_HT_REPLACE|PH_HT_COPY);
+}
+
+static inline struct cht_entry *find_entry(ph_cht_t *cht, const void *key)
+{
+  struct cht_entry search;
+
+  search.kdef = cht->kdef;
+  search.key = key;
+  search.hash = cht->kdef->hash_func(key);
+
+  return ck_hs_get(&cht->hs, search.hash, &search);
+}
+
+void *ph_cht_get(ph_cht_t *cht, const void *key)
+{
+  struct cht_entry *e = find_entry(cht, key);
+
+  return e ? entry_val(e) : NULL;
+}
+
+ph_result_t ph_cht_lookup(ph_cht_t *cht, const void *key, void *val)
+{
+  struct cht_entry *e;
+  ph_result_t res = PH_OK;
+
+  ph_thread_epoch_begin();
+  e = find_entry(cht, key);
+  if (!e) {
+    res = PH_NOENT;
+  } else if (cht->vdef->val_copy) {
+    if (!cht->vdef->val_copy(entry_val(e), val)) {
+      res = PH_ERR;
+    }
+  } else {
+    memcpy(val, entry_val(e), cht->vdef->vsize);
+  }
+  ph_thread_epoch_end();
+
+  return res;
+}
+
+ph_result_t ph_cht_del(ph_cht_t *cht, const void *key)
+{
+  struct cht_entry search, *e;
+
+  search.kdef = cht->kdef;
+  search.key = key;
+  search.hash = cht->kdef->hash_func(key);
+
+  pthread_mutex_lock(&cht->lock);
+  e = ck_hs_remove(&cht->hs, search.hash, &search);
+  pthread_mutex_unlock(&cht->lock);
+
+  if (!e) {
+    return PH_NOENT;
+  }
+  ph_thread_epoch_defer(&e->epoch, deferred_entry_free);
+  return PH_OK;
+}
+
+uint32_t ph_cht_size(ph_cht_t *cht)
+{
+  return ck_hs_count(&cht->hs);
+}
+
+bool ph_cht_iter_next(ph_cht_t *cht, ph_cht_iter_t *iter,
+    void **key, void **val)
+{
+  struct cht_entry *e;
+
+  if (!ck_hs_next(&cht->hs, iter, (void**)(void*)&e)) {
+    return false;
+  }
+  if (key) {
+    *key = e->data;
+  }
+  if (val) {
+    *val = entry_val(e);
+  }
+  return true;
+}
+
+bool ph_cht_iter_first(ph_cht_t *cht, ph_cht_iter_t *iter,
+    void **key, void **val)
+{
+  ck_hs_iterator_init(iter);
+  return ph_cht_iter_next(cht, iter, key, val);
+}
+
+void ph_cht_destroy(ph_cht_t *cht)
+{
+  ck_hs_iterator_t iter;
+  struct cht_entry *e;
+
+  ck_hs_iterator_init(&iter);
+  while (ck_hs_next(&cht->hs, &iter, (void**)(void*)&e)) {
+    free_entry(e);
+  }
+  ck_hs_destroy(&cht->hs);
+  pthread_mutex_destroy(&cht->lock);
+}
+
+/* vim:ts=2:sw=2:et:
+ */
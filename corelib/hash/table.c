@@ -16,50 +16,213 @@
 
 #include <phenom/defs.h>
 #include "phenom/hashtable.h"
+#include "phenom/btree.h"
 #include "phenom/sysutil.h"
 #include "phenom/string.h"
 #include "phenom/memory.h"
 #include "phenom/log.h"
 
-static ph_memtype_t mt_table;
-static struct ph_memtype_def table_def = {
-  "hashtable", "table", 0, PH_MEM_FLAGS_ZERO
+static ph_memtype_t mt_table, mt_migration, mt_index;
+static struct ph_memtype_def table_defs[] = {
+  { "hashtable", "table", 0, PH_MEM_FLAGS_ZERO },
+  { "hashtable", "migration", sizeof(struct ph_ht_migration), 0 },
+  { "hashtable", "index", sizeof(ph_btree_t), 0 },
 };
 
 static void init_hashtable(void)
 {
-  mt_table = ph_memtype_register(&table_def);
+  mt_table = ph_memtype_register_block(
+      sizeof(table_defs) / sizeof(table_defs[0]), table_defs, NULL);
+  mt_migration = mt_table + 1;
+  mt_index = mt_table + 2;
 }
 
 PH_LIBRARY_INIT_PRI(init_hashtable, 0, 5)
 
-static inline void *keyptr(struct ph_ht_elem *elem)
+/* The table is split into an array of control bytes, one per slot,
+ * and an array of slots holding the keys and values.  A full slot's
+ * control byte holds 7 bits of the key's hash, so a probe can rule out
+ * most slots without touching them or calling key_compare.
+ *
+ * Slots are probed in aligned groups of PH_HT_GROUP_WIDTH, and a
+ * group's control bytes are matched in one go.  Probing moves between
+ * groups in triangular steps, which visits every group because the
+ * number of groups is a power of two.  A probe ends at the first group
+ * with an empty slot.  Tables smaller than a group pad their control
+ * bytes with PH_HT_CTRL_SENTINEL, which never matches.
+ *
+ * The full hash of each element is kept alongside the control bytes.
+ * A probe checks it before calling key_compare, and resizing never
+ * needs to call hash_func.
+ *
+ * Growing the table is incremental: a new table is allocated and the
+ * old one is drained into it MIGRATE_SLOTS slots at a time by each
+ * subsequent insert.  Until it has been drained, lookups that miss in
+ * the new table also check the old one, and iteration walks the new
+ * table and then the old one.  Only calls that modify the table move
+ * elements, so that concurrent readers of a shared table don't race,
+ * and deletes don't either, so that deleting while iterating is safe.
+ */
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+
+// the full-slot tag for a hash
+static inline uint8_t hash_tag(uint32_t hash)
+{
+  return hash & 0x7f;
+}
+
+#if defined(__SSE2__)
+static inline uint32_t group_match(const uint8_t *ctrl, uint8_t tag)
+{
+  __m128i group = _mm_loadu_si128((const __m128i*)(const void*)ctrl);
+
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(tag)));
+}
+
+// empty or deleted; those are the control bytes below the sentinel
+// when compared as signed bytes
+static inline uint32_t group_match_free(const uint8_t *ctrl)
+{
+  __m128i group = _mm_loadu_si128((const __m128i*)(const void*)ctrl);
+
+  return _mm_movemask_epi8(_mm_cmpgt_epi8(
+        _mm_set1_epi8((char)PH_HT_CTRL_SENTINEL), group));
+}
+#else
+static inline uint32_t group_match(const uint8_t *ctrl, uint8_t tag)
+{
+  uint32_t bits = 0;
+  int i;
+
+  for (i = 0; i < PH_HT_GROUP_WIDTH; i++) {
+    bits |= (uint32_t)(ctrl[i] == tag) << i;
+  }
+  return bits;
+}
+
+static inline uint32_t group_match_free(const uint8_t *ctrl)
+{
+  uint32_t bits = 0;
+  int i;
+
+  for (i = 0; i < PH_HT_GROUP_WIDTH; i++) {
+    bits |= (uint32_t)(ctrl[i] == PH_HT_CTRL_EMPTY ||
+        ctrl[i] == PH_HT_CTRL_DELETED) << i;
+  }
+  return bits;
+}
+#endif
+
+// slots of the old table moved by each insert while resizing
+#define MIGRATE_SLOTS (2 * PH_HT_GROUP_WIDTH)
+
+static inline bool is_full(uint8_t ctrl)
+{
+  return (ctrl & 0x80) == 0;
+}
+
+static inline void *elemptr(ph_ht_t *ht, struct ph_ht_store *st,
+    uint64_t slot)
 {
-  return (char*)elem + sizeof(elem->status);
+  return st->table + (slot * ht->elem_size);
 }
 
-static inline void *valptr(ph_ht_t *ht, struct ph_ht_elem *elem)
+static inline void *keyptr(ph_ht_t *ht, uint64_t slot)
 {
-  return (char*)elem + sizeof(elem->status) + ht->kdef->ksize;
+  return elemptr(ht, &ht->cur, slot);
 }
 
-static inline struct ph_ht_elem *elemptr(ph_ht_t *ht, uint32_t p)
+static inline void *valptr(ph_ht_t *ht, uint64_t slot)
 {
-  return (struct ph_ht_elem*)(void*)(ht->table + (p * ht->elem_size));
+  return (char*)elemptr(ht, &ht->cur, slot) + ht->kdef->ksize;
+}
+
+// The table can be filled to 7/8ths before it is rebuilt
+static inline uint64_t table_capacity(uint64_t size)
+{
+  return size - (size / 8);
+}
+
+static inline uint32_t table_size_for(uint32_t nelems)
+{
+  uint32_t size = ph_power_2(nelems + (nelems / 7));
+
+  return size < 4 ? 4 : size;
+}
+
+static inline uint64_t ctrl_size(uint64_t size)
+{
+  return size < PH_HT_GROUP_WIDTH ? PH_HT_GROUP_WIDTH : size;
+}
+
+static bool alloc_store(ph_ht_t *ht, uint64_t size, struct ph_ht_store *st)
+{
+  uint64_t csize = ctrl_size(size);
+  uint64_t total = csize + (size * sizeof(uint32_t)) + (size * ht->elem_size);
+  uint8_t *ctrl;
+
+  if (ht->arena) {
+    ctrl = ph_arena_alloc(ht->arena, total);
+  } else {
+    ctrl = ph_mem_alloc_size(mt_table, total);
+  }
+  if (!ctrl) {
+    return false;
+  }
+  memset(ctrl, PH_HT_CTRL_EMPTY, size);
+  memset(ctrl + size, PH_HT_CTRL_SENTINEL, csize - size);
+
+  st->table_size = size;
+  st->ctrl = ctrl;
+  st->hashes = (uint32_t*)(void*)(ctrl + csize);
+  st->table = (char*)(st->hashes + size);
+  return true;
+}
+
+static void free_store(ph_ht_t *ht, struct ph_ht_store *st)
+{
+  if (!ht->arena) {
+    ph_mem_free(mt_table, st->ctrl);
+  }
+  memset(st, 0, sizeof(*st));
+}
+
+// Releases the drained (or discarded) old table
+static void end_migration(ph_ht_t *ht)
+{
+  free_store(ht, &ht->mig->old);
+  if (!ht->arena) {
+    ph_mem_free(mt_migration, ht->mig);
+  }
+  ht->mig = NULL;
+  ht->gen++;
 }
 
 ph_result_t ph_ht_init(ph_ht_t *ht, uint32_t size_hint,
     const struct ph_ht_key_def *kdef,
     const struct ph_ht_val_def *vdef)
+{
+  return ph_ht_init_arena(ht, NULL, size_hint, kdef, vdef);
+}
+
+ph_result_t ph_ht_init_arena(ph_ht_t *ht, ph_arena_t *arena,
+    uint32_t size_hint, const struct ph_ht_key_def *kdef,
+    const struct ph_ht_val_def *vdef)
 {
   ht->kdef = kdef;
   ht->vdef = vdef;
   ht->nelems = 0;
-  ht->table_size = ph_power_2(size_hint * 2);
-  ht->elem_size = sizeof(struct ph_ht_elem) + kdef->ksize + vdef->vsize;
-  ht->mask = ht->table_size - 1;
-  ht->table = ph_mem_alloc_size(mt_table, ht->elem_size * ht->table_size);
-  if (!ht->table) {
+  ht->ndeleted = 0;
+  ht->gen = 0;
+  // keep keys and values pointer aligned
+  ht->elem_size = (kdef->ksize + vdef->vsize + sizeof(void*) - 1) &
+    ~(sizeof(void*) - 1);
+  ht->mig = NULL;
+  ht->index = NULL;
+  ht->arena = arena;
+  if (!alloc_store(ht, table_size_for(size_hint), &ht->cur)) {
     return PH_NOMEM;
   }
 
@@ -69,8 +232,12 @@ ph_result_t ph_ht_init(ph_ht_t *ht, uint32_t size_hint,
 void ph_ht_destroy(ph_ht_t *ht)
 {
   ph_ht_free_entries(ht);
-  ph_mem_free(mt_table, ht->table);
-  ht->table = 0;
+  free_store(ht, &ht->cur);
+  if (ht->index) {
+    ph_btree_destroy(ht->index);
+    ph_mem_free(mt_index, ht->index);
+    ht->index = NULL;
+  }
 }
 
 static inline int key_compare(ph_ht_t *ht, const void *a, const void *b)
@@ -115,149 +282,268 @@ static inline void key_delete(ph_ht_t *ht, void *key)
   }
 }
 
-void ph_ht_free_entries(ph_ht_t *ht)
+static void free_store_entries(ph_ht_t *ht, struct ph_ht_store *st)
 {
-  uint32_t i;
-  struct ph_ht_elem *elem;
+  uint64_t i;
+  char *elem;
 
-  for (i = 0; i < ht->table_size; i++) {
-    elem = (struct ph_ht_elem*)(void*)(ht->table + (i * ht->elem_size));
-
-    if (elem->status == PH_HT_ELEM_EMPTY) {
-      continue;
-    }
-    if (elem->status == PH_HT_ELEM_TOMBSTONE) {
-      elem->status = PH_HT_ELEM_EMPTY;
+  for (i = 0; i < st->table_size; i++) {
+    if (!is_full(st->ctrl[i])) {
       continue;
     }
 
-    key_delete(ht, keyptr(elem));
-    val_delete(ht, valptr(ht, elem));
+    elem = elemptr(ht, st, i);
+    key_delete(ht, elem);
+    val_delete(ht, elem + ht->kdef->ksize);
+  }
+  memset(st->ctrl, PH_HT_CTRL_EMPTY, st->table_size);
+}
 
-    elem->status = PH_HT_ELEM_EMPTY;
+void ph_ht_free_entries(ph_ht_t *ht)
+{
+  free_store_entries(ht, &ht->cur);
+  if (ht->mig) {
+    free_store_entries(ht, &ht->mig->old);
+    end_migration(ht);
+  }
+  if (ht->index) {
+    ph_btree_free_entries(ht->index);
   }
   ht->nelems = 0;
+  ht->ndeleted = 0;
 }
 
-static struct ph_ht_elem *find_elem_slot(ph_ht_t *ht, const void *key)
+/* Looks for key in st.  Returns true and stores its slot in *slotp if
+ * it is present.  Otherwise returns false and stores the first free slot
+ * on its probe sequence, or table_size if there were none */
+static bool find_slot(ph_ht_t *ht, struct ph_ht_store *st,
+    const void *key, uint32_t hash, uint64_t *slotp)
 {
-  uint32_t pos = ht->kdef->hash_func(key) & ht->mask;
-  struct ph_ht_elem *elem, *tomb = NULL;
-  uint32_t attempts = 0;
-
-  while (attempts++ < ht->table_size) {
-    elem = elemptr(ht, pos & ht->mask);
-
-    if (elem->status == PH_HT_ELEM_TOMBSTONE) {
-      // Remember the first tombstone
-      if (!tomb) {
-        tomb = elem;
+  uint64_t gmask = (st->table_size - 1) / PH_HT_GROUP_WIDTH;
+  uint64_t group = (hash >> 7) & gmask;
+  uint64_t base, step, slot, insert = st->table_size;
+  uint8_t tag = hash_tag(hash);
+  const uint8_t *ctrl;
+  uint32_t bits;
+
+  for (step = 1; step <= gmask + 1; step++) {
+    base = group * PH_HT_GROUP_WIDTH;
+    ctrl = st->ctrl + base;
+
+    for (bits = group_match(ctrl, tag); bits; bits &= bits - 1) {
+      slot = base + __builtin_ctz(bits);
+      if (st->hashes[slot] == hash &&
+          key_compare(ht, key, elemptr(ht, st, slot)) == 0) {
+        *slotp = slot;
+        return true;
       }
-      pos++;
-      continue;
     }
 
-    if (elem->status == PH_HT_ELEM_EMPTY) {
-      // Element is not in the table; reuse a tombstone
-      // if we found one, otherwise claim this empty elem
-      return tomb ? tomb : elem;
+    bits = group_match_free(ctrl);
+    if (bits && insert == st->table_size) {
+      insert = base + __builtin_ctz(bits);
     }
-
-    if (key_compare(ht, key, keyptr(elem)) == 0) {
-      return elem;
+    if (group_match(ctrl, PH_HT_CTRL_EMPTY)) {
+      break;
     }
 
-    // Not this one, look for another
-    pos++;
+    group = (group + step) & gmask;
   }
 
-  // There were no empty slots in the whole table, we need to rebuild
-  return NULL;
+  *slotp = insert;
+  return false;
 }
 
-static struct ph_ht_elem *find_new_slot(ph_ht_t *ht, char *table,
-    uint32_t mask, const void *key)
+// Finds an empty slot for an element that is known not to be present
+static uint64_t find_new_slot(struct ph_ht_store *st, uint32_t hash)
 {
-  uint32_t pos = ht->kdef->hash_func(key) & mask;
-  struct ph_ht_elem *elem;
-
-  while (true) {
-    elem = (struct ph_ht_elem*)(void*)(table + ((pos & mask) * ht->elem_size));
-
-    if (elem->status == PH_HT_ELEM_EMPTY) {
-      return elem;
+  uint64_t gmask = (st->table_size - 1) / PH_HT_GROUP_WIDTH;
+  uint64_t group = (hash >> 7) & gmask;
+  uint64_t step, base;
+  uint32_t bits;
+
+  for (step = 1; ; step++) {
+    base = group * PH_HT_GROUP_WIDTH;
+    bits = group_match(st->ctrl + base, PH_HT_CTRL_EMPTY);
+    if (bits) {
+      return base + __builtin_ctz(bits);
     }
-
-    pos++;
+    group = (group + step) & gmask;
   }
 }
 
-static bool rebuild_table(ph_ht_t *ht, uint32_t size)
+// Moves slot of the old table into the current one
+static void migrate_slot(ph_ht_t *ht, uint64_t slot)
 {
-  char *table;
-  uint32_t mask, i, done;
+  uint32_t hash = ht->mig->old.hashes[slot];
+  uint64_t dest = find_new_slot(&ht->cur, hash);
+
+  ht->cur.ctrl[dest] = hash_tag(hash);
+  ht->cur.hashes[dest] = hash;
+  memcpy(keyptr(ht, dest), elemptr(ht, &ht->mig->old, slot),
+      ht->elem_size);
+  ht->mig->old.ctrl[slot] = PH_HT_CTRL_DELETED;
+  ht->mig->nelems--;
+  // It may land in a slot that an iterator has already passed
+  ht->gen++;
+}
 
-  mask = size - 1;
+static void migrate(ph_ht_t *ht, uint64_t nslots)
+{
+  uint64_t end = ht->mig->pos + nslots;
 
-  table = ph_mem_alloc_size(mt_table, ht->elem_size * size);
-  if (!table) {
-    return false;
+  if (end > ht->mig->old.table_size || ht->mig->nelems == 0) {
+    end = ht->mig->old.table_size;
+  }
+  for (; ht->mig->pos < end; ht->mig->pos++) {
+    if (is_full(ht->mig->old.ctrl[ht->mig->pos])) {
+      migrate_slot(ht, ht->mig->pos);
+    }
   }
 
-  for (i = 0, done = 0; done < ht->nelems && i < ht->table_size; i++) {
-    struct ph_ht_elem *src, *dest;
+  if (ht->mig->pos == ht->mig->old.table_size) {
+    end_migration(ht);
+  }
+}
 
-    src = elemptr(ht, i);
-    if (src->status == PH_HT_ELEM_TAKEN) {
-      dest = find_new_slot(ht, table, mask, keyptr(src));
+static inline void finish_migration(ph_ht_t *ht)
+{
+  if (ht->mig) {
+    migrate(ht, ht->mig->old.table_size);
+  }
+}
 
-      memcpy(dest, src, ht->elem_size);
-      done++;
+// Starts moving everything into a new table of the given size
+static bool start_resize(ph_ht_t *ht, uint64_t size)
+{
+  struct ph_ht_migration *mig;
+  struct ph_ht_store st;
+
+  finish_migration(ht);
+  if (ht->arena) {
+    mig = ph_arena_alloc(ht->arena, sizeof(*mig));
+  } else {
+    mig = ph_mem_alloc(mt_migration);
+  }
+  if (!mig) {
+    return false;
+  }
+  if (!alloc_store(ht, size, &st)) {
+    if (!ht->arena) {
+      ph_mem_free(mt_migration, mig);
     }
+    return false;
   }
 
-  ph_mem_free(mt_table, ht->table);
-  ht->table = table;
-  ht->table_size = size;
-  ht->mask = mask;
+  mig->old = ht->cur;
+  mig->pos = 0;
+  mig->nelems = ht->nelems;
+  ht->mig = mig;
+  ht->cur = st;
+  ht->ndeleted = 0;
+  ht->gen++;
+
+  migrate(ht, MIGRATE_SLOTS);
   return true;
 }
 
 bool ph_ht_grow(ph_ht_t *ht, uint32_t nelems)
 {
-  uint32_t size = ph_power_2(nelems * 2);
+  uint64_t size = table_size_for(nelems);
 
-  if (size <= ht->table_size) {
+  if (size <= ht->cur.table_size) {
     return true;
   }
 
-  return rebuild_table(ht, size);
+  // The caller is paying for the resize up front
+  if (!start_resize(ht, size)) {
+    return false;
+  }
+  finish_migration(ht);
+  return true;
+}
+
+// Makes room for one more element
+static bool make_room(ph_ht_t *ht)
+{
+  // If the table is mostly tombstones, clearing them out is enough
+  if (ht->ndeleted > ht->nelems) {
+    return start_resize(ht, ht->cur.table_size);
+  }
+  return start_resize(ht, ht->cur.table_size << 1);
+}
+
+// Deleted slots become empty again if their group has never been
+// full, as no probe can have passed through it
+static void clear_slot(ph_ht_t *ht, uint64_t slot)
+{
+  uint64_t base = slot & ~(uint64_t)(PH_HT_GROUP_WIDTH - 1);
+
+  if (group_match(ht->cur.ctrl + base, PH_HT_CTRL_EMPTY)) {
+    ht->cur.ctrl[slot] = PH_HT_CTRL_EMPTY;
+  } else {
+    ht->cur.ctrl[slot] = PH_HT_CTRL_DELETED;
+    ht->ndeleted++;
+  }
+}
+
+static inline void unindex(ph_ht_t *ht, const void *key)
+{
+  if (ht->index) {
+    ph_btree_del(ht->index, key);
+  }
+}
+
+// Looks in both tables.  Returns the element, or NULL if not present
+static char *find_elem_hashed(ph_ht_t *ht, const void *key, uint32_t hash)
+{
+  uint64_t slot;
+
+  if (find_slot(ht, &ht->cur, key, hash, &slot)) {
+    return keyptr(ht, slot);
+  }
+  if (ht->mig && find_slot(ht, &ht->mig->old, key, hash, &slot)) {
+    return elemptr(ht, &ht->mig->old, slot);
+  }
+  return NULL;
+}
+
+static inline char *find_elem(ph_ht_t *ht, const void *key)
+{
+  return find_elem_hashed(ht, key, ht->kdef->hash_func(key));
 }
 
 ph_result_t ph_ht_insert(ph_ht_t *ht, void *key, void *value, int flags)
 {
-  struct ph_ht_elem *elem;
+  uint32_t hash = ht->kdef->hash_func(key);
+  uint64_t slot;
+  bool found;
 
-  elem = find_elem_slot(ht, key);
-  if (!elem || (elem->status != PH_HT_ELEM_TAKEN &&
-      ht->nelems + 1 > ht->table_size >> 1)) {
-    // Getting full
-    if (rebuild_table(ht, ht->table_size << 1)) {
-      elem = find_elem_slot(ht, key);
-    }
-    if (!elem) {
-      return PH_NOMEM;
+  if (ht->mig) {
+    migrate(ht, MIGRATE_SLOTS);
+  }
+
+  found = find_slot(ht, &ht->cur, key, hash, &slot);
+  if (!found && ht->mig) {
+    uint64_t oslot;
+
+    if (find_slot(ht, &ht->mig->old, key, hash, &oslot)) {
+      // Move it across so that it can be replaced below
+      migrate_slot(ht, oslot);
+      found = find_slot(ht, &ht->cur, key, hash, &slot);
     }
   }
 
-  if (elem->status == PH_HT_ELEM_TAKEN) {
+  if (found) {
     if ((flags & PH_HT_REPLACE) == 0) {
       return PH_EXISTS;
     }
 
-    val_delete(ht, valptr(ht, elem));
-    if (!val_copy(ht, value, valptr(ht, elem), flags)) {
-      elem->status = PH_HT_ELEM_TOMBSTONE;
+    val_delete(ht, valptr(ht, slot));
+    if (!val_copy(ht, value, valptr(ht, slot), flags)) {
+      unindex(ht, keyptr(ht, slot));
+      key_delete(ht, keyptr(ht, slot));
+      clear_slot(ht, slot);
       ht->nelems--;
       return PH_ERR;
     }
@@ -269,21 +555,46 @@ ph_result_t ph_ht_insert(ph_ht_t *ht, void *key, void *value, int flags)
       key_delete(ht, key);
     }
 
-    elem->status = PH_HT_ELEM_TAKEN;
     return PH_OK;
   }
 
-  if (!key_copy(ht, key, keyptr(elem), flags)) {
+  // The index is updated first, as it is the part that may fail
+  // without anything else to undo
+  if (ht->index &&
+      ph_btree_insert(ht->index, key, &hash, PH_HT_COPY) != PH_OK) {
+    return PH_NOMEM;
+  }
+
+  // Elements still in the old table will end up in this one, so
+  // they count against its capacity
+  if (slot == ht->cur.table_size ||
+      (ht->cur.ctrl[slot] == PH_HT_CTRL_EMPTY &&
+       ht->nelems + ht->ndeleted + 1 > table_capacity(ht->cur.table_size))) {
+    // Getting full
+    if (!make_room(ht)) {
+      unindex(ht, key);
+      return PH_NOMEM;
+    }
+    find_slot(ht, &ht->cur, key, hash, &slot);
+  }
+
+  if (!key_copy(ht, key, keyptr(ht, slot), flags)) {
+    unindex(ht, key);
     return PH_ERR;
   }
-  if (!val_copy(ht, value, valptr(ht, elem), flags)) {
+  if (!val_copy(ht, value, valptr(ht, slot), flags)) {
+    unindex(ht, key);
     // Undo the key copy
-    if (flags & PH_HT_COPY_KEY) {
-      key_delete(ht, keyptr(elem));
+    if ((flags & PH_HT_CLAIM_KEY) == 0) {
+      key_delete(ht, keyptr(ht, slot));
     }
     return PH_ERR;
   }
-  elem->status = PH_HT_ELEM_TAKEN;
+  if (ht->cur.ctrl[slot] == PH_HT_CTRL_DELETED) {
+    ht->ndeleted--;
+  }
+  ht->cur.ctrl[slot] = hash_tag(hash);
+  ht->cur.hashes[slot] = hash;
   ht->nelems++;
   return PH_OK;
 }
@@ -300,24 +611,22 @@ ph_result_t ph_ht_replace(ph_ht_t *ht, void *key, void *value)
 
 void *ph_ht_get(ph_ht_t *ht, const void *key)
 {
-  struct ph_ht_elem *elem;
+  char *elem = find_elem(ht, key);
 
-  elem = find_elem_slot(ht, key);
-  if (!elem || elem->status != PH_HT_ELEM_TAKEN) {
+  if (!elem) {
     return 0;
   }
-  return valptr(ht, elem);
+  return elem + ht->kdef->ksize;
 }
 
 ph_result_t ph_ht_lookup(ph_ht_t *ht, const void *key, void *val, bool copy)
 {
-  struct ph_ht_elem *elem;
+  char *elem = find_elem(ht, key);
 
-  elem = find_elem_slot(ht, key);
-  if (!elem || elem->status != PH_HT_ELEM_TAKEN) {
+  if (!elem) {
     return PH_NOENT;
   }
-  if (!val_copy(ht, valptr(ht, elem), val,
+  if (!val_copy(ht, elem + ht->kdef->ksize, val,
         copy ? PH_HT_COPY_VAL : PH_HT_CLAIM_VAL)) {
     return PH_ERR;
   }
@@ -326,19 +635,30 @@ ph_result_t ph_ht_lookup(ph_ht_t *ht, const void *key, void *val, bool copy)
 
 ph_result_t ph_ht_del(ph_ht_t *ht, const void *key)
 {
-  struct ph_ht_elem *elem;
-
-  elem = find_elem_slot(ht, key);
-  if (!elem || elem->status != PH_HT_ELEM_TAKEN) {
+  uint32_t hash = ht->kdef->hash_func(key);
+  uint64_t slot;
+  char *elem;
+
+  if (find_slot(ht, &ht->cur, key, hash, &slot)) {
+    elem = keyptr(ht, slot);
+    unindex(ht, elem);
+    key_delete(ht, elem);
+    val_delete(ht, elem + ht->kdef->ksize);
+    clear_slot(ht, slot);
+  } else if (ht->mig && find_slot(ht, &ht->mig->old, key, hash, &slot)) {
+    // The old table is never probed for inserts, so a tombstone
+    // is all it needs
+    elem = elemptr(ht, &ht->mig->old, slot);
+    unindex(ht, elem);
+    key_delete(ht, elem);
+    val_delete(ht, elem + ht->kdef->ksize);
+    ht->mig->old.ctrl[slot] = PH_HT_CTRL_DELETED;
+    ht->mig->nelems--;
+  } else {
     return PH_NOENT;
   }
 
-  key_delete(ht, keyptr(elem));
-  val_delete(ht, valptr(ht, elem));
-
-  elem->status = PH_HT_ELEM_TOMBSTONE;
   ht->nelems--;
-
   return PH_OK;
 }
 
@@ -347,52 +667,181 @@ uint32_t ph_ht_size(ph_ht_t *ht)
   return ht->nelems;
 }
 
+/* Walks the elements of both tables without moving any, resuming from
+ * *pos, which counts the slots of the current table and then those of
+ * the old one.  Returns the next element, or NULL if there are no more,
+ * and stores its hash in *hashp if hashp is not NULL */
+static char *next_elem(ph_ht_t *ht, uint64_t *pos, uint32_t **hashp)
+{
+  struct ph_ht_store *st;
+  uint64_t slot;
+
+  while (true) {
+    slot = *pos;
+    if (slot < ht->cur.table_size) {
+      st = &ht->cur;
+    } else if (ht->mig &&
+        slot - ht->cur.table_size < ht->mig->old.table_size) {
+      st = &ht->mig->old;
+      slot -= ht->cur.table_size;
+    } else {
+      return NULL;
+    }
+    (*pos)++;
+
+    if (is_full(st->ctrl[slot])) {
+      if (hashp) {
+        *hashp = st->hashes + slot;
+      }
+      return elemptr(ht, st, slot);
+    }
+  }
+}
+
 bool ph_ht_iter_next(ph_ht_t *ht, ph_ht_iter_t *iter, void **key, void **val)
 {
-  struct ph_ht_elem *elem;
+  uint64_t pos = iter->slot;
+  char *elem;
 
-  if (iter->size != ht->table_size) {
+  if (iter->size != ht->cur.table_size || iter->gen != ht->gen) {
     return false;
   }
 
-  while (iter->slot < ht->table_size) {
-    elem = elemptr(ht, iter->slot);
-    iter->slot++;
-
-    if (elem->status == PH_HT_ELEM_TAKEN) {
-      if (key) {
-        *key = keyptr(elem);
-      }
-      if (val) {
-        *val = valptr(ht, elem);
-      }
-      return true;
-    }
+  elem = next_elem(ht, &pos, NULL);
+  iter->slot = pos;
+  if (!elem) {
+    return false;
   }
-  return false;
+  if (key) {
+    *key = elem;
+  }
+  if (val) {
+    *val = elem + ht->kdef->ksize;
+  }
+  return true;
 }
 
 bool ph_ht_iter_first(ph_ht_t *ht, ph_ht_iter_t *iter, void **key, void **val)
 {
   iter->slot = 0;
-  iter->size = ht->table_size;
+  iter->size = ht->cur.table_size;
+  iter->gen = ht->gen;
   return ph_ht_iter_next(ht, iter, key, val);
 }
 
+static struct ph_ht_val_def index_val_def = {
+  sizeof(uint32_t), NULL, NULL
+};
+
+ph_result_t ph_ht_keep_ordered(ph_ht_t *ht)
+{
+  ph_btree_t *index;
+  ph_result_t res;
+  uint64_t pos = 0;
+  uint32_t *hash;
+  char *elem;
+
+  if (ht->index) {
+    return PH_OK;
+  }
+  if (ht->arena) {
+    return PH_ERR;
+  }
+  if (ph_unlikely(ht->kdef->key_compare == NULL)) {
+    ph_panic("you must define a key_compare function to keep an index");
+  }
+
+  index = ph_mem_alloc(mt_index);
+  if (!index) {
+    return PH_NOMEM;
+  }
+  res = ph_btree_init(index, ht->kdef, &index_val_def);
+  if (res != PH_OK) {
+    ph_mem_free(mt_index, index);
+    return res;
+  }
+
+  while ((elem = next_elem(ht, &pos, &hash)) != NULL) {
+    res = ph_btree_insert(index, elem, hash, PH_HT_COPY);
+    if (res != PH_OK) {
+      ph_btree_destroy(index);
+      ph_mem_free(mt_index, index);
+      return res;
+    }
+  }
+
+  ht->index = index;
+  return PH_OK;
+}
+
+/* When the table keeps an ordered index, the ordered iterator walks it,
+ * keeping its place in leaf and slot.  Deleting elements while iterating
+ * must still work, so the iterator also holds a copy of the current key
+ * in slots; if the index has changed, it finds its place again from
+ * there.  The index holds the hash of each key, so finding the element
+ * doesn't need to rehash it. */
+static bool index_yield(ph_ht_t *ht, ph_ht_ordered_iter_t *iter,
+    ph_btree_iter_t *pos, bool more, void *ikey, void *ihash,
+    void **key, void **val)
+{
+  char *elem;
+
+  iter->leaf = pos->node;
+  iter->slot = pos->pos;
+  iter->gen = ht->index->gen;
+  if (!more) {
+    return false;
+  }
+
+  elem = find_elem_hashed(ht, ikey, *(uint32_t*)ihash);
+  if (!elem) {
+    // Shouldn't happen
+    return false;
+  }
+
+  if (iter->size) {
+    key_delete(ht, iter->slots);
+  }
+  iter->size = key_copy(ht, ikey, iter->slots, PH_HT_COPY_KEY) ? 1 : 0;
+
+  if (key) {
+    *key = elem;
+  }
+  if (val) {
+    *val = elem + ht->kdef->ksize;
+  }
+  return true;
+}
+
 bool ph_ht_ordered_iter_first(ph_ht_t *ht, ph_ht_ordered_iter_t *iter,
     void **key, void **val)
 {
-  uint32_t i;
-  char *kptr;
-  struct ph_ht_elem *elem;
+  uint64_t slot = 0;
+  char *kptr, *elem;
 
   if (ht->nelems == 0) {
     iter->size = 0;
     iter->slot = 1;
     iter->slots = 0;
+    iter->leaf = NULL;
     return false;
   }
 
+  if (ht->index) {
+    ph_btree_iter_t pos;
+    void *ikey, *ihash;
+    bool more;
+
+    // size is the number of saved keys, as for the sorted keys
+    iter->size = 0;
+    iter->slots = ph_mem_alloc_size(mt_table, ht->kdef->ksize);
+    if (!iter->slots) {
+      return false;
+    }
+    more = ph_btree_iter_first(ht->index, &pos, &ikey, &ihash);
+    return index_yield(ht, iter, &pos, more, ikey, ihash, key, val);
+  }
+
   if (ph_unlikely(ht->kdef->key_compare == NULL)) {
     ph_panic("you must define a key_compare function to use ordered_iter");
   }
@@ -407,31 +856,25 @@ bool ph_ht_ordered_iter_first(ph_ht_t *ht, ph_ht_ordered_iter_t *iter,
 
   // Collect the items in their physical order
   kptr = iter->slots;
-  for (i = 0; i < ht->table_size; i++) {
-    elem = elemptr(ht, i);
-
-    if (elem->status != PH_HT_ELEM_TAKEN) {
-      continue;
-    }
-
-    key_copy(ht, keyptr(elem), kptr, PH_HT_COPY_KEY);
+  while ((elem = next_elem(ht, &slot, NULL)) != NULL) {
+    key_copy(ht, elem, kptr, PH_HT_COPY_KEY);
     kptr += ht->kdef->ksize;
   }
 
   qsort(iter->slots, ht->nelems, ht->kdef->ksize, ht->kdef->key_compare);
 
-  elem = find_elem_slot(ht, iter->slots);
-  if (!elem || elem->status != PH_HT_ELEM_TAKEN) {
+  elem = find_elem(ht, iter->slots);
+  if (!elem) {
     // Shouldn't happen
     ph_ht_ordered_iter_end(ht, iter);
     return false;
   }
 
   if (key) {
-    *key = keyptr(elem);
+    *key = elem;
   }
   if (val) {
-    *val = valptr(ht, elem);
+    *val = elem + ht->kdef->ksize;
   }
 
   return true;
@@ -440,25 +883,47 @@ bool ph_ht_ordered_iter_first(ph_ht_t *ht, ph_ht_ordered_iter_t *iter,
 bool ph_ht_ordered_iter_next(ph_ht_t *ht, ph_ht_ordered_iter_t *iter,
     void **key, void **val)
 {
-  char *kptr;
-  struct ph_ht_elem *elem;
+  char *kptr, *elem;
+
+  if (ht->index) {
+    ph_btree_iter_t pos = { iter->leaf, iter->slot };
+    void *ikey, *ihash;
+    bool more;
+
+    if (!iter->slots) {
+      return false;
+    }
+    if (iter->gen != ht->index->gen) {
+      if (!iter->size) {
+        return false;
+      }
+      more = ph_btree_lower_bound(ht->index, &pos, iter->slots,
+          &ikey, &ihash);
+      if (!more || key_compare(ht, ikey, iter->slots) != 0) {
+        // the current key went away; this is the one after it
+        return index_yield(ht, iter, &pos, more, ikey, ihash, key, val);
+      }
+    }
+    more = ph_btree_iter_next(ht->index, &pos, &ikey, &ihash);
+    return index_yield(ht, iter, &pos, more, ikey, ihash, key, val);
+  }
 
   if (iter->slot >= iter->size || iter->slots == 0) {
     return false;
   }
 
   kptr = iter->slots + (ht->kdef->ksize * iter->slot);
-  elem = find_elem_slot(ht, kptr);
-  if (!elem || elem->status != PH_HT_ELEM_TAKEN) {
+  elem = find_elem(ht, kptr);
+  if (!elem) {
     // Shouldn't happen
     return false;
   }
 
   if (key) {
-    *key = keyptr(elem);
+    *key = elem;
   }
   if (val) {
-    *val = valptr(ht, elem);
+    *val = elem + ht->kdef->ksize;
   }
 
   iter->slot++;
@@ -482,6 +947,19 @@ void ph_ht_ordered_iter_end(ph_ht_t *ht, ph_ht_ordered_iter_t *iter)
 }
 
 static uint32_t string_hash(const void *key)
+{
+  ph_string_t *str = *(ph_string_t**)key;
+  uint64_t hval;
+
+  if (str->interned) {
+    return str->hval;
+  }
+  hval = ph_hash_bytes(str->buf, str->len);
+
+  return (uint32_t)(hval ^ (hval >> 32));
+}
+
+static uint32_t string_hash_murmur(const void *key)
 {
   uint64_t hval[2];
   ph_string_t *str = *(ph_string_t**)key;
@@ -527,6 +1005,14 @@ struct ph_ht_key_def ph_ht_string_key_def = {
   string_delete
 };
 
+struct ph_ht_key_def ph_ht_string_murmur_key_def = {
+  sizeof(ph_string_t*),
+  string_hash_murmur,
+  string_compare,
+  string_copy,
+  string_delete
+};
+
 struct ph_ht_val_def ph_ht_string_val_def = {
   sizeof(ph_string_t*),
   string_copy,
@@ -0,0 +1,152 @@
+/* NOLINT(legal/copyright)
+ * Based on wyhash by Wang Yi, which is in the public domain.
+ */
+#include "phenom/sysutil.h"
+#include <stdint.h>
+#include <ck_cc.h>
+
+/* wyhash reads the key 4, 8 or 16 bytes at a time and folds them in
+ * with 64x64->128 bit multiplies.  Keys of up to 16 bytes take a single
+ * multiply plus the finalizer, which is what makes it quick for the
+ * short keys that dominate our tables. */
+
+static const uint64_t secret[4] = {
+  0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+  0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL
+};
+
+static uint64_t process_seed;
+
+static void init_hash_seed(void)
+{
+  struct timeval tv;
+  uint64_t seed = 0;
+  int fd;
+
+  fd = open("/dev/urandom", O_RDONLY|O_CLOEXEC);
+  if (fd >= 0) {
+    if (read(fd, &seed, sizeof(seed)) != sizeof(seed)) {
+      seed = 0;
+    }
+    close(fd);
+  }
+  if (seed == 0) {
+    // Not as good, but still differs from one process to the next
+    gettimeofday(&tv, NULL);
+    seed = ((uint64_t)tv.tv_sec * 1000000) + tv.tv_usec;
+    seed ^= (uint64_t)getpid() << 32;
+    seed ^= (uint64_t)(uintptr_t)&tv;
+  }
+  process_seed = seed;
+}
+
+// Before anything that might hash, such as the counter scope map
+PH_LIBRARY_INIT_PRI(init_hash_seed, 0, 0)
+
+static CK_CC_INLINE void mum(uint64_t *a, uint64_t *b)
+{
+#ifdef __SIZEOF_INT128__
+  __uint128_t r = *a;
+
+  r *= *b;
+  *a = (uint64_t)r;
+  *b = (uint64_t)(r >> 64);
+#else
+  uint64_t ha = *a >> 32, hb = *b >> 32;
+  uint64_t la = (uint32_t)*a, lb = (uint32_t)*b;
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  uint64_t t = rl + (rm0 << 32), lo, c = t < rl;
+
+  lo = t + (rm1 << 32);
+  c += lo < t;
+  *a = lo;
+  *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static CK_CC_INLINE uint64_t mix(uint64_t a, uint64_t b)
+{
+  mum(&a, &b);
+  return a ^ b;
+}
+
+static CK_CC_INLINE uint64_t read8(const uint8_t *p)
+{
+  uint64_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static CK_CC_INLINE uint64_t read4(const uint8_t *p)
+{
+  uint32_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// 1 to 3 bytes, reading each byte at most twice
+static CK_CC_INLINE uint64_t read3(const uint8_t *p, size_t k)
+{
+  return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
+uint64_t ph_hash_bytes_seeded(const void *key, size_t len, uint64_t seed)
+{
+  const uint8_t *p = key;
+  uint64_t a, b, see1, see2;
+  size_t i;
+
+  seed ^= mix(seed ^ secret[0], secret[1]);
+
+  if (ph_likely(len <= 16)) {
+    if (ph_likely(len >= 4)) {
+      // two overlapping pairs of 4 byte reads cover 4 to 16 bytes
+      a = (read4(p) << 32) | read4(p + ((len >> 3) << 2));
+      b = (read4(p + len - 4) << 32) |
+        read4(p + len - 4 - ((len >> 3) << 2));
+    } else if (len > 0) {
+      a = read3(p, len);
+      b = 0;
+    } else {
+      a = 0;
+      b = 0;
+    }
+  } else {
+    i = len;
+    if (ph_unlikely(i >= 48)) {
+      see1 = seed;
+      see2 = seed;
+      do {
+        seed = mix(read8(p) ^ secret[1], read8(p + 8) ^ seed);
+        see1 = mix(read8(p + 16) ^ secret[2], read8(p + 24) ^ see1);
+        see2 = mix(read8(p + 32) ^ secret[3], read8(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (ph_likely(i >= 48));
+      seed ^= see1 ^ see2;
+    }
+    while (ph_unlikely(i > 16)) {
+      seed = mix(read8(p) ^ secret[1], read8(p + 8) ^ seed);
+      i -= 16;
+      p += 16;
+    }
+    // the last 16 bytes, which may overlap what we've already mixed
+    a = read8(p + i - 16);
+    b = read8(p + i - 8);
+  }
+
+  a ^= secret[1];
+  b ^= seed;
+  mum(&a, &b);
+  return mix(a ^ secret[0] ^ len, b ^ secret[1]);
+}
+
+uint64_t ph_hash_bytes(const void *key, size_t len)
+{
+  return ph_hash_bytes_seeded(key, len, process_seed);
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -22,6 +22,7 @@
 #include "phenom/configuration.h"
 #include "phenom/printf.h"
 #include "corelib/job.h"
+#include "corelib/lockprof.h"
 #include <ck_stack.h>
 #include <ck_backoff.h>
 #include <ck_queue.h>
@@ -103,6 +104,8 @@ static const char *counter_names[] = {
 extern int _ph_run_loop;
 
 #define MAX_COLLECTORS 128
+static struct ph_lock_class pool_lock_class = PH_LOCK_CLASS_INIT("job_pool");
+
 static uint8_t next_collector_id = 0;
 static ph_job_collector_func collector_funcs[MAX_COLLECTORS];
 
@@ -367,6 +370,7 @@ static inline ph_job_t *pop_job(ph_thread_pool_t *pool,
 
     if (!woke) {
       ph_job_collector_call(ph_thread_self());
+      ph_mem_thread_idle(ph_thread_self());
     }
 
     // poll to clean up anything we might have been sitting on while waiting for
@@ -532,7 +536,7 @@ static inline void do_set_pool(ph_job_t *job, ph_thread_t *me)
   ph_counter_block_add(cblock, SLOT_NUM_PENDING, 1);
 
   if (ph_unlikely(me->tid >= MAX_RINGS)) {
-    ck_spinlock_lock(&pool->lock);
+    ph_spinlock_lock(&pool->lock, &pool_lock_class);
     if (should_init_ring(pool, MAX_RINGS)) {
       init_ring(pool, MAX_RINGS);
     }
@@ -542,7 +546,7 @@ static inline void do_set_pool(ph_job_t *job, ph_thread_t *me)
       ck_spinlock_unlock(&pool->lock);
       ph_counter_block_add(cblock, SLOT_PRODUCER_SLEEP, 1);
       wait_pool(&pool->producer);
-      ck_spinlock_lock(&pool->lock);
+      ph_spinlock_lock(&pool->lock, &pool_lock_class);
     }
     ck_spinlock_unlock(&pool->lock);
   } else {
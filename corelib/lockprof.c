@@ -0,0 +1,251 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phenom/sysutil.h"
+#include "phenom/configuration.h"
+#include "phenom/stream.h"
+#include "corelib/lockprof.h"
+
+/* Each lock class is registered on its first profiled acquisition and
+ * gets a counter scope named locks.<class> with these slots */
+#define SLOT_ACQUIRED  0
+#define SLOT_CONTENDED 1
+#define SLOT_WAIT      2
+
+int ph_lock_prof_on = 0;
+
+static struct ph_lock_class *classes = NULL;
+static ck_spinlock_t classes_lock = CK_SPINLOCK_INITIALIZER;
+static ph_counter_scope_t *locks_scope = NULL;
+
+// registered states
+#define CLASS_NEW        0
+#define CLASS_REGISTERED 1
+
+static void register_class(struct ph_lock_class *cls)
+{
+  static const char *names[] = { "acquired", "contended" };
+  static const ph_counter_histogram_spec_t wait_spec = {
+    // waits beyond ~17s are not interesting to distinguish
+    1LL << 34, 4
+  };
+  ph_counter_scope_t *scope;
+
+  ck_spinlock_lock(&classes_lock);
+  if (cls->registered != CLASS_NEW) {
+    ck_spinlock_unlock(&classes_lock);
+    return;
+  }
+
+  if (!locks_scope) {
+    locks_scope = ph_counter_scope_define(NULL, "locks", 1);
+    if (!locks_scope) {
+      locks_scope = ph_counter_scope_resolve(NULL, "locks");
+    }
+  }
+  scope = ph_counter_scope_define(locks_scope, cls->name, 3);
+  if (scope) {
+    if (!ph_counter_scope_register_counter_block(scope, 2, SLOT_ACQUIRED,
+          names) ||
+        ph_counter_scope_register_histogram(scope, "wait_ns", &wait_spec)
+          != SLOT_WAIT) {
+      ph_counter_scope_delref(scope);
+      scope = NULL;
+    }
+  }
+  // If we couldn't make the scope, the site table still works
+  cls->scope = scope;
+
+  cls->next = classes;
+  classes = cls;
+  ck_pr_fence_store();
+  ck_pr_store_32(&cls->registered, CLASS_REGISTERED);
+  ck_spinlock_unlock(&classes_lock);
+}
+
+static inline bool ensure_registered(struct ph_lock_class *cls)
+{
+  if (ph_unlikely(ck_pr_load_32(&cls->registered) == CLASS_NEW)) {
+    register_class(cls);
+  }
+  ck_pr_fence_load();
+  return cls->scope != NULL;
+}
+
+uint64_t ph_lock_prof_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+void ph_lock_prof_acquired(struct ph_lock_class *cls)
+{
+  if (ensure_registered(cls)) {
+    ph_counter_scope_add(cls->scope, SLOT_ACQUIRED, 1);
+  }
+}
+
+static void charge_site(struct ph_lock_class *cls, const char *site,
+    uint64_t wait)
+{
+  struct ph_lock_site *s;
+  const char *cur;
+  int i;
+
+  for (i = 0; i < PH_LOCK_PROF_SITES; i++) {
+    s = &cls->sites[i];
+    cur = ck_pr_load_ptr(&s->site);
+    if (!cur) {
+      if (!ck_pr_cas_ptr_value(&s->site, NULL, (void*)site, (void*)&cur)) {
+        // someone else claimed it; maybe for this site
+        if (cur != site) {
+          continue;
+        }
+      }
+    } else if (cur != site) {
+      continue;
+    }
+    ck_pr_inc_64(&s->contended);
+    ck_pr_add_64(&s->wait_ns, wait);
+    return;
+  }
+  ck_pr_inc_64(&cls->other_contended);
+}
+
+void ph_lock_prof_contended(struct ph_lock_class *cls, const char *site,
+    uint64_t start)
+{
+  uint64_t wait = ph_lock_prof_now() - start;
+
+  if (ensure_registered(cls)) {
+    ph_counter_scope_add(cls->scope, SLOT_ACQUIRED, 1);
+    ph_counter_scope_add(cls->scope, SLOT_CONTENDED, 1);
+    ph_counter_scope_record(cls->scope, SLOT_WAIT, (int64_t)wait);
+  }
+  charge_site(cls, site, wait);
+}
+
+void ph_lock_prof_enable(bool enable)
+{
+  ck_pr_store_int(&ph_lock_prof_on, enable ? 1 : 0);
+}
+
+bool ph_lock_prof_is_enabled(void)
+{
+  return ck_pr_load_int(&ph_lock_prof_on);
+}
+
+void ph_lock_prof_configure(void)
+{
+  ph_variant_t *v = ph_config_query("$.locks.profile");
+
+  if (!v) {
+    return;
+  }
+  if (ph_var_is_boolean(v)) {
+    ph_lock_prof_enable(ph_var_bool_val(v));
+  } else {
+    ph_lock_prof_enable(ph_var_int_val(v) != 0);
+  }
+  ph_var_delref(v);
+}
+
+static int compare_site(const void *a, const void *b)
+{
+  const struct ph_lock_site *A = a, *B = b;
+
+  if (A->wait_ns > B->wait_ns) {
+    return -1;
+  }
+  if (A->wait_ns < B->wait_ns) {
+    return 1;
+  }
+  return 0;
+}
+
+static void dump_class(ph_stream_t *stm, struct ph_lock_class *cls)
+{
+  struct ph_lock_site sites[PH_LOCK_PROF_SITES];
+  ph_counter_histogram_t *hist = NULL;
+  int64_t acquired = 0, contended = 0;
+  int i, n = 0;
+
+  if (cls->scope) {
+    acquired = ph_counter_scope_get(cls->scope, SLOT_ACQUIRED);
+    contended = ph_counter_scope_get(cls->scope, SLOT_CONTENDED);
+    hist = ph_counter_scope_get_histogram(cls->scope, SLOT_WAIT);
+  }
+
+  ph_stm_printf(stm, "%-12s %12" PRIi64 " %12" PRIi64 " %6.2f%%",
+      cls->name, acquired, contended,
+      acquired ? 100.0 * contended / acquired : 0.0);
+  if (hist) {
+    ph_stm_printf(stm, " %10" PRIi64 " %10" PRIi64 " %10" PRIi64 "\r\n",
+        ph_counter_histogram_percentile(hist, 50),
+        ph_counter_histogram_percentile(hist, 99),
+        ph_counter_histogram_percentile(hist, 99.9));
+    ph_counter_histogram_free(hist);
+  } else {
+    ph_stm_printf(stm, "\r\n");
+  }
+
+  for (i = 0; i < PH_LOCK_PROF_SITES; i++) {
+    sites[n].site = ck_pr_load_ptr(&cls->sites[i].site);
+    if (!sites[n].site) {
+      continue;
+    }
+    sites[n].contended = ck_pr_load_64(&cls->sites[i].contended);
+    sites[n].wait_ns = ck_pr_load_64(&cls->sites[i].wait_ns);
+    n++;
+  }
+  qsort(sites, n, sizeof(sites[0]), compare_site);
+  for (i = 0; i < n; i++) {
+    ph_stm_printf(stm, "    %-40s %12" PRIu64 " contended %14" PRIu64
+        " ns\r\n", sites[i].site, sites[i].contended, sites[i].wait_ns);
+  }
+  if (ck_pr_load_64(&cls->other_contended)) {
+    ph_stm_printf(stm, "    %-40s %12" PRIu64 " contended\r\n",
+        "(other sites)", ck_pr_load_64(&cls->other_contended));
+  }
+}
+
+bool ph_lock_prof_dump(ph_stream_t *stm)
+{
+  struct ph_lock_class *cls;
+
+  if (!ph_lock_prof_is_enabled()) {
+    ph_stm_printf(stm,
+        "# lock profiling is disabled; set locks.profile\r\n");
+  }
+  ph_stm_printf(stm, "%-12s %12s %12s %7s %10s %10s %10s\r\n",
+      "LOCK", "ACQUIRED", "CONTENDED", "", "P50NS", "P99NS", "P999NS");
+
+  // classes are never unregistered, so the list can be walked without
+  // the lock once we've seen its head
+  ck_spinlock_lock(&classes_lock);
+  cls = classes;
+  ck_spinlock_unlock(&classes_lock);
+
+  for (; cls; cls = cls->next) {
+    dump_class(stm, cls);
+  }
+  return true;
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -0,0 +1,108 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CORELIB_LOCKPROF_H
+#define CORELIB_LOCKPROF_H
+
+#include "phenom/counter.h"
+#include <ck_spinlock.h>
+#include <ck_rwlock.h>
+#include <pthread.h>
+
+/* Instrumented locking for phenom's internal locks.
+ *
+ * Each lock belongs to a class that aggregates all of its instances;
+ * every stream mutex is in the "stream" class, for example.  When
+ * profiling is enabled, an acquisition first tries the lock.  If that
+ * fails, the acquisition is contended: the time spent waiting is
+ * recorded in the class histogram and charged to the call site.
+ *
+ * When profiling is disabled, the cost is a single load and branch.
+ * Configuring with --disable-lock-profiling removes even that. */
+
+#define PH_LOCK_PROF_SITES 16
+
+struct ph_lock_site {
+  const char *site;
+  uint64_t contended;
+  uint64_t wait_ns;
+};
+
+struct ph_lock_class {
+  const char *name;
+  ph_counter_scope_t *scope;
+  struct ph_lock_class *next;
+  uint32_t registered;
+  struct ph_lock_site sites[PH_LOCK_PROF_SITES];
+  // contention from sites that didn't fit in the table
+  uint64_t other_contended;
+};
+
+#define PH_LOCK_CLASS_INIT(name) { name, NULL, NULL, 0, {{0, 0, 0}}, 0 }
+
+#define PH_LOCK_PROF_STR2(x) #x
+#define PH_LOCK_PROF_STR(x) PH_LOCK_PROF_STR2(x)
+#define PH_LOCK_PROF_SITE __FILE__ ":" PH_LOCK_PROF_STR(__LINE__)
+
+extern int ph_lock_prof_on;
+extern struct ph_lock_class ph_timerwheel_lock_class;
+
+uint64_t ph_lock_prof_now(void);
+void ph_lock_prof_acquired(struct ph_lock_class *cls);
+void ph_lock_prof_contended(struct ph_lock_class *cls, const char *site,
+    uint64_t start);
+void ph_lock_prof_configure(void);
+
+#ifdef PH_NO_LOCK_PROFILING
+# define ph_lock_prof_active() false
+#else
+# define ph_lock_prof_active() \
+  ph_unlikely(ck_pr_load_int(&ph_lock_prof_on))
+#endif
+
+#define PH_LOCK_PROF_ACQUIRE(cls, site, trylock, lock) do { \
+  if (!ph_lock_prof_active()) { \
+    lock; \
+  } else if (trylock) { \
+    ph_lock_prof_acquired(cls); \
+  } else { \
+    uint64_t start_ = ph_lock_prof_now(); \
+    lock; \
+    ph_lock_prof_contended(cls, site, start_); \
+  } \
+} while (0)
+
+#define ph_spinlock_lock(l, cls) \
+  PH_LOCK_PROF_ACQUIRE(cls, PH_LOCK_PROF_SITE, \
+      ck_spinlock_trylock(l), ck_spinlock_lock(l))
+
+#define ph_rwlock_read_lock(l, cls) \
+  PH_LOCK_PROF_ACQUIRE(cls, PH_LOCK_PROF_SITE, \
+      ck_rwlock_read_trylock(l), ck_rwlock_read_lock(l))
+
+#define ph_rwlock_write_lock(l, cls) \
+  PH_LOCK_PROF_ACQUIRE(cls, PH_LOCK_PROF_SITE, \
+      ck_rwlock_write_trylock(l), ck_rwlock_write_lock(l))
+
+#define ph_mutex_lock(m, cls, res) \
+  PH_LOCK_PROF_ACQUIRE(cls, PH_LOCK_PROF_SITE, \
+      ((res) = pthread_mutex_trylock(m)) == 0, \
+      (res) = pthread_mutex_lock(m))
+
+#endif
+
+/* vim:ts=2:sw=2:et:
+ */
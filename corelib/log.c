@@ -22,8 +22,10 @@
 #include "phenom/hook.h"
 #include "corelib/log.h"
 #include "corelib/job.h"
+#include "corelib/lockprof.h"
 
 static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ph_lock_class log_lock_class = PH_LOCK_CLASS_INIT("log");
 static uint8_t log_level = PH_LOG_ERR;
 static const char *log_labels[] = {
   "panic",
@@ -108,6 +110,7 @@ void ph_logv(uint8_t level, const char *fmt, va_list ap)
   void *args[] = { &level, &mystr };
   static ph_hook_point_t *hook = NULL;
   char tname[32];
+  int res;
 
   if (level > log_level) {
     return;
@@ -140,7 +143,10 @@ void ph_logv(uint8_t level, const char *fmt, va_list ap)
     return;
   }
 
-  pthread_mutex_lock(&log_lock);
+  ph_mutex_lock(&log_lock, &log_lock_class, res);
+  if (ph_unlikely(res != 0)) {
+    return;
+  }
   buf = mystr.buf;
   len = mystr.len;
   while (len) {
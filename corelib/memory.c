@@ -18,12 +18,110 @@
 #include "phenom/counter.h"
 #include "phenom/log.h"
 #include "phenom/thread.h"
+#include "phenom/sysutil.h"
+#include "phenom/hook.h"
+#include "phenom/configuration.h"
+#include "corelib/memprof.h"
 #include <ck_pr.h>
+#include <ck_spinlock.h>
+
+/* Slab backend for fixed size memtypes that specify PH_MEM_FLAGS_SLAB.
+ *
+ * This is a magazine allocator in the style of Bonwick and Adams.
+ * Each thread holds a pair of magazines (loaded and previous) for each
+ * slab memtype that it touches, and most allocations and frees are
+ * satisfied from those without any synchronization.  When both magazines
+ * are empty (or full) the thread trades one with the per-memtype depot,
+ * which is protected by a spinlock.  The depot refills itself by carving
+ * items out of page aligned slabs.
+ *
+ * An object freed on a thread other than the one that allocated it lands
+ * in the magazines of the freeing thread and makes its way back to the
+ * depot a full magazine at a time, so cross-thread frees are batched.
+ *
+ * Slabs are retained for the life of the process.
+ */
+#define SLAB_ALIGN 16
+#define MAG_MIN_ROUNDS 4
+#define MAG_MAX_ROUNDS 64
+// aim to cache roughly this many bytes per magazine
+#define MAG_TARGET_BYTES 16384
+// empty magazines beyond this are released rather than kept in the depot
+#define DEPOT_MAX_EMPTY 16
+
+struct mem_magazine {
+  struct mem_magazine *next;
+  uint32_t rounds;
+  /* variable size array; holds depot->mag_rounds elements */
+  void *objs[1];
+};
+
+struct mem_slab {
+  struct mem_slab *next;
+} CK_CC_ALIGN(SLAB_ALIGN);
+
+// Overlays a free object that was spilled directly into the depot
+struct mem_loose {
+  struct mem_loose *next;
+};
+
+struct mem_depot {
+  ck_spinlock_t lock;
+  struct mem_magazine *full, *empty;
+  uint32_t num_empty;
+  struct mem_loose *loose;
+
+  uint32_t item_size;
+  uint32_t mag_rounds;
+  uint64_t slab_size;
+  struct mem_slab *slabs;
+  // uncarved space in the most recently allocated slab
+  char *cursor, *end;
+};
+
+// Per-thread, per-memtype magazine pair
+struct ph_mem_magazine_cache {
+  struct mem_magazine *loaded, *previous;
+  // our counter block for this memtype; saves looking it up per call
+  ph_counter_block_t *block;
+};
+
+/* Byte limits.
+ * Each thread reserves bytes from a limit in chunks and charges its
+ * allocations against the local reservation, so the shared count is
+ * only touched about once per chunk rather than on every allocation.
+ * Memtype limits use the memtype as their id; facility limits are
+ * numbered from memtypes_size upwards. */
+#define QUOTA_MAX_GRANT 65536
+
+struct mem_quota {
+  uint32_t id;
+  // 0 means no limit
+  uint64_t soft, hard;
+  // bytes reserved by threads; never less than the bytes in use, except
+  // for the allocations in flight when the limit was first set, so it
+  // is compared as signed (see quota_seed())
+  uint64_t reserved;
+  // 1 while reserved is above the soft limit
+  int soft_exceeded;
+  // 1 while a new limit is finding out how much is already in use
+  int seeding;
+  // the ph_mem_configure_limits() pass that last set this limit, or 0
+  // if it was set by ph_mem_set_limit() and friends
+  uint32_t config_gen;
+  // name and list linkage for facility limits
+  const char *facility;
+  struct mem_quota *next;
+};
 
 struct mem_type {
   ph_memtype_def_t def;
   ph_counter_scope_t *scope;
   uint8_t first_slot;
+  // non-NULL if this memtype is slab backed
+  struct mem_depot *depot;
+  // non-NULL if this memtype or its facility is limited
+  struct mem_quota *quota, *fac_quota;
 };
 
 #define HEADER_RESERVATION 16
@@ -37,6 +135,12 @@ static ph_memtype_t next_memtype = PH_MEMTYPE_FIRST;
 
 static struct mem_type *memtypes = NULL;
 static ph_counter_scope_t *memory_scope = NULL;
+static long page_size = 0; // NOLINT(runtime/int)
+
+static ck_spinlock_t quota_lock = CK_SPINLOCK_INITIALIZER;
+static struct mem_quota *fac_quotas = NULL;
+static uint32_t next_fac_quota = 0;
+static ph_hook_point_t *soft_limit_hook = NULL;
 
 static const char *sized_counter_names[] = {
   "bytes",   // current number of allocated bytes
@@ -61,11 +165,38 @@ static const char *vsize_counter_names[] = {
 
 #define MEM_COUNTER_SLOTS 5
 
+CK_STACK_CONTAINER(ph_thread_t,
+    thread_linkage, ph_thread_from_stack_entry)
+
+#ifdef PH_PLACATE_VALGRIND
+static void depot_destroy(struct mem_depot *depot)
+{
+  struct mem_magazine *mag;
+  struct mem_slab *slab;
+
+  while ((mag = depot->full) != NULL) {
+    depot->full = mag->next;
+    free(mag);
+  }
+  while ((mag = depot->empty) != NULL) {
+    depot->empty = mag->next;
+    free(mag);
+  }
+  while ((slab = depot->slabs) != NULL) {
+    depot->slabs = slab->next;
+    free(slab);
+  }
+  free(depot);
+}
+#endif
+
 /** tear things down and make valgrind believe that we didn't leak */
 static void memory_destroy(void)
 {
 #ifdef PH_PLACATE_VALGRIND
   int i;
+  ck_stack_entry_t *stack_entry;
+  ph_thread_t *thr;
 
   // One last try to collect anything lingering in SMR.
   // Any defers that take place after this point will most likely never
@@ -74,8 +205,46 @@ static void memory_destroy(void)
 
   ph_counter_scope_delref(memory_scope);
 
+  CK_STACK_FOREACH(&ph_thread_all_threads, stack_entry) {
+    thr = ph_thread_from_stack_entry(stack_entry);
+    if (!thr->mem_cache) {
+      continue;
+    }
+    for (i = PH_MEMTYPE_FIRST; i < next_memtype; i++) {
+      struct ph_mem_magazine_cache *cache = thr->mem_cache[i];
+
+      if (!cache) {
+        continue;
+      }
+      free(cache->loaded);
+      free(cache->previous);
+      if (cache->block) {
+        ph_counter_block_delref(cache->block);
+      }
+      free(cache);
+    }
+    free(thr->mem_cache);
+    thr->mem_cache = NULL;
+  }
+  CK_STACK_FOREACH(&ph_thread_all_threads, stack_entry) {
+    thr = ph_thread_from_stack_entry(stack_entry);
+    free(thr->mem_grant);
+    thr->mem_grant = NULL;
+  }
+  while (fac_quotas) {
+    struct mem_quota *q = fac_quotas;
+
+    fac_quotas = q->next;
+    free((char*)q->facility);
+    free(q);
+  }
+
   for (i = PH_MEMTYPE_FIRST; i < next_memtype; i++) {
     ph_counter_scope_delref(memtypes[i].scope);
+    if (memtypes[i].depot) {
+      depot_destroy(memtypes[i].depot);
+    }
+    free(memtypes[i].quota);
     if (i == PH_MEMTYPE_FIRST ||
         memtypes[i].def.facility != memtypes[i-1].def.facility) {
       free((char*)memtypes[i].def.facility);
@@ -118,6 +287,8 @@ static void memory_init(void)
   if (!memory_scope) {
     memory_panic("failed to define memory scope");
   }
+
+  page_size = sysconf(_SC_PAGESIZE);
 }
 
 PH_LIBRARY_INIT_PRI(memory_init, memory_destroy, 3)
@@ -134,6 +305,51 @@ static ph_counter_scope_t *resolve_facility(const char *fac)
   return ph_counter_scope_define(memory_scope, fac, 0);
 }
 
+static struct mem_quota *find_fac_quota(const char *facility)
+{
+  struct mem_quota *q;
+
+  ck_spinlock_lock(&quota_lock);
+  for (q = fac_quotas; q; q = q->next) {
+    if (!strcmp(q->facility, facility)) {
+      break;
+    }
+  }
+  ck_spinlock_unlock(&quota_lock);
+
+  return q;
+}
+
+static bool setup_depot(struct mem_type *mem_type)
+{
+  struct mem_depot *depot;
+  uint64_t item_size = mem_type->def.item_size;
+
+  if (!(mem_type->def.flags & PH_MEM_FLAGS_SLAB) || item_size == 0) {
+    return true;
+  }
+
+  depot = calloc(1, sizeof(*depot));
+  if (!depot) {
+    return false;
+  }
+  ck_spinlock_init(&depot->lock);
+
+  depot->item_size = (item_size + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+  depot->mag_rounds = MAG_TARGET_BYTES / depot->item_size;
+  depot->mag_rounds = MAX(MAG_MIN_ROUNDS,
+                        MIN(MAG_MAX_ROUNDS, depot->mag_rounds));
+
+  // Size the slab so that it can fill at least one magazine, and round
+  // it up to a whole number of pages
+  depot->slab_size = sizeof(struct mem_slab) +
+                     (uint64_t)depot->item_size * depot->mag_rounds;
+  depot->slab_size = (depot->slab_size + page_size - 1) & ~(page_size - 1);
+
+  mem_type->depot = depot;
+  return true;
+}
+
 ph_memtype_t ph_memtype_register(const ph_memtype_def_t *def)
 {
   ph_memtype_t mt;
@@ -166,6 +382,10 @@ ph_memtype_t ph_memtype_register(const ph_memtype_def_t *def)
   mem_type->def.facility = strdup(def->facility);
   mem_type->def.name = strdup(def->name);
   mem_type->scope = scope;
+  if (!setup_depot(mem_type)) {
+    memory_panic("failed to allocate slab depot for %s", def->name);
+  }
+  mem_type->fac_quota = find_fac_quota(def->facility);
 
   if (mem_type->def.item_size == 0) {
     names = vsize_counter_names;
@@ -224,6 +444,10 @@ ph_memtype_t ph_memtype_register_block(
       mem_type->def.facility = memtypes[mt].def.facility;
     }
     mem_type->def.name = strdup(defs[i].name);
+    if (!setup_depot(mem_type)) {
+      memory_panic("failed to allocate slab depot for %s", defs[i].name);
+    }
+    mem_type->fac_quota = find_fac_quota(defs[i].facility);
 
     scope = ph_counter_scope_define(fac_scope, mem_type->def.name,
         MEM_COUNTER_SLOTS);
@@ -269,6 +493,461 @@ static struct mem_type *resolve_mt(ph_memtype_t mt)
   return &memtypes[mt];
 }
 
+static struct mem_magazine *magazine_new(struct mem_depot *depot)
+{
+  struct mem_magazine *mag;
+
+  mag = malloc(sizeof(*mag) + ((depot->mag_rounds - 1) * sizeof(void*)));
+  if (!mag) {
+    return NULL;
+  }
+  mag->next = NULL;
+  mag->rounds = 0;
+  return mag;
+}
+
+static struct ph_mem_magazine_cache *get_magazine_cache(
+    struct mem_type *mem_type, ph_memtype_t mt)
+{
+  ph_thread_t *me = ph_thread_self();
+  struct ph_mem_magazine_cache *cache;
+
+  if (ph_likely(me->mem_cache != NULL)) {
+    cache = me->mem_cache[mt];
+    if (ph_likely(cache != NULL && cache->block != NULL)) {
+      return cache;
+    }
+    if (cache) {
+      // Dropped by ph_mem_flush_thread() when the record's previous
+      // owner exited; its counters now live in a fresh block table
+      cache->block = ph_counter_block_open(mem_type->scope);
+      if (!cache->block) {
+        return NULL;
+      }
+      return cache;
+    }
+  } else {
+    me->mem_cache = calloc(memtypes_size, sizeof(*me->mem_cache));
+    if (!me->mem_cache) {
+      return NULL;
+    }
+  }
+
+  cache = calloc(1, sizeof(*cache));
+  if (!cache) {
+    return NULL;
+  }
+  cache->loaded = magazine_new(mem_type->depot);
+  cache->previous = magazine_new(mem_type->depot);
+  cache->block = ph_counter_block_open(mem_type->scope);
+  if (!cache->loaded || !cache->previous || !cache->block) {
+    free(cache->loaded);
+    free(cache->previous);
+    if (cache->block) {
+      ph_counter_block_delref(cache->block);
+    }
+    free(cache);
+    return NULL;
+  }
+
+  me->mem_cache[mt] = cache;
+  return cache;
+}
+
+// Fill an empty magazine from the loose list and then from the slabs.
+// Must be called with the depot locked
+static void depot_fill(struct mem_depot *depot, struct mem_magazine *mag)
+{
+  struct mem_slab *slab;
+
+  while (depot->loose && mag->rounds < depot->mag_rounds) {
+    mag->objs[mag->rounds++] = depot->loose;
+    depot->loose = depot->loose->next;
+  }
+
+  while (mag->rounds < depot->mag_rounds) {
+    if (depot->cursor + depot->item_size > depot->end) {
+      if (mag->rounds) {
+        // Don't grab a fresh slab if we already have something to return
+        return;
+      }
+      if (posix_memalign((void**)(void*)&slab, page_size, depot->slab_size)) {
+        return;
+      }
+      slab->next = depot->slabs;
+      depot->slabs = slab;
+      depot->cursor = (char*)(slab + 1);
+      depot->end = (char*)slab + depot->slab_size;
+    }
+    mag->objs[mag->rounds++] = depot->cursor;
+    depot->cursor += depot->item_size;
+  }
+}
+
+// Return the contents of a magazine directly to the depot.
+// Must be called with the depot locked
+static void depot_spill(struct mem_depot *depot, struct mem_magazine *mag)
+{
+  struct mem_loose *obj;
+
+  while (mag->rounds) {
+    obj = mag->objs[--mag->rounds];
+    obj->next = depot->loose;
+    depot->loose = obj;
+  }
+}
+
+static void *slab_alloc(struct mem_type *mem_type, ph_memtype_t mt)
+{
+  struct mem_depot *depot = mem_type->depot;
+  struct ph_mem_magazine_cache *cache;
+  struct mem_magazine *mag, *full;
+  static const uint8_t slots[2] = { SLOT_BYTES, SLOT_ALLOCS };
+  int64_t values[2];
+  void *ptr;
+
+  cache = get_magazine_cache(mem_type, mt);
+  if (ph_unlikely(!cache)) {
+    return NULL;
+  }
+
+  mag = cache->loaded;
+  if (ph_unlikely(mag->rounds == 0)) {
+    if (cache->previous->rounds) {
+      cache->loaded = cache->previous;
+      cache->previous = mag;
+    } else {
+      // Both are empty; trade the previous magazine for a full one
+      // from the depot, or have the depot fill the loaded one for us
+      ck_spinlock_lock(&depot->lock);
+      full = depot->full;
+      if (full) {
+        depot->full = full->next;
+        mag = cache->previous;
+        if (depot->num_empty < DEPOT_MAX_EMPTY) {
+          mag->next = depot->empty;
+          depot->empty = mag;
+          depot->num_empty++;
+          mag = NULL;
+        }
+        cache->previous = cache->loaded;
+        cache->loaded = full;
+      } else {
+        depot_fill(depot, mag);
+        mag = NULL;
+      }
+      ck_spinlock_unlock(&depot->lock);
+      free(mag);
+    }
+    mag = cache->loaded;
+    if (mag->rounds == 0) {
+      return NULL;
+    }
+  }
+
+  ptr = mag->objs[--mag->rounds];
+
+  values[0] = mem_type->def.item_size;
+  values[1] = 1;
+  ph_counter_block_bulk_add(cache->block, 2, slots, values);
+
+  return ptr;
+}
+
+static void slab_free(struct mem_type *mem_type, ph_memtype_t mt, void *ptr)
+{
+  struct mem_depot *depot = mem_type->depot;
+  struct ph_mem_magazine_cache *cache;
+  struct mem_magazine *mag, *empty;
+  static const uint8_t slots[2] = { SLOT_BYTES, SLOT_FREES };
+  int64_t values[2];
+
+  values[0] = -mem_type->def.item_size;
+  values[1] = 1;
+
+  cache = get_magazine_cache(mem_type, mt);
+  if (ph_unlikely(!cache)) {
+    ph_counter_block_t *block;
+
+    // Nowhere to stash it locally; hand it straight back to the depot
+    ck_spinlock_lock(&depot->lock);
+    ((struct mem_loose*)ptr)->next = depot->loose;
+    depot->loose = ptr;
+    ck_spinlock_unlock(&depot->lock);
+
+    block = ph_counter_block_open(mem_type->scope);
+    if (block) {
+      ph_counter_block_bulk_add(block, 2, slots, values);
+      ph_counter_block_delref(block);
+    }
+    return;
+  }
+
+  mag = cache->loaded;
+  if (ph_unlikely(mag->rounds == depot->mag_rounds)) {
+    if (cache->previous->rounds == 0) {
+      cache->loaded = cache->previous;
+      cache->previous = mag;
+    } else {
+      // Both are full; give the previous magazine to the depot
+      // in exchange for an empty one
+      ck_spinlock_lock(&depot->lock);
+      empty = depot->empty;
+      if (empty) {
+        depot->empty = empty->next;
+        depot->num_empty--;
+      }
+      ck_spinlock_unlock(&depot->lock);
+
+      if (!empty) {
+        empty = magazine_new(depot);
+      }
+
+      ck_spinlock_lock(&depot->lock);
+      if (empty) {
+        mag = cache->previous;
+        mag->next = depot->full;
+        depot->full = mag;
+        cache->previous = cache->loaded;
+        cache->loaded = empty;
+      } else {
+        depot_spill(depot, cache->previous);
+      }
+      ck_spinlock_unlock(&depot->lock);
+
+      if (!empty) {
+        mag = cache->loaded;
+        cache->loaded = cache->previous;
+        cache->previous = mag;
+      }
+    }
+    mag = cache->loaded;
+  }
+
+  mag->objs[mag->rounds++] = ptr;
+  ph_counter_block_bulk_add(cache->block, 2, slots, values);
+}
+
+static inline uint64_t quota_grant_size(struct mem_quota *q)
+{
+  uint64_t limit = q->hard ? q->hard : q->soft;
+
+  if (limit == 0 || limit / 32 > QUOTA_MAX_GRANT) {
+    return QUOTA_MAX_GRANT;
+  }
+  return limit / 32;
+}
+
+// Compares a count against a limit; see mem_quota.reserved
+static inline bool quota_over(uint64_t total, uint64_t limit)
+{
+  return (int64_t)total > (int64_t)limit;
+}
+
+static void quota_notify(struct mem_quota *q, ph_memtype_t mt,
+    bool exceeded)
+{
+  bool facility = q->facility != NULL;
+  void *args[] = { &mt, &facility, &exceeded };
+
+  // Only the thread that flips the state gets to report it
+  if (!ck_pr_cas_int(&q->soft_exceeded, !exceeded, exceeded)) {
+    return;
+  }
+  if (soft_limit_hook) {
+    ph_hook_invoke_inner(soft_limit_hook,
+        sizeof(args)/sizeof(args[0]), args);
+  }
+}
+
+// Charge size bytes against a limit, topping up the local reservation
+// from the shared count if needed.  If local is NULL the shared count
+// is charged directly
+static bool quota_take(struct mem_quota *q, ph_memtype_t mt,
+    int64_t *local, uint64_t size)
+{
+  uint64_t need, want, total, hard;
+
+  if (ph_unlikely(ck_pr_load_int(&q->seeding))) {
+    local = NULL;
+  }
+  if (local && ph_likely((uint64_t)*local >= size)) {
+    *local -= size;
+    return true;
+  }
+
+  need = size - (local ? *local : 0);
+  want = need + (local ? quota_grant_size(q) : 0);
+  total = ck_pr_faa_64(&q->reserved, want) + want;
+
+  hard = ck_pr_load_64(&q->hard);
+  if (hard && quota_over(total, hard)) {
+    // Don't let the slack for our reservation push us over;
+    // see if what we actually need will fit
+    ck_pr_sub_64(&q->reserved, want - need);
+    total -= want - need;
+    want = need;
+    if (quota_over(total, hard)) {
+      ck_pr_sub_64(&q->reserved, need);
+      return false;
+    }
+  }
+
+  if (local) {
+    *local += want - size;
+  }
+
+  if (ph_unlikely(q->soft && quota_over(total, q->soft) &&
+        !q->soft_exceeded)) {
+    quota_notify(q, mt, true);
+  }
+  return true;
+}
+
+// Credit size bytes back to a limit, returning the local reservation
+// to the shared count once it grows beyond a couple of chunks
+static void quota_give(struct mem_quota *q, ph_memtype_t mt,
+    int64_t *local, uint64_t size)
+{
+  uint64_t grant, total;
+
+  if (ph_unlikely(ck_pr_load_int(&q->seeding))) {
+    local = NULL;
+  }
+  if (local) {
+    grant = quota_grant_size(q);
+    *local += size;
+    if (ph_likely((uint64_t)*local <= 2 * grant)) {
+      return;
+    }
+    size = *local - grant;
+    *local = grant;
+  }
+
+  total = ck_pr_faa_64(&q->reserved, -size) - size;
+
+  if (ph_unlikely(q->soft_exceeded && !quota_over(total, q->soft))) {
+    quota_notify(q, mt, false);
+  }
+}
+
+static int64_t *get_grants(void)
+{
+  ph_thread_t *me = ph_thread_self();
+
+  if (ph_unlikely(me->mem_grant == NULL)) {
+    // If this fails, quota_take and quota_give charge the shared count
+    me->mem_grant = calloc(2 * memtypes_size, sizeof(*me->mem_grant));
+  }
+  return me->mem_grant;
+}
+
+static inline bool mem_limited(struct mem_type *mem_type)
+{
+  return mem_type->quota || mem_type->fac_quota;
+}
+
+static bool mem_charge(struct mem_type *mem_type, ph_memtype_t mt,
+    uint64_t size)
+{
+  int64_t *grants = get_grants();
+  struct mem_quota *q = mem_type->quota, *fq = mem_type->fac_quota;
+
+  if (q && !quota_take(q, mt, grants ? &grants[q->id] : NULL, size)) {
+    return false;
+  }
+  if (fq && !quota_take(fq, mt, grants ? &grants[fq->id] : NULL, size)) {
+    if (q) {
+      quota_give(q, mt, grants ? &grants[q->id] : NULL, size);
+    }
+    return false;
+  }
+  return true;
+}
+
+static void mem_credit(struct mem_type *mem_type, ph_memtype_t mt,
+    uint64_t size)
+{
+  int64_t *grants = get_grants();
+  struct mem_quota *q = mem_type->quota, *fq = mem_type->fac_quota;
+
+  if (q) {
+    quota_give(q, mt, grants ? &grants[q->id] : NULL, size);
+  }
+  if (fq) {
+    quota_give(fq, mt, grants ? &grants[fq->id] : NULL, size);
+  }
+}
+
+// Return a thread's reservations to the shared counts
+static void flush_grants(ph_thread_t *thr)
+{
+  struct mem_quota *q;
+  int i;
+
+  if (!thr->mem_grant) {
+    return;
+  }
+
+  for (i = PH_MEMTYPE_FIRST; i < next_memtype; i++) {
+    q = ck_pr_load_ptr(&memtypes[i].quota);
+    if (q && thr->mem_grant[q->id]) {
+      ck_pr_sub_64(&q->reserved, thr->mem_grant[q->id]);
+      thr->mem_grant[q->id] = 0;
+    }
+  }
+
+  ck_spinlock_lock(&quota_lock);
+  for (q = fac_quotas; q; q = q->next) {
+    if (thr->mem_grant[q->id]) {
+      ck_pr_sub_64(&q->reserved, thr->mem_grant[q->id]);
+      thr->mem_grant[q->id] = 0;
+    }
+  }
+  ck_spinlock_unlock(&quota_lock);
+}
+
+void ph_mem_thread_idle(ph_thread_t *thr)
+{
+  // Reservations held by an idle thread could otherwise leave busier
+  // threads short of room under a limit
+  flush_grants(thr);
+}
+
+void ph_mem_flush_thread(ph_thread_t *thr)
+{
+  int i;
+  struct ph_mem_magazine_cache *cache;
+  struct mem_depot *depot;
+
+  flush_grants(thr);
+
+  if (!thr->mem_cache) {
+    return;
+  }
+
+  for (i = PH_MEMTYPE_FIRST; i < next_memtype; i++) {
+    cache = thr->mem_cache[i];
+    if (!cache) {
+      continue;
+    }
+    depot = memtypes[i].depot;
+
+    ck_spinlock_lock(&depot->lock);
+    depot_spill(depot, cache->loaded);
+    depot_spill(depot, cache->previous);
+    ck_spinlock_unlock(&depot->lock);
+
+    // ph_counter_fold_thread() is about to retire this block along with
+    // the rest of the thread's table; a thread that recycles the record
+    // must count into a block from the new table
+    if (cache->block) {
+      ph_counter_block_delref(cache->block);
+      cache->block = NULL;
+    }
+  }
+}
+
 void *ph_mem_alloc(ph_memtype_t mt)
 {
   struct mem_type *mem_type = resolve_mt(mt);
@@ -285,7 +964,21 @@ void *ph_mem_alloc(ph_memtype_t mt)
     return NULL;
   }
 
-  ptr = malloc(mem_type->def.item_size);
+  if (ph_unlikely(mem_limited(mem_type)) &&
+      !mem_charge(mem_type, mt, mem_type->def.item_size)) {
+    ptr = NULL;
+  } else if (mem_type->depot) {
+    // accounts for itself on success
+    ptr = slab_alloc(mem_type, mt);
+    if (!ptr && mem_limited(mem_type)) {
+      mem_credit(mem_type, mt, mem_type->def.item_size);
+    }
+  } else {
+    ptr = malloc(mem_type->def.item_size);
+    if (!ptr && mem_limited(mem_type)) {
+      mem_credit(mem_type, mt, mem_type->def.item_size);
+    }
+  }
   if (!ptr) {
     ph_counter_scope_add(mem_type->scope,
         mem_type->first_slot + SLOT_OOM, 1);
@@ -298,16 +991,22 @@ void *ph_mem_alloc(ph_memtype_t mt)
     return NULL;
   }
 
-  block = ph_counter_block_open(mem_type->scope);
-  values[0] = mem_type->def.item_size;
-  values[1] = 1;
-  ph_counter_block_bulk_add(block, 2, slots, values);
-  ph_counter_block_delref(block);
+  if (!mem_type->depot) {
+    block = ph_counter_block_open(mem_type->scope);
+    values[0] = mem_type->def.item_size;
+    values[1] = 1;
+    ph_counter_block_bulk_add(block, 2, slots, values);
+    ph_counter_block_delref(block);
+  }
 
   if (mem_type->def.flags & PH_MEM_FLAGS_ZERO) {
     memset(ptr, 0, mem_type->def.item_size);
   }
 
+  if (ph_unlikely(ph_mem_prof_rate)) {
+    ph_mem_prof_sample(mt, ptr, mem_type->def.item_size);
+  }
+
   return ptr;
 }
 
@@ -345,7 +1044,15 @@ void *ph_mem_alloc_size(ph_memtype_t mt, uint64_t size)
     return NULL;
   }
 
-  ptr = malloc(size + HEADER_RESERVATION);
+  if (ph_unlikely(mem_limited(mem_type)) &&
+      !mem_charge(mem_type, mt, size)) {
+    ptr = NULL;
+  } else {
+    ptr = malloc(size + HEADER_RESERVATION);
+    if (!ptr && mem_limited(mem_type)) {
+      mem_credit(mem_type, mt, size);
+    }
+  }
   if (!ptr) {
     ph_counter_scope_add(mem_type->scope,
         mem_type->first_slot + SLOT_OOM, 1);
@@ -373,6 +1080,10 @@ void *ph_mem_alloc_size(ph_memtype_t mt, uint64_t size)
     memset(ptr, 0, size);
   }
 
+  if (ph_unlikely(ph_mem_prof_rate)) {
+    ph_mem_prof_sample(mt, ptr, size);
+  }
+
   return ptr;
 }
 
@@ -388,7 +1099,18 @@ void ph_mem_free(ph_memtype_t mt, void *ptr)
     return;
   }
 
+  if (ph_unlikely(ph_mem_prof_live)) {
+    ph_mem_prof_forget(ptr);
+  }
+
   mem_type = resolve_mt(mt);
+  if (mem_type->depot) {
+    if (ph_unlikely(mem_limited(mem_type))) {
+      mem_credit(mem_type, mt, mem_type->def.item_size);
+    }
+    slab_free(mem_type, mt, ptr);
+    return;
+  }
   if (mem_type->def.item_size) {
     size = mem_type->def.item_size;
   } else {
@@ -406,6 +1128,10 @@ void ph_mem_free(ph_memtype_t mt, void *ptr)
 
   free(ptr);
 
+  if (ph_unlikely(mem_limited(mem_type))) {
+    mem_credit(mem_type, mt, size);
+  }
+
   block = ph_counter_block_open(mem_type->scope);
   values[0] = -size;
   values[1] = 1;
@@ -420,7 +1146,8 @@ void *ph_mem_realloc(ph_memtype_t mt, void *ptr, uint64_t size)
   static const uint8_t slots[2] = { SLOT_BYTES, SLOT_REALLOC };
   int64_t values[3];
   struct sized_header *hdr;
-  uint64_t orig_size;
+  struct prof_stack *sampled = NULL;
+  uint64_t orig_size, sampled_size = 0;
   void *new_ptr;
 
   if (size == 0) {
@@ -449,11 +1176,31 @@ void *ph_mem_realloc(ph_memtype_t mt, void *ptr, uint64_t size)
 
   orig_size = hdr->size;
   if (orig_size == size) {
-    return ptr;
+    return hdr + 1;
   }
 
-  hdr = realloc(ptr, size + HEADER_RESERVATION);
+  if (ph_unlikely(mem_limited(mem_type)) && size > orig_size &&
+      !mem_charge(mem_type, mt, size - orig_size)) {
+    hdr = NULL;
+  } else {
+    // Treat it as a free of the old block and allocation of the new one.
+    // The old block has to be forgotten first: once realloc() has moved
+    // it, another thread may be handed the same address and sample it.
+    if (ph_unlikely(ph_mem_prof_live)) {
+      sampled = ph_mem_prof_take((struct sized_header*)ptr + 1,
+          &sampled_size);
+    }
+    hdr = realloc(ptr, size + HEADER_RESERVATION);
+    if (!hdr && mem_limited(mem_type) && size > orig_size) {
+      mem_credit(mem_type, mt, size - orig_size);
+    }
+  }
   if (!hdr) {
+    // The old block is still live
+    if (sampled) {
+      ph_mem_prof_restore((struct sized_header*)ptr + 1, sampled_size,
+          sampled);
+    }
     ph_counter_scope_add(mem_type->scope,
         mem_type->first_slot + SLOT_OOM, 1);
 
@@ -468,6 +1215,10 @@ void *ph_mem_realloc(ph_memtype_t mt, void *ptr, uint64_t size)
   new_ptr = hdr + 1;
   hdr->size = size;
 
+  if (ph_unlikely(mem_limited(mem_type)) && size < orig_size) {
+    mem_credit(mem_type, mt, orig_size - size);
+  }
+
   block = ph_counter_block_open(mem_type->scope);
   values[0] = size - orig_size;
   values[1] = 1;
@@ -478,6 +1229,10 @@ void *ph_mem_realloc(ph_memtype_t mt, void *ptr, uint64_t size)
     memset((char*)new_ptr + orig_size, 0, size - orig_size);
   }
 
+  if (ph_unlikely(ph_mem_prof_rate)) {
+    ph_mem_prof_sample(mt, new_ptr, size);
+  }
+
   return new_ptr;
 }
 
@@ -503,6 +1258,10 @@ bool ph_mem_stat(ph_memtype_t mt, ph_mem_stats_t *stats)
   stats->allocs = values[SLOT_ALLOCS];
   stats->oom = values[SLOT_OOM];
   stats->bytes = values[SLOT_BYTES];
+  if (mem_type->quota) {
+    stats->soft_limit = mem_type->quota->soft;
+    stats->hard_limit = mem_type->quota->hard;
+  }
 
   return true;
 }
@@ -550,6 +1309,267 @@ ph_memtype_t ph_mem_type_by_name(const char *facility,
   return PH_MEMTYPE_INVALID;
 }
 
+/* Counts what was in use before a new limit was published.
+ *
+ * The limit is published first, unenforced and with q->seeding set, so
+ * that from then on every allocation and free is charged, and charged
+ * straight to the shared count rather than to a thread's reservation.
+ * Then `charged` is read from the shared count and `in_use` from the
+ * stats; what the stats have that the charges don't was allocated
+ * before the limit existed, and is added in.  Only the operations in
+ * flight between the two reads can be counted twice or missed, which
+ * is why the count is compared as signed. */
+static void quota_seed(struct mem_quota *q, uint64_t charged,
+    uint64_t in_use)
+{
+  ck_pr_add_64(&q->reserved, in_use - charged);
+  ck_pr_fence_store();
+  ck_pr_store_int(&q->seeding, 0);
+}
+
+// Caller must hold quota_lock
+static void store_quota_limits(struct mem_quota *q, uint64_t soft,
+    uint64_t hard, uint32_t config_gen)
+{
+  ck_pr_store_64(&q->soft, soft);
+  ck_pr_store_64(&q->hard, hard);
+  if (q->soft_exceeded && (soft == 0 || !quota_over(q->reserved, soft))) {
+    ck_pr_store_int(&q->soft_exceeded, 0);
+  }
+  q->config_gen = config_gen;
+}
+
+static void set_quota_limits(struct mem_quota *q, uint64_t soft,
+    uint64_t hard, uint32_t config_gen)
+{
+  // This allocates, so resolve it before taking the spinlock
+  if (soft && !ck_pr_load_ptr(&soft_limit_hook)) {
+    ck_pr_store_ptr(&soft_limit_hook,
+        ph_hook_point_get_cstr(PH_MEM_SOFT_LIMIT_HOOK_NAME, true));
+  }
+
+  ck_spinlock_lock(&quota_lock);
+  store_quota_limits(q, soft, hard, config_gen);
+  ck_spinlock_unlock(&quota_lock);
+}
+
+// Finds the limit for a memtype, creating it if needed
+static ph_result_t memtype_quota(ph_memtype_t mt, struct mem_quota **qp)
+{
+  struct mem_type *mem_type = &memtypes[mt];
+  struct mem_quota *q;
+  ph_mem_stats_t stats;
+  uint64_t charged;
+
+  ck_spinlock_lock(&quota_lock);
+  q = mem_type->quota;
+  if (q) {
+    ck_spinlock_unlock(&quota_lock);
+    *qp = q;
+    return PH_OK;
+  }
+  q = calloc(1, sizeof(*q));
+  if (!q) {
+    ck_spinlock_unlock(&quota_lock);
+    return PH_NOMEM;
+  }
+  q->id = mt;
+  q->seeding = 1;
+  // Once tracked, always tracked; this way the reserved count stays
+  // in step with frees of memory that was charged against it
+  ck_pr_store_ptr(&mem_type->quota, q);
+  ck_spinlock_unlock(&quota_lock);
+
+  ck_pr_fence_memory();
+  charged = ck_pr_load_64(&q->reserved);
+  ph_mem_stat(mt, &stats);
+  quota_seed(q, charged, stats.bytes);
+
+  *qp = q;
+  return PH_OK;
+}
+
+// Finds the limit for a facility, creating it if needed
+static ph_result_t facility_quota(const char *facility,
+    struct mem_quota **qp)
+{
+  struct mem_quota *q;
+  ph_mem_stats_t stats;
+  uint64_t charged, in_use = 0;
+  int i;
+
+  ck_spinlock_lock(&quota_lock);
+  for (q = fac_quotas; q; q = q->next) {
+    if (!strcmp(q->facility, facility)) {
+      ck_spinlock_unlock(&quota_lock);
+      *qp = q;
+      return PH_OK;
+    }
+  }
+  if (next_fac_quota >= memtypes_size) {
+    ck_spinlock_unlock(&quota_lock);
+    return PH_ERR;
+  }
+  q = calloc(1, sizeof(*q));
+  if (!q) {
+    ck_spinlock_unlock(&quota_lock);
+    return PH_NOMEM;
+  }
+  q->facility = strdup(facility);
+  if (!q->facility) {
+    free(q);
+    ck_spinlock_unlock(&quota_lock);
+    return PH_NOMEM;
+  }
+  q->id = memtypes_size + next_fac_quota++;
+  q->seeding = 1;
+
+  // As in memtype_quota(), start charging and then count
+  for (i = PH_MEMTYPE_FIRST; i < next_memtype; i++) {
+    if (!strcmp(facility, memtypes[i].def.facility)) {
+      ck_pr_store_ptr(&memtypes[i].fac_quota, q);
+    }
+  }
+  q->next = fac_quotas;
+  fac_quotas = q;
+  ck_spinlock_unlock(&quota_lock);
+
+  ck_pr_fence_memory();
+  charged = ck_pr_load_64(&q->reserved);
+  for (i = PH_MEMTYPE_FIRST; i < next_memtype; i++) {
+    if (strcmp(facility, memtypes[i].def.facility)) {
+      continue;
+    }
+    ph_mem_stat(i, &stats);
+    in_use += stats.bytes;
+  }
+  quota_seed(q, charged, in_use);
+
+  *qp = q;
+  return PH_OK;
+}
+
+ph_result_t ph_mem_set_limit(ph_memtype_t mt, uint64_t soft, uint64_t hard)
+{
+  struct mem_quota *q;
+  ph_result_t res;
+
+  if (mt < PH_MEMTYPE_FIRST || mt >= next_memtype) {
+    return PH_NOENT;
+  }
+  res = memtype_quota(mt, &q);
+  if (res != PH_OK) {
+    return res;
+  }
+  set_quota_limits(q, soft, hard, 0);
+  return PH_OK;
+}
+
+ph_result_t ph_mem_set_facility_limit(const char *facility,
+    uint64_t soft, uint64_t hard)
+{
+  struct mem_quota *q;
+  ph_result_t res;
+
+  res = facility_quota(facility, &q);
+  if (res != PH_OK) {
+    return res;
+  }
+  set_quota_limits(q, soft, hard, 0);
+  return PH_OK;
+}
+
+// Lifts the limits that an earlier configuration set, but that the
+// configuration applied by pass `gen` does not mention
+static void clear_stale_limits(uint32_t gen)
+{
+  struct mem_quota *q;
+  int i;
+
+  ck_spinlock_lock(&quota_lock);
+  for (i = PH_MEMTYPE_FIRST; i < next_memtype; i++) {
+    q = memtypes[i].quota;
+    if (q && q->config_gen && q->config_gen != gen) {
+      store_quota_limits(q, 0, 0, 0);
+    }
+  }
+  for (q = fac_quotas; q; q = q->next) {
+    if (q->config_gen && q->config_gen != gen) {
+      store_quota_limits(q, 0, 0, 0);
+    }
+  }
+  ck_spinlock_unlock(&quota_lock);
+}
+
+static uint64_t config_limit(ph_variant_t *lim, const char *name)
+{
+  ph_variant_t *v = ph_var_object_get_cstr(lim, name);
+
+  if (!v || !ph_var_is_int(v) || ph_var_int_val(v) < 0) {
+    return 0;
+  }
+  return ph_var_int_val(v);
+}
+
+void ph_mem_configure_limits(void)
+{
+  static uint32_t config_passes = 0;
+  ph_variant_t *limits, *lim;
+  ph_ht_iter_t iter;
+  ph_string_t *key;
+  struct mem_quota *q;
+  char name[128];
+  char *slash;
+  uint64_t soft, hard;
+  ph_memtype_t mt;
+  uint32_t gen;
+
+  gen = ck_pr_faa_32(&config_passes, 1) + 1;
+
+  limits = ph_config_query("$.memory.limits");
+  if (limits && !ph_var_is_object(limits)) {
+    ph_log(PH_LOG_ERR, "memory.limits must be an object");
+    ph_var_delref(limits);
+    limits = NULL;
+  }
+
+  if (limits && ph_var_object_iter_first(limits, &iter, &key, &lim)) do {
+    if (key->len >= sizeof(name) || !ph_var_is_object(lim)) {
+      ph_log(PH_LOG_ERR, "memory.limits: ignoring `Ps%p", (void*)key);
+      continue;
+    }
+    memcpy(name, key->buf, key->len);
+    name[key->len] = '\0';
+
+    soft = config_limit(lim, "soft");
+    hard = config_limit(lim, "hard");
+
+    slash = strchr(name, '/');
+    if (!slash) {
+      if (facility_quota(name, &q) == PH_OK) {
+        set_quota_limits(q, soft, hard, gen);
+      }
+      continue;
+    }
+
+    *slash = '\0';
+    mt = ph_mem_type_by_name(name, slash + 1);
+    if (mt == PH_MEMTYPE_INVALID) {
+      ph_log(PH_LOG_ERR, "memory.limits: no memtype %s/%s",
+          name, slash + 1);
+      continue;
+    }
+    if (memtype_quota(mt, &q) == PH_OK) {
+      set_quota_limits(q, soft, hard, gen);
+    }
+  } while (ph_var_object_iter_next(limits, &iter, &key, &lim));
+
+  if (limits) {
+    ph_var_delref(limits);
+  }
+  clear_stale_limits(gen);
+}
+
 /* vim:ts=2:sw=2:et:
  */
 
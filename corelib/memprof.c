@@ -0,0 +1,414 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phenom/memory.h"
+#include "phenom/thread.h"
+#include "phenom/stream.h"
+#include "phenom/configuration.h"
+#include "phenom/sysutil.h"
+#include "corelib/memprof.h"
+#include <ck_pr.h>
+#include <ck_spinlock.h>
+
+#if defined(HAVE_BACKTRACE)
+# include <execinfo.h>
+#endif
+
+/* Sampling heap profiler.
+ *
+ * Each thread counts down the bytes it allocates and takes a sample when
+ * the count reaches zero.  The distance to the next sample is drawn from
+ * an exponential distribution with a mean of ph_mem_prof_rate bytes, which
+ * is what pprof assumes when it scales the samples back up.
+ *
+ * Samples are aggregated by (stack, memtype) in a fixed size table of
+ * stacks; a second table maps live sampled pointers to their stack so that
+ * frees can be attributed.  Both tables are bounded; once full, new stacks
+ * or live samples are dropped and counted.  A small counting filter over
+ * the sampled pointers means that most frees don't need the lock.
+ */
+#define PROF_MAX_DEPTH 32
+// frames belonging to ph_mem_prof_sample() and ph_mem_alloc*()
+#define PROF_SKIP_FRAMES 2
+#define PROF_STACK_BUCKETS 4096
+#define PROF_LIVE_BUCKETS 65536
+#define PROF_FILTER_SIZE 16384
+
+struct prof_stack {
+  uint32_t hash;
+  uint32_t depth;
+  ph_memtype_t mt;
+  int64_t live_count, live_bytes;
+  uint64_t total_count, total_bytes;
+  void *pcs[PROF_MAX_DEPTH];
+};
+
+struct prof_live {
+  void *ptr;
+  uint64_t size;
+  struct prof_stack *stack;
+};
+
+uint64_t ph_mem_prof_rate = 0;
+uint32_t ph_mem_prof_live = 0;
+
+static ck_spinlock_t prof_lock = CK_SPINLOCK_INITIALIZER;
+static struct prof_stack *stacks = NULL;
+static uint32_t num_stacks = 0;
+static struct prof_live *live = NULL;
+static uint64_t dropped = 0;
+static uint16_t filter[PROF_FILTER_SIZE];
+
+static inline uint32_t ptr_hash(void *ptr)
+{
+  uintptr_t p = (uintptr_t)ptr;
+
+  p ^= p >> 33;
+  p *= 0xff51afd7ed558ccdULL;
+  p ^= p >> 33;
+  return (uint32_t)p;
+}
+
+static uint32_t stack_hash(void **pcs, uint32_t depth, ph_memtype_t mt)
+{
+  uint32_t h = 2166136261U ^ (uint32_t)mt;
+  uint32_t i;
+
+  for (i = 0; i < depth; i++) {
+    h = (h ^ ptr_hash(pcs[i])) * 16777619U;
+  }
+  return h;
+}
+
+// Returns the number of bytes until the next sample.  This is
+// -ln(u) * rate for uniform u, with a piecewise linear log2 that is
+// good to within a few percent and avoids depending on libm
+static int64_t next_sample(ph_thread_t *me, uint64_t rate)
+{
+  uint64_t x = me->mem_prof_seed;
+  uint64_t q;
+  uint32_t e;
+  double lg;
+
+  // xorshift64*
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  me->mem_prof_seed = x;
+  q = ((x * 2685821657736338717ULL) >> 38) + 1;
+
+  e = 63 - __builtin_clzll(q);
+  lg = e + ((double)q / (double)(1ULL << e) - 1.0);
+
+  return (int64_t)((26.0 - lg) * 0.6931471805599453 * rate) + 1;
+}
+
+static struct prof_stack *find_stack(void **pcs, uint32_t depth,
+    ph_memtype_t mt)
+{
+  uint32_t h = stack_hash(pcs, depth, mt);
+  uint32_t i, pos;
+  struct prof_stack *st;
+
+  for (i = 0; i < PROF_STACK_BUCKETS; i++) {
+    pos = (h + i) & (PROF_STACK_BUCKETS - 1);
+    st = &stacks[pos];
+
+    if (st->depth == 0) {
+      // Keep some headroom so that probe sequences stay short
+      if (num_stacks >= PROF_STACK_BUCKETS * 3 / 4) {
+        return NULL;
+      }
+      st->hash = h;
+      st->depth = depth;
+      st->mt = mt;
+      memcpy(st->pcs, pcs, depth * sizeof(void*));
+      num_stacks++;
+      return st;
+    }
+    if (st->hash == h && st->depth == depth && st->mt == mt &&
+        !memcmp(st->pcs, pcs, depth * sizeof(void*))) {
+      return st;
+    }
+  }
+  return NULL;
+}
+
+static bool live_insert(void *ptr, uint64_t size, struct prof_stack *st)
+{
+  uint32_t pos = ptr_hash(ptr) & (PROF_LIVE_BUCKETS - 1);
+
+  if (ph_mem_prof_live >= PROF_LIVE_BUCKETS * 3 / 4) {
+    return false;
+  }
+  while (live[pos].ptr) {
+    pos = (pos + 1) & (PROF_LIVE_BUCKETS - 1);
+  }
+  live[pos].ptr = ptr;
+  live[pos].size = size;
+  live[pos].stack = st;
+  ck_pr_store_32(&ph_mem_prof_live, ph_mem_prof_live + 1);
+  return true;
+}
+
+// Linear probing with backward shift deletion, so there are no tombstones.
+// Returns the stack that ptr was sampled with, or NULL.
+static struct prof_stack *live_remove(void *ptr, uint64_t *size)
+{
+  uint32_t pos = ptr_hash(ptr) & (PROF_LIVE_BUCKETS - 1);
+  uint32_t next, home;
+  struct prof_stack *st;
+
+  while (live[pos].ptr != ptr) {
+    if (!live[pos].ptr) {
+      return NULL;
+    }
+    pos = (pos + 1) & (PROF_LIVE_BUCKETS - 1);
+  }
+
+  st = live[pos].stack;
+  *size = live[pos].size;
+  st->live_count--;
+  st->live_bytes -= live[pos].size;
+
+  next = pos;
+  while (1) {
+    next = (next + 1) & (PROF_LIVE_BUCKETS - 1);
+    if (!live[next].ptr) {
+      break;
+    }
+    home = ptr_hash(live[next].ptr) & (PROF_LIVE_BUCKETS - 1);
+    // Move it into the hole unless its home lies cyclically in (pos, next]
+    if (((next - home) & (PROF_LIVE_BUCKETS - 1)) >=
+        ((next - pos) & (PROF_LIVE_BUCKETS - 1))) {
+      live[pos] = live[next];
+      pos = next;
+    }
+  }
+  live[pos].ptr = NULL;
+  ck_pr_store_32(&ph_mem_prof_live, ph_mem_prof_live - 1);
+  return st;
+}
+
+static void record_sample(ph_memtype_t mt, void *ptr, uint64_t size,
+    void **pcs, uint32_t depth)
+{
+  struct prof_stack *st;
+
+  ck_spinlock_lock(&prof_lock);
+  if (ph_unlikely(!stacks)) {
+    stacks = calloc(PROF_STACK_BUCKETS, sizeof(*stacks));
+    live = calloc(PROF_LIVE_BUCKETS, sizeof(*live));
+    if (!stacks || !live) {
+      free(stacks);
+      free(live);
+      stacks = NULL;
+      live = NULL;
+      dropped++;
+      ck_spinlock_unlock(&prof_lock);
+      return;
+    }
+  }
+
+  st = find_stack(pcs, depth, mt);
+  if (st) {
+    st->total_count++;
+    st->total_bytes += size;
+    if (live_insert(ptr, size, st)) {
+      st->live_count++;
+      st->live_bytes += size;
+      ck_pr_inc_16(&filter[ptr_hash(ptr) % PROF_FILTER_SIZE]);
+    } else {
+      dropped++;
+    }
+  } else {
+    dropped++;
+  }
+  ck_spinlock_unlock(&prof_lock);
+}
+
+void ph_mem_prof_sample(ph_memtype_t mt, void *ptr, uint64_t size)
+{
+  ph_thread_t *me = ph_thread_self();
+  uint64_t rate = ck_pr_load_64(&ph_mem_prof_rate);
+  void *pcs[PROF_MAX_DEPTH + PROF_SKIP_FRAMES];
+  uint32_t depth = 0;
+
+  if (ph_unlikely(me->mem_prof_seed == 0)) {
+    me->mem_prof_seed = ((uint64_t)me->tid << 32) ^ (uintptr_t)me ^
+      (uint64_t)ph_time_now().tv_usec;
+    if (!me->mem_prof_seed) {
+      me->mem_prof_seed = 1;
+    }
+    me->mem_prof_countdown = next_sample(me, rate);
+  }
+
+  me->mem_prof_countdown -= size;
+  if (ph_likely(me->mem_prof_countdown > 0)) {
+    return;
+  }
+  me->mem_prof_countdown = next_sample(me, rate);
+
+  // Capture the stack here rather than in record_sample, as the latter
+  // may be turned into a tail call and throw off the frame count
+#if defined(HAVE_BACKTRACE)
+  {
+    int n = backtrace(pcs, sizeof(pcs)/sizeof(pcs[0]));
+
+    if (n > PROF_SKIP_FRAMES) {
+      depth = n - PROF_SKIP_FRAMES;
+      memmove(pcs, pcs + PROF_SKIP_FRAMES, depth * sizeof(void*));
+    }
+  }
+#endif
+  if (depth == 0) {
+    pcs[0] = __builtin_return_address(0);
+    depth = 1;
+  }
+
+  record_sample(mt, ptr, size, pcs, depth);
+}
+
+struct prof_stack *ph_mem_prof_take(void *ptr, uint64_t *size)
+{
+  uint32_t slot = ptr_hash(ptr) % PROF_FILTER_SIZE;
+  struct prof_stack *st = NULL;
+
+  if (ph_likely(ck_pr_load_16(&filter[slot]) == 0)) {
+    return NULL;
+  }
+
+  ck_spinlock_lock(&prof_lock);
+  if (live) {
+    st = live_remove(ptr, size);
+    if (st) {
+      ck_pr_dec_16(&filter[slot]);
+    }
+  }
+  ck_spinlock_unlock(&prof_lock);
+  return st;
+}
+
+void ph_mem_prof_forget(void *ptr)
+{
+  uint64_t size;
+
+  ph_mem_prof_take(ptr, &size);
+}
+
+void ph_mem_prof_restore(void *ptr, uint64_t size, struct prof_stack *st)
+{
+  ck_spinlock_lock(&prof_lock);
+  // Another thread may have taken the last free slot in the meantime
+  if (live_insert(ptr, size, st)) {
+    st->live_count++;
+    st->live_bytes += size;
+    ck_pr_inc_16(&filter[ptr_hash(ptr) % PROF_FILTER_SIZE]);
+  } else {
+    dropped++;
+  }
+  ck_spinlock_unlock(&prof_lock);
+}
+
+void ph_mem_prof_set_rate(uint64_t rate)
+{
+  ck_pr_store_64(&ph_mem_prof_rate, rate);
+}
+
+uint64_t ph_mem_prof_get_rate(void)
+{
+  return ck_pr_load_64(&ph_mem_prof_rate);
+}
+
+void ph_mem_prof_configure(void)
+{
+  int64_t rate = ph_config_query_int("$.memory.sample_rate", -1);
+
+  if (rate >= 0) {
+    ph_mem_prof_set_rate(rate);
+  }
+}
+
+bool ph_mem_prof_dump(ph_stream_t *stm)
+{
+  struct prof_stack *snap = NULL;
+  uint32_t i, j, n = 0;
+  int64_t live_count = 0, live_bytes = 0;
+  uint64_t total_count = 0, total_bytes = 0, ndropped;
+  ph_mem_stats_t stats;
+  ph_stream_t *maps;
+
+  // Copy the table out so that we don't hold the lock while we write
+  // to the stream, which will allocate
+  ck_spinlock_lock(&prof_lock);
+  ndropped = dropped;
+  if (num_stacks) {
+    snap = malloc(num_stacks * sizeof(*snap));
+    if (!snap) {
+      ck_spinlock_unlock(&prof_lock);
+      return false;
+    }
+    for (i = 0; i < PROF_STACK_BUCKETS; i++) {
+      if (stacks[i].depth) {
+        snap[n++] = stacks[i];
+      }
+    }
+  }
+  ck_spinlock_unlock(&prof_lock);
+
+  for (i = 0; i < n; i++) {
+    live_count += snap[i].live_count;
+    live_bytes += snap[i].live_bytes;
+    total_count += snap[i].total_count;
+    total_bytes += snap[i].total_bytes;
+  }
+
+  ph_stm_printf(stm,
+      "heap profile: %" PRIi64 ": %" PRIi64 " [%" PRIu64 ": %" PRIu64 "]"
+      " @ heap_v2/%" PRIu64 "\n",
+      live_count, live_bytes, total_count, total_bytes,
+      ph_mem_prof_get_rate());
+  ph_stm_printf(stm, "# dropped samples: %" PRIu64 "\n", ndropped);
+
+  for (i = 0; i < n; i++) {
+    if (ph_mem_stat(snap[i].mt, &stats)) {
+      ph_stm_printf(stm, "# %s/%s\n",
+          stats.def->facility, stats.def->name);
+    }
+    ph_stm_printf(stm,
+        "%" PRIi64 ": %" PRIi64 " [%" PRIu64 ": %" PRIu64 "] @",
+        snap[i].live_count, snap[i].live_bytes,
+        snap[i].total_count, snap[i].total_bytes);
+    for (j = 0; j < snap[i].depth; j++) {
+      ph_stm_printf(stm, " 0x%" PRIxPTR, (uintptr_t)snap[i].pcs[j]);
+    }
+    ph_stm_printf(stm, "\n");
+  }
+  free(snap);
+
+  // pprof needs this to resolve the addresses to symbols
+  ph_stm_printf(stm, "\nMAPPED_LIBRARIES:\n");
+  maps = ph_stm_file_open("/proc/self/maps", O_RDONLY, 0);
+  if (maps) {
+    ph_stm_copy(maps, stm, PH_STREAM_READ_ALL, NULL, NULL);
+    ph_stm_close(maps);
+  }
+
+  return true;
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -0,0 +1,47 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CORELIB_MEMPROF_H
+#define CORELIB_MEMPROF_H
+
+// Mean number of bytes between heap profile samples; 0 when disabled
+extern uint64_t ph_mem_prof_rate;
+// Number of sampled allocations that have not yet been freed
+extern uint32_t ph_mem_prof_live;
+
+// Called after each successful allocation while ph_mem_prof_rate is set
+void ph_mem_prof_sample(ph_memtype_t mt, void *ptr, uint64_t size);
+
+// Called before each free while ph_mem_prof_live is non-zero
+void ph_mem_prof_forget(void *ptr);
+
+struct prof_stack;
+
+// Like ph_mem_prof_forget(), but returns the stack that ptr was sampled
+// with and its size, or NULL if it was not sampled.  For ph_mem_realloc(),
+// which has to forget the block before realloc() may hand it out again.
+struct prof_stack *ph_mem_prof_take(void *ptr, uint64_t *size);
+
+// Puts back a sample taken by ph_mem_prof_take() when realloc() failed
+void ph_mem_prof_restore(void *ptr, uint64_t size, struct prof_stack *st);
+
+// Applies $.memory.sample_rate from the configuration
+void ph_mem_prof_configure(void);
+
+#endif
+
+/* vim:ts=2:sw=2:et:
+ */
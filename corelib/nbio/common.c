@@ -21,6 +21,7 @@
 #include "phenom/counter.h"
 #include "phenom/configuration.h"
 #include "corelib/job.h"
+#include "corelib/lockprof.h"
 #include <ck_epoch.h>
 
 #ifdef USE_GIMLI
@@ -29,7 +30,8 @@ GIMLI_DECLARE_TRACER_MODULE("gimli_libphenom");
 #endif
 
 static ph_memtype_def_t ajob_def = {
-  "nbio", "affine_job", sizeof(struct ph_nbio_affine_job), PH_MEM_FLAGS_ZERO
+  "nbio", "affine_job", sizeof(struct ph_nbio_affine_job),
+  PH_MEM_FLAGS_ZERO|PH_MEM_FLAGS_SLAB
 };
 static ph_memtype_t mt_ajob;
 static ph_counter_scope_t *counter_scope = NULL;
@@ -182,7 +184,8 @@ void ph_nbio_process_affine_jobs(struct ph_nbio_emitter *emitter)
     ph_nbio_affine_job_stailq_t list;
 
     PH_STAILQ_INIT(&list);
-    ck_rwlock_write_lock(&emitter->wheel.lock);
+    ph_rwlock_write_lock(&emitter->wheel.lock,
+        &ph_timerwheel_lock_class);
     PH_STAILQ_SWAP(&list, &emitter->affine_jobs, ph_nbio_affine_job);
     ck_rwlock_write_unlock(&emitter->wheel.lock);
 
@@ -212,7 +215,8 @@ ph_result_t ph_nbio_queue_affine_func(uint32_t emitter_affinity,
   ajob->arg = arg;
 
   emitter = emitter_for_affinity(emitter_affinity);
-  ck_rwlock_write_lock(&emitter->wheel.lock);
+  ph_rwlock_write_lock(&emitter->wheel.lock,
+        &ph_timerwheel_lock_class);
   need_ping = PH_STAILQ_EMPTY(&emitter->affine_jobs);
   PH_STAILQ_INSERT_TAIL(&emitter->affine_jobs, ajob, ent);
   ck_rwlock_write_unlock(&emitter->wheel.lock);
@@ -132,6 +132,7 @@ void ph_nbio_emitter_run(struct ph_nbio_emitter *emitter, ph_thread_t *thread)
     }
 
     if (n == 0) {
+      ph_mem_thread_idle(thread);
       continue;
     }
 
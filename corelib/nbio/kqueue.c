@@ -143,6 +143,9 @@ void ph_nbio_emitter_run(struct ph_nbio_emitter *emitter, ph_thread_t *thread)
     }
 
     if (n <= 0) {
+      if (n == 0) {
+        ph_mem_thread_idle(thread);
+      }
       ph_job_collector_emitter_call(emitter);
       ph_thread_epoch_poll();
       continue;
@@ -76,6 +76,7 @@ void ph_nbio_emitter_run(struct ph_nbio_emitter *emitter, ph_thread_t *thread)
     }
 
     if (!n) {
+      ph_mem_thread_idle(thread);
       ph_job_collector_emitter_call(emitter);
       ph_thread_epoch_poll();
       continue;
@@ -46,7 +46,8 @@ struct resolve_and_connect {
 
 static ph_memtype_def_t defs[] = {
   { "socket", "connect_job", sizeof(struct connect_job), PH_MEM_FLAGS_ZERO },
-  { "socket", "sock", sizeof(ph_sock_t), PH_MEM_FLAGS_ZERO },
+  { "socket", "sock", sizeof(ph_sock_t),
+    PH_MEM_FLAGS_ZERO|PH_MEM_FLAGS_SLAB },
   { "socket", "resolve_and_connect",
     sizeof(struct resolve_and_connect), PH_MEM_FLAGS_ZERO },
 };
@@ -380,6 +381,8 @@ void ph_socket_connect(ph_socket_t s, const ph_sockaddr_t *addr,
 }
 
 #define MAX_SOCK_BUFFER_SIZE 128*1024
+static ph_config_handle_t max_buffer_size =
+  PH_CONFIG_HANDLE_INIT("$.socket.max_buffer_size");
 
 static bool sock_stm_close(ph_stream_t *stm)
 {
@@ -487,8 +490,7 @@ ph_sock_t *ph_sock_new_from_socket(ph_socket_t s, const ph_sockaddr_t *sockname,
 
   sock->free_ssl_ctx = true;
 
-  max_buf = ph_config_query_int("$.socket.max_buffer_size",
-              MAX_SOCK_BUFFER_SIZE);
+  max_buf = ph_config_handle_int(&max_buffer_size, MAX_SOCK_BUFFER_SIZE);
 
   sock->wbuf = ph_bufq_new(max_buf);
   if (!sock->wbuf) {
@@ -745,8 +747,8 @@ void ph_sock_openssl_enable(ph_sock_t *sock, SSL *ssl,
   sock->ssl_stream = ph_stm_ssl_open(ssl);
   SSL_set_mode(ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 
-  sock->sslwbuf = ph_bufq_new(ph_config_query_int(
-        "$.socket.max_buffer_size", MAX_SOCK_BUFFER_SIZE));
+  sock->sslwbuf = ph_bufq_new(ph_config_handle_int(&max_buffer_size,
+        MAX_SOCK_BUFFER_SIZE));
   sock->handshake_cb = handshake_cb;
   if (handshake_cb) {
     SSL_set_info_callback(ssl, ssl_info_callback);
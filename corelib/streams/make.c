@@ -18,6 +18,7 @@
 #include "phenom/stream.h"
 #include "phenom/log.h"
 #include <pthread.h>
+#include "corelib/lockprof.h"
 
 static ph_memtype_t mt_stm;
 static ph_memtype_def_t stm_def = {
@@ -25,10 +26,13 @@ static ph_memtype_def_t stm_def = {
 };
 
 static pthread_mutexattr_t mtx_attr;
+static struct ph_lock_class stm_lock_class = PH_LOCK_CLASS_INIT("stream");
 
 void ph_stm_lock(ph_stream_t *stm)
 {
-  int res = pthread_mutex_lock(&stm->lock);
+  int res;
+
+  ph_mutex_lock(&stm->lock, &stm_lock_class, res);
   if (ph_unlikely(res != 0)) {
     ph_panic("ph_stm_lock: `Pe%d", res);
   }
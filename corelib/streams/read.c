@@ -82,6 +82,53 @@ bool ph_stm_readahead(ph_stream_t *stm, uint64_t count)
   return true;
 }
 
+bool ph_stm_peek(ph_stream_t *stm, const void **buf, uint64_t *len)
+{
+  if (!stm->bufsize) {
+    stm->last_err = EINVAL;
+    errno = EINVAL;
+    return false;
+  }
+
+  if (!ph_stm_flush(stm)) {
+    return false;
+  }
+
+  ph_stm_lock(stm);
+  stm->last_err = 0;
+
+  if (stm->rpos == stm->rend) {
+    // Nothing buffered; start over at the front of the buffer
+    struct iovec vec = {
+      .iov_base = stm->buf,
+      .iov_len = stm->bufsize
+    };
+    uint64_t nread;
+
+    stm->rpos = stm->rend = stm->buf;
+    if (!stm->funcs->readv(stm, &vec, 1, &nread)) {
+      stm->rpos = stm->rend = 0;
+      ph_stm_unlock(stm);
+      errno = ph_stm_errno(stm);
+      return false;
+    }
+    stm->rend += nread;
+  }
+
+  *buf = stm->rpos;
+  *len = stm->rend - stm->rpos;
+
+  ph_stm_unlock(stm);
+  return true;
+}
+
+void ph_stm_consume(ph_stream_t *stm, uint64_t count)
+{
+  ph_stm_lock(stm);
+  stm->rpos += MIN((uint64_t)(stm->rend - stm->rpos), count);
+  ph_stm_unlock(stm);
+}
+
 bool ph_stm_read(ph_stream_t *stm, void *buf, uint64_t count, uint64_t *nread)
 {
   int64_t res = 0;
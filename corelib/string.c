@@ -17,16 +17,33 @@
 #include "phenom/string.h"
 #include "phenom/sysutil.h"
 #include "phenom/printf.h"
+#include "phenom/cht.h"
 #include <ctype.h>
 
 static ph_memtype_t mt_string = PH_MEMTYPE_INVALID;
 static ph_memtype_def_t string_def = {
-  "string", "string", sizeof(ph_string_t), 0
+  "string", "string", sizeof(ph_string_t), PH_MEM_FLAGS_SLAB
+};
+static ph_memtype_t mt_intern = PH_MEMTYPE_INVALID;
+static ph_memtype_def_t intern_def = {
+  "string", "intern", 0, 0
+};
+
+/* Interned strings, keyed and valued by themselves, so that looking
+ * one up by its contents finds the shared instance */
+static ph_cht_t interned;
+static struct ph_ht_val_def intern_val_def = {
+  sizeof(ph_string_t*), NULL, NULL
 };
 
 static void do_string_init(void)
 {
   mt_string = ph_memtype_register(&string_def);
+  mt_intern = ph_memtype_register(&intern_def);
+  if (ph_cht_init(&interned, 1024, &ph_ht_string_key_def,
+        &intern_val_def) != PH_OK) {
+    ph_panic("failed to init interned string table");
+  }
 }
 
 PH_LIBRARY_INIT(do_string_init, 0)
@@ -38,6 +55,7 @@ void ph_string_init_slice(ph_string_t *str,
   str->slice = slice;
   str->mt = PH_MEMTYPE_INVALID;
   str->onstack = true;
+  str->interned = false;
   str->buf = slice->buf + start;
   str->len = len;
   str->alloc = len;
@@ -74,6 +92,7 @@ void ph_string_init_claim(ph_string_t *str,
   str->slice = 0;
   str->mt = mt;
   str->onstack = true;
+  str->interned = false;
 }
 
 ph_string_t *ph_string_make_claim(ph_memtype_t mt,
@@ -93,6 +112,7 @@ ph_string_t *ph_string_make_claim(ph_memtype_t mt,
   str->slice = 0;
   str->mt = mt;
   str->onstack = false;
+  str->interned = false;
 
   return str;
 }
@@ -128,9 +148,30 @@ ph_string_t *ph_string_make_copy(ph_memtype_t mt,
   return str;
 }
 
+ph_string_t *ph_string_make_arena(ph_arena_t *arena,
+    const char *buf, uint32_t len)
+{
+  ph_string_t *str;
+  char *sbuf;
+
+  str = ph_arena_alloc(arena, sizeof(*str) + len + 1);
+  if (!str) {
+    return NULL;
+  }
+
+  sbuf = (char*)(str + 1);
+  memcpy(sbuf, buf, len);
+  sbuf[len] = '\0';
+
+  // Static and "on stack" so that the final delref is a no-op;
+  // the arena owns the storage
+  ph_string_init_claim(str, PH_STRING_STATIC, sbuf, len, len + 1);
+  return str;
+}
+
 void ph_string_delref(ph_string_t *str)
 {
-  if (!ph_refcnt_del(&str->ref)) {
+  if (str->interned || !ph_refcnt_del(&str->ref)) {
     return;
   }
 
@@ -214,7 +255,8 @@ bool ph_string_equal(const ph_string_t *a, const ph_string_t *b)
   if (a == b) {
     return true;
   }
-  if (a->len != b->len) {
+  // There is only one interned string with any given contents
+  if (a->len != b->len || (a->interned && b->interned)) {
     return false;
   }
   return memcmp(a->buf, b->buf, a->len) == 0;
@@ -483,6 +525,62 @@ bool _ph_string_nul_terminated(ph_string_t *str) {
   return false;
 }
 
+static ph_string_t *intern_find(ph_string_t *key)
+{
+  ph_string_t **strp;
+
+  ph_thread_epoch_begin();
+  strp = ph_cht_get(&interned, &key);
+  ph_thread_epoch_end();
+
+  // Interned strings are never freed, so this remains valid
+  // after we leave the epoch
+  return strp ? *strp : NULL;
+}
+
+ph_string_t *ph_string_intern(const char *buf, uint32_t len)
+{
+  ph_string_t key, *str;
+  ph_result_t res;
+  char *sbuf;
+
+  if (len > PH_STRING_INTERN_MAX_LEN) {
+    return NULL;
+  }
+
+  ph_string_init_claim(&key, PH_STRING_STATIC, (char*)buf, len, len);
+  str = intern_find(&key);
+  if (str) {
+    return str;
+  }
+  if (ph_cht_size(&interned) >= PH_STRING_INTERN_MAX_COUNT) {
+    return NULL;
+  }
+
+  str = ph_mem_alloc_size(mt_intern, sizeof(*str) + len + 1);
+  if (!str) {
+    return NULL;
+  }
+  sbuf = (char*)(str + 1);
+  memcpy(sbuf, buf, len);
+  sbuf[len] = '\0';
+
+  // Static and "on stack", like an arena string, in case anything
+  // finds a way to release it
+  ph_string_init_claim(str, PH_STRING_STATIC, sbuf, len, len + 1);
+  str->hval = ph_ht_string_key_def.hash_func(&str);
+  str->interned = true;
+
+  res = ph_cht_insert(&interned, &str, &str, PH_HT_NO_REPLACE|PH_HT_CLAIM);
+  if (res == PH_OK) {
+    return str;
+  }
+
+  // Another thread got there first, or we are out of memory
+  ph_mem_free(mt_intern, str);
+  return res == PH_EXISTS ? intern_find(&key) : NULL;
+}
+
 /* vim:ts=2:sw=2:et:
  */
 
@@ -71,6 +71,11 @@ static void destroy_thread(void *ptr)
 {
   ph_thread_t *thr = ptr;
 
+  // Give any cached slab items back so that other threads can use them,
+  // and let go of the counter blocks that are about to be folded
+  ph_mem_flush_thread(thr);
+  // Fold our counters into the scope totals and release the blocks
+  ph_counter_fold_thread(thr);
   ck_epoch_unregister(&thr->epoch_record);
 
 #ifdef HAVE___THREAD
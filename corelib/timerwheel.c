@@ -15,6 +15,12 @@
  */
 
 #include "phenom/timerwheel.h"
+#include "corelib/lockprof.h"
+
+// shared with the nbio emitters, which also guard their affine job
+// queues with the wheel lock
+struct ph_lock_class ph_timerwheel_lock_class =
+  PH_LOCK_CLASS_INIT("timerwheel");
 
 static inline void tval_add_res(ph_timerwheel_t *wheel,
     struct timeval *op1, struct timeval *res)
@@ -103,7 +109,7 @@ ph_result_t ph_timerwheel_enable(
   }
 
   if (ck_pr_load_ptr(&timer->list)) {
-    ck_rwlock_read_lock(&wheel->lock);
+    ph_rwlock_read_lock(&wheel->lock, &ph_timerwheel_lock_class);
     {
       list = compute_list(wheel, timer);
       if (list == timer->list) {
@@ -118,7 +124,7 @@ ph_result_t ph_timerwheel_enable(
   // Need to recompute as the time may have changed since
   // we released the reader and obtained the writer lock
 
-  ck_rwlock_write_lock(&wheel->lock);
+  ph_rwlock_write_lock(&wheel->lock, &ph_timerwheel_lock_class);
   {
     if (timer->list) {
       PH_LIST_REMOVE(timer, t);
@@ -149,7 +155,7 @@ ph_result_t ph_timerwheel_remove(
     return res;
   }
 
-  ck_rwlock_write_lock(&wheel->lock);
+  ph_rwlock_write_lock(&wheel->lock, &ph_timerwheel_lock_class);
   {
     PH_LIST_REMOVE(timer, t);
     ck_pr_store_ptr(&timer->list, 0);
@@ -210,7 +216,7 @@ uint32_t ph_timerwheel_tick(
 
   PH_LIST_INIT(&list);
 
-  ck_rwlock_write_lock(&wheel->lock);
+  ph_rwlock_write_lock(&wheel->lock, &ph_timerwheel_lock_class);
   {
     if (nowtick <= tick) {
       idx = nowtick & PHENOM_WHEEL_MASK;
@@ -0,0 +1,786 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phenom/bser.h"
+#include "phenom/sysutil.h"
+#include "phenom/memory.h"
+#include "phenom/printf.h"
+#include "corelib/variant/out.h"
+
+/* BSER, as spoken by Watchman.  Every value starts with a type byte;
+ * integers follow it in the smallest of 1, 2, 4 or 8 bytes that holds
+ * them, little endian, and lengths and counts are encoded as integers.
+ * The encoder sizes the whole value first, so that the PDU length can
+ * be written before it, and then renders it in one pass. */
+
+#define BSER_ARRAY    0x00
+#define BSER_OBJECT   0x01
+#define BSER_STRING   0x02
+#define BSER_INT8     0x03
+#define BSER_INT16    0x04
+#define BSER_INT32    0x05
+#define BSER_INT64    0x06
+#define BSER_REAL     0x07
+#define BSER_TRUE     0x08
+#define BSER_FALSE    0x09
+#define BSER_NULL     0x0a
+#define BSER_TEMPLATE 0x0b
+#define BSER_SKIP     0x0c
+#define BSER_UTF8     0x0d
+
+// Version 2 headers carry 4 bytes of capabilities before the length
+#define BSER_MAX_HEADER (2 + 4 + 9)
+
+// Deeper than any sane document; keeps a hostile peer off our stack
+#define BSER_MAX_DEPTH 1024
+
+static ph_memtype_t mt_bser;
+static struct ph_memtype_def def = {
+  "variant", "bser", 0, 0
+};
+
+static void init_bser(void)
+{
+  mt_bser = ph_memtype_register(&def);
+}
+PH_LIBRARY_INIT(init_bser, 0)
+
+static inline uint32_t int_width(uint8_t type)
+{
+  switch (type) {
+    case BSER_INT8:  return 1;
+    case BSER_INT16: return 2;
+    case BSER_INT32: return 4;
+    case BSER_INT64: return 8;
+    default:         return 0;
+  }
+}
+
+static inline uint64_t get_le(const uint8_t *p, uint32_t n)
+{
+  uint64_t v = 0;
+
+  while (n-- > 0) {
+    v = (v << 8) | p[n];
+  }
+  return v;
+}
+
+static inline int64_t get_int(const uint8_t *p, uint32_t n)
+{
+  uint64_t v = get_le(p, n);
+
+  switch (n) {
+    case 1:  return (int8_t)v;
+    case 2:  return (int16_t)v;
+    case 4:  return (int32_t)v;
+    default: return (int64_t)v;
+  }
+}
+
+static inline uint32_t int_size(int64_t v)
+{
+  if (v >= INT8_MIN && v <= INT8_MAX) {
+    return 2;
+  }
+  if (v >= INT16_MIN && v <= INT16_MAX) {
+    return 3;
+  }
+  if (v >= INT32_MIN && v <= INT32_MAX) {
+    return 5;
+  }
+  return 9;
+}
+
+/*** encoder ***/
+
+static int put_byte(struct ph_var_out *out, uint8_t type)
+{
+  uint8_t *p = (uint8_t*)ph_var_out_reserve(out, 1);
+
+  if (!p) {
+    return -1;
+  }
+  *p = type;
+  out->len++;
+  return 0;
+}
+
+static int put_int(struct ph_var_out *out, int64_t v)
+{
+  uint8_t *p = (uint8_t*)ph_var_out_reserve(out, 9);
+  uint64_t u = (uint64_t)v;
+  uint32_t n = int_size(v), i;
+
+  if (!p) {
+    return -1;
+  }
+  switch (n) {
+    case 2:  p[0] = BSER_INT8; break;
+    case 3:  p[0] = BSER_INT16; break;
+    case 5:  p[0] = BSER_INT32; break;
+    default: p[0] = BSER_INT64; break;
+  }
+  for (i = 1; i < n; i++) {
+    p[i] = (uint8_t)u;
+    u >>= 8;
+  }
+  out->len += n;
+  return 0;
+}
+
+static int put_real(struct ph_var_out *out, double dval)
+{
+  uint8_t *p = (uint8_t*)ph_var_out_reserve(out, 9);
+  uint64_t u;
+  uint32_t i;
+
+  if (!p) {
+    return -1;
+  }
+  memcpy(&u, &dval, sizeof(u));
+  p[0] = BSER_REAL;
+  for (i = 1; i < 9; i++) {
+    p[i] = (uint8_t)u;
+    u >>= 8;
+  }
+  out->len += 9;
+  return 0;
+}
+
+static int put_string(struct ph_var_out *out, ph_string_t *str)
+{
+  if (put_byte(out, BSER_STRING) || put_int(out, str->len)) {
+    return -1;
+  }
+  return ph_var_out_write(out, str->buf, str->len);
+}
+
+static uint64_t value_size(ph_variant_t *var)
+{
+  ph_string_t *key;
+  ph_variant_t *val;
+  ph_ht_iter_t iter;
+  uint64_t size;
+  uint32_t i, n;
+
+  switch (ph_var_type(var)) {
+    case PH_VAR_INTEGER:
+      return int_size(ph_var_int_val(var));
+
+    case PH_VAR_REAL:
+      return 9;
+
+    case PH_VAR_STRING:
+      n = ph_var_string_val(var)->len;
+      return 1 + int_size(n) + n;
+
+    case PH_VAR_ARRAY:
+      n = ph_var_array_size(var);
+      size = 1 + int_size(n);
+      for (i = 0; i < n; i++) {
+        size += value_size(ph_var_array_get(var, i));
+      }
+      return size;
+
+    case PH_VAR_OBJECT:
+      n = ph_var_object_size(var);
+      size = 1 + int_size(n);
+      if (ph_var_object_iter_first(var, &iter, &key, &val)) do {
+        size += 1 + int_size(key->len) + key->len + value_size(val);
+      } while (ph_var_object_iter_next(var, &iter, &key, &val));
+      return size;
+
+    default:
+      return 1;
+  }
+}
+
+static int encode(struct ph_var_out *out, ph_variant_t *var)
+{
+  ph_string_t *key;
+  ph_variant_t *val;
+  ph_ht_iter_t iter;
+  uint32_t i, n;
+
+  switch (ph_var_type(var)) {
+    case PH_VAR_NULL:
+      return put_byte(out, BSER_NULL);
+
+    case PH_VAR_TRUE:
+      return put_byte(out, BSER_TRUE);
+
+    case PH_VAR_FALSE:
+      return put_byte(out, BSER_FALSE);
+
+    case PH_VAR_INTEGER:
+      return put_int(out, ph_var_int_val(var));
+
+    case PH_VAR_REAL:
+      return put_real(out, ph_var_double_val(var));
+
+    case PH_VAR_STRING:
+      return put_string(out, ph_var_string_val(var));
+
+    case PH_VAR_ARRAY:
+      n = ph_var_array_size(var);
+      if (put_byte(out, BSER_ARRAY) || put_int(out, n)) {
+        return -1;
+      }
+      for (i = 0; i < n; i++) {
+        if (encode(out, ph_var_array_get(var, i))) {
+          return -1;
+        }
+      }
+      return 0;
+
+    case PH_VAR_OBJECT:
+      n = ph_var_object_size(var);
+      if (put_byte(out, BSER_OBJECT) || put_int(out, n)) {
+        return -1;
+      }
+      if (ph_var_object_iter_first(var, &iter, &key, &val)) do {
+        if (put_string(out, key) || encode(out, val)) {
+          return -1;
+        }
+      } while (ph_var_object_iter_next(var, &iter, &key, &val));
+      return 0;
+
+    default:
+      /* not reached */
+      return -1;
+  }
+}
+
+static ph_result_t dump_to(ph_variant_t *var, ph_string_t *str,
+    ph_stream_t *stm, ph_bufq_t *q)
+{
+  static const uint8_t magic[2] = { 0x00, 0x01 };
+  struct ph_var_out out;
+
+  ph_var_out_init(&out, str, stm, q);
+  if (ph_var_out_write(&out, magic, sizeof(magic)) ||
+      put_int(&out, value_size(var)) ||
+      encode(&out, var) || ph_var_out_flush(&out)) {
+    return PH_ERR;
+  }
+  return PH_OK;
+}
+
+ph_result_t ph_bser_dump_string(ph_variant_t *var, ph_string_t *str)
+{
+  return dump_to(var, str, NULL, NULL);
+}
+
+ph_result_t ph_bser_dump_bufq(ph_variant_t *var, ph_bufq_t *q)
+{
+  return dump_to(var, NULL, NULL, q);
+}
+
+ph_result_t ph_bser_dump_stream(ph_variant_t *var, ph_stream_t *stm)
+{
+  return dump_to(var, NULL, stm, NULL);
+}
+
+/*** decoder ***/
+
+struct in {
+  ph_string_t *src;
+  const uint8_t *start, *p, *end;
+  ph_var_err_t *err;
+  uint32_t depth;
+};
+
+static void error_init(ph_var_err_t *err)
+{
+  if (err) {
+    err->text[0] = '\0';
+    err->line = 0;
+    err->column = 0;
+    err->position = 0;
+    err->transient = false;
+  }
+}
+
+static void error_set(struct in *in, bool transient, const char *fmt, ...)
+{
+  va_list ap;
+
+  if (!in->err || in->err->text[0]) {
+    return;
+  }
+  in->err->transient = transient;
+  in->err->position = in->p - in->start;
+  va_start(ap, fmt);
+  ph_vsnprintf(in->err->text, sizeof(in->err->text), fmt, ap);
+  va_end(ap);
+}
+
+static inline bool need(struct in *in, uint64_t n)
+{
+  if ((uint64_t)(in->end - in->p) < n) {
+    error_set(in, false, "value runs past the end of the PDU");
+    return false;
+  }
+  return true;
+}
+
+static bool read_int(struct in *in, int64_t *val)
+{
+  uint32_t n;
+
+  if (!need(in, 1)) {
+    return false;
+  }
+  n = int_width(*in->p);
+  if (n == 0) {
+    error_set(in, false, "integer expected, found type 0x%02x", *in->p);
+    return false;
+  }
+  if (!need(in, 1 + n)) {
+    return false;
+  }
+  *val = get_int(in->p + 1, n);
+  in->p += 1 + n;
+  return true;
+}
+
+// Reads a length or count, which can't exceed the bytes that remain
+static bool read_len(struct in *in, uint32_t *len)
+{
+  int64_t val;
+
+  if (!read_int(in, &val)) {
+    return false;
+  }
+  if (val < 0 || val > in->end - in->p) {
+    error_set(in, false, "invalid length %" PRIi64, val);
+    return false;
+  }
+  *len = (uint32_t)val;
+  return true;
+}
+
+static ph_string_t *read_string(struct in *in)
+{
+  ph_string_t *str;
+  uint32_t len;
+
+  if (!need(in, 1)) {
+    return NULL;
+  }
+  if (*in->p != BSER_STRING && *in->p != BSER_UTF8) {
+    error_set(in, false, "string expected, found type 0x%02x", *in->p);
+    return NULL;
+  }
+  in->p++;
+  if (!read_len(in, &len)) {
+    return NULL;
+  }
+  str = ph_string_make_slice(in->src,
+      (const char*)in->p - in->src->buf, len);
+  if (!str) {
+    error_set(in, true, "out of memory");
+    return NULL;
+  }
+  in->p += len;
+  return str;
+}
+
+static ph_variant_t *decode(struct in *in);
+
+static ph_variant_t *decode_array(struct in *in)
+{
+  ph_variant_t *arr, *elem;
+  uint32_t n, i;
+
+  if (!read_len(in, &n)) {
+    return NULL;
+  }
+  arr = ph_var_array(n);
+  if (!arr) {
+    error_set(in, true, "out of memory");
+    return NULL;
+  }
+  for (i = 0; i < n; i++) {
+    elem = decode(in);
+    if (!elem) {
+      goto error;
+    }
+    if (ph_var_array_append_claim(arr, elem) != PH_OK) {
+      error_set(in, true, "out of memory");
+      ph_var_delref(elem);
+      goto error;
+    }
+  }
+  return arr;
+
+error:
+  ph_var_delref(arr);
+  return NULL;
+}
+
+static ph_variant_t *decode_object(struct in *in)
+{
+  ph_variant_t *obj, *val;
+  ph_string_t *key;
+  uint32_t n, i;
+
+  if (!read_len(in, &n)) {
+    return NULL;
+  }
+  obj = ph_var_object(n);
+  if (!obj) {
+    error_set(in, true, "out of memory");
+    return NULL;
+  }
+  for (i = 0; i < n; i++) {
+    key = read_string(in);
+    if (!key) {
+      goto error;
+    }
+    val = decode(in);
+    if (!val) {
+      ph_string_delref(key);
+      goto error;
+    }
+    if (ph_var_object_set_claim_kv(obj, key, val) != PH_OK) {
+      error_set(in, true, "out of memory");
+      ph_string_delref(key);
+      ph_var_delref(val);
+      goto error;
+    }
+  }
+  return obj;
+
+error:
+  ph_var_delref(obj);
+  return NULL;
+}
+
+/* A template is an array of objects with the same keys: the keys are
+ * sent once, as an array of strings, followed by the number of objects
+ * and then, for each object, a value or a skip marker for each key. */
+static ph_variant_t *decode_template(struct in *in)
+{
+  ph_variant_t *keys, *arr = NULL, *obj = NULL, *val;
+  ph_string_t *key;
+  uint32_t nkeys, n, i, k;
+
+  if (!need(in, 1)) {
+    return NULL;
+  }
+  if (*in->p != BSER_ARRAY) {
+    error_set(in, false, "template keys must be an array");
+    return NULL;
+  }
+  in->p++;
+  keys = decode_array(in);
+  if (!keys) {
+    return NULL;
+  }
+  nkeys = ph_var_array_size(keys);
+  for (k = 0; k < nkeys; k++) {
+    if (!ph_var_is_string(ph_var_array_get(keys, k))) {
+      error_set(in, false, "template keys must be strings");
+      goto error;
+    }
+  }
+
+  if (!read_len(in, &n)) {
+    goto error;
+  }
+  arr = ph_var_array(n);
+  if (!arr) {
+    error_set(in, true, "out of memory");
+    goto error;
+  }
+  for (i = 0; i < n; i++) {
+    obj = ph_var_object(nkeys);
+    if (!obj) {
+      error_set(in, true, "out of memory");
+      goto error;
+    }
+    for (k = 0; k < nkeys; k++) {
+      if (!need(in, 1)) {
+        goto error;
+      }
+      if (*in->p == BSER_SKIP) {
+        in->p++;
+        continue;
+      }
+      val = decode(in);
+      if (!val) {
+        goto error;
+      }
+      key = ph_var_string_val(ph_var_array_get(keys, k));
+      ph_string_addref(key);
+      if (ph_var_object_set_claim_kv(obj, key, val) != PH_OK) {
+        error_set(in, true, "out of memory");
+        ph_string_delref(key);
+        ph_var_delref(val);
+        goto error;
+      }
+    }
+    if (ph_var_array_append_claim(arr, obj) != PH_OK) {
+      error_set(in, true, "out of memory");
+      goto error;
+    }
+    obj = NULL;
+  }
+  ph_var_delref(keys);
+  return arr;
+
+error:
+  if (obj) {
+    ph_var_delref(obj);
+  }
+  if (arr) {
+    ph_var_delref(arr);
+  }
+  ph_var_delref(keys);
+  return NULL;
+}
+
+static ph_variant_t *decode(struct in *in)
+{
+  ph_variant_t *var = NULL;
+  ph_string_t *str;
+  uint64_t u;
+  double dval;
+  int64_t ival;
+  uint8_t type;
+
+  if (!need(in, 1)) {
+    return NULL;
+  }
+  if (++in->depth > BSER_MAX_DEPTH) {
+    error_set(in, false, "nesting too deep");
+    return NULL;
+  }
+
+  type = *in->p;
+  switch (type) {
+    case BSER_ARRAY:
+      in->p++;
+      var = decode_array(in);
+      break;
+
+    case BSER_OBJECT:
+      in->p++;
+      var = decode_object(in);
+      break;
+
+    case BSER_STRING:
+    case BSER_UTF8:
+      str = read_string(in);
+      if (str) {
+        var = ph_var_string_claim(str);
+        if (!var) {
+          error_set(in, true, "out of memory");
+          ph_string_delref(str);
+        }
+      }
+      break;
+
+    case BSER_INT8:
+    case BSER_INT16:
+    case BSER_INT32:
+    case BSER_INT64:
+      if (read_int(in, &ival)) {
+        var = ph_var_int(ival);
+        if (!var) {
+          error_set(in, true, "out of memory");
+        }
+      }
+      break;
+
+    case BSER_REAL:
+      if (need(in, 9)) {
+        u = get_le(in->p + 1, 8);
+        memcpy(&dval, &u, sizeof(dval));
+        in->p += 9;
+        var = ph_var_double(dval);
+        if (!var) {
+          error_set(in, true, "out of memory");
+        }
+      }
+      break;
+
+    case BSER_TRUE:
+    case BSER_FALSE:
+      in->p++;
+      var = ph_var_bool(type == BSER_TRUE);
+      break;
+
+    case BSER_NULL:
+      in->p++;
+      var = ph_var_null();
+      break;
+
+    case BSER_TEMPLATE:
+      in->p++;
+      var = decode_template(in);
+      break;
+
+    default:
+      error_set(in, false, "unknown type 0x%02x", type);
+      break;
+  }
+
+  in->depth--;
+  return var;
+}
+
+/* Finds the length of the header at p and of the value that follows
+ * it.  Returns 0 if more than avail bytes are needed to tell, or -1 if
+ * this isn't a BSER header. */
+static int parse_header(const uint8_t *p, uint64_t avail, int64_t *vlen)
+{
+  uint32_t off, n;
+
+  if (avail < 2) {
+    return 0;
+  }
+  if (p[0] != 0x00) {
+    return -1;
+  }
+  switch (p[1]) {
+    case 0x01: off = 2; break;
+    case 0x02: off = 6; break;
+    default:   return -1;
+  }
+  if (avail < off + 1) {
+    return 0;
+  }
+  n = int_width(p[off]);
+  if (n == 0) {
+    return -1;
+  }
+  if (avail < off + 1 + n) {
+    return 0;
+  }
+  *vlen = get_int(p + off + 1, n);
+  if (*vlen < 0) {
+    return -1;
+  }
+  return off + 1 + n;
+}
+
+ph_variant_t *ph_bser_load_string(ph_string_t *str, ph_var_err_t *err)
+{
+  struct in in;
+  ph_variant_t *var;
+  int64_t vlen;
+  int hlen;
+
+  error_init(err);
+  in.src = str;
+  in.err = err;
+  in.depth = 0;
+  in.start = (const uint8_t*)str->buf;
+  in.p = in.start;
+  in.end = in.start + str->len;
+
+  hlen = parse_header(in.p, str->len, &vlen);
+  if (hlen < 0) {
+    error_set(&in, false, "invalid BSER header");
+    return NULL;
+  }
+  if (hlen == 0 || vlen > str->len - hlen) {
+    error_set(&in, true, "premature end of input");
+    return NULL;
+  }
+
+  in.p += hlen;
+  in.end = in.p + vlen;
+  var = decode(&in);
+  if (var && in.p != in.end) {
+    error_set(&in, false, "end of PDU expected");
+    ph_var_delref(var);
+    return NULL;
+  }
+  if (var && err) {
+    err->position = in.p - in.start;
+  }
+  return var;
+}
+
+ph_variant_t *ph_bser_load_bufq(ph_bufq_t *q, ph_var_err_t *err)
+{
+  uint8_t header[BSER_MAX_HEADER];
+  uint64_t avail = ph_bufq_len(q);
+  ph_string_t *str;
+  ph_variant_t *var;
+  ph_buf_t *buf;
+  int64_t vlen = 0;
+  int hlen = 0;
+
+  error_init(err);
+
+  buf = avail ? ph_bufq_peek_bytes(q, MIN(avail, sizeof(header))) : NULL;
+  if (buf) {
+    memcpy(header, ph_buf_mem(buf), ph_buf_len(buf));
+    hlen = parse_header(header, ph_buf_len(buf), &vlen);
+    ph_buf_delref(buf);
+  }
+  if (hlen < 0) {
+    if (err) {
+      strcpy(err->text, "invalid BSER header"); // NOLINT(runtime/printf)
+    }
+    return NULL;
+  }
+  if (hlen == 0 || (uint64_t)vlen > avail - hlen) {
+    if (err) {
+      err->transient = true;
+      strcpy(err->text, "premature end of input"); // NOLINT(runtime/printf)
+    }
+    return NULL;
+  }
+  if (hlen + vlen > UINT32_MAX) {
+    if (err) {
+      strcpy(err->text, "PDU too large"); // NOLINT(runtime/printf)
+    }
+    return NULL;
+  }
+
+  // One copy, so that the strings can be slices of it.  If we can't
+  // make it, the PDU is gone, so the failure isn't transient.
+  buf = ph_bufq_consume_bytes(q, hlen + vlen);
+  if (!buf) {
+    if (err) {
+      err->transient = true;
+      strcpy(err->text, "out of memory"); // NOLINT(runtime/printf)
+    }
+    return NULL;
+  }
+  str = ph_string_make_copy(mt_bser, (const char*)ph_buf_mem(buf),
+      ph_buf_len(buf), ph_buf_len(buf));
+  ph_buf_delref(buf);
+  if (!str) {
+    if (err) {
+      strcpy(err->text, "out of memory"); // NOLINT(runtime/printf)
+    }
+    return NULL;
+  }
+
+  var = ph_bser_load_string(str, err);
+  ph_string_delref(str);
+  return var;
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -24,29 +24,42 @@
 #include "phenom/variant.h"
 #include "phenom/sysutil.h"
 #include "phenom/printf.h"
+#include "corelib/variant/json-index.h"
+#include "corelib/variant/json-number.h"
+#include "corelib/variant/out.h"
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
 
 static int do_dump(ph_variant_t *json, uint32_t flags,
-    int depth, ph_stream_t *stm);
+    int depth, struct ph_var_out *out);
 
 /* 32 spaces (the maximum indentation size) */
 static const char whitespace[] = "                                ";
 
+static const char hexdigits[] = "0123456789abcdef";
+
 // I prefer to inline, but gcc 4.4.6 on RHEL 6.2 and 6.3 are unhappy, so
 // we get to use good old fashioned define
 // https://github.com/facebook/libphenom/issues/7
-#define dump(buf, len, stm) (ph_stm_write(stm, buf, len, NULL) ? 0 : -1)
+#define dump(data, n, o) \
+  ((o)->len + (n) <= sizeof((o)->buf) ? \
+    (memcpy((o)->buf + (o)->len, data, n), (o)->len += (n), 0) : \
+    ph_var_out_write(o, data, n))
 
-static int dump_indent(uint32_t flags, int depth, int space, ph_stream_t *stm)
+static int dump_indent(uint32_t flags, int depth, int space,
+    struct ph_var_out *out)
 {
   if (PH_JSON_INDENT(flags) > 0) {
     int i, ws_count = PH_JSON_INDENT(flags);
 
-    if (dump("\n", 1, stm)) {
+    if (dump("\n", 1, out)) {
       return -1;
     }
 
     for (i = 0; i < depth; i++) {
-      if (dump(whitespace, ws_count, stm)) {
+      if (dump(whitespace, ws_count, out)) {
         return -1;
       }
     }
@@ -55,55 +68,97 @@ static int dump_indent(uint32_t flags, int depth, int space, ph_stream_t *stm)
   }
 
   if (space && !(flags & PH_JSON_COMPACT)) {
-    return dump(" ", 1, stm);
+    return dump(" ", 1, out);
   }
   return 0;
 }
 
-static int dump_string(ph_string_t *str, ph_stream_t *stm, uint32_t flags)
+static inline bool plain_char(uint8_t c, bool slash, bool ascii)
+{
+  return c >= 0x20 && c != '"' && c != '\\' &&
+    !(slash && c == '/') && !(ascii && c >= 0x80);
+}
+
+// Returns the first byte at or after p that needs an escape, or end
+static const char *scan_plain(const char *p, const char *end,
+    bool slash, bool ascii)
 {
+#ifdef __SSE2__
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i bs = _mm_set1_epi8('\\');
+  const __m128i sl = _mm_set1_epi8(slash ? '/' : '"');
+  const __m128i space = _mm_set1_epi8(0x20);
+  __m128i v, m;
+  uint32_t mask;
+
+  while (end - p >= 16) {
+    v = _mm_loadu_si128((const __m128i*)(const void*)p);
+    m = _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bs));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, sl));
+    // The comparison is signed, so this catches bytes >= 0x80 too
+    m = _mm_or_si128(m, _mm_cmplt_epi8(v, space));
+    mask = _mm_movemask_epi8(m);
+    if (!ascii) {
+      mask &= ~_mm_movemask_epi8(v);
+    }
+    if (mask) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 16;
+  }
+#endif
+  while (p < end && plain_char(*p, slash, ascii)) {
+    p++;
+  }
+  return p;
+}
+
+static uint32_t escape_bmp(char *seq, int32_t codepoint)
+{
+  seq[0] = '\\';
+  seq[1] = 'u';
+  seq[2] = hexdigits[(codepoint >> 12) & 0xf];
+  seq[3] = hexdigits[(codepoint >> 8) & 0xf];
+  seq[4] = hexdigits[(codepoint >> 4) & 0xf];
+  seq[5] = hexdigits[codepoint & 0xf];
+  return 6;
+}
+
+static int dump_string(ph_string_t *str, struct ph_var_out *out, uint32_t flags)
+{
+  const char *p = str->buf, *end = str->buf + str->len, *run;
+  bool slash = flags & PH_JSON_ESCAPE_SLASH;
+  bool ascii = flags & PH_JSON_ENSURE_ASCII;
   int32_t codepoint;
-  uint32_t off = 0, pos = 0;
-  ph_result_t res;
+  uint32_t off, length;
   const char *text;
   char seq[13];
-  int length;
 
-  if (dump("\"", 1, stm)) {
+  // Without ENSURE_ASCII, non-ASCII text passes through as it is, so
+  // check it all up front; otherwise each sequence is decoded below
+  if (!ascii && !ph_json_valid_utf8((const uint8_t*)p,
+        (const uint8_t*)end)) {
+    // bad UTF-8 text in string
     return -1;
   }
 
-  while ((res = ph_string_iterate_utf8_as_utf16(str, &off,
-          &codepoint)) == PH_OK) {
-    bool escape = false;
-
-    /* mandatory escape or control char */
-    if (codepoint == '\\' || codepoint == '"' || codepoint < 0x20) {
-      escape = true;
-    }
-
-    /* slash */
-    if ((flags & PH_JSON_ESCAPE_SLASH) && codepoint == '/') {
-      escape = true;
-    }
+  if (dump("\"", 1, out)) {
+    return -1;
+  }
 
-    /* non-ASCII */
-    if ((flags & PH_JSON_ENSURE_ASCII) && codepoint > 0x7F) {
-      escape = true;
+  while (p < end) {
+    run = p;
+    p = scan_plain(p, end, slash, ascii);
+    if (p > run && dump(run, (uint32_t)(p - run), out)) {
+      return -1;
     }
-
-    if (!escape) {
-      // pass it thru
-      if (dump(str->buf + pos, off - pos, stm)) {
-        return -1;
-      }
-      pos = off;
-      continue;
+    if (p == end) {
+      break;
     }
 
     /* handle \, /, ", and control codes */
     length = 2;
-    switch (codepoint) {
+    switch (*p) {
       case '\\': text = "\\\\"; break;
       case '\"': text = "\\\""; break;
       case '\b': text = "\\b"; break;
@@ -113,10 +168,24 @@ static int dump_string(ph_string_t *str, ph_stream_t *stm, uint32_t flags)
       case '\t': text = "\\t"; break;
       case '/':  text = "\\/"; break;
       default:
+        if ((uint8_t)*p < 0x80) {
+          length = escape_bmp(seq, (uint8_t)*p);
+          text = seq;
+          break;
+        }
+
+        /* non-ASCII with ENSURE_ASCII */
+        off = p - str->buf;
+        if (ph_string_iterate_utf8_as_utf16(str, &off,
+              &codepoint) != PH_OK) {
+          // bad UTF-8 text in string
+          return -1;
+        }
+        p = str->buf + off - 1;
+
         /* codepoint is in BMP */
         if (codepoint < 0x10000) {
-          ph_snprintf(seq, sizeof(seq), "\\u%04x", codepoint);
-          length = 6;
+          length = escape_bmp(seq, codepoint);
         } else { /* not in BMP -> construct a UTF-16 surrogate pair */
           int32_t first, last;
 
@@ -124,141 +193,108 @@ static int dump_string(ph_string_t *str, ph_stream_t *stm, uint32_t flags)
           first = 0xD800 | ((codepoint & 0xffc00) >> 10);
           last = 0xDC00 | (codepoint & 0x003ff);
 
-          ph_snprintf(seq, sizeof(seq), "\\u%04x\\u%04x", first, last);
-          length = 12;
+          length = escape_bmp(seq, first);
+          length += escape_bmp(seq + length, last);
         }
 
         text = seq;
         break;
     }
 
-    if (dump(text, length, stm)) {
+    if (dump(text, length, out)) {
       return -1;
     }
-
-    pos = off;
+    p++;
   }
 
-  if (res != PH_DONE) {
-    // bad UTF-8 text in string
-    return -1;
-  }
-
-  return dump("\"", 1, stm);
+  return dump("\"", 1, out);
 }
 
-static int dump_real(ph_stream_t *stm, double value)
+static int dump_real(struct ph_var_out *out, double value)
 {
-  char buffer[64];
-  uint32_t size = sizeof(buffer);
-  int ret;
-  char *start, *end;
-  size_t length;
-
-  ret = ph_snprintf(buffer, size, "%.17g", value);
-  if (ret < 0) {
-    return -1;
-  }
+  char *buf = ph_var_out_reserve(out, PH_JSON_REAL_MAX);
+  uint32_t length;
 
-  length = (size_t)ret;
-  if (length >= size) {
+  if (!buf) {
     return -1;
   }
-
-  /* Make sure there's a dot or 'e' in the output. Otherwise
-     a real is converted to an integer when decoding */
-  if (strchr(buffer, '.') == NULL &&
-      strchr(buffer, 'e') == NULL) {
-    if (length + 3 >= size) {
-      /* No space to append ".0" */
-      return -1;
-    }
-    buffer[length] = '.';
-    buffer[length + 1] = '0';
-    buffer[length + 2] = '\0';
-    length += 2;
+  length = ph_json_format_real(buf, value);
+  if (length == 0) {
+    return -1;
   }
+  out->len += length;
+  return 0;
+}
 
-  /* Remove leading '+' from positive exponent. Also remove leading
-     zeros from exponents (added by some printf() implementations) */
-  start = strchr(buffer, 'e');
-  if (start) {
-    start++;
-    end = start + 1;
-
-    if (*start == '-')
-      start++;
-
-    while (*end == '0')
-      end++;
+static int dump_int(struct ph_var_out *out, int64_t value)
+{
+  char *buf = ph_var_out_reserve(out, PH_JSON_REAL_MAX);
 
-    if (end != start) {
-      memmove(start, end, length - (size_t)(end - buffer));
-      length -= (size_t)(end - start);
-    }
+  if (!buf) {
+    return -1;
   }
-
-  return dump(buffer, length, stm);
+  out->len += ph_json_format_int(buf, value);
+  return 0;
 }
 
 static int dump_array(ph_variant_t *json, uint32_t flags,
-    int depth, ph_stream_t *stm)
+    int depth, struct ph_var_out *out)
 {
   uint32_t i, n;
 
   n = ph_var_array_size(json);
 
-  if (dump("[", 1, stm)) {
+  if (dump("[", 1, out)) {
     return -1;
   }
 
   if (n == 0) {
-    return dump("]", 1, stm);
+    return dump("]", 1, out);
   }
 
-  if (dump_indent(flags, depth + 1, 0, stm)) {
+  if (dump_indent(flags, depth + 1, 0, out)) {
     return -1;
   }
 
   for (i = 0; i < n; ++i) {
-    if (do_dump(ph_var_array_get(json, i), flags, depth + 1, stm)) {
+    if (do_dump(ph_var_array_get(json, i), flags, depth + 1, out)) {
       return -1;
     }
 
     if (i < n - 1) {
-      if (dump(",", 1, stm) ||
-          dump_indent(flags, depth + 1, 1, stm)) {
+      if (dump(",", 1, out) ||
+          dump_indent(flags, depth + 1, 1, out)) {
         return -1;
       }
     } else {
-      if (dump_indent(flags, depth, 0, stm)) {
+      if (dump_indent(flags, depth, 0, out)) {
         return -1;
       }
     }
   }
 
-  return dump("]", 1, stm);
+  return dump("]", 1, out);
 }
 
 static int dump_obj_elem(ph_string_t *key, ph_variant_t *value,
-    uint32_t flags, int depth, ph_stream_t *stm,
+    uint32_t flags, int depth, struct ph_var_out *out,
     const char *separator, int separator_length, bool last)
 {
-  if (dump_string(key, stm, flags)) {
+  if (dump_string(key, out, flags)) {
     return -1;
   }
 
-  if (dump(separator, separator_length, stm) ||
-      do_dump(value, flags, depth + 1, stm)) {
+  if (dump(separator, separator_length, out) ||
+      do_dump(value, flags, depth + 1, out)) {
     return -1;
   }
 
   if (last) {
-    return dump_indent(flags, depth, 0, stm);
+    return dump_indent(flags, depth, 0, out);
   }
 
-  if (dump(",", 1, stm) ||
-      dump_indent(flags, depth + 1, 1, stm)) {
+  if (dump(",", 1, out) ||
+      dump_indent(flags, depth + 1, 1, out)) {
     return -1;
   }
 
@@ -266,7 +302,7 @@ static int dump_obj_elem(ph_string_t *key, ph_variant_t *value,
 }
 
 static int dump_obj(ph_variant_t *json, uint32_t flags,
-    int depth, ph_stream_t *stm)
+    int depth, struct ph_var_out *out)
 {
   const char *separator;
   int separator_length;
@@ -277,7 +313,7 @@ static int dump_obj(ph_variant_t *json, uint32_t flags,
 
   n = ph_var_object_size(json);
   if (ph_var_object_size(json) == 0) {
-    return dump("{}", 2, stm);
+    return dump("{}", 2, out);
   }
 
   if (flags & PH_JSON_COMPACT) {
@@ -288,11 +324,11 @@ static int dump_obj(ph_variant_t *json, uint32_t flags,
     separator_length = 2;
   }
 
-  if (dump("{", 1, stm)) {
+  if (dump("{", 1, out)) {
     return -1;
   }
 
-  if (dump_indent(flags, depth + 1, 0, stm)) {
+  if (dump_indent(flags, depth + 1, 0, out)) {
     return -1;
   }
 
@@ -302,7 +338,7 @@ static int dump_obj(ph_variant_t *json, uint32_t flags,
 
     if (ph_var_object_ordered_iter_first(json, &oiter, &key, &val)) do {
       last = ++i >= n;
-      if (dump_obj_elem(key, val, flags, depth + 1, stm,
+      if (dump_obj_elem(key, val, flags, depth + 1, out,
             separator, separator_length, last)) {
         return -1;
       }
@@ -315,44 +351,43 @@ static int dump_obj(ph_variant_t *json, uint32_t flags,
 
     if (ph_var_object_iter_first(json, &iter, &key, &val)) do {
       last = ++i >= n;
-      if (dump_obj_elem(key, val, flags, depth + 1, stm,
+      if (dump_obj_elem(key, val, flags, depth + 1, out,
             separator, separator_length, last)) {
         return -1;
       }
     } while (ph_var_object_iter_next(json, &iter, &key, &val));
   }
 
-  return dump("}", 1, stm);
+  return dump("}", 1, out);
 }
 
 static int do_dump(ph_variant_t *json, uint32_t flags,
-    int depth, ph_stream_t *stm)
+    int depth, struct ph_var_out *out)
 {
   switch (ph_var_type(json)) {
     case PH_VAR_NULL:
-      return dump("null", 4, stm);
+      return dump("null", 4, out);
 
     case PH_VAR_TRUE:
-      return dump("true", 4, stm);
+      return dump("true", 4, out);
 
     case PH_VAR_FALSE:
-      return dump("false", 5, stm);
+      return dump("false", 5, out);
 
     case PH_VAR_INTEGER:
-      return ph_stm_printf(stm, "%" PRIi64,
-          ph_var_int_val(json)) <= 0 ? -1 : 0;
+      return dump_int(out, ph_var_int_val(json));
 
     case PH_VAR_REAL:
-      return dump_real(stm, ph_var_double_val(json));
+      return dump_real(out, ph_var_double_val(json));
 
     case PH_VAR_STRING:
-      return dump_string(ph_var_string_val(json), stm, flags);
+      return dump_string(ph_var_string_val(json), out, flags);
 
     case PH_VAR_ARRAY:
-      return dump_array(json, flags, depth, stm);
+      return dump_array(json, flags, depth, out);
 
     case PH_VAR_OBJECT:
-      return dump_obj(json, flags, depth, stm);
+      return dump_obj(json, flags, depth, out);
 
     default:
       /* not reached */
@@ -360,33 +395,35 @@ static int do_dump(ph_variant_t *json, uint32_t flags,
   }
 }
 
-ph_result_t ph_json_dump_stream(ph_variant_t *var, ph_stream_t *stm,
-    uint32_t flags)
+static ph_result_t dump_to(ph_variant_t *var, ph_string_t *str,
+    ph_stream_t *stm, ph_bufq_t *q, uint32_t flags)
 {
-  if (do_dump(var, flags, 0, stm)) {
+  struct ph_var_out out;
+
+  ph_var_out_init(&out, str, stm, q);
+  if (do_dump(var, flags, 0, &out) || ph_var_out_flush(&out)) {
     return PH_ERR;
   }
   return PH_OK;
 }
 
-ph_result_t ph_json_dump_string(ph_variant_t *var, ph_string_t *str,
+ph_result_t ph_json_dump_stream(ph_variant_t *var, ph_stream_t *stm,
     uint32_t flags)
 {
-  ph_stream_t *stm;
-  ph_result_t res;
-
-  stm = ph_stm_string_open(str);
-  if (!stm) {
-    return PH_NOMEM;
-  }
-  ph_stm_seek(stm, 0, SEEK_END, NULL);
-  res = ph_json_dump_stream(var, stm, flags);
+  return dump_to(var, NULL, stm, NULL, flags);
+}
 
-  ph_stm_close(stm);
+ph_result_t ph_json_dump_string(ph_variant_t *var, ph_string_t *str,
+    uint32_t flags)
+{
+  return dump_to(var, str, NULL, NULL, flags);
+}
 
-  return res;
+ph_result_t ph_json_dump_bufq(ph_variant_t *var, ph_bufq_t *q,
+    uint32_t flags)
+{
+  return dump_to(var, NULL, NULL, q, flags);
 }
 
 /* vim:ts=2:sw=2:et:
  */
-
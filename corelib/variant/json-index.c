@@ -0,0 +1,306 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phenom/sysutil.h"
+#include "phenom/memory.h"
+#include "phenom/string.h"
+#include "corelib/variant/json-index.h"
+
+/* Stage one of the indexed JSON loader, in the style of simdjson.
+ *
+ * Each 64 byte block is classified into bitmasks, one bit per byte:
+ * quotes, backslashes, whitespace, structural characters, control
+ * characters and non-ASCII bytes.  Escaped quotes are removed, and a
+ * prefix XOR over the remaining quotes gives the mask of bytes inside
+ * strings.  Whatever is left outside of strings is either structural,
+ * whitespace, or part of a scalar, and the index records the offset of
+ * each structural character, each quote and the first byte of each
+ * scalar.  Stage two, in json-load.c, walks the index. */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define JSON_INDEX_X86 1
+# include <immintrin.h>
+#endif
+
+struct block {
+  uint64_t quote, bs, ws, op, ctrl, hi;
+};
+
+typedef void (*classify_func)(const uint8_t *p, struct block *b);
+
+static ph_memtype_t mt_index;
+static struct ph_memtype_def def = {
+  "variant", "json_index", 0, 0
+};
+
+static void classify_scalar(const uint8_t *p, struct block *b)
+{
+  uint64_t bit;
+  int i;
+
+  memset(b, 0, sizeof(*b));
+  for (i = 0; i < 64; i++) {
+    bit = 1ULL << i;
+    switch (p[i]) {
+      case '"':
+        b->quote |= bit;
+        break;
+      case '\\':
+        b->bs |= bit;
+        break;
+      case ' ': case '\t': case '\n': case '\r':
+        b->ws |= bit;
+        break;
+      case '{': case '}': case '[': case ']': case ':': case ',':
+        b->op |= bit;
+        break;
+    }
+    if (p[i] < 0x20) {
+      b->ctrl |= bit;
+    } else if (p[i] >= 0x80) {
+      b->hi |= bit;
+    }
+  }
+}
+
+#ifdef JSON_INDEX_X86
+/* '{' and '[' differ only in the 0x20 bit, as do '}' and ']', so
+ * OR-ing that bit in lets one compare find both */
+# define CLASSIFY_BODY(T, W, LOAD, EQ, OR, LT, SET1, MOVEMASK) \
+  for (i = 0; i < 64; i += W) { \
+    T v = LOAD((const T*)(p + i)); \
+    T folded = OR(v, SET1(0x20)); \
+    uint64_t hi = (uint32_t)MOVEMASK(v); \
+    b->quote |= (uint64_t)(uint32_t)MOVEMASK(EQ(v, SET1('"'))) << i; \
+    b->bs |= (uint64_t)(uint32_t)MOVEMASK(EQ(v, SET1('\\'))) << i; \
+    b->ws |= (uint64_t)(uint32_t)MOVEMASK( \
+        OR(OR(EQ(v, SET1(' ')), EQ(v, SET1('\t'))), \
+          OR(EQ(v, SET1('\n')), EQ(v, SET1('\r'))))) << i; \
+    b->op |= (uint64_t)(uint32_t)MOVEMASK( \
+        OR(OR(EQ(folded, SET1('{')), EQ(folded, SET1('}'))), \
+          OR(EQ(v, SET1(':')), EQ(v, SET1(','))))) << i; \
+    /* the compare is signed, so non-ASCII bytes look small too */ \
+    b->ctrl |= ((uint64_t)(uint32_t)MOVEMASK(LT(v, SET1(0x20))) & ~hi) << i; \
+    b->hi |= hi << i; \
+  }
+
+static void classify_sse2(const uint8_t *p, struct block *b)
+    __attribute__((target("sse2")));
+static void classify_sse2(const uint8_t *p, struct block *b)
+{
+  int i;
+
+  memset(b, 0, sizeof(*b));
+  CLASSIFY_BODY(__m128i, 16, _mm_loadu_si128, _mm_cmpeq_epi8, _mm_or_si128,
+      _mm_cmplt_epi8, _mm_set1_epi8, _mm_movemask_epi8)
+}
+
+static void classify_avx2(const uint8_t *p, struct block *b)
+    __attribute__((target("avx2")));
+static void classify_avx2(const uint8_t *p, struct block *b)
+{
+  int i;
+
+  memset(b, 0, sizeof(*b));
+  // avx2 has no signed less-than, so swap the operands of greater-than
+# define AVX2_LT(a, c) _mm256_cmpgt_epi8(c, a)
+  CLASSIFY_BODY(__m256i, 32, _mm256_loadu_si256, _mm256_cmpeq_epi8,
+      _mm256_or_si256, AVX2_LT, _mm256_set1_epi8, _mm256_movemask_epi8)
+# undef AVX2_LT
+}
+#endif
+
+static classify_func classify = classify_scalar;
+
+static void init_json_index(void)
+{
+  mt_index = ph_memtype_register(&def);
+#ifdef JSON_INDEX_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    classify = classify_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    classify = classify_sse2;
+  }
+#endif
+}
+PH_LIBRARY_INIT(init_json_index, 0)
+
+/* Returns the mask of characters that are escaped by a backslash.
+ * Backslashes are rare, so we just walk them in order; *carry is set
+ * when the block ends with a backslash that escapes the first
+ * character of the next one. */
+static inline uint64_t find_escaped(uint64_t bs, uint64_t *carry)
+{
+  uint64_t escaped = *carry;
+  int i;
+
+  *carry = 0;
+  bs &= ~escaped;
+  while (bs) {
+    i = __builtin_ctzll(bs);
+    bs &= bs - 1;
+    if (escaped & (1ULL << i)) {
+      continue;
+    }
+    if (i == 63) {
+      *carry = 1;
+    } else {
+      escaped |= 1ULL << (i + 1);
+    }
+  }
+  return escaped;
+}
+
+// Each bit becomes the XOR of itself and all of the bits below it
+static inline uint64_t prefix_xor(uint64_t x)
+{
+  x ^= x << 1;
+  x ^= x << 2;
+  x ^= x << 4;
+  x ^= x << 8;
+  x ^= x << 16;
+  x ^= x << 32;
+  return x;
+}
+
+bool ph_json_valid_utf8(const uint8_t *p, const uint8_t *end)
+{
+  uint64_t word;
+  uint32_t cp;
+  uint8_t n, i;
+
+  while (p < end) {
+    if (end - p >= 8) {
+      memcpy(&word, p, sizeof(word));
+      if ((word & 0x8080808080808080ULL) == 0) {
+        p += 8;
+        continue;
+      }
+    }
+    if (*p < 0x80) {
+      p++;
+      continue;
+    }
+
+    n = ph_utf8_seq_len(*p);
+    if (n == 0 || n > end - p) {
+      return false;
+    }
+    cp = *p & (0xff >> (n + 1));
+    for (i = 1; i < n; i++) {
+      if ((p[i] & 0xc0) != 0x80) {
+        return false;
+      }
+      cp = (cp << 6) | (p[i] & 0x3f);
+    }
+    // overlong forms, surrogate halves and values beyond Unicode
+    if ((n == 3 && cp < 0x800) || (n == 4 && cp < 0x10000) ||
+        (cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff) {
+      return false;
+    }
+    p += n;
+  }
+  return true;
+}
+
+static bool reserve(struct ph_json_index *ix, uint32_t extra)
+{
+  uint32_t cap;
+  uint32_t *pos;
+
+  if (ix->n + extra <= ix->cap) {
+    return true;
+  }
+  cap = ix->cap ? ix->cap * 2 : 256;
+  while (cap < ix->n + extra) {
+    cap *= 2;
+  }
+  pos = ph_mem_realloc(mt_index, ix->pos, cap * sizeof(*pos));
+  if (!pos) {
+    return false;
+  }
+  ix->pos = pos;
+  ix->cap = cap;
+  return true;
+}
+
+bool ph_json_index_build(struct ph_json_index *ix,
+    const char *buf, uint32_t len)
+{
+  const uint8_t *p;
+  uint8_t tail[64];
+  struct block b;
+  uint64_t escape_carry = 0, prev_in_string = 0, prev_scalar = 0;
+  uint64_t quotes, in_string, scalar, bits;
+  bool non_ascii = false;
+  uint32_t off;
+
+  ix->n = 0;
+
+  for (off = 0; off < len; off += 64) {
+    p = (const uint8_t*)buf + off;
+    if (len - off < 64) {
+      // Pad the last block with whitespace, which is never indexed
+      memset(tail, ' ', sizeof(tail));
+      memcpy(tail, p, len - off);
+      p = tail;
+    }
+    classify(p, &b);
+
+    quotes = b.quote & ~find_escaped(b.bs, &escape_carry);
+    // Includes opening quotes but not closing quotes
+    in_string = prefix_xor(quotes) ^ prev_in_string;
+    prev_in_string = (uint64_t)((int64_t)in_string >> 63);
+
+    if (b.ctrl & in_string) {
+      return false;
+    }
+    non_ascii |= b.hi != 0;
+
+    scalar = ~(b.ws | b.op | quotes | in_string);
+    bits = (b.op & ~in_string) | quotes |
+      (scalar & ~((scalar << 1) | prev_scalar));
+    prev_scalar = scalar >> 63;
+
+    if (!reserve(ix, 64)) {
+      return false;
+    }
+    while (bits) {
+      ix->pos[ix->n++] = off + __builtin_ctzll(bits);
+      bits &= bits - 1;
+    }
+  }
+
+  if (prev_in_string) {
+    return false;
+  }
+  if (non_ascii && !ph_json_valid_utf8((const uint8_t*)buf,
+        (const uint8_t*)buf + len)) {
+    return false;
+  }
+  return true;
+}
+
+void ph_json_index_free(struct ph_json_index *ix)
+{
+  ph_mem_free(mt_index, ix->pos);
+  ix->pos = NULL;
+  ix->n = ix->cap = 0;
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -0,0 +1,48 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CORELIB_VARIANT_JSON_INDEX_H
+#define CORELIB_VARIANT_JSON_INDEX_H
+
+/* The structural index of a JSON document: the offsets of every
+ * bracket, brace, colon and comma outside of strings, of both quotes
+ * of every string, and of the first byte of every other scalar.  A
+ * string runs from its opening quote to the next entry, which is its
+ * closing quote; a scalar runs up to the next entry, less any
+ * trailing whitespace. */
+struct ph_json_index {
+  uint32_t *pos;
+  uint32_t n, cap;
+};
+
+/* Builds the index, 64 bytes at a time using the widest vector unit
+ * that the CPU supports.  Returns false if the input has invalid
+ * UTF-8, a control character in a string or an unterminated string, or
+ * if we ran out of memory; the caller should then fall back to the
+ * lexer, which knows how to describe the problem. */
+bool ph_json_index_build(struct ph_json_index *ix,
+    const char *buf, uint32_t len);
+
+void ph_json_index_free(struct ph_json_index *ix);
+
+/* Returns true if the bytes are well formed UTF-8, with the same rules
+ * as ph_string_is_valid_utf8(), but skipping ASCII a word at a time. */
+bool ph_json_valid_utf8(const uint8_t *p, const uint8_t *end);
+
+#endif
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -0,0 +1,663 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phenom/json.h"
+#include "phenom/sysutil.h"
+#include "phenom/memory.h"
+#include "corelib/variant/json-index.h"
+#include "corelib/variant/json-load.h"
+#include "corelib/variant/json-lazy.h"
+
+/* Lazy documents.  ph_json_load_lazy() builds the structural index of
+ * the input and checks the grammar by walking it, which allocates
+ * nothing per value.  Containers are then built one level at a time as
+ * they are read: a lazy object starts with an empty hash table and
+ * searches the index for keys that aren't in it yet, and a lazy array
+ * knows where each of its elements starts but leaves its slots NULL
+ * until ph_var_array_get() fills them in.  Strings without escapes are
+ * slices of the document text. */
+
+#define NO_ENTRY UINT32_MAX
+
+struct json_doc {
+  ph_refcnt_t ref;
+  // A copy of the input.  A ph_string can't hold a reference on a
+  // ph_buf, and one copy costs far less than the allocations we save.
+  ph_string_t *text;
+  struct ph_json_index ix;
+  // For each bracket, the entry of the matching bracket
+  uint32_t *match;
+  // PH_JSON_INTERN_KEYS was passed to the load
+  bool intern_keys;
+};
+
+struct ph_var_lazy {
+  struct json_doc *doc;
+  // The entry of the opening bracket
+  uint32_t open;
+  // For arrays, the entry at which each element starts, and the number
+  // of slots that are still NULL
+  uint32_t *elems;
+  uint32_t unbuilt;
+};
+
+static ph_memtype_t mt_lazy;
+static struct ph_memtype_def def = {
+  "variant", "json_lazy", 0, 0
+};
+
+static void init_json_lazy(void)
+{
+  mt_lazy = ph_memtype_register(&def);
+}
+PH_LIBRARY_INIT(init_json_lazy, 0)
+
+static void doc_delref(struct json_doc *doc)
+{
+  if (!ph_refcnt_del(&doc->ref)) {
+    return;
+  }
+  if (doc->text) {
+    ph_string_delref(doc->text);
+  }
+  ph_json_index_free(&doc->ix);
+  ph_mem_free(mt_lazy, doc->match);
+  ph_mem_free(mt_lazy, doc);
+}
+
+void ph_json_lazy_free(struct ph_var_lazy *lazy)
+{
+  doc_delref(lazy->doc);
+  ph_mem_free(mt_lazy, lazy->elems);
+  ph_mem_free(mt_lazy, lazy);
+}
+
+static inline char entry_char(struct json_doc *doc, uint32_t e)
+{
+  return doc->text->buf[doc->ix.pos[e]];
+}
+
+// Returns the entry that follows the value starting at entry e
+static inline uint32_t skip_value(struct json_doc *doc, uint32_t e)
+{
+  switch (entry_char(doc, e)) {
+    case '{': case '[':
+      return doc->match[e] + 1;
+    case '"':
+      return e + 2;
+    default:
+      return e + 1;
+  }
+}
+
+// Returns the entry at which the value ending at entry e starts
+static inline uint32_t value_start(struct json_doc *doc, uint32_t e)
+{
+  switch (entry_char(doc, e)) {
+    case '}': case ']':
+      return doc->match[e];
+    case '"':
+      return e - 1;
+    default:
+      return e;
+  }
+}
+
+// Returns the length of the text of the scalar at entry e
+static uint32_t scalar_len(struct json_doc *doc, uint32_t e)
+{
+  const char *buf = doc->text->buf;
+  uint32_t start = doc->ix.pos[e], end;
+
+  end = e + 1 < doc->ix.n ? doc->ix.pos[e + 1] : doc->text->len;
+  // Only whitespace can separate a scalar from the next entry
+  while (end > start && (buf[end - 1] == ' ' || buf[end - 1] == '\t' ||
+        buf[end - 1] == '\n' || buf[end - 1] == '\r')) {
+    end--;
+  }
+  return end - start;
+}
+
+static inline const char *string_text(struct json_doc *doc, uint32_t e,
+    uint32_t *len)
+{
+  *len = doc->ix.pos[e + 1] - doc->ix.pos[e] - 1;
+  return doc->text->buf + doc->ix.pos[e] + 1;
+}
+
+// Decodes the string at entry e into scratch
+static bool decode_string(struct json_doc *doc, uint32_t e,
+    ph_string_t *scratch)
+{
+  const char *p;
+  uint32_t len;
+
+  p = string_text(doc, e, &len);
+  ph_string_reset(scratch);
+  if (ph_string_append_buf(scratch, p, len) != PH_OK) {
+    return false;
+  }
+  return ph_json_unescape(scratch->buf, scratch->buf + len, scratch->buf,
+      &scratch->len);
+}
+
+static ph_string_t *make_string(struct json_doc *doc, uint32_t e)
+{
+  ph_string_t *str;
+  const char *p;
+  uint32_t len;
+
+  p = string_text(doc, e, &len);
+  if (!memchr(p, '\\', len)) {
+    return ph_string_make_slice(doc->text, p - doc->text->buf, len);
+  }
+
+  // The check in ph_json_load_lazy() made sure that this will decode
+  str = ph_string_make_copy(mt_lazy, p, len, len);
+  if (str) {
+    ph_json_unescape(str->buf, str->buf + len, str->buf, &str->len);
+  }
+  return str;
+}
+
+static ph_string_t *make_key(struct json_doc *doc, uint32_t e)
+{
+  ph_string_t *str;
+  const char *p;
+  uint32_t len;
+
+  p = string_text(doc, e, &len);
+  if (doc->intern_keys && !memchr(p, '\\', len)) {
+    str = ph_string_intern(p, len);
+    if (str) {
+      return str;
+    }
+  }
+  return make_string(doc, e);
+}
+
+static bool key_equal(struct json_doc *doc, uint32_t e, ph_string_t *key,
+    ph_string_t *scratch)
+{
+  const char *p;
+  uint32_t len;
+
+  p = string_text(doc, e, &len);
+  // Escapes only ever make the text longer than its value
+  if (len < key->len) {
+    return false;
+  }
+  if (!memchr(p, '\\', len)) {
+    return len == key->len && !memcmp(p, key->buf, len);
+  }
+  return decode_string(doc, e, scratch) && ph_string_equal(scratch, key);
+}
+
+static struct ph_var_lazy *lazy_new(struct json_doc *doc, uint32_t open)
+{
+  struct ph_var_lazy *lazy;
+
+  lazy = ph_mem_alloc_size(mt_lazy, sizeof(*lazy));
+  if (!lazy) {
+    return NULL;
+  }
+  lazy->doc = doc;
+  lazy->open = open;
+  lazy->elems = NULL;
+  lazy->unbuilt = 0;
+  ph_refcnt_add(&doc->ref);
+  return lazy;
+}
+
+static ph_variant_t *lazy_object(struct json_doc *doc, uint32_t open)
+{
+  ph_variant_t *obj;
+
+  obj = ph_var_object(8);
+  if (!obj || doc->match[open] == open + 1) {
+    return obj;
+  }
+  obj->u.oval.lazy = lazy_new(doc, open);
+  if (!obj->u.oval.lazy) {
+    ph_var_delref(obj);
+    return NULL;
+  }
+  return obj;
+}
+
+static ph_variant_t *lazy_array(struct json_doc *doc, uint32_t open)
+{
+  ph_variant_t *arr;
+  struct ph_var_lazy *lazy;
+  uint32_t e, n = 0;
+
+  for (e = open + 1; entry_char(doc, e) != ']'; n++) {
+    e = skip_value(doc, e);
+    if (entry_char(doc, e) == ',') {
+      e++;
+    }
+  }
+
+  arr = ph_var_array(n + 1);
+  if (!arr || n == 0) {
+    return arr;
+  }
+  lazy = lazy_new(doc, open);
+  if (!lazy) {
+    goto fail;
+  }
+  arr->u.aval.lazy = lazy;
+  lazy->elems = ph_mem_alloc_size(mt_lazy, n * sizeof(*lazy->elems));
+  if (!lazy->elems) {
+    goto fail;
+  }
+
+  for (e = open + 1, n = 0; entry_char(doc, e) != ']'; n++) {
+    lazy->elems[n] = e;
+    arr->u.aval.arr[n] = NULL;
+    e = skip_value(doc, e);
+    if (entry_char(doc, e) == ',') {
+      e++;
+    }
+  }
+  arr->u.aval.len = n;
+  lazy->unbuilt = n;
+  return arr;
+
+fail:
+  ph_var_delref(arr);
+  return NULL;
+}
+
+static ph_variant_t *build_value(struct json_doc *doc, uint32_t e)
+{
+  ph_string_t *str;
+  ph_variant_t *v;
+
+  switch (entry_char(doc, e)) {
+    case '{':
+      return lazy_object(doc, e);
+    case '[':
+      return lazy_array(doc, e);
+    case '"':
+      str = make_string(doc, e);
+      if (!str) {
+        return NULL;
+      }
+      v = ph_var_string_claim(str);
+      if (!v) {
+        ph_string_delref(str);
+      }
+      return v;
+    default:
+      return ph_json_scalar_value(doc->text->buf + doc->ix.pos[e],
+          scalar_len(doc, e), NULL);
+  }
+}
+
+ph_variant_t *_ph_var_array_get_slow(ph_variant_t *arr, uint32_t pos)
+{
+  struct ph_var_lazy *lazy;
+  ph_variant_t *v;
+
+  if (arr->type != PH_VAR_ARRAY || pos >= arr->u.aval.len) {
+    return NULL;
+  }
+  // Elements of a lazy array are NULL until they are first read
+  if (arr->u.aval.arr[pos]) {
+    return arr->u.aval.arr[pos];
+  }
+  // Appended elements are never NULL, so pos is within elems
+  lazy = arr->u.aval.lazy;
+  if (!lazy) {
+    return NULL;
+  }
+  v = build_value(lazy->doc, lazy->elems[pos]);
+  if (!v) {
+    return NULL;
+  }
+  arr->u.aval.arr[pos] = v;
+  ph_json_lazy_slot_filled(arr);
+  return v;
+}
+
+void ph_json_lazy_slot_filled(ph_variant_t *arr)
+{
+  struct ph_var_lazy *lazy = arr->u.aval.lazy;
+
+  // Once every slot is filled, the document is no longer needed
+  if (--lazy->unbuilt == 0) {
+    ph_json_lazy_free(lazy);
+    arr->u.aval.lazy = NULL;
+  }
+}
+
+ph_variant_t *ph_json_lazy_object_get(ph_variant_t *obj, ph_string_t *key)
+{
+  struct json_doc *doc = obj->u.oval.lazy->doc;
+  PH_STRING_DECLARE_GROW(scratch, 128, mt_lazy);
+  uint32_t e, found = NO_ENTRY;
+  ph_string_t *k;
+  ph_variant_t *v;
+
+  // When a key is repeated, the last value wins, as in the loaders
+  for (e = obj->u.oval.lazy->open + 1; entry_char(doc, e) != '}'; ) {
+    if (key_equal(doc, e, key, &scratch)) {
+      found = e;
+    }
+    // skip the key, the colon and the value
+    e = skip_value(doc, e + 3);
+    if (entry_char(doc, e) == ',') {
+      e++;
+    }
+  }
+  ph_string_delref(&scratch);
+
+  if (found == NO_ENTRY) {
+    return NULL;
+  }
+  k = make_key(doc, found);
+  if (!k) {
+    return NULL;
+  }
+  v = build_value(doc, found + 3);
+  if (!v) {
+    ph_string_delref(k);
+    return NULL;
+  }
+  if (ph_var_object_set_claim_kv(obj, k, v) != PH_OK) {
+    ph_string_delref(k);
+    ph_var_delref(v);
+    return NULL;
+  }
+  return v;
+}
+
+static ph_result_t force_object(ph_variant_t *obj)
+{
+  struct json_doc *doc = obj->u.oval.lazy->doc;
+  uint32_t open = obj->u.oval.lazy->open, e, start;
+  PH_STRING_DECLARE_GROW(scratch, 128, mt_lazy);
+  ph_string_t *k;
+  ph_variant_t *v;
+  ph_result_t res = PH_OK;
+
+  // Walk the members backwards and keep whatever is already in the
+  // table, so that the last of any repeated key wins, and neither the
+  // values we've handed out nor the ones set since are replaced
+  for (e = doc->match[open] - 1; ; e = start - 5) {
+    start = value_start(doc, e);
+    e = start - 3;
+
+    if (!decode_string(doc, e, &scratch)) {
+      res = PH_NOMEM;
+      break;
+    }
+    if (!_ph_var_object_get_built(obj, &scratch)) {
+      k = make_key(doc, e);
+      v = k ? build_value(doc, start) : NULL;
+      if (!v) {
+        if (k) {
+          ph_string_delref(k);
+        }
+        res = PH_NOMEM;
+        break;
+      }
+      if (ph_var_object_set_claim_kv(obj, k, v) != PH_OK) {
+        ph_string_delref(k);
+        ph_var_delref(v);
+        res = PH_NOMEM;
+        break;
+      }
+    }
+
+    // the comma, or the opening brace
+    if (e - 1 == open) {
+      break;
+    }
+  }
+  ph_string_delref(&scratch);
+
+  if (res == PH_OK) {
+    ph_json_lazy_free(obj->u.oval.lazy);
+    obj->u.oval.lazy = NULL;
+  }
+  return res;
+}
+
+ph_result_t ph_json_lazy_force(ph_variant_t *var)
+{
+  uint32_t i;
+
+  if (!ph_var_lazy_of(var)) {
+    return PH_OK;
+  }
+  if (var->type == PH_VAR_OBJECT) {
+    return force_object(var);
+  }
+
+  // Filling the last slot releases the lazy state
+  for (i = 0; var->u.aval.lazy && i < var->u.aval.len; i++) {
+    if (!var->u.aval.arr[i] && !_ph_var_array_get_slow(var, i)) {
+      return PH_NOMEM;
+    }
+  }
+  return PH_OK;
+}
+
+static bool check_scalar(struct json_doc *doc, uint32_t e)
+{
+  const char *p = doc->text->buf + doc->ix.pos[e];
+  uint32_t len = scalar_len(doc, e);
+  int64_t ival;
+  double dval;
+
+  switch (*p) {
+    case 't':
+      return len == 4 && !memcmp(p, "true", 4);
+    case 'f':
+      return len == 5 && !memcmp(p, "false", 5);
+    case 'n':
+      return len == 4 && !memcmp(p, "null", 4);
+  }
+  switch (ph_json_parse_number(p, len, &ival, &dval)) {
+    case PH_JSON_NUM_INT:
+    case PH_JSON_NUM_REAL:
+      return true;
+    default:
+      return false;
+  }
+}
+
+enum {
+  C_VALUE,
+  C_VALUE_OR_END,
+  C_KEY_OR_END,
+  C_KEY,
+  C_COLON,
+  C_COMMA_OR_END,
+  C_DONE,
+};
+
+/* Checks the grammar and the text of every scalar, and matches up the
+ * brackets.  While a container is open, its match entry holds the
+ * entry of the enclosing container, so the stack costs nothing. */
+static bool doc_check(struct json_doc *doc, uint32_t flags)
+{
+  PH_STRING_DECLARE_GROW(scratch, 128, mt_lazy);
+  uint32_t e, top = NO_ENTRY, open;
+  const char *p;
+  uint32_t len;
+  int state = C_VALUE;
+  char c;
+
+  if (doc->ix.n == 0) {
+    return false;
+  }
+  c = entry_char(doc, 0);
+  if (!(flags & PH_JSON_DECODE_ANY) && c != '{' && c != '[') {
+    return false;
+  }
+
+  for (e = 0; e < doc->ix.n; e++) {
+    c = entry_char(doc, e);
+    switch (c) {
+      case '{':
+      case '[':
+        if (state != C_VALUE && state != C_VALUE_OR_END) {
+          goto bad;
+        }
+        doc->match[e] = top;
+        top = e;
+        state = c == '{' ? C_KEY_OR_END : C_VALUE_OR_END;
+        break;
+
+      case '}':
+      case ']':
+        if (top == NO_ENTRY || entry_char(doc, top) != (c == '}' ? '{' : '[')) {
+          goto bad;
+        }
+        if (state != C_COMMA_OR_END &&
+            state != (c == '}' ? C_KEY_OR_END : C_VALUE_OR_END)) {
+          goto bad;
+        }
+        open = top;
+        top = doc->match[open];
+        doc->match[open] = e;
+        doc->match[e] = open;
+        state = top == NO_ENTRY ? C_DONE : C_COMMA_OR_END;
+        break;
+
+      case ':':
+        if (state != C_COLON) {
+          goto bad;
+        }
+        state = C_VALUE;
+        break;
+
+      case ',':
+        if (state != C_COMMA_OR_END) {
+          goto bad;
+        }
+        state = entry_char(doc, top) == '{' ? C_KEY : C_VALUE;
+        break;
+
+      case '"':
+        p = string_text(doc, e, &len);
+        if (memchr(p, '\\', len) && !decode_string(doc, e, &scratch)) {
+          goto bad;
+        }
+        if (state == C_KEY_OR_END || state == C_KEY) {
+          state = C_COLON;
+        } else if (state == C_VALUE || state == C_VALUE_OR_END) {
+          state = top == NO_ENTRY ? C_DONE : C_COMMA_OR_END;
+        } else {
+          goto bad;
+        }
+        // the closing quote
+        e++;
+        break;
+
+      default:
+        if ((state != C_VALUE && state != C_VALUE_OR_END) ||
+            !check_scalar(doc, e)) {
+          goto bad;
+        }
+        state = top == NO_ENTRY ? C_DONE : C_COMMA_OR_END;
+    }
+  }
+
+bad:
+  ph_string_delref(&scratch);
+  return e == doc->ix.n && state == C_DONE;
+}
+
+ph_variant_t *ph_json_load_lazy(ph_buf_t *buf, uint32_t flags,
+    ph_var_err_t *err)
+{
+  uint64_t len = ph_buf_len(buf);
+  struct json_doc *doc;
+  ph_string_t str;
+  ph_variant_t *v = NULL;
+
+  if (len > UINT32_MAX) {
+    if (err) {
+      memset(err, 0, sizeof(*err));
+      strcpy(err->text, "input is too large"); // NOLINT(runtime/printf)
+    }
+    return NULL;
+  }
+
+  // Neither of these fits a lazy document, so load eagerly
+  if (len == 0 ||
+      (flags & (PH_JSON_REJECT_DUPLICATES|PH_JSON_DISABLE_EOF_CHECK))) {
+    ph_string_init_claim(&str, PH_STRING_STATIC, (char*)ph_buf_mem(buf),
+        len, len);
+    return ph_json_load_string(&str, flags, err);
+  }
+
+  doc = ph_mem_alloc_size(mt_lazy, sizeof(*doc));
+  if (!doc) {
+    goto oom;
+  }
+  memset(doc, 0, sizeof(*doc));
+  doc->ref = 1;
+  doc->intern_keys = flags & PH_JSON_INTERN_KEYS;
+
+  doc->text = ph_string_make_copy(mt_lazy, (char*)ph_buf_mem(buf), len, len);
+  if (!doc->text) {
+    goto oom;
+  }
+
+  if (!ph_json_index_build(&doc->ix, doc->text->buf, len) ||
+      !(doc->match = ph_mem_alloc_size(mt_lazy,
+          MAX(doc->ix.n, 1) * sizeof(*doc->match))) ||
+      !doc_check(doc, flags)) {
+    // Let the lexer describe the problem
+    v = ph_json_load_string(doc->text, flags|PH_JSON_NO_SIMD, err);
+    doc_delref(doc);
+    return v;
+  }
+
+  // Containers hold their own references on the document
+  v = build_value(doc, 0);
+  doc_delref(doc);
+  doc = NULL;
+  if (!v) {
+    goto oom;
+  }
+
+  if (err) {
+    err->text[0] = 0;
+    err->transient = false;
+    err->position = len;
+  }
+  return v;
+
+oom:
+  if (doc) {
+    doc_delref(doc);
+  }
+  if (err) {
+    memset(err, 0, sizeof(*err));
+    strcpy(err->text, "out of memory"); // NOLINT(runtime/printf)
+    err->transient = true;
+  }
+  return NULL;
+}
+
+/* vim:ts=2:sw=2:et:
+ */
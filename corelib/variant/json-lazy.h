@@ -0,0 +1,57 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CORELIB_VARIANT_JSON_LAZY_H
+#define CORELIB_VARIANT_JSON_LAZY_H
+
+/* The hooks that variant.c calls for containers that have a `lazy`
+ * pointer; see json-lazy.c */
+
+/* Builds the value of key, if the object's source text has it, and
+ * adds it to the object.  Returns a borrowed reference. */
+ph_variant_t *ph_json_lazy_object_get(ph_variant_t *obj, ph_string_t *key);
+
+/* Builds every element that hasn't been built yet, after which the
+ * container is an ordinary one */
+ph_result_t ph_json_lazy_force(ph_variant_t *var);
+
+/* Counts off an array slot that was NULL and now holds a value,
+ * releasing the lazy state once every slot has one */
+void ph_json_lazy_slot_filled(ph_variant_t *arr);
+
+void ph_json_lazy_free(struct ph_var_lazy *lazy);
+
+// The lazy state of a container, or NULL if it is fully built
+static inline struct ph_var_lazy *ph_var_lazy_of(ph_variant_t *var)
+{
+  switch (var->type) {
+    case PH_VAR_ARRAY:
+      return var->u.aval.lazy;
+    case PH_VAR_OBJECT:
+      return var->u.oval.lazy;
+    default:
+      return NULL;
+  }
+}
+
+/* Provided by variant.c: looks up key among the values that have been
+ * built, without building it.  Returns a borrowed reference. */
+ph_variant_t *_ph_var_object_get_built(ph_variant_t *obj, ph_string_t *key);
+
+#endif
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -25,6 +25,9 @@
 #include "phenom/sysutil.h"
 #include "phenom/log.h"
 #include "phenom/printf.h"
+#include "phenom/thread.h"
+#include "corelib/variant/json-index.h"
+#include "corelib/variant/json-load.h"
 #include <assert.h>
 
 #define STREAM_STATE_OK        0
@@ -48,8 +51,18 @@
 #define l_isxdigit(c) \
     (l_isdigit(c) || ('A' <= (c) && (c) <= 'F') || ('a' <= (c) && (c) <= 'f'))
 
+/* The lexer reads from a window of contiguous input, [pos, end).  When
+ * loading from memory, the window is the whole input.  When loading
+ * from a buffered stream, it is the stream's read buffer, borrowed via
+ * ph_stm_peek(); only the bytes that we used are consumed from the
+ * stream, so consecutive values can be loaded from it with
+ * PH_JSON_DISABLE_EOF_CHECK.  Unbuffered streams are read a byte at a
+ * time for the same reason. */
 typedef struct {
   ph_stream_t *stm;
+  const unsigned char *start, *pos, *end;
+  unsigned char byte;
+  /* the current code point; bytes can be pushed back into here */
   char buffer[5];
   size_t buffer_pos;
   int state;
@@ -67,15 +80,22 @@ typedef struct {
     int64_t integer;
     double real;
   } value;
+  /* length of value.string */
+  uint32_t string_len;
+  /* if non-NULL, the document is built in this arena */
+  ph_arena_t *arena;
   char saved_buf[512];
 } lex_t;
 
 #define stream_to_lex(stream) ph_container_of(stream, lex_t, stream)
 
-static ph_memtype_t mt_json;
+static ph_memtype_t mt_json, mt_json_arena;
 static struct ph_memtype_def def = {
   "variant", "json", 0, 0
 };
+static struct ph_memtype_def arena_def = {
+  "variant", "json_arena", 0, 0
+};
 
 
 /*** error reporting ***/
@@ -150,9 +170,13 @@ static void error_set_oom(ph_var_err_t *error, const lex_t *lex)
 
 /*** lexical analyzer ***/
 
-static void stream_init(stream_t *stream, ph_stream_t *stm)
+static void stream_init(stream_t *stream, ph_stream_t *stm,
+    const char *buf, uint32_t len)
 {
   stream->stm = stm;
+  stream->start = (const unsigned char*)buf;
+  stream->pos = stream->start;
+  stream->end = stream->start + len;
   stream->buffer[0] = '\0';
   stream->buffer_pos = 0;
 
@@ -162,16 +186,82 @@ static void stream_init(stream_t *stream, ph_stream_t *stm)
   stream->position = 0;
 }
 
-static int stream_getc(stream_t *stream)
+static bool stream_fill(stream_t *stream)
+{
+  const void *buf;
+  uint64_t len = 0;
+  ph_stream_t *stm = stream->stm;
+
+  if (!stm) {
+    return false;
+  }
+
+  if (stm->bufsize == 0) {
+    stream->start = stream->pos = stream->end = NULL;
+    if (!ph_stm_read(stm, &stream->byte, 1, &len) || len == 0) {
+      return false;
+    }
+    buf = &stream->byte;
+  } else {
+    ph_stm_consume(stm, stream->end - stream->start);
+    stream->start = stream->pos = stream->end = NULL;
+    if (!ph_stm_peek(stm, &buf, &len) || len == 0) {
+      return false;
+    }
+  }
+
+  stream->start = buf;
+  stream->pos = stream->start;
+  stream->end = stream->start + len;
+  return true;
+}
+
+// Gives back whatever is left of a borrowed stream buffer
+static void stream_close(stream_t *stream)
 {
-  uint8_t buf;
-  uint64_t nread = 0;
+  if (stream->stm && stream->stm->bufsize && stream->start) {
+    ph_stm_consume(stream->stm, stream->pos - stream->start);
+  }
+}
 
-  if (!ph_stm_read(stream->stm, &buf, 1, &nread) || nread == 0) {
+static inline int stream_getc(stream_t *stream)
+{
+  if (ph_unlikely(stream->pos == stream->end) && !stream_fill(stream)) {
     stream->state = STREAM_STATE_EOF;
     return STREAM_STATE_EOF;
   }
-  return (int)buf;
+  return *stream->pos++;
+}
+
+static inline bool stream_cached(stream_t *stream)
+{
+  return stream->buffer[stream->buffer_pos] != '\0';
+}
+
+/* Skips whitespace directly in the input window */
+static void stream_skip_space(stream_t *stream)
+{
+  const unsigned char *p;
+
+  if (stream->state != STREAM_STATE_OK || stream_cached(stream)) {
+    return;
+  }
+
+  do {
+    for (p = stream->pos; p < stream->end; p++) {
+      if (*p == '\n') {
+        stream->line++;
+        stream->last_column = stream->column;
+        stream->column = 0;
+      } else if (*p == ' ' || *p == '\t' || *p == '\r') {
+        stream->column++;
+      } else {
+        break;
+      }
+    }
+    stream->position += p - stream->pos;
+    stream->pos = p;
+  } while (p == stream->end && stream_fill(stream));
 }
 
 static int utf8_check_full(const char *buffer, int size)
@@ -307,11 +397,16 @@ static int lex_get(lex_t *lex, ph_var_err_t *error)
   return stream_get(&lex->stream, error);
 }
 
-static void lex_save(lex_t *lex, int c)
+static inline void lex_save(lex_t *lex, int c)
 {
   char b = (uint8_t)c;
+  ph_string_t *str = &lex->saved_text;
 
-  ph_string_append_buf(&lex->saved_text, &b, 1);
+  if (ph_likely(str->len < str->alloc)) {
+    str->buf[str->len++] = b;
+    return;
+  }
+  ph_string_append_buf(str, &b, 1);
 }
 
 static int lex_get_save(lex_t *lex, ph_var_err_t *error)
@@ -340,6 +435,50 @@ static void lex_unget_unsave(lex_t *lex, int c)
   }
 }
 
+/* Saves a run of plain string characters straight from the input
+ * window, stopping at anything that needs a closer look: quotes,
+ * escapes, control characters and UTF-8 sequences that are invalid or
+ * cross the end of the window. */
+static void lex_save_run(lex_t *lex)
+{
+  stream_t *stream = &lex->stream;
+  const unsigned char *p, *run;
+  uint8_t n;
+
+  if (stream->state != STREAM_STATE_OK || stream_cached(stream)) {
+    return;
+  }
+
+  do {
+    run = stream->pos;
+    p = run;
+    while (p < stream->end) {
+      if (*p >= 0x20 && *p < 0x80) {
+        if (*p == '"' || *p == '\\') {
+          break;
+        }
+        p++;
+      } else if (*p >= 0x80) {
+        n = ph_utf8_seq_len(*p);
+        if (n < 2 || n > stream->end - p ||
+            !utf8_check_full((const char*)p, n)) {
+          break;
+        }
+        p += n;
+      } else {
+        break;
+      }
+      stream->column++;
+    }
+    if (p == run) {
+      return;
+    }
+    ph_string_append_buf(&lex->saved_text, (const char*)run, p - run);
+    stream->position += p - run;
+    stream->pos = p;
+  } while (p == stream->end && stream_fill(stream));
+}
+
 static void lex_save_cached(lex_t *lex)
 {
   while (lex->stream.buffer[lex->stream.buffer_pos] != '\0') {
@@ -408,10 +547,12 @@ static void lex_scan_string(lex_t *lex, ph_var_err_t *error)
   const char *p;
   char *t;
   int i;
+  bool escaped = false;
 
   lex->value.string = NULL;
   lex->token = TOKEN_INVALID;
 
+  lex_save_run(lex);
   c = lex_get_save(lex, error);
 
   while (c != '"') {
@@ -430,6 +571,7 @@ static void lex_scan_string(lex_t *lex, ph_var_err_t *error)
       }
       goto out;
     } else if (c == '\\') {
+      escaped = true;
       c = lex_get_save(lex, error);
       if (c == 'u') {
         c = lex_get_save(lex, error);
@@ -448,6 +590,7 @@ static void lex_scan_string(lex_t *lex, ph_var_err_t *error)
         goto out;
       }
     } else {
+      lex_save_run(lex);
       c = lex_get_save(lex, error);
     }
   }
@@ -473,6 +616,15 @@ static void lex_scan_string(lex_t *lex, ph_var_err_t *error)
   /* + 1 to skip the " */
   p = lex->saved_text.buf + 1;
 
+  if (!escaped) {
+    // The common case: the text between the quotes is the value
+    lex->string_len = ph_string_len(&lex->saved_text) - 2;
+    memcpy(t, p, lex->string_len);
+    t[lex->string_len] = '\0';
+    lex->token = TOKEN_STRING;
+    return;
+  }
+
   while (*p != '"') {
     if (*p == '\\') {
       p++;
@@ -543,6 +695,7 @@ static void lex_scan_string(lex_t *lex, ph_var_err_t *error)
     }
   }
   *t = '\0';
+  lex->string_len = t - lex->value.string;
   lex->token = TOKEN_STRING;
   return;
 
@@ -694,6 +847,7 @@ static int lex_scan(lex_t *lex, ph_var_err_t *error)
 
   c = lex_get(lex, error);
   while (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+    stream_skip_space(&lex->stream);
     c = lex_get(lex, error);
   }
 
@@ -755,24 +909,40 @@ static ph_string_t *lex_steal_string(lex_t *lex)
     return 0;
   }
 
-  len = strlen(lex->value.string);
-  str = ph_string_make_claim(mt_json, lex->value.string, len, len);
+  len = lex->string_len;
+  if (lex->arena) {
+    // Copy, leaving value.string to be freed by the next lex_scan()
+    return ph_string_make_arena(lex->arena, lex->value.string, len);
+  }
+  str = ph_string_make_claim(mt_json, lex->value.string, len, len + 1);
   if (str) {
     lex->value.string = NULL;
   }
   return str;
 }
 
+static ph_string_t *lex_key(lex_t *lex, size_t flags)
+{
+  ph_string_t *str = NULL;
+
+  if (flags & PH_JSON_INTERN_KEYS) {
+    str = ph_string_intern(lex->value.string, lex->string_len);
+  }
+  return str ? str : lex_steal_string(lex);
+}
+
 static void init_json_mem(void)
 {
   mt_json = ph_memtype_register(&def);
+  mt_json_arena = ph_memtype_register(&arena_def);
 }
 PH_LIBRARY_INIT(init_json_mem, 0)
 
-static int lex_init(lex_t *lex, ph_stream_t *stm)
+static int lex_init(lex_t *lex, ph_stream_t *stm,
+    const char *buf, uint32_t len)
 {
   memset(lex, 0, sizeof(*lex));
-  stream_init(&lex->stream, stm);
+  stream_init(&lex->stream, stm, buf, len);
 
   ph_string_init_claim(&lex->saved_text, PH_STRING_GROW_MT(mt_json),
       lex->saved_buf, 0, sizeof(lex->saved_buf));
@@ -786,6 +956,7 @@ static void lex_close(lex_t *lex)
   if (lex->token == TOKEN_STRING) {
     ph_mem_free(mt_json, lex->value.string);
   }
+  stream_close(&lex->stream);
 
   ph_string_delref(&lex->saved_text);
 }
@@ -793,13 +964,23 @@ static void lex_close(lex_t *lex)
 
 /*** parser ***/
 
+static inline ph_variant_t *make_object(ph_arena_t *arena)
+{
+  return arena ? ph_var_object_arena(arena, 8) : ph_var_object(8);
+}
+
+static inline ph_variant_t *make_array(ph_arena_t *arena)
+{
+  return arena ? ph_var_array_arena(arena, 8) : ph_var_array(8);
+}
+
 static ph_variant_t *parse_value(lex_t *lex, size_t flags,
     ph_var_err_t *error);
 
 static ph_variant_t *parse_object(lex_t *lex, size_t flags,
     ph_var_err_t *error)
 {
-  ph_variant_t *object = ph_var_object(8);
+  ph_variant_t *object = make_object(lex->arena);
 
   if (!object) {
     error_set_oom(error, lex);
@@ -820,7 +1001,7 @@ static ph_variant_t *parse_object(lex_t *lex, size_t flags,
       goto error;
     }
 
-    key = lex_steal_string(lex);
+    key = lex_key(lex, flags);
     if (!key) {
       return NULL;
     }
@@ -876,7 +1057,7 @@ error:
 
 static ph_variant_t *parse_array(lex_t *lex, size_t flags, ph_var_err_t *error)
 {
-  ph_variant_t *array = ph_var_array(8);
+  ph_variant_t *array = make_array(lex->arena);
 
   if (!array) {
     error_set_oom(error, lex);
@@ -927,7 +1108,12 @@ static ph_variant_t *parse_value(lex_t *lex, size_t flags, ph_var_err_t *error)
 
   switch (lex->token) {
     case TOKEN_STRING:
-      str = ph_string_make_cstr(mt_json, lex->value.string);
+      if (lex->arena) {
+        json = ph_var_string_arena(lex->arena, lex->value.string,
+            lex->string_len);
+        break;
+      }
+      str = lex_steal_string(lex);
       if (str) {
         json = ph_var_string_claim(str);
         if (!json) {
@@ -937,11 +1123,19 @@ static ph_variant_t *parse_value(lex_t *lex, size_t flags, ph_var_err_t *error)
       break;
 
     case TOKEN_INTEGER:
-      json = ph_var_int(lex->value.integer);
+      if (lex->arena) {
+        json = ph_var_int_arena(lex->arena, lex->value.integer);
+      } else {
+        json = ph_var_int(lex->value.integer);
+      }
       break;
 
     case TOKEN_REAL:
-      json = ph_var_double(lex->value.real);
+      if (lex->arena) {
+        json = ph_var_double_arena(lex->arena, lex->value.real);
+      } else {
+        json = ph_var_double(lex->value.real);
+      }
       break;
 
     case TOKEN_TRUE:
@@ -988,11 +1182,13 @@ static ph_variant_t *parse_json(lex_t *lex, size_t flags, ph_var_err_t *error)
   }
 
   lex_scan(lex, error);
-  if (!(flags & PH_JSON_DECODE_ANY)) {
-    if (lex->token != '[' && lex->token != '{') {
+  if (lex->token != '[' && lex->token != '{') {
+    if (!(flags & PH_JSON_DECODE_ANY)) {
       error_set(error, lex, "'[' or '{' expected");
       return NULL;
     }
+    // Only a container can own the arena
+    lex->arena = NULL;
   }
 
   result = parse_value(lex, flags, error);
@@ -1016,48 +1212,581 @@ static ph_variant_t *parse_json(lex_t *lex, size_t flags, ph_var_err_t *error)
   return result;
 }
 
+/* Makes the arena for a PH_JSON_ARENA load of len bytes of text, or
+ * of a stream if len is 0.  Even small values take the best part of a
+ * hundred bytes as variants, so the chunks are a few times the size of
+ * the text, to keep the number of them down. */
+static ph_arena_t *doc_arena_new(uint32_t len, ph_var_err_t *err)
+{
+  uint64_t size = len ? MIN((uint64_t)len * 4, 1 << 20) : 64 * 1024;
+  ph_arena_t *arena;
+
+  arena = ph_arena_new(mt_json_arena, MAX(size, 8192));
+  if (!arena && err) {
+    err->text[0] = 0;
+    error_set_oom(err, NULL);
+  }
+  return arena;
+}
+
+/* Hands the arena to the root of the document, if the load succeeded
+ * and built one there.  Otherwise nothing refers to it any more. */
+static ph_variant_t *doc_arena_finish(ph_arena_t *arena, ph_variant_t *v)
+{
+  if (!v || ph_var_own_arena(v) != PH_OK) {
+    ph_arena_destroy(arena);
+  }
+  return v;
+}
+
 ph_variant_t *ph_json_load_stream(ph_stream_t *stm, uint32_t flags,
     ph_var_err_t *err)
 {
+  ph_arena_t *arena = NULL;
   lex_t lex;
   ph_variant_t *v;
 
-  lex_init(&lex, stm);
+  if (flags & PH_JSON_ARENA) {
+    arena = doc_arena_new(0, err);
+    if (!arena) {
+      return NULL;
+    }
+  }
+
+  lex_init(&lex, stm, NULL, 0);
+  lex.arena = arena;
   v = parse_json(&lex, flags, err);
   lex_close(&lex);
 
+  return arena ? doc_arena_finish(arena, v) : v;
+}
+
+/*** helpers shared with the other parsers ***/
+
+static bool is_hex4(const char *p)
+{
+  return l_isxdigit(p[1]) && l_isxdigit(p[2]) &&
+    l_isxdigit(p[3]) && l_isxdigit(p[4]);
+}
+
+bool ph_json_unescape(const char *p, const char *end, char *t,
+    uint32_t *len)
+{
+  char *start = t;
+  int32_t value, value2;
+  int length;
+
+  while (p < end) {
+    if (*p != '\\') {
+      *t++ = *p++;
+      continue;
+    }
+    p++;
+    switch (*p) {
+      case '"': case '\\': case '/':
+        *t++ = *p++;
+        break;
+      case 'b': *t++ = '\b'; p++; break;
+      case 'f': *t++ = '\f'; p++; break;
+      case 'n': *t++ = '\n'; p++; break;
+      case 'r': *t++ = '\r'; p++; break;
+      case 't': *t++ = '\t'; p++; break;
+      case 'u':
+        if (end - p < 5 || !is_hex4(p)) {
+          return false;
+        }
+        value = decode_unicode_escape(p);
+        p += 5;
+        if (0xD800 <= value && value <= 0xDBFF) {
+          if (end - p < 6 || p[0] != '\\' || p[1] != 'u' || !is_hex4(p + 1)) {
+            return false;
+          }
+          value2 = decode_unicode_escape(p + 1);
+          p += 6;
+          if (value2 < 0xDC00 || value2 > 0xDFFF) {
+            return false;
+          }
+          value = ((value - 0xD800) << 10) + (value2 - 0xDC00) + 0x10000;
+        } else if ((0xDC00 <= value && value <= 0xDFFF) || value == 0) {
+          return false;
+        }
+        if (utf8_encode(value, t, &length)) {
+          return false;
+        }
+        t += length;
+        break;
+      default:
+        return false;
+    }
+  }
+  *len = t - start;
+  return true;
+}
+
+enum ph_json_number ph_json_parse_number(const char *p, uint32_t len,
+    int64_t *ival, double *dval)
+{
+  const char *s = p, *e = p + len;
+  bool real = false;
+  char tmp[64];
+  char *end;
+  ph_string_t str;
+  enum ph_json_number res = PH_JSON_NUM_INVALID;
+
+  // Stricter than strtod: just the JSON number grammar
+  if (s < e && *s == '-') {
+    s++;
+  }
+  if (s < e && *s == '0') {
+    s++;
+  } else if (s < e && l_isdigit(*s)) {
+    while (s < e && l_isdigit(*s)) {
+      s++;
+    }
+  } else {
+    return PH_JSON_NUM_INVALID;
+  }
+  if (s < e && *s == '.') {
+    real = true;
+    if (++s == e || !l_isdigit(*s)) {
+      return PH_JSON_NUM_INVALID;
+    }
+    while (s < e && l_isdigit(*s)) {
+      s++;
+    }
+  }
+  if (s < e && (*s == 'e' || *s == 'E')) {
+    real = true;
+    s++;
+    if (s < e && (*s == '+' || *s == '-')) {
+      s++;
+    }
+    if (s == e || !l_isdigit(*s)) {
+      return PH_JSON_NUM_INVALID;
+    }
+    while (s < e && l_isdigit(*s)) {
+      s++;
+    }
+  }
+  if (s != e) {
+    return PH_JSON_NUM_INVALID;
+  }
+
+  // strtoll and strtod want a NUL terminated copy
+  ph_string_init_claim(&str, PH_STRING_GROW_MT(mt_json), tmp, 0, sizeof(tmp));
+  if (ph_string_append_buf(&str, p, len) != PH_OK ||
+      ph_string_append_buf(&str, "\0", 1) != PH_OK) {
+    goto out;
+  }
+  str.len--;
+
+  if (!real) {
+    errno = 0;
+    *ival = strtoll(str.buf, &end, 10);
+    res = errno == ERANGE ? PH_JSON_NUM_RANGE : PH_JSON_NUM_INT;
+  } else if (ugh_strtod(&str, dval)) {
+    res = PH_JSON_NUM_RANGE;
+  } else {
+    res = PH_JSON_NUM_REAL;
+  }
+
+out:
+  ph_string_delref(&str);
+  return res;
+}
+
+ph_variant_t *ph_json_scalar_value(const char *p, uint32_t len,
+    ph_arena_t *arena)
+{
+  int64_t ivalue;
+  double dvalue;
+
+  switch (*p) {
+    case 't':
+      return len == 4 && !memcmp(p, "true", 4) ? ph_var_bool(true) : NULL;
+    case 'f':
+      return len == 5 && !memcmp(p, "false", 5) ? ph_var_bool(false) : NULL;
+    case 'n':
+      return len == 4 && !memcmp(p, "null", 4) ? ph_var_null() : NULL;
+  }
+
+  switch (ph_json_parse_number(p, len, &ivalue, &dvalue)) {
+    case PH_JSON_NUM_INT:
+      return arena ? ph_var_int_arena(arena, ivalue) : ph_var_int(ivalue);
+    case PH_JSON_NUM_REAL:
+      if (arena) {
+        return ph_var_double_arena(arena, dvalue);
+      }
+      return ph_var_double(dvalue);
+    default:
+      return NULL;
+  }
+}
+
+#ifndef PH_NO_JSON_SIMD
+/*** indexed parser ***/
+
+/* Stage two of the indexed loader walks the structural index built by
+ * json-index.c.  It only accepts valid documents; at the first sign of
+ * trouble it gives up and load_buf() parses again with the lexer, so
+ * that errors are described exactly as they always have been. */
+
+typedef struct {
+  const char *buf;
+  uint32_t len;
+  const uint32_t *pos;
+  uint32_t n, cur;
+  uint32_t flags;
+  ph_arena_t *arena;
+} ix_t;
+
+static ph_variant_t *ix_value(ix_t *ix);
+
+static inline int ix_peek(ix_t *ix)
+{
+  return ix->cur < ix->n ? ix->buf[ix->pos[ix->cur]] : 0;
+}
+
+// Decodes the escapes of a string that was copied into the arena
+static bool unescape_in_place(ph_string_t *str)
+{
+  uint32_t len;
+
+  if (!memchr(str->buf, '\\', str->len)) {
+    return true;
+  }
+  if (!ph_json_unescape(str->buf, str->buf + str->len, str->buf, &len)) {
+    return false;
+  }
+  str->buf[len] = '\0';
+  str->len = len;
+  return true;
+}
+
+static ph_string_t *ix_string(ix_t *ix)
+{
+  uint32_t start, end, len;
+  ph_string_t *str;
+  char *buf;
+
+  // cur is the opening quote; stage one guarantees that the next
+  // entry is the closing quote
+  start = ix->pos[ix->cur] + 1;
+  end = ix->pos[ix->cur + 1];
+  ix->cur += 2;
+
+  if (ix->arena) {
+    str = ph_string_make_arena(ix->arena, ix->buf + start, end - start);
+    if (!str || !unescape_in_place(str)) {
+      return NULL;
+    }
+    return str;
+  }
+
+  // As in the lexer, the value is never longer than its source text
+  buf = ph_mem_alloc_size(mt_json, end - start + 1);
+  if (!buf) {
+    return NULL;
+  }
+  if (!memchr(ix->buf + start, '\\', end - start)) {
+    len = end - start;
+    memcpy(buf, ix->buf + start, len);
+  } else if (!ph_json_unescape(ix->buf + start, ix->buf + end, buf, &len)) {
+    ph_mem_free(mt_json, buf);
+    return NULL;
+  }
+  buf[len] = '\0';
+
+  str = ph_string_make_claim(mt_json, buf, len, end - start + 1);
+  if (!str) {
+    ph_mem_free(mt_json, buf);
+  }
+  return str;
+}
+
+static ph_string_t *ix_key(ix_t *ix)
+{
+  uint32_t start = ix->pos[ix->cur] + 1, end = ix->pos[ix->cur + 1];
+  ph_string_t *str;
+
+  if (!(ix->flags & PH_JSON_INTERN_KEYS) ||
+      memchr(ix->buf + start, '\\', end - start)) {
+    return ix_string(ix);
+  }
+  str = ph_string_intern(ix->buf + start, end - start);
+  if (!str) {
+    return ix_string(ix);
+  }
+  ix->cur += 2;
+  return str;
+}
+
+static ph_variant_t *ix_scalar(ix_t *ix)
+{
+  uint32_t start, end;
+
+  start = ix->pos[ix->cur++];
+  end = ix->cur < ix->n ? ix->pos[ix->cur] : ix->len;
+  // Only whitespace can separate a scalar from the next entry
+  while (end > start && (ix->buf[end - 1] == ' ' ||
+        ix->buf[end - 1] == '\t' || ix->buf[end - 1] == '\n' ||
+        ix->buf[end - 1] == '\r')) {
+    end--;
+  }
+  return ph_json_scalar_value(ix->buf + start, end - start, ix->arena);
+}
+
+static ph_variant_t *ix_object(ix_t *ix)
+{
+  ph_variant_t *object, *value;
+  ph_string_t *key;
+  int c;
+
+  object = make_object(ix->arena);
+  if (!object) {
+    return NULL;
+  }
+
+  ix->cur++;
+  if (ix_peek(ix) == '}') {
+    ix->cur++;
+    return object;
+  }
+
+  while (1) {
+    if (ix_peek(ix) != '"') {
+      goto error;
+    }
+    key = ix_key(ix);
+    if (!key) {
+      goto error;
+    }
+    if ((ix->flags & PH_JSON_REJECT_DUPLICATES) &&
+        ph_var_object_get(object, key)) {
+      ph_string_delref(key);
+      goto error;
+    }
+
+    if (ix_peek(ix) != ':') {
+      ph_string_delref(key);
+      goto error;
+    }
+    ix->cur++;
+
+    value = ix_value(ix);
+    if (!value) {
+      ph_string_delref(key);
+      goto error;
+    }
+    if (ph_var_object_set_claim_kv(object, key, value) != PH_OK) {
+      ph_string_delref(key);
+      ph_var_delref(value);
+      goto error;
+    }
+
+    c = ix_peek(ix);
+    if (c == '}') {
+      ix->cur++;
+      return object;
+    }
+    if (c != ',') {
+      goto error;
+    }
+    ix->cur++;
+  }
+
+error:
+  ph_var_delref(object);
+  return NULL;
+}
+
+static ph_variant_t *ix_array(ix_t *ix)
+{
+  ph_variant_t *array, *elem;
+  int c;
+
+  array = make_array(ix->arena);
+  if (!array) {
+    return NULL;
+  }
+
+  ix->cur++;
+  if (ix_peek(ix) == ']') {
+    ix->cur++;
+    return array;
+  }
+
+  while (1) {
+    elem = ix_value(ix);
+    if (!elem) {
+      goto error;
+    }
+    if (ph_var_array_append_claim(array, elem) != PH_OK) {
+      ph_var_delref(elem);
+      goto error;
+    }
+
+    c = ix_peek(ix);
+    if (c == ']') {
+      ix->cur++;
+      return array;
+    }
+    if (c != ',') {
+      goto error;
+    }
+    ix->cur++;
+  }
+
+error:
+  ph_var_delref(array);
+  return NULL;
+}
+
+static ph_variant_t *ix_value(ix_t *ix)
+{
+  ph_variant_t *v;
+  ph_string_t *str;
+
+  switch (ix_peek(ix)) {
+    case '{':
+      return ix_object(ix);
+    case '[':
+      return ix_array(ix);
+    case '"':
+      if (ix->arena) {
+        // Skip the ph_string_t that ix_string() would make
+        v = ph_var_string_arena(ix->arena,
+            ix->buf + ix->pos[ix->cur] + 1,
+            ix->pos[ix->cur + 1] - ix->pos[ix->cur] - 1);
+        ix->cur += 2;
+        if (v && !unescape_in_place(v->u.sval)) {
+          v = NULL;
+        }
+        return v;
+      }
+      str = ix_string(ix);
+      if (!str) {
+        return NULL;
+      }
+      v = ph_var_string_claim(str);
+      if (!v) {
+        ph_string_delref(str);
+      }
+      return v;
+    case '}': case ']': case ':': case ',': case 0:
+      return NULL;
+    default:
+      return ix_scalar(ix);
+  }
+}
+
+static ph_variant_t *load_indexed(const char *buf, uint32_t len,
+    uint32_t flags, ph_arena_t *arena, ph_var_err_t *err)
+{
+  struct ph_json_index index;
+  ph_variant_t *v = NULL;
+  ix_t ix;
+  int c;
+
+  memset(&index, 0, sizeof(index));
+  if (!ph_json_index_build(&index, buf, len)) {
+    goto out;
+  }
+
+  ix.buf = buf;
+  ix.len = len;
+  ix.pos = index.pos;
+  ix.n = index.n;
+  ix.cur = 0;
+  ix.flags = flags;
+  ix.arena = arena;
+
+  c = ix_peek(&ix);
+  if (c != '[' && c != '{') {
+    if (!(flags & PH_JSON_DECODE_ANY)) {
+      goto out;
+    }
+    // Only a container can own the arena
+    ix.arena = NULL;
+  }
+
+  v = ix_value(&ix);
+  if (v && ix.cur != ix.n) {
+    // trailing garbage
+    ph_var_delref(v);
+    v = NULL;
+  }
+
+  if (v && err) {
+    err->text[0] = 0;
+    err->transient = false;
+    err->position = len;
+  }
+
+out:
+  ph_json_index_free(&index);
   return v;
 }
+#endif
 
-ph_variant_t *ph_json_load_string(ph_string_t *str, uint32_t flags,
+static ph_variant_t *load_buf(const char *buf, uint32_t len, uint32_t flags,
     ph_var_err_t *err)
 {
-  ph_stream_t *stm;
+  ph_arena_t *arena = NULL;
+  lex_t lex;
   ph_variant_t *v;
 
-  stm = ph_stm_string_open(str);
-  if (!stm) {
-    if (err) {
-      error_set_oom(err, NULL);
+  if (flags & PH_JSON_ARENA) {
+    arena = doc_arena_new(len, err);
+    if (!arena) {
+      return NULL;
     }
-    return 0;
   }
 
-  v = ph_json_load_stream(stm, flags, err);
+  // Saves each key from entering and leaving an epoch to intern it
+  if (flags & PH_JSON_INTERN_KEYS) {
+    ph_thread_epoch_begin();
+  }
+
+#ifndef PH_NO_JSON_SIMD
+  // Indexing looks at all of the input, which is wasted effort when
+  // the caller only wants the first of several values
+  if ((flags & (PH_JSON_NO_SIMD|PH_JSON_DISABLE_EOF_CHECK)) == 0) {
+    v = load_indexed(buf, len, flags, arena, err);
+    if (v) {
+      goto out;
+    }
+    if (arena) {
+      // discard whatever was built before the indexed parser gave up
+      ph_arena_reset(arena);
+    }
+  }
+#endif
 
-  ph_stm_close(stm);
+  lex_init(&lex, NULL, buf, len);
+  lex.arena = arena;
+  v = parse_json(&lex, flags, err);
+  lex_close(&lex);
 
-  return v;
+#ifndef PH_NO_JSON_SIMD
+out:
+#endif
+  if (flags & PH_JSON_INTERN_KEYS) {
+    ph_thread_epoch_end();
+  }
+  return arena ? doc_arena_finish(arena, v) : v;
 }
 
-ph_variant_t *ph_json_load_cstr(const char *cstr, uint32_t flags,
+ph_variant_t *ph_json_load_string(ph_string_t *str, uint32_t flags,
     ph_var_err_t *err)
 {
-  ph_string_t str;
-  uint32_t len = strlen(cstr);
+  return load_buf(str->buf, str->len, flags, err);
+}
 
-  ph_string_init_claim(&str, PH_STRING_STATIC, (char*)cstr, len, len);
-  return ph_json_load_string(&str, flags, err);
+ph_variant_t *ph_json_load_cstr(const char *cstr, uint32_t flags,
+    ph_var_err_t *err)
+{
+  return load_buf(cstr, strlen(cstr), flags, err);
 }
 
 /* These live in here because they have access to the mt_json memtype
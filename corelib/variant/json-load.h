@@ -0,0 +1,50 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CORELIB_VARIANT_JSON_LOAD_H
+#define CORELIB_VARIANT_JSON_LOAD_H
+
+/* Token decoding that json-load.c shares with the other JSON parsers */
+
+/* Decodes the escapes in the text of a string, which lies between p and
+ * end, into t.  The output is never longer than the input, so t may be
+ * p.  Stores the length of the output in *len.  Returns false if there
+ * is an invalid escape or an escape for an invalid code point. */
+bool ph_json_unescape(const char *p, const char *end, char *t,
+    uint32_t *len);
+
+enum ph_json_number {
+  PH_JSON_NUM_INVALID,
+  PH_JSON_NUM_INT,
+  PH_JSON_NUM_REAL,
+  /* a valid number that doesn't fit its type */
+  PH_JSON_NUM_RANGE,
+};
+
+/* Parses len bytes at p, which must be exactly a JSON number */
+enum ph_json_number ph_json_parse_number(const char *p, uint32_t len,
+    int64_t *ival, double *dval);
+
+/* Makes a variant of len bytes at p, which must be exactly true, false,
+ * null or a number.  Returns NULL if they aren't, or if the number
+ * doesn't fit.  Numbers are allocated from arena, if it isn't NULL. */
+ph_variant_t *ph_json_scalar_value(const char *p, uint32_t len,
+    ph_arena_t *arena);
+
+#endif
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -0,0 +1,461 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phenom/sysutil.h"
+#include "phenom/printf.h"
+#include "corelib/variant/json-number.h"
+
+/* Number formatting for the JSON encoder.
+ *
+ * Doubles are printed with the fewest digits that read back as the
+ * same value, using Ulf Adams' Ryu algorithm ("Ryu: fast float-to-string
+ * conversion", PLDI 2018).  Ryu multiplies the binary mantissa by a
+ * 125 bit approximation of a power of five; rather than carry ten
+ * kilobytes of tables in the source, we compute them exactly with a
+ * small bignum when the library is initialized. */
+
+static const char digit_pairs[201] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+// Writes the digits of v, which has exactly len of them, ending at end
+static inline void write_digits(char *end, uint64_t v)
+{
+  while (v >= 100) {
+    end -= 2;
+    memcpy(end, digit_pairs + (v % 100) * 2, 2);
+    v /= 100;
+  }
+  if (v >= 10) {
+    memcpy(end - 2, digit_pairs + v * 2, 2);
+  } else {
+    end[-1] = '0' + v;
+  }
+}
+
+static inline uint32_t count_digits(uint64_t v)
+{
+  uint32_t n = 1;
+
+  while (v >= 10000) {
+    v /= 10000;
+    n += 4;
+  }
+  while (v >= 10) {
+    v /= 10;
+    n++;
+  }
+  return n;
+}
+
+uint32_t ph_json_format_int(char *buf, int64_t ival)
+{
+  uint64_t v = ival < 0 ? -(uint64_t)ival : (uint64_t)ival;
+  uint32_t len = count_digits(v), neg = ival < 0;
+
+  if (neg) {
+    buf[0] = '-';
+  }
+  write_digits(buf + neg + len, v);
+  return neg + len;
+}
+
+// The way we always did it, for when Ryu isn't available, and for
+// infinities and NaN
+static uint32_t format_real_printf(char *buf, double value)
+{
+  int ret;
+  char *start, *end;
+  uint32_t length;
+
+  ret = ph_snprintf(buf, PH_JSON_REAL_MAX, "%.17g", value);
+  if (ret < 0 || ret >= PH_JSON_REAL_MAX - 3) {
+    return 0;
+  }
+  length = ret;
+
+  /* Make sure there's a dot or 'e' in the output. Otherwise
+     a real is converted to an integer when decoding */
+  if (strchr(buf, '.') == NULL && strchr(buf, 'e') == NULL) {
+    buf[length] = '.';
+    buf[length + 1] = '0';
+    buf[length + 2] = '\0';
+    length += 2;
+  }
+
+  /* Remove leading '+' from positive exponent. Also remove leading
+     zeros from exponents (added by some printf() implementations) */
+  start = strchr(buf, 'e');
+  if (start) {
+    start++;
+    end = start + 1;
+
+    if (*start == '-')
+      start++;
+
+    while (*end == '0')
+      end++;
+
+    if (end != start) {
+      memmove(start, end, length - (end - buf));
+      length -= end - start;
+    }
+  }
+
+  return length;
+}
+
+#ifdef __SIZEOF_INT128__
+#define MANTISSA_BITS 52
+#define EXPONENT_BITS 11
+#define BIAS 1023
+#define POW5_INV_BITCOUNT 125
+#define POW5_BITCOUNT 125
+#define POW5_INV_TABLE_SIZE 342
+#define POW5_TABLE_SIZE 326
+
+// Each is a 128 bit value, low half first
+static uint64_t pow5_inv_split[POW5_INV_TABLE_SIZE][2];
+static uint64_t pow5_split[POW5_TABLE_SIZE][2];
+
+// Large enough for 2^1024, from which the inverses are divided
+#define BIG_LIMBS 33
+
+static uint32_t big_bitlen(const uint32_t *n)
+{
+  int i;
+
+  for (i = BIG_LIMBS - 1; i >= 0; i--) {
+    if (n[i]) {
+      return i * 32 + 32 - __builtin_clz(n[i]);
+    }
+  }
+  return 0;
+}
+
+// Stores the 128 bits of n starting at bit shift, which may be negative
+static void big_bits128(const uint32_t *n, int shift, uint64_t out[2])
+{
+  int b, src;
+
+  out[0] = out[1] = 0;
+  for (b = 0; b < 128; b++) {
+    src = b + shift;
+    if (src >= 0 && src < BIG_LIMBS * 32 &&
+        ((n[src / 32] >> (src % 32)) & 1)) {
+      out[b / 64] |= 1ULL << (b % 64);
+    }
+  }
+}
+
+static void init_json_number(void)
+{
+  uint32_t pow5[BIG_LIMBS], inv[BIG_LIMBS];
+  uint64_t carry;
+  uint32_t i, len;
+  int j, k;
+
+  // pow5 is 5^i, and inv is floor(2^1024 / 5^i)
+  memset(pow5, 0, sizeof(pow5));
+  memset(inv, 0, sizeof(inv));
+  pow5[0] = 1;
+  inv[BIG_LIMBS - 1] = 1;
+
+  for (i = 0; i < POW5_INV_TABLE_SIZE; i++) {
+    len = big_bitlen(pow5);
+    if (i < POW5_TABLE_SIZE) {
+      // the top POW5_BITCOUNT bits of 5^i
+      big_bits128(pow5, (int)len - POW5_BITCOUNT, pow5_split[i]);
+    }
+    // floor(2^j / 5^i) + 1, where j = len - 1 + POW5_INV_BITCOUNT;
+    // the quotient of 2^1024 shifted down has the same floor
+    j = len - 1 + POW5_INV_BITCOUNT;
+    big_bits128(inv, 1024 - j, pow5_inv_split[i]);
+    if (++pow5_inv_split[i][0] == 0) {
+      pow5_inv_split[i][1]++;
+    }
+
+    for (k = 0, carry = 0; k < BIG_LIMBS; k++) {
+      carry += (uint64_t)pow5[k] * 5;
+      pow5[k] = (uint32_t)carry;
+      carry >>= 32;
+    }
+    for (k = BIG_LIMBS - 1, carry = 0; k >= 0; k--) {
+      carry = (carry << 32) | inv[k];
+      inv[k] = (uint32_t)(carry / 5);
+      carry %= 5;
+    }
+  }
+}
+PH_LIBRARY_INIT(init_json_number, 0)
+
+// ceil(log2(5^e)), or 1 for e == 0
+static inline int32_t pow5bits(int32_t e)
+{
+  return ((e * 1217359) >> 19) + 1;
+}
+
+// floor(log10(2^e))
+static inline uint32_t log10_pow2(int32_t e)
+{
+  return (e * 78913) >> 18;
+}
+
+// floor(log10(5^e))
+static inline uint32_t log10_pow5(int32_t e)
+{
+  return (e * 732923) >> 20;
+}
+
+static inline uint32_t pow5_factor(uint64_t v)
+{
+  uint32_t n = 0;
+
+  while (v % 5 == 0) {
+    v /= 5;
+    n++;
+  }
+  return n;
+}
+
+static inline bool multiple_of_pow5(uint64_t v, uint32_t p)
+{
+  return pow5_factor(v) >= p;
+}
+
+static inline bool multiple_of_pow2(uint64_t v, uint32_t p)
+{
+  return (v & ((1ULL << p) - 1)) == 0;
+}
+
+// (m * mul) >> j, where mul is 128 bits and j >= 64
+static inline uint64_t mul_shift(uint64_t m, const uint64_t *mul, int32_t j)
+{
+  __uint128_t b0 = (__uint128_t)m * mul[0];
+  __uint128_t b2 = (__uint128_t)m * mul[1];
+
+  return (uint64_t)(((b0 >> 64) + b2) >> (j - 64));
+}
+
+/* Finds the shortest decimal, output * 10^exp, that reads back as the
+ * double with this mantissa and biased exponent, which must be finite
+ * and non-zero. */
+static void ryu(uint64_t mantissa, uint32_t exponent,
+    uint64_t *output, int32_t *exp)
+{
+  int32_t e2, e10, k, i, j, removed = 0;
+  uint64_t m2, mv, vr, vp, vm, vp_div, vm_div, vr_div;
+  uint32_t q, mm_shift, vr_mod;
+  bool accept_bounds, vm_trailing_zeros = false, vr_trailing_zeros = false;
+  uint8_t last_removed = 0;
+  bool round_up = false;
+
+  if (exponent == 0) {
+    e2 = 1 - BIAS - MANTISSA_BITS - 2;
+    m2 = mantissa;
+  } else {
+    e2 = (int32_t)exponent - BIAS - MANTISSA_BITS - 2;
+    m2 = (1ULL << MANTISSA_BITS) | mantissa;
+  }
+  accept_bounds = (m2 & 1) == 0;
+
+  // The interval of values that round to this double is
+  // [mv - mm_shift - 1, mv + 2] / 4 * 2^e2
+  mv = 4 * m2;
+  mm_shift = mantissa != 0 || exponent <= 1;
+
+  // Convert the interval to decimal
+  if (e2 >= 0) {
+    q = log10_pow2(e2) - (e2 > 3);
+    e10 = q;
+    k = POW5_INV_BITCOUNT + pow5bits(q) - 1;
+    i = -e2 + (int32_t)q + k;
+    vr = mul_shift(4 * m2, pow5_inv_split[q], i);
+    vp = mul_shift(4 * m2 + 2, pow5_inv_split[q], i);
+    vm = mul_shift(4 * m2 - 1 - mm_shift, pow5_inv_split[q], i);
+    if (q <= 21) {
+      // Only one of mp, mv and mm can be a multiple of 5, if any
+      if (mv % 5 == 0) {
+        vr_trailing_zeros = multiple_of_pow5(mv, q);
+      } else if (accept_bounds) {
+        vm_trailing_zeros = multiple_of_pow5(mv - 1 - mm_shift, q);
+      } else {
+        vp -= multiple_of_pow5(mv + 2, q);
+      }
+    }
+  } else {
+    q = log10_pow5(-e2) - (-e2 > 1);
+    e10 = (int32_t)q + e2;
+    i = -e2 - (int32_t)q;
+    k = pow5bits(i) - POW5_BITCOUNT;
+    j = (int32_t)q - k;
+    vr = mul_shift(4 * m2, pow5_split[i], j);
+    vp = mul_shift(4 * m2 + 2, pow5_split[i], j);
+    vm = mul_shift(4 * m2 - 1 - mm_shift, pow5_split[i], j);
+    if (q <= 1) {
+      // mv has at least q trailing zero bits, as it is a multiple of 4
+      vr_trailing_zeros = true;
+      if (accept_bounds) {
+        vm_trailing_zeros = mm_shift == 1;
+      } else {
+        vp--;
+      }
+    } else if (q < 63) {
+      vr_trailing_zeros = multiple_of_pow2(mv, q);
+    }
+  }
+
+  // Remove digits while the interval still holds a shorter number
+  if (vm_trailing_zeros || vr_trailing_zeros) {
+    // Rarely, the bounds are exact and need care
+    while ((vp_div = vp / 10) > (vm_div = vm / 10)) {
+      vm_trailing_zeros &= vm % 10 == 0;
+      vr_div = vr / 10;
+      vr_mod = vr - 10 * vr_div;
+      vr_trailing_zeros &= last_removed == 0;
+      last_removed = vr_mod;
+      vr = vr_div;
+      vp = vp_div;
+      vm = vm_div;
+      removed++;
+    }
+    if (vm_trailing_zeros) {
+      while (vm % 10 == 0) {
+        vr_div = vr / 10;
+        vr_mod = vr - 10 * vr_div;
+        vr_trailing_zeros &= last_removed == 0;
+        last_removed = vr_mod;
+        vr = vr_div;
+        vp /= 10;
+        vm /= 10;
+        removed++;
+      }
+    }
+    if (vr_trailing_zeros && last_removed == 5 && vr % 2 == 0) {
+      // Round half to even
+      last_removed = 4;
+    }
+    *output = vr + ((vr == vm && (!accept_bounds || !vm_trailing_zeros)) ||
+        last_removed >= 5);
+  } else {
+    // The common case
+    if (vp / 100 > vm / 100) {
+      round_up = vr % 100 >= 50;
+      vr /= 100;
+      vp /= 100;
+      vm /= 100;
+      removed += 2;
+    }
+    while (vp / 10 > vm / 10) {
+      round_up = vr % 10 >= 5;
+      vr /= 10;
+      vp /= 10;
+      vm /= 10;
+      removed++;
+    }
+    *output = vr + (vr == vm || round_up);
+  }
+  *exp = e10 + removed;
+}
+
+uint32_t ph_json_format_real(char *buf, double dval)
+{
+  uint64_t bits, mantissa, output;
+  uint32_t exponent, olen, i;
+  int32_t exp, x;
+  char *p = buf;
+
+  memcpy(&bits, &dval, sizeof(bits));
+  mantissa = bits & ((1ULL << MANTISSA_BITS) - 1);
+  exponent = (bits >> MANTISSA_BITS) & ((1u << EXPONENT_BITS) - 1);
+
+  if (exponent == (1u << EXPONENT_BITS) - 1) {
+    return format_real_printf(buf, dval);
+  }
+  if (bits >> 63) {
+    *p++ = '-';
+  }
+  if (exponent == 0 && mantissa == 0) {
+    memcpy(p, "0.0", 3);
+    return p + 3 - buf;
+  }
+
+  ryu(mantissa, exponent, &output, &exp);
+  olen = count_digits(output);
+  // the value is d.ddd * 10^x
+  x = exp + (int32_t)olen - 1;
+
+  // Lay it out as printf's %.17g would
+  if (x < -4 || x >= 17) {
+    write_digits(p + 1 + olen, output);
+    p[0] = p[1];
+    if (olen > 1) {
+      p[1] = '.';
+      p += olen + 1;
+    } else {
+      p++;
+    }
+    *p++ = 'e';
+    if (x < 0) {
+      *p++ = '-';
+      x = -x;
+    }
+    p += ph_json_format_int(p, x);
+  } else if (x < 0) {
+    // 0.000ddd
+    memcpy(p, "0.", 2);
+    p += 2;
+    for (i = 0; i < (uint32_t)(-x - 1); i++) {
+      *p++ = '0';
+    }
+    write_digits(p + olen, output);
+    p += olen;
+  } else if ((uint32_t)x + 1 >= olen) {
+    // ddd000.0
+    write_digits(p + olen, output);
+    p += olen;
+    for (i = olen; i < (uint32_t)x + 1; i++) {
+      *p++ = '0';
+    }
+    memcpy(p, ".0", 2);
+    p += 2;
+  } else {
+    // ddd.ddd
+    write_digits(p + olen + 1, output);
+    memmove(p, p + 1, x + 1);
+    p[x + 1] = '.';
+    p += olen + 1;
+  }
+
+  return p - buf;
+}
+#else
+uint32_t ph_json_format_real(char *buf, double dval)
+{
+  return format_real_printf(buf, dval);
+}
+#endif
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -0,0 +1,36 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CORELIB_VARIANT_JSON_NUMBER_H
+#define CORELIB_VARIANT_JSON_NUMBER_H
+
+// Enough for either of the formatters below
+#define PH_JSON_REAL_MAX 32
+
+/* Writes the decimal form of ival to buf, which must have room for
+ * PH_JSON_REAL_MAX bytes, and returns its length.  No NUL is added. */
+uint32_t ph_json_format_int(char *buf, int64_t ival);
+
+/* Writes the shortest decimal form of dval that reads back as the same
+ * double, laid out as "%.17g" would lay it out, and always with a '.'
+ * or an exponent so that it reads back as a real.  Returns the length,
+ * or 0 if the value can't be formatted.  No NUL is added. */
+uint32_t ph_json_format_real(char *buf, double dval);
+
+#endif
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -0,0 +1,567 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phenom/json.h"
+#include "phenom/sysutil.h"
+#include "phenom/memory.h"
+#include "phenom/printf.h"
+#include "corelib/variant/json-load.h"
+
+/* The SAX parser is a push parser: it is a state machine over the
+ * grammar plus a partially scanned token, so input can be split at
+ * any byte.  Tokens are accumulated in `text` only until they are
+ * complete; containers leave nothing behind but a byte on the stack. */
+
+enum {
+  /* a value: at the top level, or after ':' or ',' in an array */
+  S_VALUE,
+  /* just after '[' */
+  S_VALUE_OR_END,
+  /* just after '{' */
+  S_KEY_OR_END,
+  /* after ',' in an object */
+  S_KEY,
+  S_COLON,
+  S_COMMA_OR_END,
+  /* after a complete top level value */
+  S_DONE,
+};
+
+enum {
+  T_NONE,
+  T_STRING,
+  /* a number, or true, false or null */
+  T_WORD,
+};
+
+struct ph_json_sax {
+  struct ph_json_sax_callbacks cb;
+  void *arg;
+  uint32_t flags;
+  uint8_t state, tok;
+  /* the last byte of the string was an unescaped backslash */
+  bool escape;
+  /* the string has bytes outside of ASCII */
+  bool non_ascii;
+  ph_result_t result;
+  ph_var_err_t error;
+  /* the text of the token in progress */
+  ph_string_t text;
+  /* '{' or '[' for each open container */
+  uint8_t *stack;
+  uint32_t depth, stack_size;
+  int line, column;
+  uint64_t position;
+  char text_buf[256];
+};
+
+#define l_isdigit(c)  ('0' <= (c) && (c) <= '9')
+#define l_isalpha(c)  (('a' <= (c) && (c) <= 'z') || ('A' <= (c) && (c) <= 'Z'))
+
+static ph_memtype_t mt_sax;
+static struct ph_memtype_def def = {
+  "variant", "json_sax", 0, 0
+};
+
+static void init_json_sax(void)
+{
+  mt_sax = ph_memtype_register(&def);
+}
+PH_LIBRARY_INIT(init_json_sax, 0)
+
+static void sax_fail(ph_json_sax_t *sax, ph_result_t res, const char *fmt, ...)
+{
+  va_list ap;
+
+  if (sax->result != PH_OK) {
+    return;
+  }
+  sax->result = res;
+
+  va_start(ap, fmt);
+  ph_vsnprintf(sax->error.text, sizeof(sax->error.text), fmt, ap);
+  va_end(ap);
+  sax->error.line = sax->line;
+  sax->error.column = sax->column;
+  sax->error.position = sax->position;
+  sax->error.transient = res == PH_NOMEM;
+}
+
+static inline void stopped(ph_json_sax_t *sax)
+{
+  sax_fail(sax, PH_ERR, "stopped by callback");
+}
+
+static ph_result_t report(ph_json_sax_t *sax, ph_var_err_t *err)
+{
+  if (err) {
+    if (sax->result != PH_OK) {
+      *err = sax->error;
+    } else {
+      err->text[0] = 0;
+      err->transient = false;
+      err->position = sax->position;
+    }
+  }
+  return sax->result;
+}
+
+ph_json_sax_t *ph_json_sax_new(const struct ph_json_sax_callbacks *cb,
+    void *arg, uint32_t flags)
+{
+  ph_json_sax_t *sax;
+
+  sax = ph_mem_alloc_size(mt_sax, sizeof(*sax));
+  if (!sax) {
+    return NULL;
+  }
+  memset(sax, 0, sizeof(*sax));
+
+  sax->stack_size = 32;
+  sax->stack = ph_mem_alloc_size(mt_sax, sax->stack_size);
+  if (!sax->stack) {
+    ph_mem_free(mt_sax, sax);
+    return NULL;
+  }
+
+  sax->cb = *cb;
+  sax->arg = arg;
+  sax->flags = flags;
+  sax->state = S_VALUE;
+  sax->tok = T_NONE;
+  sax->result = PH_OK;
+  sax->line = 1;
+  ph_string_init_claim(&sax->text, PH_STRING_GROW_MT(mt_sax),
+      sax->text_buf, 0, sizeof(sax->text_buf));
+
+  return sax;
+}
+
+void ph_json_sax_free(ph_json_sax_t *sax)
+{
+  ph_string_delref(&sax->text);
+  ph_mem_free(mt_sax, sax->stack);
+  ph_mem_free(mt_sax, sax);
+}
+
+static void end_value(ph_json_sax_t *sax)
+{
+  sax->state = sax->depth ? S_COMMA_OR_END : S_DONE;
+}
+
+// Returns true if a value that begins with c can appear here,
+// otherwise fails the parse
+static bool want_value(ph_json_sax_t *sax, int c)
+{
+  switch (sax->state) {
+    case S_VALUE:
+    case S_VALUE_OR_END:
+      if (sax->depth == 0 && (sax->flags & PH_JSON_DECODE_ANY) == 0 &&
+          c != '{' && c != '[') {
+        sax_fail(sax, PH_ERR, "'[' or '{' expected");
+        return false;
+      }
+      return true;
+    case S_KEY_OR_END:
+    case S_KEY:
+      sax_fail(sax, PH_ERR, "string or '}' expected");
+      return false;
+    case S_COLON:
+      sax_fail(sax, PH_ERR, "':' expected");
+      return false;
+    default:
+      sax_fail(sax, PH_ERR, "'%c' expected",
+          sax->stack[sax->depth - 1] == '{' ? '}' : ']');
+      return false;
+  }
+}
+
+static void push(ph_json_sax_t *sax, int c)
+{
+  uint8_t *stack;
+
+  if (sax->depth == sax->stack_size) {
+    stack = ph_mem_realloc(mt_sax, sax->stack, sax->stack_size * 2);
+    if (!stack) {
+      sax_fail(sax, PH_NOMEM, "out of memory");
+      return;
+    }
+    sax->stack = stack;
+    sax->stack_size *= 2;
+  }
+  sax->stack[sax->depth++] = c;
+}
+
+static void save(ph_json_sax_t *sax, const uint8_t *p, uint32_t len)
+{
+  if (ph_string_append_buf(&sax->text, (const char*)p, len) != PH_OK) {
+    sax_fail(sax, PH_NOMEM, "out of memory");
+  }
+}
+
+static void finish_string(ph_json_sax_t *sax)
+{
+  ph_string_t *text = &sax->text;
+  uint32_t len;
+  bool ok;
+
+  if (sax->non_ascii && !ph_string_is_valid_utf8(text)) {
+    sax_fail(sax, PH_ERR, "invalid UTF-8 in string");
+    return;
+  }
+
+  // Make room for the NUL; unescaping only ever shrinks the text
+  save(sax, (const uint8_t*)"", 1);
+  if (sax->result != PH_OK) {
+    return;
+  }
+  len = --text->len;
+  if (memchr(text->buf, '\\', len) &&
+      !ph_json_unescape(text->buf, text->buf + len, text->buf, &len)) {
+    sax_fail(sax, PH_ERR, "invalid escape");
+    return;
+  }
+  text->buf[len] = '\0';
+
+  if (sax->state == S_KEY_OR_END || sax->state == S_KEY) {
+    ok = !sax->cb.key || sax->cb.key(sax->arg, text->buf, len);
+    sax->state = S_COLON;
+  } else {
+    ok = !sax->cb.string || sax->cb.string(sax->arg, text->buf, len);
+    end_value(sax);
+  }
+  if (!ok) {
+    stopped(sax);
+  }
+}
+
+static void finish_word(ph_json_sax_t *sax)
+{
+  ph_string_t *text = &sax->text;
+  int64_t ival;
+  double dval;
+  bool ok;
+
+  if (ph_string_equal_cstr(text, "true")) {
+    ok = !sax->cb.boolean || sax->cb.boolean(sax->arg, true);
+  } else if (ph_string_equal_cstr(text, "false")) {
+    ok = !sax->cb.boolean || sax->cb.boolean(sax->arg, false);
+  } else if (ph_string_equal_cstr(text, "null")) {
+    ok = !sax->cb.null || sax->cb.null(sax->arg);
+  } else {
+    switch (ph_json_parse_number(text->buf, text->len, &ival, &dval)) {
+      case PH_JSON_NUM_INT:
+        ok = !sax->cb.integer || sax->cb.integer(sax->arg, ival);
+        break;
+      case PH_JSON_NUM_REAL:
+        ok = !sax->cb.real || sax->cb.real(sax->arg, dval);
+        break;
+      case PH_JSON_NUM_RANGE:
+        sax_fail(sax, PH_ERR, "number out of range");
+        return;
+      default:
+        sax_fail(sax, PH_ERR, "invalid token");
+        return;
+    }
+  }
+
+  end_value(sax);
+  if (!ok) {
+    stopped(sax);
+  }
+}
+
+static const uint8_t *scan_string(ph_json_sax_t *sax, const uint8_t *p,
+    const uint8_t *end)
+{
+  const uint8_t *run = p;
+  int columns = 0;
+
+  for (; p < end; p++) {
+    if (sax->escape) {
+      sax->escape = false;
+    } else if (*p == '\\') {
+      sax->escape = true;
+    } else if (*p == '"') {
+      break;
+    } else if (*p < 0x20) {
+      sax->position += p - run;
+      sax->column += columns;
+      sax_fail(sax, PH_ERR, "control character 0x%x", *p);
+      return p;
+    }
+    if (*p >= 0x80) {
+      sax->non_ascii = true;
+    }
+    // count code points rather than continuation bytes
+    if ((*p & 0xc0) != 0x80) {
+      columns++;
+    }
+  }
+
+  save(sax, run, p - run);
+  sax->position += p - run;
+  sax->column += columns;
+  if (p == end || sax->result != PH_OK) {
+    return p;
+  }
+
+  // the closing quote
+  sax->position++;
+  sax->column++;
+  sax->tok = T_NONE;
+  finish_string(sax);
+  return p + 1;
+}
+
+static const uint8_t *scan_word(ph_json_sax_t *sax, const uint8_t *p,
+    const uint8_t *end)
+{
+  const uint8_t *run = p;
+
+  while (p < end && (l_isalpha(*p) || l_isdigit(*p) || *p == '-' ||
+        *p == '+' || *p == '.')) {
+    p++;
+  }
+
+  save(sax, run, p - run);
+  sax->position += p - run;
+  sax->column += p - run;
+  if (p < end && sax->result == PH_OK) {
+    sax->tok = T_NONE;
+    finish_word(sax);
+  }
+  return p;
+}
+
+static const uint8_t *scan_structure(ph_json_sax_t *sax, const uint8_t *p,
+    const uint8_t *end)
+{
+  int c;
+  bool ok = true;
+
+  for (; p < end; p++) {
+    if (*p == '\n') {
+      sax->line++;
+      sax->column = 0;
+    } else if (*p == ' ' || *p == '\t' || *p == '\r') {
+      sax->column++;
+    } else {
+      break;
+    }
+    sax->position++;
+  }
+  if (p == end) {
+    return p;
+  }
+
+  c = *p;
+  if (sax->state == S_DONE) {
+    if ((sax->flags & PH_JSON_DISABLE_EOF_CHECK) == 0) {
+      sax_fail(sax, PH_ERR, "end of file expected");
+      return p;
+    }
+    sax->state = S_VALUE;
+  }
+
+  switch (c) {
+    case '{':
+    case '[':
+      if (!want_value(sax, c)) {
+        return p;
+      }
+      push(sax, c);
+      if (sax->result != PH_OK) {
+        return p;
+      }
+      if (c == '{') {
+        ok = !sax->cb.start_object || sax->cb.start_object(sax->arg);
+        sax->state = S_KEY_OR_END;
+      } else {
+        ok = !sax->cb.start_array || sax->cb.start_array(sax->arg);
+        sax->state = S_VALUE_OR_END;
+      }
+      break;
+
+    case '}':
+    case ']':
+      if (sax->state != (c == '}' ? S_KEY_OR_END : S_VALUE_OR_END) &&
+          (sax->state != S_COMMA_OR_END ||
+           sax->stack[sax->depth - 1] != (c == '}' ? '{' : '['))) {
+        sax_fail(sax, PH_ERR, "unexpected token");
+        return p;
+      }
+      sax->depth--;
+      if (c == '}') {
+        ok = !sax->cb.end_object || sax->cb.end_object(sax->arg);
+      } else {
+        ok = !sax->cb.end_array || sax->cb.end_array(sax->arg);
+      }
+      end_value(sax);
+      break;
+
+    case ':':
+      if (sax->state != S_COLON) {
+        sax_fail(sax, PH_ERR, "unexpected token");
+        return p;
+      }
+      sax->state = S_VALUE;
+      break;
+
+    case ',':
+      if (sax->state != S_COMMA_OR_END) {
+        sax_fail(sax, PH_ERR, "unexpected token");
+        return p;
+      }
+      sax->state = sax->stack[sax->depth - 1] == '{' ? S_KEY : S_VALUE;
+      break;
+
+    case '"':
+      if (sax->state != S_KEY_OR_END && sax->state != S_KEY &&
+          !want_value(sax, c)) {
+        return p;
+      }
+      ph_string_reset(&sax->text);
+      sax->tok = T_STRING;
+      sax->escape = false;
+      sax->non_ascii = false;
+      break;
+
+    default:
+      if (c != '-' && !l_isdigit(c) && !l_isalpha(c)) {
+        sax_fail(sax, PH_ERR, "invalid token");
+        return p;
+      }
+      if (!want_value(sax, c)) {
+        return p;
+      }
+      ph_string_reset(&sax->text);
+      sax->tok = T_WORD;
+      // scan_word takes it from here
+      return p;
+  }
+
+  sax->position++;
+  sax->column++;
+  if (!ok) {
+    stopped(sax);
+  }
+  return p + 1;
+}
+
+ph_result_t ph_json_sax_feed(ph_json_sax_t *sax, const void *buf,
+    uint64_t len, ph_var_err_t *err)
+{
+  const uint8_t *p = buf, *end = p + len;
+
+  while (p < end && sax->result == PH_OK) {
+    switch (sax->tok) {
+      case T_STRING:
+        p = scan_string(sax, p, end);
+        break;
+      case T_WORD:
+        p = scan_word(sax, p, end);
+        break;
+      default:
+        p = scan_structure(sax, p, end);
+    }
+  }
+
+  return report(sax, err);
+}
+
+ph_result_t ph_json_sax_feed_bufq(ph_json_sax_t *sax, ph_bufq_t *q,
+    ph_var_err_t *err)
+{
+  uint64_t len = ph_bufq_len(q);
+  ph_result_t res;
+  ph_buf_t *buf;
+
+  if (len == 0) {
+    return report(sax, err);
+  }
+  buf = ph_bufq_consume_bytes(q, len);
+  if (!buf) {
+    sax_fail(sax, PH_NOMEM, "out of memory");
+    return report(sax, err);
+  }
+  res = ph_json_sax_feed(sax, ph_buf_mem(buf), ph_buf_len(buf), err);
+  ph_buf_delref(buf);
+  return res;
+}
+
+ph_result_t ph_json_sax_finish(ph_json_sax_t *sax, ph_var_err_t *err)
+{
+  if (sax->result == PH_OK) {
+    if (sax->tok == T_WORD) {
+      sax->tok = T_NONE;
+      finish_word(sax);
+    }
+    if (sax->result != PH_OK) {
+      // already failed
+    } else if (sax->tok == T_STRING || sax->depth) {
+      sax_fail(sax, PH_ERR, "premature end of input");
+    } else if (sax->state == S_VALUE &&
+        (sax->flags & PH_JSON_DISABLE_EOF_CHECK) == 0) {
+      sax_fail(sax, PH_ERR, (sax->flags & PH_JSON_DECODE_ANY) ?
+          "premature end of input" : "'[' or '{' expected");
+    }
+  }
+  return report(sax, err);
+}
+
+ph_result_t ph_json_sax_parse(ph_stream_t *stm,
+    const struct ph_json_sax_callbacks *cb, void *arg, uint32_t flags,
+    ph_var_err_t *err)
+{
+  ph_json_sax_t *sax;
+  char buf[8192];
+  uint64_t nread;
+  ph_result_t res = PH_OK;
+
+  sax = ph_json_sax_new(cb, arg, flags);
+  if (!sax) {
+    if (err) {
+      strcpy(err->text, "out of memory"); // NOLINT(runtime/printf)
+      err->transient = true;
+    }
+    return PH_NOMEM;
+  }
+
+  while (res == PH_OK) {
+    // A read at EOF fails without setting an error
+    if (!ph_stm_read(stm, buf, sizeof(buf), &nread)) {
+      nread = 0;
+    }
+    if (nread == 0 && ph_stm_errno(stm)) {
+      sax_fail(sax, PH_ERR, "read failed: `Pe%d", ph_stm_errno(stm));
+      sax->error.transient = true;
+      res = report(sax, err);
+      break;
+    }
+    if (nread == 0) {
+      res = ph_json_sax_finish(sax, err);
+      break;
+    }
+    res = ph_json_sax_feed(sax, buf, nread, err);
+  }
+
+  ph_json_sax_free(sax);
+  return res;
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -0,0 +1,67 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phenom/sysutil.h"
+#include "corelib/variant/out.h"
+
+static int out_emit(struct ph_var_out *out, const char *buf, uint32_t len)
+{
+  uint64_t added;
+
+  if (out->stm) {
+    return ph_stm_write(out->stm, buf, len, NULL) ? 0 : -1;
+  }
+  if (out->q) {
+    if (ph_bufq_append(out->q, buf, len, &added) != PH_OK ||
+        added != len) {
+      return -1;
+    }
+    return 0;
+  }
+  return ph_string_append_buf(out->str, buf, len) == PH_OK ? 0 : -1;
+}
+
+int ph_var_out_flush(struct ph_var_out *out)
+{
+  uint32_t len = out->len;
+
+  out->len = 0;
+  if (len == 0) {
+    return 0;
+  }
+  return out_emit(out, out->buf, len);
+}
+
+int ph_var_out_write(struct ph_var_out *out, const void *buf, uint32_t len)
+{
+  if (out->len + len <= sizeof(out->buf)) {
+    memcpy(out->buf + out->len, buf, len);
+    out->len += len;
+    return 0;
+  }
+  if (ph_var_out_flush(out)) {
+    return -1;
+  }
+  if (len > sizeof(out->buf)) {
+    return out_emit(out, buf, len);
+  }
+  memcpy(out->buf, buf, len);
+  out->len = len;
+  return 0;
+}
+
+/* vim:ts=2:sw=2:et:
+ */
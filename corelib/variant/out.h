@@ -0,0 +1,67 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CORELIB_VARIANT_OUT_H
+#define CORELIB_VARIANT_OUT_H
+
+#include "phenom/string.h"
+#include "phenom/stream.h"
+#include "phenom/buffer.h"
+
+/* The encoders render into a buffer on the stack and hand it to the
+ * destination a chunk at a time, so that a stream is locked once per
+ * chunk rather than once per token, and a string or buffer queue is
+ * appended to directly.  Exactly one of str, stm and q is set. */
+struct ph_var_out {
+  ph_string_t *str;
+  ph_stream_t *stm;
+  ph_bufq_t *q;
+  uint32_t len;
+  char buf[8192];
+};
+
+static inline void ph_var_out_init(struct ph_var_out *out, ph_string_t *str,
+    ph_stream_t *stm, ph_bufq_t *q)
+{
+  out->str = str;
+  out->stm = stm;
+  out->q = q;
+  out->len = 0;
+}
+
+/* Passes whatever is buffered to the destination.  Returns 0, or -1 if
+ * the destination failed. */
+int ph_var_out_flush(struct ph_var_out *out);
+
+/* Appends len bytes, flushing first if they don't fit and bypassing
+ * the buffer if they are larger than it.  Returns 0 or -1. */
+int ph_var_out_write(struct ph_var_out *out, const void *buf, uint32_t len);
+
+/* Returns space for n more bytes, which must be no more than the size
+ * of the buffer, or NULL if the flush to make room failed.  The caller
+ * adds what it used to out->len. */
+static inline char *ph_var_out_reserve(struct ph_var_out *out, uint32_t n)
+{
+  if (out->len + n > sizeof(out->buf) && ph_var_out_flush(out)) {
+    return NULL;
+  }
+  return out->buf + out->len;
+}
+
+#endif
+
+/* vim:ts=2:sw=2:et:
+ */
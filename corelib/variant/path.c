@@ -19,78 +19,204 @@
  */
 
 #include "phenom/variant.h"
+#include "phenom/sysutil.h"
 
-ph_variant_t *ph_var_jsonpath_get(ph_variant_t *var, const char *path)
+static ph_memtype_t mt_path;
+static struct ph_memtype_def def = {
+  "variant", "path", 0, 0
+};
+
+static void init_path(void)
 {
-  static const char root_chr = '$', array_open = '[';
-  static const char *path_delims = ".[", *array_close = "]";
-  ph_variant_t *cursor = 0;
-  char *token, *buf, *peek, *endptr, delim = '\0';
-  const char *expect;
-  char local_buf[128];
-  uint32_t pathlen;
-
-  if (!var || !path || path[0] != root_chr) {
-    return NULL;
+  mt_path = ph_memtype_register(&def);
+}
+PH_LIBRARY_INIT(init_path, 0)
+
+/* A step selects an object member by key, or an array element by index
+ * when key is NULL */
+struct ph_var_path_step {
+  ph_string_t *key;
+  uint32_t idx;
+};
+
+struct ph_var_path {
+  uint32_t nsteps;
+  struct ph_var_path_step steps[1];
+};
+
+/* Scans the step at *pos, which is just after the root or a previous
+ * step, and advances past it.  A key step leaves its name in `name` and
+ * `len`; an index step sets `name` to NULL.  Returns false at the end of
+ * the path, and sets *bad if the path is malformed.
+ *
+ * A trailing `.` or an unclosed `[` at the very end selects nothing and
+ * is ignored, and `[]` means `[0]`: ph_var_jsonpath_get() has always
+ * behaved this way. */
+static bool scan_step(const char **pos, const char **name, uint32_t *len,
+    uint32_t *idx, bool *bad)
+{
+  const char *p = *pos, *close;
+  char *end;
+  long val; // NOLINT(runtime/int)
+
+  *bad = false;
+  if (*p == '\0') {
+    return false;
+  }
+
+  if (*p == '.') {
+    p++;
+    *name = p;
+    p += strcspn(p, ".[");
+    *len = p - *name;
+    *pos = p;
+    if (*len == 0 && *p == '\0') {
+      return false;
+    }
+    return true;
+  }
+
+  if (*p != '[') {
+    *bad = true;
+    return false;
+  }
+
+  p++;
+  if (*p == '\0') {
+    *pos = p;
+    return false;
+  }
+  close = strchr(p, ']');
+  if (!close) {
+    *bad = true;
+    return false;
+  }
+  val = strtol(p, &end, 0);
+  if (end != close) {
+    *bad = true;
+    return false;
+  }
+  p = close + 1;
+  if (*p != '\0' && *p != '.' && *p != '[') {
+    *bad = true;
+    return false;
   }
-  pathlen = strlen(path);
-  // Avoid malloc in the common case.  If your queries are longer
-  // than 128 characters you might be doing something weird
-  if (pathlen < sizeof(local_buf)-1) {
-    strcpy(local_buf, path); // NOLINT(runtime/printf)
-    buf = local_buf;
+  *name = NULL;
+  // Out of range indices can never match anything
+  if (val < 0 || (uint64_t)val >= UINT32_MAX) {
+    *idx = UINT32_MAX;
   } else {
-    buf = strdup(path);
+    *idx = (uint32_t)val;
   }
+  *pos = p;
+  return true;
+}
 
-  peek = buf + 1;
-  cursor = var;
-  token = NULL;
-  expect = path_delims;
+ph_variant_t *ph_var_jsonpath_get(ph_variant_t *var, const char *path)
+{
+  ph_variant_t *cursor = var;
+  const char *pos, *name;
+  uint32_t len, idx;
+  bool bad;
 
-  while (peek && *peek && cursor) {
-    char *last_peek = peek;
-    peek = strpbrk(peek, expect);
-    if (peek) {
-      if (!token && peek != last_peek) {
-        cursor = 0;
-        goto done;
-      }
-      delim = *peek;
-      *peek++ = '\0';
-    } else if (expect != path_delims || !token) {
-      cursor = 0;
-      goto done;
+  if (!var || !path || path[0] != '$') {
+    return NULL;
+  }
+
+  pos = path + 1;
+  while (cursor && scan_step(&pos, &name, &len, &idx, &bad)) {
+    if (name) {
+      ph_string_t key;
+
+      ph_string_init_claim(&key, PH_STRING_STATIC, (char*)name, len, len);
+      cursor = ph_var_object_get(cursor, &key);
+    } else {
+      cursor = ph_var_array_get(cursor, idx);
     }
+  }
 
-    if (expect == path_delims) {
-      if (token) {
-        cursor = ph_var_object_get_cstr(cursor, token);
+  if (bad) {
+    return NULL;
+  }
+  return cursor;
+}
+
+ph_var_path_t *ph_var_path_compile(const char *path)
+{
+  ph_var_path_t *prog;
+  const char *pos, *name;
+  uint32_t len, idx, n = 0;
+  bool bad;
+
+  if (!path || path[0] != '$') {
+    return NULL;
+  }
+
+  // Count and validate the steps before allocating
+  pos = path + 1;
+  while (scan_step(&pos, &name, &len, &idx, &bad)) {
+    n++;
+  }
+  if (bad) {
+    return NULL;
+  }
+
+  prog = ph_mem_alloc_size(mt_path, sizeof(*prog) +
+      (n ? n - 1 : 0) * sizeof(prog->steps[0]));
+  if (!prog) {
+    return NULL;
+  }
+  prog->nsteps = 0;
+
+  pos = path + 1;
+  while (scan_step(&pos, &name, &len, &idx, &bad)) {
+    struct ph_var_path_step *step = &prog->steps[prog->nsteps];
+
+    step->key = NULL;
+    step->idx = idx;
+    if (name) {
+      // Interned keys hash and compare with the keys of loaded documents
+      // without touching their bytes
+      step->key = ph_string_intern(name, len);
+      if (!step->key) {
+        step->key = ph_string_make_copy(mt_path, name, len, 0);
       }
-      expect = (delim == array_open ? array_close : path_delims);
-      token = peek;
-    } else if (expect == array_close) {
-      size_t idx = strtol(token, &endptr, 0);
-      if (*endptr) {
-        cursor = 0;
-        goto done;
+      if (!step->key) {
+        ph_var_path_free(prog);
+        return NULL;
       }
-      cursor = ph_var_array_get(cursor, idx);
-      token = NULL;
-      expect = path_delims;
-    } else {
-      cursor = 0;
-      goto done;
     }
+    prog->nsteps++;
   }
 
-done:
-  if (buf != local_buf) {
-    free(buf);
+  return prog;
+}
+
+ph_variant_t *ph_var_path_get(ph_variant_t *var, ph_var_path_t *path)
+{
+  uint32_t i;
+
+  for (i = 0; var && i < path->nsteps; i++) {
+    if (path->steps[i].key) {
+      var = ph_var_object_get(var, path->steps[i].key);
+    } else {
+      var = ph_var_array_get(var, path->steps[i].idx);
+    }
   }
-  return cursor;
+  return var;
 }
 
+void ph_var_path_free(ph_var_path_t *path)
+{
+  uint32_t i;
+
+  for (i = 0; i < path->nsteps; i++) {
+    if (path->steps[i].key) {
+      ph_string_delref(path->steps[i].key);
+    }
+  }
+  ph_mem_free(mt_path, path);
+}
 
 /* vim:ts=2:sw=2:et:
  */
@@ -17,20 +17,24 @@
 #include "phenom/variant.h"
 #include "phenom/log.h"
 #include "phenom/sysutil.h"
+#include "corelib/variant/json-lazy.h"
 
 static struct {
-  ph_memtype_t var, arr;
+  ph_memtype_t var, arr, obj;
 } mt;
 
 static struct ph_memtype_def defs[] = {
   { "variant", "variant", sizeof(ph_variant_t), 0 },
   { "variant", "array",   0, 0 },
+  { "variant", "object",  0, 0 },
 };
 
 static ph_variant_t bool_true_variant  = { 1, PH_VAR_TRUE, { 0 } };
 static ph_variant_t bool_false_variant = { 1, PH_VAR_FALSE, { 0 } };
 static ph_variant_t null_variant       = { 1, PH_VAR_NULL, { 0 } };
 
+static void obj_destroy(ph_variant_t *obj);
+
 static void init_variant(void)
 {
   ph_memtype_register_block(sizeof(defs)/sizeof(defs[0]), defs, &mt.var);
@@ -127,6 +131,17 @@ void ph_var_delref(ph_variant_t *var)
     return;
   }
 
+  // The arena holds a reference on each of its values, so only a
+  // container that was passed to ph_var_own_arena() can get here
+  if (var->type == PH_VAR_ARRAY && var->u.aval.arena) {
+    ph_arena_destroy(var->u.aval.arena);
+    return;
+  }
+  if (var->type == PH_VAR_OBJECT && var->u.oval.arena) {
+    ph_arena_destroy(var->u.oval.arena);
+    return;
+  }
+
   switch (var->type) {
     case PH_VAR_TRUE:
     case PH_VAR_FALSE:
@@ -138,15 +153,24 @@ void ph_var_delref(ph_variant_t *var)
         uint32_t i;
 
         for (i = 0; i < var->u.aval.len; i++) {
-          ph_var_delref(var->u.aval.arr[i]);
+          // lazy arrays have NULL slots
+          if (var->u.aval.arr[i]) {
+            ph_var_delref(var->u.aval.arr[i]);
+          }
         }
         ph_mem_free(mt.arr, var->u.aval.arr);
         var->u.aval.arr = 0;
       }
+      if (var->u.aval.lazy) {
+        ph_json_lazy_free(var->u.aval.lazy);
+      }
       break;
 
     case PH_VAR_OBJECT:
-      ph_ht_destroy(&var->u.oval);
+      obj_destroy(var);
+      if (var->u.oval.lazy) {
+        ph_json_lazy_free(var->u.oval.lazy);
+      }
       break;
 
     case PH_VAR_STRING:
@@ -176,6 +200,8 @@ ph_variant_t *ph_var_array(uint32_t nelems)
   var->type = PH_VAR_ARRAY;
   var->u.aval.len = 0;
   var->u.aval.alloc = nelems;
+  var->u.aval.arena = NULL;
+  var->u.aval.lazy = NULL;
   var->u.aval.arr = ph_mem_alloc_size(mt.arr, nelems * sizeof(ph_variant_t*));
 
   if (!var->u.aval.arr) {
@@ -186,6 +212,80 @@ ph_variant_t *ph_var_array(uint32_t nelems)
   return var;
 }
 
+static ph_variant_t *arena_var(ph_arena_t *arena, ph_variant_type_t type)
+{
+  ph_variant_t *var;
+
+  var = ph_arena_alloc(arena, sizeof(*var));
+  if (!var) {
+    return NULL;
+  }
+
+  // One reference for the caller and one held by the arena; the latter
+  // is never released, so the final ph_var_delref() is a no-op
+  var->ref = 2;
+  var->type = type;
+
+  return var;
+}
+
+ph_variant_t *ph_var_int_arena(ph_arena_t *arena, int64_t ival)
+{
+  ph_variant_t *var = arena_var(arena, PH_VAR_INTEGER);
+
+  if (var) {
+    var->u.ival = ival;
+  }
+  return var;
+}
+
+ph_variant_t *ph_var_double_arena(ph_arena_t *arena, double dval)
+{
+  ph_variant_t *var = arena_var(arena, PH_VAR_REAL);
+
+  if (var) {
+    var->u.dval = dval;
+  }
+  return var;
+}
+
+ph_variant_t *ph_var_string_arena(ph_arena_t *arena,
+    const char *buf, uint32_t len)
+{
+  ph_variant_t *var = arena_var(arena, PH_VAR_STRING);
+
+  if (!var) {
+    return NULL;
+  }
+
+  var->u.sval = ph_string_make_arena(arena, buf, len);
+  if (!var->u.sval) {
+    return NULL;
+  }
+  return var;
+}
+
+ph_variant_t *ph_var_array_arena(ph_arena_t *arena, uint32_t nelems)
+{
+  ph_variant_t *var = arena_var(arena, PH_VAR_ARRAY);
+
+  if (!var) {
+    return NULL;
+  }
+
+  nelems = MAX(nelems, 1);
+  var->u.aval.len = 0;
+  var->u.aval.alloc = nelems;
+  var->u.aval.arena = arena;
+  var->u.aval.lazy = NULL;
+  var->u.aval.arr = ph_arena_alloc(arena, nelems * sizeof(ph_variant_t*));
+  if (!var->u.aval.arr) {
+    return NULL;
+  }
+
+  return var;
+}
+
 ph_result_t ph_var_array_append(ph_variant_t *arr, ph_variant_t *val)
 {
   ph_result_t res;
@@ -210,8 +310,17 @@ ph_result_t ph_var_array_append_claim(ph_variant_t *arr, ph_variant_t *val)
     ph_variant_t **narr;
     uint32_t nsize = ph_power_2(arr->u.aval.alloc * 2);
 
-    narr = ph_mem_realloc(mt.arr, arr->u.aval.arr,
-              nsize * sizeof(ph_variant_t*));
+    if (arr->u.aval.arena) {
+      narr = ph_arena_alloc(arr->u.aval.arena,
+                nsize * sizeof(ph_variant_t*));
+      if (narr) {
+        memcpy(narr, arr->u.aval.arr,
+            arr->u.aval.len * sizeof(ph_variant_t*));
+      }
+    } else {
+      narr = ph_mem_realloc(mt.arr, arr->u.aval.arr,
+                nsize * sizeof(ph_variant_t*));
+    }
     if (!narr) {
       return PH_NOMEM;
     }
@@ -239,7 +348,12 @@ ph_result_t ph_var_array_set_claim(ph_variant_t *arr, uint32_t pos,
     return PH_NOENT;
   }
 
-  ph_var_delref(arr->u.aval.arr[pos]);
+  if (arr->u.aval.arr[pos]) {
+    ph_var_delref(arr->u.aval.arr[pos]);
+  } else if (arr->u.aval.lazy) {
+    // An element of a lazy array that was never read
+    ph_json_lazy_slot_filled(arr);
+  }
   arr->u.aval.arr[pos] = val;
   return PH_OK;
 }
@@ -284,10 +398,220 @@ static struct ph_ht_val_def var_val_def = {
   var_del
 };
 
+/* Objects start out small: their pairs are kept in an array, sorted by
+ * key, that is searched linearly.  That is cheaper than hashing for a
+ * handful of keys, and a lot more compact than a hash table.  Deleting
+ * a pair leaves a hole, with a NULL key, so that iterators aren't
+ * disturbed; the holes are squeezed out by the next insert.  Once an
+ * object would have more than SMALL_OBJECT_MAX pairs, they are moved
+ * into a ph_ht_t for good. */
+#define SMALL_OBJECT_MAX 8
+
+static inline bool obj_is_small(ph_variant_t *obj)
+{
+  return !obj->u.oval.promoted;
+}
+
+static void *obj_alloc(ph_variant_t *obj, uint64_t size)
+{
+  if (obj->u.oval.arena) {
+    return ph_arena_alloc(obj->u.oval.arena, size);
+  }
+  return ph_mem_alloc_size(mt.obj, size);
+}
+
+static void obj_free(ph_variant_t *obj, void *ptr)
+{
+  if (!obj->u.oval.arena) {
+    ph_mem_free(mt.obj, ptr);
+  }
+}
+
+static void obj_init(ph_variant_t *var, ph_arena_t *arena, uint32_t nelems)
+{
+  var->u.oval.len = 0;
+  var->u.oval.count = 0;
+  // the pairs are allocated on the first insert; until then, this is
+  // how many to make room for
+  var->u.oval.alloc = MAX(MIN(nelems, SMALL_OBJECT_MAX), 2);
+  var->u.oval.keep_sorted = false;
+  var->u.oval.promoted = false;
+  var->u.oval.p.kv = NULL;
+  var->u.oval.arena = arena;
+  var->u.oval.lazy = NULL;
+}
+
+// Moves the pairs of a small object into a hash table
+static ph_result_t obj_promote(ph_variant_t *obj, uint32_t nelems)
+{
+  struct ph_var_kv *kv = obj->u.oval.p.kv;
+  ph_ht_t *ht;
+  ph_result_t res;
+  uint16_t i;
+
+  ht = obj_alloc(obj, sizeof(*ht));
+  if (!ht) {
+    return PH_NOMEM;
+  }
+  res = ph_ht_init_arena(ht, obj->u.oval.arena, nelems,
+      &ph_ht_string_key_def, &var_val_def);
+  if (res == PH_OK && obj->u.oval.keep_sorted) {
+    res = ph_ht_keep_ordered(ht);
+    if (res != PH_OK) {
+      ph_ht_destroy(ht);
+    }
+  }
+  if (res != PH_OK) {
+    obj_free(obj, ht);
+    return res;
+  }
+
+  // The table is large enough for all of these, so this can't fail
+  for (i = 0; i < obj->u.oval.len; i++) {
+    if (kv[i].key) {
+      ph_ht_insert(ht, &kv[i].key, &kv[i].val, PH_HT_CLAIM);
+    }
+  }
+  if (kv) {
+    obj_free(obj, kv);
+  }
+  obj->u.oval.len = 0;
+  obj->u.oval.count = 0;
+  obj->u.oval.alloc = 0;
+  obj->u.oval.p.ht = ht;
+  obj->u.oval.promoted = true;
+  return PH_OK;
+}
+
+// Makes room in a small object for one more pair
+static ph_result_t small_reserve(ph_variant_t *obj)
+{
+  struct ph_var_kv *kv = obj->u.oval.p.kv, *nkv;
+  uint16_t i, n;
+
+  if (kv && obj->u.oval.len > obj->u.oval.count) {
+    // squeeze out the holes
+    for (i = n = 0; i < obj->u.oval.len; i++) {
+      if (kv[i].key) {
+        kv[n++] = kv[i];
+      }
+    }
+    obj->u.oval.len = n;
+  }
+  if (kv && obj->u.oval.len < obj->u.oval.alloc) {
+    return PH_OK;
+  }
+
+  n = kv ? MIN(obj->u.oval.alloc * 2, SMALL_OBJECT_MAX) : obj->u.oval.alloc;
+  nkv = obj_alloc(obj, n * sizeof(*nkv));
+  if (!nkv) {
+    return PH_NOMEM;
+  }
+  if (kv) {
+    memcpy(nkv, kv, obj->u.oval.len * sizeof(*nkv));
+    obj_free(obj, kv);
+  }
+  obj->u.oval.p.kv = nkv;
+  obj->u.oval.alloc = n;
+  return PH_OK;
+}
+
+static struct ph_var_kv *small_find(ph_variant_t *obj, ph_string_t *key)
+{
+  struct ph_var_kv *kv = obj->u.oval.p.kv;
+  uint16_t i;
+
+  for (i = 0; i < obj->u.oval.len; i++) {
+    if (kv[i].key && ph_string_equal(kv[i].key, key)) {
+      return kv + i;
+    }
+  }
+  return NULL;
+}
+
+/* Sets a pair, with the same reference counting behavior as
+ * ph_ht_insert() with PH_HT_REPLACE and either PH_HT_CLAIM or
+ * PH_HT_COPY */
+static ph_result_t obj_set(ph_variant_t *obj, ph_string_t *key,
+    ph_variant_t *val, bool claim)
+{
+  struct ph_var_kv *kv;
+  ph_result_t res;
+  uint16_t i;
+
+  if (!obj_is_small(obj)) {
+    return ph_ht_insert(obj->u.oval.p.ht, &key, &val,
+        PH_HT_REPLACE|(claim ? PH_HT_CLAIM : PH_HT_COPY));
+  }
+
+  kv = small_find(obj, key);
+  if (kv) {
+    ph_var_delref(kv->val);
+    kv->val = val;
+    if (claim) {
+      ph_string_delref(key);
+    } else {
+      ph_var_addref(val);
+    }
+    return PH_OK;
+  }
+
+  if (obj->u.oval.count == SMALL_OBJECT_MAX) {
+    res = obj_promote(obj, SMALL_OBJECT_MAX * 2);
+    if (res != PH_OK) {
+      return res;
+    }
+    return obj_set(obj, key, val, claim);
+  }
+
+  res = small_reserve(obj);
+  if (res != PH_OK) {
+    return res;
+  }
+
+  kv = obj->u.oval.p.kv;
+  for (i = obj->u.oval.len; i > 0; i--) {
+    if (ph_string_compare(kv[i - 1].key, key) < 0) {
+      break;
+    }
+    kv[i] = kv[i - 1];
+  }
+  kv[i].key = key;
+  kv[i].val = val;
+  if (!claim) {
+    ph_string_addref(key);
+    ph_var_addref(val);
+  }
+  obj->u.oval.len++;
+  obj->u.oval.count++;
+  return PH_OK;
+}
+
+// Releases every pair, and the storage if the object is on the heap
+static void obj_destroy(ph_variant_t *obj)
+{
+  struct ph_var_kv *kv = obj->u.oval.p.kv;
+  uint16_t i;
+
+  if (!obj_is_small(obj)) {
+    ph_ht_destroy(obj->u.oval.p.ht);
+    obj_free(obj, obj->u.oval.p.ht);
+    return;
+  }
+  for (i = 0; i < obj->u.oval.len; i++) {
+    if (kv[i].key) {
+      ph_string_delref(kv[i].key);
+      ph_var_delref(kv[i].val);
+    }
+  }
+  if (kv) {
+    obj_free(obj, kv);
+  }
+}
+
 ph_variant_t *ph_var_object(uint32_t nelems)
 {
   ph_variant_t *var;
-  ph_result_t res;
 
   var = ph_mem_alloc(mt.var);
   if (!var) {
@@ -296,16 +620,53 @@ ph_variant_t *ph_var_object(uint32_t nelems)
 
   var->ref = 1;
   var->type = PH_VAR_OBJECT;
-
-  res = ph_ht_init(&var->u.oval, nelems, &ph_ht_string_key_def, &var_val_def);
-  if (res != PH_OK) {
+  obj_init(var, NULL, nelems);
+  if (nelems > SMALL_OBJECT_MAX && obj_promote(var, nelems) != PH_OK) {
     ph_mem_free(mt.var, var);
-    return 0;
+    return NULL;
   }
 
   return var;
 }
 
+ph_variant_t *ph_var_object_arena(ph_arena_t *arena, uint32_t nelems)
+{
+  ph_variant_t *var = arena_var(arena, PH_VAR_OBJECT);
+
+  if (!var) {
+    return NULL;
+  }
+
+  obj_init(var, arena, nelems);
+  if (nelems > SMALL_OBJECT_MAX && obj_promote(var, nelems) != PH_OK) {
+    return NULL;
+  }
+
+  return var;
+}
+
+ph_result_t ph_var_own_arena(ph_variant_t *var)
+{
+  switch (var->type) {
+    case PH_VAR_ARRAY:
+      if (!var->u.aval.arena) {
+        return PH_ERR;
+      }
+      break;
+    case PH_VAR_OBJECT:
+      if (!var->u.oval.arena) {
+        return PH_ERR;
+      }
+      break;
+    default:
+      return PH_ERR;
+  }
+
+  // Hand over the reference that the arena held
+  ph_var_delref(var);
+  return PH_OK;
+}
+
 ph_result_t ph_var_object_set_claim_kv(ph_variant_t *obj,
     ph_string_t *key, ph_variant_t *val)
 {
@@ -313,7 +674,7 @@ ph_result_t ph_var_object_set_claim_kv(ph_variant_t *obj,
     return PH_ERR;
   }
 
-  return ph_ht_insert(&obj->u.oval, &key, &val, PH_HT_REPLACE|PH_HT_CLAIM);
+  return obj_set(obj, key, val, true);
 }
 
 ph_result_t ph_var_object_set(ph_variant_t *obj,
@@ -323,21 +684,35 @@ ph_result_t ph_var_object_set(ph_variant_t *obj,
     return PH_ERR;
   }
 
-  return ph_ht_insert(&obj->u.oval, &key, &val, PH_HT_REPLACE|PH_HT_COPY);
+  return obj_set(obj, key, val, false);
+}
+
+ph_variant_t *_ph_var_object_get_built(ph_variant_t *obj, ph_string_t *key)
+{
+  struct ph_var_kv *kv;
+  ph_variant_t *val;
+
+  if (obj_is_small(obj)) {
+    kv = small_find(obj, key);
+    return kv ? kv->val : NULL;
+  }
+  if (ph_ht_lookup(obj->u.oval.p.ht, &key, &val, false) != PH_OK) {
+    return NULL;
+  }
+  return val;
 }
 
 ph_variant_t *ph_var_object_get(ph_variant_t *obj, ph_string_t *key)
 {
-  ph_result_t res;
   ph_variant_t *val;
 
   if (obj->type != PH_VAR_OBJECT) {
     return 0;
   }
 
-  res = ph_ht_lookup(&obj->u.oval, &key, &val, false);
-  if (res != PH_OK) {
-    return 0;
+  val = _ph_var_object_get_built(obj, key);
+  if (!val) {
+    return obj->u.oval.lazy ? ph_json_lazy_object_get(obj, key) : 0;
   }
 
   return val;
@@ -352,12 +727,41 @@ ph_variant_t *ph_var_object_get_cstr(ph_variant_t *obj, const char *key)
   return ph_var_object_get(obj, &kstr);
 }
 
+/* Iterating a small object walks its array, skipping holes, using
+ * the slot of the iterator as the position */
+static bool small_iter(ph_variant_t *obj, uint32_t *slot,
+    ph_string_t **key, ph_variant_t **val)
+{
+  struct ph_var_kv *kv = obj->u.oval.p.kv;
+
+  for (; *slot < obj->u.oval.len; (*slot)++) {
+    if (kv[*slot].key) {
+      if (key) {
+        *key = kv[*slot].key;
+      }
+      if (val) {
+        *val = kv[*slot].val;
+      }
+      (*slot)++;
+      return true;
+    }
+  }
+  return false;
+}
+
 bool ph_var_object_iter_first(ph_variant_t *obj, ph_ht_iter_t *iter,
     ph_string_t **key, ph_variant_t **val)
 {
   void **a, **b;
 
-  if (!ph_ht_iter_first(&obj->u.oval, iter,
+  if (obj->u.oval.lazy && ph_json_lazy_force(obj) != PH_OK) {
+    return false;
+  }
+  if (obj_is_small(obj)) {
+    iter->slot = 0;
+    return small_iter(obj, &iter->slot, key, val);
+  }
+  if (!ph_ht_iter_first(obj->u.oval.p.ht, iter,
         (void**)(void*)&a, (void**)(void*)&b)) {
     return false;
   }
@@ -377,7 +781,10 @@ bool ph_var_object_iter_next(ph_variant_t *obj, ph_ht_iter_t *iter,
 {
   void **a, **b;
 
-  if (!ph_ht_iter_next(&obj->u.oval, iter,
+  if (obj_is_small(obj)) {
+    return small_iter(obj, &iter->slot, key, val);
+  }
+  if (!ph_ht_iter_next(obj->u.oval.p.ht, iter,
         (void**)(void*)&a, (void**)(void*)&b)) {
     return false;
   }
@@ -392,13 +799,40 @@ bool ph_var_object_iter_next(ph_variant_t *obj, ph_ht_iter_t *iter,
   return true;
 }
 
+ph_result_t ph_var_object_keep_sorted(ph_variant_t *obj)
+{
+  if (obj->type != PH_VAR_OBJECT || obj->u.oval.arena) {
+    return PH_ERR;
+  }
+  if (obj->u.oval.lazy && ph_json_lazy_force(obj) != PH_OK) {
+    return PH_NOMEM;
+  }
+  if (obj_is_small(obj)) {
+    // already sorted; remember to index the table if it is promoted
+    obj->u.oval.keep_sorted = true;
+    return PH_OK;
+  }
+  return ph_ht_keep_ordered(obj->u.oval.p.ht);
+}
+
 bool ph_var_object_ordered_iter_first(ph_variant_t *obj,
     ph_ht_ordered_iter_t *iter,
     ph_string_t **key, ph_variant_t **val)
 {
   void **a, **b;
 
-  if (!ph_ht_ordered_iter_first(&obj->u.oval, iter,
+  if (obj->u.oval.lazy && ph_json_lazy_force(obj) != PH_OK) {
+    // Leave nothing for ph_var_object_ordered_iter_end() to release
+    memset(iter, 0, sizeof(*iter));
+    return false;
+  }
+  if (obj_is_small(obj)) {
+    // The pairs are in key order already, so there is nothing to sort
+    // and nothing for ph_ht_ordered_iter_end() to release
+    memset(iter, 0, sizeof(*iter));
+    return small_iter(obj, &iter->slot, key, val);
+  }
+  if (!ph_ht_ordered_iter_first(obj->u.oval.p.ht, iter,
         (void**)(void*)&a, (void**)(void*)&b)) {
     return false;
   }
@@ -419,7 +853,10 @@ bool ph_var_object_ordered_iter_next(ph_variant_t *obj,
 {
   void **a, **b;
 
-  if (!ph_ht_ordered_iter_next(&obj->u.oval, iter,
+  if (obj_is_small(obj)) {
+    return small_iter(obj, &iter->slot, key, val);
+  }
+  if (!ph_ht_ordered_iter_next(obj->u.oval.p.ht, iter,
         (void**)(void*)&a, (void**)(void*)&b)) {
     return false;
   }
@@ -437,15 +874,37 @@ bool ph_var_object_ordered_iter_next(ph_variant_t *obj,
 void ph_var_object_ordered_iter_end(ph_variant_t *obj,
     ph_ht_ordered_iter_t *iter)
 {
-  ph_ht_ordered_iter_end(&obj->u.oval, iter);
+  if (obj_is_small(obj)) {
+    return;
+  }
+  ph_ht_ordered_iter_end(obj->u.oval.p.ht, iter);
 }
 
 ph_result_t ph_var_object_del(ph_variant_t *obj, ph_string_t *key)
 {
+  struct ph_var_kv *kv;
+
   if (obj->type != PH_VAR_OBJECT) {
     return PH_ERR;
   }
-  return ph_ht_del(&obj->u.oval, &key);
+  // Otherwise a later get would find the key in the source text
+  if (obj->u.oval.lazy && ph_json_lazy_force(obj) != PH_OK) {
+    return PH_NOMEM;
+  }
+  if (!obj_is_small(obj)) {
+    return ph_ht_del(obj->u.oval.p.ht, &key);
+  }
+
+  kv = small_find(obj, key);
+  if (!kv) {
+    return PH_NOENT;
+  }
+  ph_string_delref(kv->key);
+  ph_var_delref(kv->val);
+  kv->key = NULL;
+  kv->val = NULL;
+  obj->u.oval.count--;
+  return PH_OK;
 }
 
 uint32_t ph_var_object_size(ph_variant_t *var)
@@ -453,7 +912,13 @@ uint32_t ph_var_object_size(ph_variant_t *var)
   if (var->type != PH_VAR_OBJECT) {
     return 0;
   }
-  return ph_ht_size(&var->u.oval);
+  if (var->u.oval.lazy && ph_json_lazy_force(var) != PH_OK) {
+    return 0;
+  }
+  if (obj_is_small(var)) {
+    return var->u.oval.count;
+  }
+  return ph_ht_size(var->u.oval.p.ht);
 }
 
 static bool obj_equal(ph_variant_t *a, ph_variant_t *b)
@@ -0,0 +1,102 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PHENOM_BSER_H
+#define PHENOM_BSER_H
+
+#include "phenom/defs.h"
+#include "phenom/stream.h"
+#include "phenom/variant.h"
+#include "phenom/buffer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * # BSER Support
+ *
+ * BSER is the binary serialization used by Watchman.  It carries the
+ * same values as JSON, but integers and reals are sent in binary and
+ * strings are sent with their length rather than escaped, so it is
+ * much cheaper to produce and to parse.  Use it in place of JSON when
+ * both ends of a connection are under your control.
+ *
+ * Each value is sent as a PDU: the two bytes `00 01`, the length of
+ * the encoded value, and then the value itself.  Because the length
+ * comes first, a reader can tell whether a whole PDU has arrived before
+ * it starts to decode, which is what ph_bser_load_bufq() does.
+ *
+ * ```
+ * // sender
+ * ph_bser_dump_bufq(reply, sock->wbuf);
+ *
+ * // receiver, each time data arrives on the socket
+ * while ((v = ph_bser_load_bufq(sock->rbuf, &err)) != NULL) {
+ *   handle(v);
+ *   ph_var_delref(v);
+ * }
+ * if (!err.transient) {
+ *   ph_log(PH_LOG_ERR, "bad bser: %s", err.text);
+ * }
+ * ```
+ *
+ * Decoded strings are slices of the input rather than copies, and are
+ * not checked for valid UTF-8.  The decoder also understands the
+ * compact arrays of objects (templates) and the version 2 header that
+ * Watchman may send, but the encoder only produces version 1 without
+ * templates.
+ */
+
+/** Encode a variant as a BSER PDU, append to string */
+ph_result_t ph_bser_dump_string(ph_variant_t *var, ph_string_t *str);
+
+/** Encode a variant as a BSER PDU, append to buffer queue */
+ph_result_t ph_bser_dump_bufq(ph_variant_t *var, ph_bufq_t *q);
+
+/** Encode a variant as a BSER PDU, write to stream */
+ph_result_t ph_bser_dump_stream(ph_variant_t *var, ph_stream_t *stm);
+
+/** Decode a BSER PDU from the start of a string
+ *
+ * Returns a variant instance if successful, and sets the `position` of
+ * `err` to the length of the PDU, which is where the next one, if any,
+ * starts.  Strings in the result are slices of `str`, so it must not be
+ * modified while they are in use.
+ *
+ * On failure, returns NULL and updates `err`.  `transient` is set if
+ * the string holds only part of a PDU.
+ */
+ph_variant_t *ph_bser_load_string(ph_string_t *str, ph_var_err_t *err);
+
+/** Decode the next BSER PDU from a buffer queue
+ *
+ * If a whole PDU is queued, consumes it and decodes it as
+ * ph_bser_load_string() does, with strings that are slices of a single
+ * copy of the PDU.  If only part of one has arrived, returns NULL and
+ * sets `transient` in `err`, leaving the queue untouched so that the
+ * call can be repeated when more data arrives.
+ */
+ph_variant_t *ph_bser_load_bufq(ph_bufq_t *q, ph_var_err_t *err);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -0,0 +1,179 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PHENOM_BTREE_H
+#define PHENOM_BTREE_H
+
+#include "phenom/defs.h"
+#include "phenom/hashtable.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * # Ordered Map
+ *
+ * `ph_btree_t` is a B+tree that keeps its elements sorted by key.  It
+ * uses the same key and value definitions as `ph_ht_t`; the
+ * `key_compare` function defines the order, and memcmp is used if it
+ * is NULL.  The `hash_func` is not used.
+ *
+ * Keys and values are stored in arrays inside each node, and the
+ * leaves are chained together, so walking the map in order touches
+ * memory sequentially.  Lookups, inserts and deletes are O(log n).
+ *
+ * ```
+ * ph_btree_t tree;
+ * ph_btree_iter_t iter;
+ * ph_string_t **key, **val;
+ *
+ * ph_btree_init(&tree, &ph_ht_string_key_def, &ph_ht_string_val_def);
+ * ph_btree_set(&tree, &k, &v);
+ *
+ * // Visit all keys in [lo, hi)
+ * if (ph_btree_lower_bound(&tree, &iter, &lo, (void*)&key, (void*)&val)) do {
+ *   if (ph_string_compare(*key, hi) >= 0) {
+ *     break;
+ *   }
+ *   ph_log(PH_LOG_DEBUG, "`Ps%p -> `Ps%p", *key, *val);
+ * } while (ph_btree_iter_next(&tree, &iter, (void*)&key, (void*)&val));
+ * ```
+ *
+ * Iterators are invalidated by any insert or delete; `gen` changes
+ * whenever that happens.
+ */
+
+struct ph_btree_node;
+
+struct ph_btree {
+  const struct ph_ht_key_def *kdef;
+  const struct ph_ht_val_def *vdef;
+  struct ph_btree_node *root;
+  /* the leftmost leaf */
+  struct ph_btree_node *first;
+  uint32_t nelems;
+  /* number of levels above the leaves */
+  uint32_t height;
+  /* bumped whenever elements are added or removed */
+  uint32_t gen;
+  /* maximum keys in a leaf and in an interior node */
+  uint32_t leaf_cap, inner_cap;
+  /* offsets of the values or children from the start of node data */
+  uint32_t val_off, child_off;
+  uint32_t node_size;
+  /* holds a copy of a separator key while a split is prepared */
+  char *scratch;
+};
+typedef struct ph_btree ph_btree_t;
+
+/** Initialize an ordered map
+ *
+ * Returns `PH_OK` on success, or an error code on failure.
+ */
+ph_result_t ph_btree_init(ph_btree_t *tree,
+    const struct ph_ht_key_def *kdef,
+    const struct ph_ht_val_def *vdef);
+
+/** Tear down an ordered map
+ *
+ * Frees all elements and nodes.
+ */
+void ph_btree_destroy(ph_btree_t *tree);
+
+/** Delete all elements of an ordered map
+ *
+ * The map remains initialized.
+ */
+void ph_btree_free_entries(ph_btree_t *tree);
+
+/** Insert an entry in the map
+ *
+ * Takes the same `PH_HT_*` flags as ph_ht_insert(), with the same
+ * meaning.
+ */
+ph_result_t ph_btree_insert(ph_btree_t *tree, void *key, void *value,
+    int flags);
+
+/** Set, but not replace, an entry in the map */
+ph_result_t ph_btree_set(ph_btree_t *tree, void *key, void *value);
+
+/** Set or replace an entry in the map */
+ph_result_t ph_btree_replace(ph_btree_t *tree, void *key, void *value);
+
+/** Returns the address of the value associated with key
+ *
+ * Returns NULL if there is no such key.  The address is valid until
+ * the next insert or delete.
+ */
+void *ph_btree_get(ph_btree_t *tree, const void *key);
+
+/** Looks up the value associated with key
+ *
+ * Behaves like ph_ht_lookup().
+ */
+ph_result_t ph_btree_lookup(ph_btree_t *tree, const void *key, void *val,
+    bool copy);
+
+/** Deletes the value associated with key
+ *
+ * Returns `PH_OK` if the element was present, `PH_NOENT` otherwise.
+ */
+ph_result_t ph_btree_del(ph_btree_t *tree, const void *key);
+
+/** Returns the number of elements in the map */
+uint32_t ph_btree_size(ph_btree_t *tree);
+
+struct ph_btree_iter {
+  struct ph_btree_node *node;
+  uint32_t pos;
+};
+typedef struct ph_btree_iter ph_btree_iter_t;
+
+/** Begin iterating a map in key order
+ *
+ * Returns false if the map is empty.  Otherwise stores the address
+ * of the key and value of the smallest element in the provided
+ * pointers.  Unlike ph_ht_ordered_iter_first(), this allocates nothing
+ * and there is no need to end the iteration.
+ */
+bool ph_btree_iter_first(ph_btree_t *tree, ph_btree_iter_t *iter,
+    void **key, void **val);
+
+/** Begin iterating a map from a given key
+ *
+ * Positions the iterator at the first element whose key is not less
+ * than `key` and stores the address of its key and value in the
+ * provided pointers.  Returns false if there is no such element.
+ */
+bool ph_btree_lower_bound(ph_btree_t *tree, ph_btree_iter_t *iter,
+    const void *key, void **keyp, void **valp);
+
+/** Walk to the next element in key order
+ *
+ * Returns false if there are no more elements.
+ */
+bool ph_btree_iter_next(ph_btree_t *tree, ph_btree_iter_t *iter,
+    void **key, void **val);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vim:ts=2:sw=2:et:
+ */
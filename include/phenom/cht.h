@@ -0,0 +1,154 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PHENOM_CHT_H
+#define PHENOM_CHT_H
+
+#include "phenom/defs.h"
+#include "phenom/hashtable.h"
+#include "phenom/thread.h"
+#include <ck_hs.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * # Concurrent Hash Table
+ *
+ * `ph_cht_t` is a map that can be read from any number of threads
+ * without taking a lock.  It uses the same key and value definitions
+ * as `ph_ht_t`, so the `ph_ht_string_key_def` and friends work here too.
+ *
+ * Readers must be inside an epoch-protected section.  Job callbacks
+ * always are.  Other threads bracket their reads with
+ * ph_thread_epoch_begin() and ph_thread_epoch_end().  Writers are
+ * serialized by a mutex in the table, and never block readers.
+ *
+ * Each element is a separate allocation holding its key and value.
+ * Replacing or deleting an element unlinks it from the table.  Its
+ * `key_delete` and `val_delete` functions run only once every thread
+ * has left the epoch in which it could have seen the element, so a
+ * value returned by ph_cht_get() remains valid until the reader calls
+ * ph_thread_epoch_end().
+ *
+ * ```
+ * ph_cht_t cache;
+ * ph_string_t **valp;
+ *
+ * ph_cht_init(&cache, 1024, &ph_ht_string_key_def, &ph_ht_string_val_def);
+ *
+ * // any thread
+ * ph_thread_epoch_begin();
+ * valp = ph_cht_get(&cache, &key);
+ * if (valp) {
+ *   use(*valp);
+ * }
+ * ph_thread_epoch_end();
+ * ```
+ */
+
+struct ph_cht {
+  ck_hs_t hs;
+  pthread_mutex_t lock;
+  const struct ph_ht_key_def *kdef;
+  const struct ph_ht_val_def *vdef;
+};
+typedef struct ph_cht ph_cht_t;
+
+/** Initialize a concurrent hash table
+ *
+ * `size_hint` is the number of elements the table should hold without
+ * growing.  Returns `PH_OK` on success, or an error code on failure.
+ */
+ph_result_t ph_cht_init(ph_cht_t *cht, uint32_t size_hint,
+    const struct ph_ht_key_def *kdef,
+    const struct ph_ht_val_def *vdef);
+
+/** Tear down a concurrent hash table
+ *
+ * Deletes all elements immediately.  No other thread may be using
+ * the table.
+ */
+void ph_cht_destroy(ph_cht_t *cht);
+
+/** Insert an entry in the table
+ *
+ * Takes the same `PH_HT_*` flags as ph_ht_insert(), with the same
+ * meaning.  When an existing value is replaced, the old key and value
+ * are deleted after a grace period rather than immediately.
+ */
+ph_result_t ph_cht_insert(ph_cht_t *cht, void *key, void *value, int flags);
+
+/** Set, but not replace, an entry in the table */
+ph_result_t ph_cht_set(ph_cht_t *cht, void *key, void *value);
+
+/** Set or replace an entry in the table */
+ph_result_t ph_cht_replace(ph_cht_t *cht, void *key, void *value);
+
+/** Returns the address of the value associated with key
+ *
+ * Must be called from within an epoch-protected section.  The value
+ * remains valid until the end of that section.  Returns NULL if there
+ * is no such key.
+ */
+void *ph_cht_get(ph_cht_t *cht, const void *key);
+
+/** Looks up the value associated with key
+ *
+ * If found, copies the value into `*val` using the `val_copy` function
+ * and returns `PH_OK`.  Returns `PH_NOENT` if the key is not present.
+ * May be called outside of an epoch-protected section.
+ */
+ph_result_t ph_cht_lookup(ph_cht_t *cht, const void *key, void *val);
+
+/** Deletes the value associated with key
+ *
+ * The key and value are deleted after a grace period.
+ * Returns `PH_OK` if the element was present, `PH_NOENT` otherwise.
+ */
+ph_result_t ph_cht_del(ph_cht_t *cht, const void *key);
+
+/** Returns the number of elements in the table */
+uint32_t ph_cht_size(ph_cht_t *cht);
+
+typedef struct ck_hs_iterator ph_cht_iter_t;
+
+/** Begin iterating a table
+ *
+ * Must be called from within an epoch-protected section, which must
+ * last for the whole iteration.  Elements inserted or deleted while
+ * iterating may or may not be seen.
+ *
+ * Returns false if there are no elements.  Otherwise stores the
+ * address of the key and value of the first element in the provided
+ * pointers.
+ */
+bool ph_cht_iter_first(ph_cht_t *cht, ph_cht_iter_t *iter,
+    void **key, void **val);
+
+/** Walk to the next element of a table */
+bool ph_cht_iter_next(ph_cht_t *cht, ph_cht_iter_t *iter,
+    void **key, void **val);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vim:ts=2:sw=2:et:
+ */
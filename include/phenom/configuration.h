@@ -32,6 +32,20 @@
  * then you need to replace the entire configuration object with the
  * new generation of the configuration, and then dispose of the old
  * one.
+ *
+ * Code that reads a tunable often, for instance on every request, can
+ * keep it in a `ph_config_handle_t`.  The handle remembers the value it
+ * found and only repeats the query after the configuration has been
+ * replaced:
+ *
+ * ```
+ * static ph_config_handle_t max_conns =
+ *   PH_CONFIG_HANDLE_INIT("$.server.max_connections");
+ *
+ * if (nconns >= ph_config_handle_int(&max_conns, 1024)) {
+ *   ...
+ * }
+ * ```
  */
 
 #include "phenom/variant.h"
@@ -150,6 +164,55 @@ ph_string_t *ph_config_query_string(const char *query, ph_string_t *defval);
  */
 ph_string_t *ph_config_query_string_cstr(const char *query, const char *defval);
 
+/** A configuration value cached from a JSONPath query
+ *
+ * Initialize with PH_CONFIG_HANDLE_INIT(); the fields are private.
+ */
+typedef struct ph_config_handle {
+  const char *query;
+  ph_var_path_t *path;
+  // odd while a refresh is rewriting the fields below
+  uint32_t seqno;
+  // the configuration generation that the value was taken from
+  uint32_t gen;
+  bool is_int;
+  bool is_double;
+  int64_t ival;
+  double dval;
+} ph_config_handle_t;
+
+/** Initializer for a ph_config_handle_t
+ *
+ * `query` is a JSONPath expression; it is referenced, not copied, so it
+ * must outlive the handle.
+ */
+#define PH_CONFIG_HANDLE_INIT(query) \
+  { (query), NULL, 0, 0, false, false, 0, 0.0 }
+
+/** Release the compiled query held by a handle
+ *
+ * Only needed for handles that do not live as long as the process.
+ */
+void ph_config_handle_destroy(ph_config_handle_t *h);
+
+/** Return the integer value of a cached configuration query
+ *
+ * Behaves like ph_config_query_int(), except that the query is only
+ * evaluated again when ph_config_set_global() has installed a new
+ * configuration since the last call.  Otherwise the cached value is
+ * read without taking any locks.
+ *
+ * A thread that calls this while the configuration is being replaced
+ * may briefly see the value from the previous configuration.
+ */
+int64_t ph_config_handle_int(ph_config_handle_t *h, int64_t defval);
+
+/** Return the double value of a cached configuration query
+ *
+ * The double counterpart of ph_config_handle_int().
+ */
+double ph_config_handle_double(ph_config_handle_t *h, double defval);
+
 #ifdef __cplusplus
 }
 #endif
@@ -23,8 +23,9 @@
  * These values may be modified and queried atomically via the provided API.
  *
  * Functions are provided to introspect the hierarchy and groups of
- * related counters can be read consistently.  Note that the system does
- * not provide a means for snapshotting the entire counter hierarchy.
+ * related counters can be read consistently.  The entire hierarchy can
+ * be captured with ph_counter_snapshot_all(), which is cheaper than
+ * reading each scope in turn.
  *
  * Counters are implemented such that individual threads may
  * manipulate their values uncontested (with no locking!), but allowing
@@ -73,6 +74,22 @@
  * // adds 4 to the sent counter and 5 to the recvd counter
  * ph_counter_block_bulk_add(block, 2, slots, values);
  * ```
+ *
+ * ## Histograms
+ *
+ * A slot may instead be registered as a histogram, which records the
+ * distribution of the values passed to it rather than their sum.
+ * This is useful for latency measurements:
+ *
+ * ```
+ * uint8_t lat = ph_counter_scope_register_histogram(myscope,
+ *    "latency_us", NULL);
+ * ph_counter_block_record(block, lat, elapsed_us);
+ *
+ * ph_counter_histogram_t *h = ph_counter_scope_get_histogram(myscope, lat);
+ * int64_t p99 = ph_counter_histogram_percentile(h, 99.0);
+ * ph_counter_histogram_free(h);
+ * ```
  */
 
 #ifndef PHENOM_COUNTER_H
@@ -88,8 +105,13 @@ extern "C" {
 
 struct ph_counter_scope;
 struct ph_counter_block;
+struct ph_counter_hist;
+struct ph_counter_histogram;
 typedef struct ph_counter_scope ph_counter_scope_t;
 typedef struct ph_counter_block ph_counter_block_t;
+typedef struct ph_counter_histogram ph_counter_histogram_t;
+struct ph_counter_snapshot;
+typedef struct ph_counter_snapshot ph_counter_snapshot_t;
 
 /** Defines a new counter scope.
  *
@@ -191,6 +213,44 @@ bool ph_counter_scope_register_counter_block(
     const char **names
 );
 
+/** Describes the buckets of a histogram slot.
+ *
+ * Buckets are log-linear: each power of two is divided into
+ * `2^precision` equally sized buckets, bounding the relative error
+ * of a reported percentile to `2^-precision`.
+ */
+struct ph_counter_histogram_spec {
+  /* largest value that is distinguished; larger values are recorded
+   * in the top bucket.  0 selects 2^36 */
+  int64_t max_value;
+  /* sub-bucket bits, 1-10.  0 selects 5 */
+  uint8_t precision;
+};
+typedef struct ph_counter_histogram_spec ph_counter_histogram_spec_t;
+
+/** Registers a histogram slot in a counter scope.
+ *
+ * Returns a counter slot offset or `PH_COUNTER_INVALID`.
+ *
+ * * `scope` - the scope in which the histogram should be registered
+ * * `name` - the name of the histogram
+ * * `spec` - the bucket layout, or NULL for the defaults
+ *
+ * Values are added to the histogram using ph_counter_block_record()
+ * or ph_counter_scope_record().  The value of the slot reported by
+ * ph_counter_scope_get() and ph_counter_scope_get_view() is the number
+ * of values that have been recorded.
+ */
+uint8_t ph_counter_scope_register_histogram(
+    ph_counter_scope_t *scope,
+    const char *name,
+    const ph_counter_histogram_spec_t *spec);
+
+/** Returns true if the slot was registered as a histogram */
+bool ph_counter_scope_is_histogram(
+    ph_counter_scope_t *scope,
+    uint8_t offset);
+
 /** Modify a counter value.
  *
  * Adds the specified value to the current counter value.
@@ -231,10 +291,12 @@ ph_counter_block_t *ph_counter_block_open(
     ph_counter_scope_t *scope);
 
 struct ph_counter_block {
-  /* must be first in the struct so that we can cast the return
-   * value from ck_hs_get() */
   uint32_t scope_id;
   ph_refcnt_t refcnt;
+  ph_counter_scope_t *scope;
+  /* histogram storage for this thread, indexed by slot and
+   * allocated on first use */
+  struct ph_counter_hist **hists;
   uint32_t seqno CK_CC_CACHELINE;
   char pad[CK_MD_CACHELINE - sizeof(uint32_t)];
 
@@ -267,6 +329,29 @@ static inline void ph_counter_block_add(
   ph_counter_block_record_write(block);
 }
 
+/** Record a value in a histogram slot of a thread local block
+ *
+ * Like ph_counter_block_add(), this must only be called from the
+ * thread that opened the block.
+ *
+ * * `block` - the block containing the histogram
+ * * `offset` - the histogram slot offset
+ * * `value` - the value to record; negative values count as 0
+ */
+void ph_counter_block_record(
+    ph_counter_block_t *block,
+    uint8_t offset,
+    int64_t value);
+
+/** Record a value in a histogram slot
+ *
+ * The convenient but slower counterpart to ph_counter_block_record().
+ */
+void ph_counter_scope_record(
+    ph_counter_scope_t *scope,
+    uint8_t offset,
+    int64_t value);
+
 /** Release a counter block
  *
  * * `block` - the block to be released.
@@ -353,6 +438,211 @@ uint8_t ph_counter_scope_get_view(
     int64_t *slots,
     const char **names);
 
+/** Returns a consistent view of a histogram slot.
+ *
+ * The per-thread histograms are merged, retrying each thread as
+ * in ph_counter_scope_get_view().
+ *
+ * Returns NULL if the slot is not a histogram or on allocation
+ * failure.  Release the result with ph_counter_histogram_free().
+ */
+ph_counter_histogram_t *ph_counter_scope_get_histogram(
+    ph_counter_scope_t *scope,
+    uint8_t offset);
+
+/** Returns the number of values recorded in the histogram */
+int64_t ph_counter_histogram_count(ph_counter_histogram_t *hist);
+
+/** Returns the sum of the values recorded in the histogram */
+int64_t ph_counter_histogram_sum(ph_counter_histogram_t *hist);
+
+/** Returns the smallest value recorded, or 0 if empty */
+int64_t ph_counter_histogram_min(ph_counter_histogram_t *hist);
+
+/** Returns the largest value recorded, or 0 if empty */
+int64_t ph_counter_histogram_max(ph_counter_histogram_t *hist);
+
+/** Returns the value at the given percentile.
+ *
+ * `pct` is in the range 0-100; for example, 99.9 for the p999.
+ * The result is the upper bound of the bucket holding that rank,
+ * clamped to the recorded min and max.  Returns 0 if empty.
+ */
+int64_t ph_counter_histogram_percentile(ph_counter_histogram_t *hist,
+    double pct);
+
+/** Returns the number of buckets in the histogram */
+uint32_t ph_counter_histogram_num_buckets(ph_counter_histogram_t *hist);
+
+/** Returns the number of values recorded in a bucket
+ *
+ * If `upper` is not NULL, it is set to the largest value that falls
+ * into the bucket.  Buckets are ordered by increasing value.
+ */
+int64_t ph_counter_histogram_bucket(ph_counter_histogram_t *hist,
+    uint32_t idx, int64_t *upper);
+
+/** Returns a copy of a histogram
+ *
+ * Release it with ph_counter_histogram_free().
+ */
+ph_counter_histogram_t *ph_counter_histogram_copy(
+    ph_counter_histogram_t *hist);
+
+/** Subtracts an earlier view of the same histogram
+ *
+ * Leaves `hist` holding only the values recorded since `prev` was
+ * taken, which is useful for reporting per-interval distributions.
+ * The min and max are left as they were.
+ *
+ * Returns false if the histograms have different bucket layouts.
+ */
+bool ph_counter_histogram_subtract(ph_counter_histogram_t *hist,
+    ph_counter_histogram_t *prev);
+
+/** Releases a histogram returned by ph_counter_scope_get_histogram() */
+void ph_counter_histogram_free(ph_counter_histogram_t *hist);
+
+/** Captures the values of all counter scopes
+ *
+ * Reading each scope with ph_counter_scope_get_view() walks every
+ * thread once per scope.  This function walks the threads once and
+ * gathers the values of every scope and histogram as it goes, which
+ * is much cheaper when there are many scopes and threads.  The values
+ * of each scope are consistent in the same sense as get_view.
+ *
+ * Returns NULL on allocation failure.  The snapshot holds a reference
+ * on each scope until released with ph_counter_snapshot_free().
+ */
+ph_counter_snapshot_t *ph_counter_snapshot_all(void);
+
+/** Captures the values of the given counter scopes
+ *
+ * Like ph_counter_snapshot_all(), but only the `num_scopes` scopes in
+ * `scopes` are gathered, so a caller that watches a few scopes does
+ * not pay to copy out all of the others.  A scope must not appear
+ * more than once.  The snapshot takes its own references; the caller
+ * keeps the ones that it holds.
+ */
+ph_counter_snapshot_t *ph_counter_snapshot_scopes(
+    ph_counter_scope_t **scopes, uint32_t num_scopes);
+
+/** Returns the number of scopes in the snapshot */
+uint32_t ph_counter_snapshot_num_scopes(ph_counter_snapshot_t *snap);
+
+/** Returns the scope at the given index of the snapshot
+ *
+ * The scope is owned by the snapshot.  Scopes appear in no
+ * particular order.
+ */
+ph_counter_scope_t *ph_counter_snapshot_get_scope(
+    ph_counter_snapshot_t *snap, uint32_t idx);
+
+/** Returns the captured values of a scope in the snapshot
+ *
+ * Behaves like ph_counter_scope_get_view() for the scope at `idx`.
+ */
+uint8_t ph_counter_snapshot_get_view(
+    ph_counter_snapshot_t *snap,
+    uint32_t idx,
+    uint8_t num_slots,
+    int64_t *slots,
+    const char **names);
+
+/** Returns the captured histogram for a slot of a scope in the snapshot
+ *
+ * Returns NULL if the slot is not a histogram.  The histogram is
+ * owned by the snapshot and must not be passed to
+ * ph_counter_histogram_free().
+ */
+ph_counter_histogram_t *ph_counter_snapshot_get_histogram(
+    ph_counter_snapshot_t *snap,
+    uint32_t idx,
+    uint8_t offset);
+
+/** Releases a snapshot and the scope references that it holds */
+void ph_counter_snapshot_free(ph_counter_snapshot_t *snap);
+
+/** The longest window, in seconds, that rates can be computed over */
+#define PH_COUNTER_RATE_WINDOW_MAX 60
+
+/** Track the per-second rates of the counters in a scope
+ *
+ * Once a scope is tracked, the rate sampler records the values of its
+ * slots once per second, keeping the last `PH_COUNTER_RATE_WINDOW_MAX`
+ * seconds of history.  Tracking cannot be turned off.
+ *
+ * The sampler must be started with ph_counter_rate_start().
+ */
+ph_result_t ph_counter_scope_track_rate(ph_counter_scope_t *scope);
+
+/** Start the rate sampler
+ *
+ * Schedules a timer job that samples the tracked scopes every second.
+ * Requires that the NBIO subsystem has been initialized.  Calling
+ * this more than once has no further effect.
+ */
+ph_result_t ph_counter_rate_start(void);
+
+/** Sample the tracked scopes now
+ *
+ * This is what the rate sampler calls each second; applications that
+ * drive their own timing may call it directly instead.
+ */
+void ph_counter_rate_sample(void);
+
+/** Returns the per-second rate of a counter
+ *
+ * The rate is averaged over the last `window` seconds; 1, 10 and 60
+ * are typical.  If less history is available, the rate is computed
+ * over what there is.  This reads only the recorded samples; it does
+ * not examine the per-thread counter blocks.
+ *
+ * Returns 0 if the scope is not tracked or there are fewer than two
+ * samples.
+ */
+double ph_counter_scope_get_rate(
+    ph_counter_scope_t *scope,
+    uint8_t offset,
+    uint32_t window);
+
+/** A counter and its rates, as returned by ph_counter_rate_top() */
+struct ph_counter_rate_entry {
+  const char *scope_name;
+  const char *slot_name;
+  // per-second rates over 1, 10 and 60 seconds
+  double rate[3];
+};
+typedef struct ph_counter_rate_entry ph_counter_rate_entry_t;
+
+/** Returns the fastest moving tracked counters
+ *
+ * Fills in up to `max_entries` entries, ordered by the magnitude of
+ * their 10 second rate.  Counters that have not moved in the last
+ * minute are omitted.  The names remain valid for the life of the
+ * process, as tracked scopes are never released.
+ *
+ * Returns the number of entries filled in.
+ */
+uint32_t ph_counter_rate_top(ph_counter_rate_entry_t *entries,
+    uint32_t max_entries);
+
+struct ph_stream;
+
+/** Writes all counters in the Prometheus text exposition format
+ *
+ * Each slot is written as a metric named after its scope and slot,
+ * with characters that Prometheus does not allow replaced by `_`;
+ * `memory.misc.string/allocs` becomes `memory_misc_string_allocs`.
+ * Histogram slots are written as Prometheus histograms.
+ *
+ * This is what the exporter started by ph_counter_exporter_start()
+ * serves; it is exposed so that it can be embedded elsewhere.
+ *
+ * Returns false if the counters could not be captured.
+ */
+bool ph_counter_write_prometheus(struct ph_stream *stm);
+
 /** Returns the fully qualified name of the counter scope
  *
  * Introspects the provided scope and returns its full path name.
@@ -296,6 +296,16 @@ void ph_library_init_register(struct ph_library_init_entry *ent);
 #  define ph_unlikely(x)  (x)
 # endif
 
+/* For an inline fast path that hands everything else to an out of line
+ * function.  The compiler won't otherwise inline it at call sites that it
+ * considers cold, because the call to the slow path makes it larger than
+ * the call it replaces. */
+# ifdef __GNUC__
+#  define ph_always_inline inline __attribute__((always_inline))
+# else
+#  define ph_always_inline inline
+# endif
+
 /** Generic result type
  *
  * If you wish to avoid TLS overheads with errno if/when a function fails,
@@ -29,7 +29,17 @@ extern "C" {
  * an arbitrary value type.
  *
  * The hash table uses closed hashing / open addressing to reduce the volume
- * of discrete allocations required to maintain the table.
+ * of discrete allocations required to maintain the table.  Alongside the
+ * elements, the table keeps a byte per slot holding 7 bits of the hash;
+ * lookups compare a group of 16 of these at a time, using SSE2 where
+ * available, so they rarely need to call `key_compare` on a mismatch.
+ * This lets the table run at up to 7/8ths full before it grows.
+ *
+ * Growing is incremental: the elements of the old table are moved
+ * into the new one a few at a time by subsequent inserts, so no single
+ * operation pays for rehashing the whole table.  Lookups and iteration
+ * never move elements, so a table that is no longer being modified can
+ * be read from several threads at once.
  *
  * Note: The tables have no built-in mutex or locking capability.  For a
  * concurrent map you might consider using the Concurrency Kit hash-set API.
@@ -152,6 +162,10 @@ extern "C" {
  * The second is a heavier weight ordered iterator that performs a sort
  * of the keys and then passes over the table in sorted key order.
  *
+ * Tables that are often walked in order can instead maintain an ordered
+ * index of their keys by calling ph_ht_keep_ordered().  The ordered
+ * iterator then walks the index, and copies only the current key.
+ *
  * Both iterators are safe in the presence of concurrent delete operations,
  * but exhibit undefined behavior if the table is resized.
  *
@@ -190,7 +204,10 @@ struct ph_ht_key_def {
   /* size of keys in bytes */
   uint32_t ksize;
 
-  /* Hash function */
+  /* Hash function
+   * Receives the address of the key.  ph_hash_bytes() is a good way to
+   * hash the bytes that make up the key.  All 32 bits are used, so
+   * they should be well mixed. */
   uint32_t (*hash_func)(const void *key);
 
   /* function to compare two keys.
@@ -254,21 +271,49 @@ struct ph_ht_val_def {
   void (*val_delete)(void *val);
 };
 
-#define PH_HT_ELEM_EMPTY     0
-#define PH_HT_ELEM_TAKEN     1
-#define PH_HT_ELEM_TOMBSTONE 2
-struct ph_ht_elem {
-  uint32_t status;
-  /* variable size: key followed by value embedded here */
+/* Each slot in the table has a control byte.  Full slots store 7 bits
+ * of the key's hash, so they have the top bit clear. */
+#define PH_HT_CTRL_EMPTY    0x80
+#define PH_HT_CTRL_DELETED  0xfe
+#define PH_HT_CTRL_SENTINEL 0xff
+/* Number of control bytes examined at once while probing */
+#define PH_HT_GROUP_WIDTH   16
+
+/* The storage for one table: control bytes, hashes and elements */
+struct ph_ht_store {
+  uint64_t table_size;
+  /* table_size control bytes, padded to at least a group */
+  uint8_t *ctrl;
+  /* the full hash of each element */
+  uint32_t *hashes;
+  /* an array of table_size elements, each a key followed by a value */
+  char *table;
+};
+
+/* While resizing, the previous table.  Its elements move into the
+ * current one a few at a time, starting from slot pos */
+struct ph_ht_migration {
+  struct ph_ht_store old;
+  uint64_t pos;
+  uint32_t nelems;
 };
 
 struct ph_ht {
   uint32_t nelems;
-  uint64_t table_size, elem_size, mask;
+  /* deleted slots in cur; these count towards the load factor */
+  uint32_t ndeleted;
+  /* bumped whenever elements move between slots */
+  uint32_t gen;
+  uint32_t elem_size;
   const struct ph_ht_key_def *kdef;
   const struct ph_ht_val_def *vdef;
-  /* points to the table, an array of table_size elements */
-  char *table;
+  struct ph_ht_store cur;
+  /* NULL unless a resize is in progress */
+  struct ph_ht_migration *mig;
+  /* the keys in order, if ph_ht_keep_ordered() was called */
+  struct ph_btree *index;
+  /* if non-NULL, the storage is allocated from this arena */
+  struct ph_arena *arena;
 };
 
 typedef struct ph_ht ph_ht_t;
@@ -284,6 +329,22 @@ ph_result_t ph_ht_init(ph_ht_t *ht, uint32_t size_hint,
     const struct ph_ht_key_def *kdef,
     const struct ph_ht_val_def *vdef);
 
+/** Initialize a hash table whose storage comes from an arena
+ *
+ * Behaves like ph_ht_init(), except that the table, and each larger
+ * table that it grows into, is allocated from `arena` with
+ * ph_arena_alloc().  The outgrown tables are not reclaimed until the
+ * arena is reset or destroyed, so this suits tables that are built once
+ * and then read, such as those of a parsed document.
+ *
+ * ph_ht_destroy() still deletes the entries, but leaves the storage to
+ * the arena.  ph_ht_keep_ordered() is not supported and returns
+ * `PH_ERR`.
+ */
+ph_result_t ph_ht_init_arena(ph_ht_t *ht, struct ph_arena *arena,
+    uint32_t size_hint, const struct ph_ht_key_def *kdef,
+    const struct ph_ht_val_def *vdef);
+
 /** Grow the table to accomodate nelems
  *
  * If you know that you will be inserting a number of elements that
@@ -307,6 +368,19 @@ bool ph_ht_grow(ph_ht_t *ht, uint32_t nelems);
  */
 void ph_ht_destroy(ph_ht_t *ht);
 
+/** Maintain an ordered index of the keys
+ *
+ * From now on, the table keeps its keys in a `ph_btree_t` as well,
+ * which makes ph_ht_ordered_iter_first() and ph_ht_ordered_iter_next()
+ * cheap.  Inserts and deletes become O(log n) and each key is copied
+ * into the index with `key_copy`.  The key definition must have a
+ * `key_compare` function.
+ *
+ * Returns `PH_OK` on success, or an error code on failure.  Tables
+ * initialized with ph_ht_init_arena() cannot keep an index.
+ */
+ph_result_t ph_ht_keep_ordered(ph_ht_t *ht);
+
 /** Empty the hash table
  *
  * Frees all elements but retains the table definition and current
@@ -392,6 +466,7 @@ ph_result_t ph_ht_insert(ph_ht_t *ht, void *key, void *value, int flags);
  * Returns 0 if there was no matching value.
  *
  * This function will NOT invoke copy_val on the returned value.
+ * The address is only valid until the table is next modified.
  */
 void *ph_ht_get(ph_ht_t *ht, const void *key);
 
@@ -416,11 +491,13 @@ ph_result_t ph_ht_del(ph_ht_t *ht, const void *key);
 uint32_t ph_ht_size(ph_ht_t *ht);
 
 /** Iterator for hash elements.
- * Iteration will be halted if the table size changes during
- * iteration. */
+ * Iteration will be halted if the table is resized during
+ * iteration, or if an insert moves elements out of the table
+ * that is being drained by an incremental resize. */
 struct ph_ht_iter {
   uint32_t slot;
   uint32_t size;
+  uint32_t gen;
 };
 typedef struct ph_ht_iter ph_ht_iter_t;
 
@@ -449,12 +526,16 @@ bool ph_ht_iter_next(ph_ht_t *ht, ph_ht_iter_t *iter, void **key, void **val);
 /** Iterating in a defined order
  *
  * This iterator performs a sort over the keys of the table and maintains
- * a copy of the sorted keys.
+ * a copy of the sorted keys.  If the table keeps an ordered index, it
+ * walks that instead: `leaf` and `slot` hold its position and `slots`
+ * a copy of the current key.
  */
 struct ph_ht_ordered_iter {
   uint32_t slot;
   uint32_t size;
   char *slots;
+  struct ph_btree_node *leaf;
+  uint32_t gen;
 };
 typedef struct ph_ht_ordered_iter ph_ht_ordered_iter_t;
 
@@ -496,6 +577,11 @@ void ph_ht_ordered_iter_end(ph_ht_t *ht, ph_ht_ordered_iter_t *iter);
 /* String key definition for hash tables */
 extern struct ph_ht_key_def ph_ht_string_key_def;
 
+/* String key definition that hashes with murmur.  Unlike
+ * ph_ht_string_key_def, whose hash is seeded per process, the hash and
+ * so the unordered iteration order are the same in every run */
+extern struct ph_ht_key_def ph_ht_string_murmur_key_def;
+
 /* String value definition for hash tables */
 extern struct ph_ht_val_def ph_ht_string_val_def;
 
@@ -20,6 +20,7 @@
 #include "phenom/defs.h"
 #include "phenom/stream.h"
 #include "phenom/variant.h"
+#include "phenom/buffer.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -56,6 +57,29 @@ extern "C" {
  *   `t` character.  It is recommended that you separate such values by
  *   whitespace if you are reading multiple consecutive non array, non object
  *   values.
+ * * `PH_JSON_NO_SIMD` - ph_json_load_string() and ph_json_load_cstr()
+ *   normally find the structure of the whole document with vector
+ *   instructions before building the variant.  Setting this flag makes
+ *   them use the lexer that ph_json_load_stream() uses instead.  The
+ *   lexer is always used when `PH_JSON_DISABLE_EOF_CHECK` is set, when
+ *   libphenom is configured with `--disable-json-simd`, and to describe
+ *   the problem when a document fails to parse.
+ * * `PH_JSON_ARENA` - build the whole document in a single arena (see
+ *   ph_arena_new()) that belongs to the array or object at its root.
+ *   Loading then takes a handful of large allocations rather than
+ *   several per value, and releasing the root frees the document in one
+ *   step, whatever its size.  Every value in the document is only valid
+ *   while the root is held, so taking a reference to one does not keep
+ *   it alive, and the document should be treated as read only.  If
+ *   `PH_JSON_DECODE_ANY` is set and the document is a single scalar, it
+ *   is loaded as usual.  ph_json_load_lazy() only honors this flag when
+ *   it builds the whole document up front.
+ * * `PH_JSON_INTERN_KEYS` - use the interned string (see
+ *   ph_string_intern()) for each object key, so that documents that
+ *   repeat the same keys share a single copy of each.  Interned strings
+ *   are never freed, so only set this for input from a trusted source
+ *   whose keys come from a small, fixed set; otherwise one document can
+ *   fill the intern table with keys that nothing else will use.
  *
  * ### Handling load errors
  *
@@ -78,7 +102,11 @@ extern "C" {
  *
  * ## Dumping and encoding JSON
  *
- * This is accomplished using ph_json_dump_stream() or ph_json_dump_string().
+ * This is accomplished using ph_json_dump_stream(), ph_json_dump_string()
+ * or ph_json_dump_bufq().
+ *
+ * Reals are written with the fewest digits that read back as the same
+ * double, so `0.1` is dumped as `0.1` rather than `0.10000000000000001`.
  *
  * You may specify one or more of the following flags to alter the dump
  * behavior:
@@ -100,6 +128,9 @@ extern "C" {
 #define PH_JSON_REJECT_DUPLICATES 0x1
 #define PH_JSON_DISABLE_EOF_CHECK 0x2
 #define PH_JSON_DECODE_ANY        0x4
+#define PH_JSON_NO_SIMD           0x8
+#define PH_JSON_ARENA             0x10
+#define PH_JSON_INTERN_KEYS       0x200
 
 #define PH_JSON_INDENT(n)      (n & 0x1F)
 #define PH_JSON_COMPACT        0x20
@@ -132,6 +163,124 @@ ph_variant_t *ph_json_load_string(ph_string_t *str, uint32_t flags,
 ph_variant_t *ph_json_load_cstr(const char *cstr, uint32_t flags,
     ph_var_err_t *err);
 
+/** Parse JSON lazily from a buffer
+ *
+ * Checks that the buffer holds valid JSON, as ph_json_load_string()
+ * would, but builds only the outermost value.  The elements of objects
+ * and arrays are built when they are first read, with
+ * ph_var_object_get(), ph_var_array_get() or ph_var_jsonpath_get(),
+ * and containers among them are lazy in turn; so a caller that looks
+ * at three fields of a large document pays for little more than
+ * finding them.  Strings without escapes are slices of a copy of the
+ * buffer, which lives until the last of them is released.
+ *
+ * Iterating, sizing or deleting from a lazy object builds all of it
+ * first.  Because reading a lazy value can modify it, lazy values must
+ * not be read from more than one thread at a time.
+ *
+ * `PH_JSON_REJECT_DUPLICATES` and `PH_JSON_DISABLE_EOF_CHECK` need a
+ * look at every value, so with either of them the whole document is
+ * built up front.
+ */
+ph_variant_t *ph_json_load_lazy(ph_buf_t *buf, uint32_t flags,
+    ph_var_err_t *err);
+
+/**
+ * ## Event driven parsing
+ *
+ * The load functions build the whole document as variants.  When only
+ * a few fields of a large input are interesting, the SAX parser can be
+ * used instead: it calls a function for each element as it is parsed
+ * and keeps nothing but the nesting of the containers that it is in.
+ *
+ * Strings and keys are passed with their escapes decoded and with a
+ * terminating NUL; they are only valid for the duration of the call.
+ * Any callback may be NULL.  Returning false from a callback stops the
+ * parse, which then fails with the text `"stopped by callback"`.
+ *
+ * ```
+ * struct ph_json_sax_callbacks cb = {
+ *   .key = on_key,
+ *   .string = on_string,
+ * };
+ * ph_json_sax_t *sax = ph_json_sax_new(&cb, NULL, PH_JSON_DISABLE_EOF_CHECK);
+ *
+ * // each time data arrives on the socket
+ * if (ph_json_sax_feed_bufq(sax, sock->rbuf, &err) != PH_OK) {
+ *   ph_log(PH_LOG_ERR, "bad json: %s", err.text);
+ * }
+ * ```
+ *
+ * The parser understands `PH_JSON_DECODE_ANY` as the loaders do.  With
+ * `PH_JSON_DISABLE_EOF_CHECK`, it accepts any number of consecutive
+ * values, as found in newline delimited JSON, rather than exactly one.
+ * Duplicate keys are not detected, since that would mean remembering
+ * every key of every open object.
+ */
+struct ph_json_sax_callbacks {
+  bool (*start_object)(void *arg);
+  bool (*end_object)(void *arg);
+  bool (*start_array)(void *arg);
+  bool (*end_array)(void *arg);
+  bool (*key)(void *arg, const char *key, uint32_t len);
+  bool (*string)(void *arg, const char *str, uint32_t len);
+  bool (*integer)(void *arg, int64_t ival);
+  bool (*real)(void *arg, double dval);
+  bool (*boolean)(void *arg, bool bval);
+  bool (*null)(void *arg);
+};
+
+struct ph_json_sax;
+typedef struct ph_json_sax ph_json_sax_t;
+
+/** Create an incremental SAX parser
+ *
+ * Returns NULL if memory could not be allocated.
+ */
+ph_json_sax_t *ph_json_sax_new(const struct ph_json_sax_callbacks *cb,
+    void *arg, uint32_t flags);
+
+/** Release an incremental SAX parser */
+void ph_json_sax_free(ph_json_sax_t *sax);
+
+/** Feed input to an incremental SAX parser
+ *
+ * Parses `len` bytes at `buf`, calling back for each complete element.
+ * Input may be split anywhere, even in the middle of a token or a UTF-8
+ * sequence; the parser picks up where it left off on the next call.
+ *
+ * Returns `PH_OK` if all of the input was valid so far.  Otherwise
+ * returns `PH_ERR`, or `PH_NOMEM` if memory ran out, and updates `err`.
+ * Once a parser has failed, it fails all subsequent calls.
+ */
+ph_result_t ph_json_sax_feed(ph_json_sax_t *sax, const void *buf,
+    uint64_t len, ph_var_err_t *err);
+
+/** Feed everything in a buffer queue to an incremental SAX parser
+ *
+ * Consumes all of the data in the queue and behaves as
+ * ph_json_sax_feed().
+ */
+ph_result_t ph_json_sax_feed_bufq(ph_json_sax_t *sax, ph_bufq_t *q,
+    ph_var_err_t *err);
+
+/** Tell an incremental SAX parser that the input has ended
+ *
+ * Completes a trailing number or literal, and fails if the input ended
+ * part way through a value or, unless `PH_JSON_DISABLE_EOF_CHECK` is
+ * set, contained no value at all.  On success, the `position` of `err`
+ * holds the number of bytes parsed.
+ */
+ph_result_t ph_json_sax_finish(ph_json_sax_t *sax, ph_var_err_t *err);
+
+/** Parse a stream with SAX callbacks
+ *
+ * Reads the stream until EOF, feeding it to a SAX parser.
+ */
+ph_result_t ph_json_sax_parse(ph_stream_t *stm,
+    const struct ph_json_sax_callbacks *cb, void *arg, uint32_t flags,
+    ph_var_err_t *err);
+
 /** Encode a variant as JSON, write to stream
  *
  * Given a variant, encodes it as JSON and writes to the provided
@@ -148,6 +297,14 @@ ph_result_t ph_json_dump_stream(ph_variant_t *obj,
 ph_result_t ph_json_dump_string(ph_variant_t *var,
     ph_string_t *str, uint32_t flags);
 
+/** Encode a variant as JSON, append to buffer queue
+ *
+ * Given a variant, encodes it as JSON and appends to the provided
+ * buffer queue, for example the write buffer of a ph_sock_t.
+ */
+ph_result_t ph_json_dump_bufq(ph_variant_t *var,
+    ph_bufq_t *q, uint32_t flags);
+
 #ifdef __cplusplus
 }
 #endif
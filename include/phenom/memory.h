@@ -41,6 +41,10 @@ typedef int ph_memtype_t;
 /* panic if memory could not be allocated */
 #define PH_MEM_FLAGS_PANIC 2
 
+/* serve fixed size allocations from per-thread magazines
+ * backed by page aligned slabs */
+#define PH_MEM_FLAGS_SLAB 4
+
 /** defines a memory type.
  *
  * This data structure is used to define a named memory type.
@@ -68,6 +72,12 @@ struct ph_memtype_def {
    * PH_MEM_FLAGS_PANIC - if the allocation fails, call `ph_panic`.
    *   Use this only for extremely critical allocations with no reasonable
    *   recovery path.
+   * PH_MEM_FLAGS_SLAB - use the slab allocator rather than malloc(3).
+   *   Each thread caches a couple of magazines of free items so that
+   *   the common case of ph_mem_alloc() and ph_mem_free() takes no
+   *   locks.  Items freed on another thread are returned to the shared
+   *   depot in batches.  Memory held by the slabs is not returned to
+   *   the system.  Ignored for variable size memtypes.
    */
   unsigned flags;
 };
@@ -204,6 +214,8 @@ struct ph_mem_stats {
   /* total number of calls to realloc (that are not themselves
    * equivalent to an alloc or free) */
   uint64_t reallocs;
+  /* limits set via ph_mem_set_limit(); 0 if there is no limit */
+  uint64_t soft_limit, hard_limit;
 };
 typedef struct ph_mem_stats ph_mem_stats_t;
 
@@ -245,6 +257,209 @@ int ph_mem_stat_range(ph_memtype_t start,
 ph_memtype_t ph_mem_type_by_name(const char *facility,
     const char *name);
 
+/**
+ * ## Byte Limits
+ *
+ * A memtype, or a whole facility, may be given a soft and a hard limit
+ * on the number of bytes that it may have allocated at any one time.
+ *
+ * An allocation that would take usage past the hard limit fails as though
+ * the system were out of memory: the `oom` counter is bumped and NULL is
+ * returned (or `ph_panic` is called if the memtype has
+ * `PH_MEM_FLAGS_PANIC`).
+ *
+ * Crossing the soft limit, in either direction, invokes the hook named by
+ * `PH_MEM_SOFT_LIMIT_HOOK_NAME`.  Components can use this to apply
+ * backpressure; pausing listeners or shrinking buffers, for example.
+ * The hook receives 3 parameters:
+ *
+ * * `args[0]` -> `ph_memtype_t *mt` the memtype being allocated or freed
+ * * `args[1]` -> `bool *facility` true if it was the facility limit
+ *   that was crossed, false if it was the limit on `mt` itself
+ * * `args[2]` -> `bool *exceeded` true if usage went above the soft
+ *   limit, false if it has dropped back below it
+ *
+ * The hook is called from inside the allocator on the thread that caused
+ * the transition, so it should do as little as possible, for instance
+ * setting a flag or scheduling a job.
+ *
+ * To keep the cost of the check down, threads reserve bytes from a limit
+ * in chunks and charge allocations against their local reservation.
+ * Usage is therefore over-estimated by up to a couple of chunks per
+ * thread; chunks are sized at 1/32nd of the limit, up to 64k.  Threads
+ * hand their chunks back when they exit, and the NBIO and thread pool
+ * threads also do so whenever they go idle.
+ *
+ * Limits may also be set from the configuration; whenever the global
+ * configuration is replaced, `$.memory.limits` is applied, and limits
+ * that came from the previous configuration but are absent from the
+ * new one are lifted.  Keys are either a facility name or a
+ * `facility/name` pair:
+ *
+ * ```
+ * {
+ *   "memory": {
+ *     "limits": {
+ *       "buffer": { "soft": 268435456, "hard": 536870912 },
+ *       "socket/sock": { "hard": 16777216 }
+ *     }
+ *   }
+ * }
+ * ```
+ */
+#define PH_MEM_SOFT_LIMIT_HOOK_NAME "phenom::memory::soft_limit"
+
+/** Sets the byte limits on a memtype
+ *
+ * A limit of 0 means unlimited.  Bytes already allocated against the
+ * memtype count towards the limits.
+ */
+ph_result_t ph_mem_set_limit(ph_memtype_t memtype,
+    uint64_t soft, uint64_t hard);
+
+/** Sets the byte limits on a facility
+ *
+ * The limits apply to the sum of all memtypes in the facility,
+ * including those that are registered later.  A limit of 0 means
+ * unlimited.
+ */
+ph_result_t ph_mem_set_facility_limit(const char *facility,
+    uint64_t soft, uint64_t hard);
+
+/** Applies the limits from `$.memory.limits` in the configuration
+ *
+ * This is called for you when the global configuration is set.
+ * Limits applied by an earlier call that the configuration no longer
+ * mentions are lifted; those set by ph_mem_set_limit() or
+ * ph_mem_set_facility_limit() are left alone.
+ */
+void ph_mem_configure_limits(void);
+
+/**
+ * ## Heap Profiling
+ *
+ * The allocator can sample allocations to show where memory is being
+ * allocated from, and which of those allocations are still live.
+ * Roughly one sample is taken for every `rate` bytes allocated by a
+ * thread; the exact sample points are randomized so that regular
+ * allocation patterns don't bias the results.  Each sample records the
+ * stack, memtype and size, and is forgotten again when it is freed.
+ *
+ * Sampling is disabled by default.  Enable it with ph_mem_prof_set_rate()
+ * or by setting `$.memory.sample_rate` in the configuration; a rate of
+ * around 512k gives useful data at negligible cost.
+ *
+ * The profile can be obtained from the `heap` debug console command, or
+ * via ph_mem_prof_dump(), in the text format understood by pprof:
+ *
+ * ```
+ * $ echo heap | nc -U /tmp/phenom-debug-console > heap.prof
+ * $ pprof --inuse_space ./myprog heap.prof
+ * $ pprof --alloc_space ./myprog heap.prof
+ * ```
+ */
+
+/** Sets the mean number of bytes between samples
+ *
+ * A rate of 0 disables sampling.  Allocations that were sampled
+ * before sampling was disabled continue to be tracked until freed.
+ */
+void ph_mem_prof_set_rate(uint64_t rate);
+
+/** Returns the current sampling rate */
+uint64_t ph_mem_prof_get_rate(void);
+
+struct ph_stream;
+
+/** Writes the heap profile to a stream
+ *
+ * The output is a pprof heap profile holding both the live (in use)
+ * and cumulative (allocated) samples for each stack.  The memtype of
+ * each stack is noted in a comment line preceding it.
+ */
+bool ph_mem_prof_dump(struct ph_stream *stm);
+
+/**
+ * ## Arenas
+ *
+ * An arena is a region allocator that hands out memory by bumping a
+ * pointer through large chunks.  Individual allocations are never freed;
+ * instead the entire arena is released in one operation by
+ * ph_arena_reset() or ph_arena_destroy().
+ *
+ * This is useful for transient object graphs, such as those built up
+ * while servicing a single request: rather than walking the graph and
+ * releasing references one at a time, the graph is discarded wholesale.
+ *
+ * Chunks are allocated against a variable size memtype that you provide,
+ * so the memory held by arenas is visible via ph_mem_stat().
+ *
+ * ```
+ * ph_arena_t *arena = ph_arena_new(mt_request, 0);
+ * ph_string_t *name = ph_string_make_arena(arena, "alice", 5);
+ * ph_variant_t *obj = ph_var_array_arena(arena, 4);
+ * ...
+ * // releases name and obj and everything else in one go
+ * ph_arena_destroy(arena);
+ * ```
+ *
+ * Arenas have no built-in locking; an arena should be used by one
+ * thread at a time.
+ */
+struct ph_arena;
+typedef struct ph_arena ph_arena_t;
+
+/** Creates a new arena
+ *
+ * Chunks are allocated against `memtype`, which MUST have been
+ * defined with a 0 size.  `chunk_size` is the preferred size of
+ * each chunk; pass 0 to use a reasonable default.  Allocations that
+ * are larger than a chunk are given a dedicated chunk of their own.
+ *
+ * Returns NULL if the arena could not be allocated.
+ */
+ph_arena_t *ph_arena_new(ph_memtype_t memtype, uint32_t chunk_size);
+
+/** Allocates memory from an arena
+ *
+ * The returned memory is suitably aligned for any type and is not
+ * initialized.  It remains valid until the arena is reset or destroyed.
+ *
+ * Returns NULL if a new chunk was needed and could not be allocated.
+ */
+void *ph_arena_alloc(ph_arena_t *arena, uint64_t size)
+#ifdef __GNUC__
+  __attribute__((malloc))
+#endif
+  ;
+
+/** Duplicates a buffer into an arena
+ *
+ * Equivalent to ph_arena_alloc() followed by memcpy(3).
+ */
+void *ph_arena_memdup(ph_arena_t *arena, const void *buf, uint64_t size);
+
+/** Releases everything allocated from an arena
+ *
+ * All memory handed out by the arena is invalidated.  The first chunk
+ * is retained so that an arena that is reused for each request does not
+ * need to go back to the allocator in the common case.
+ */
+void ph_arena_reset(ph_arena_t *arena);
+
+/** Destroys an arena
+ *
+ * Releases all of the arena chunks and the arena itself.
+ */
+void ph_arena_destroy(ph_arena_t *arena);
+
+/** Returns the number of bytes handed out by an arena
+ *
+ * Counts the bytes requested since the arena was created or last
+ * reset; this does not include chunk overhead or alignment padding.
+ */
+uint64_t ph_arena_bytes(ph_arena_t *arena);
+
 #ifdef __cplusplus
 }
 #endif
@@ -100,6 +100,27 @@ bool ph_stm_read(ph_stream_t *stm, void *buf,
  */
 bool ph_stm_readahead(ph_stream_t *stm, uint64_t count);
 
+/** Returns the contents of the read buffer without consuming them
+ *
+ * If the read buffer is empty, issues a single read to fill it.  Stores
+ * the address of the buffered data in `*buf` and its length in `*len`;
+ * a length of 0 indicates EOF.  The data remains in the stream until
+ * ph_stm_consume() is called, so a parser can look at a whole buffer at
+ * a time and then take only the bytes that it used.
+ *
+ * The data is valid until the next operation on the stream.  Only
+ * buffered streams can be peeked; for an unbuffered stream, returns
+ * false and sets errno to EINVAL.  Returns false on error.
+ */
+bool ph_stm_peek(ph_stream_t *stm, const void **buf, uint64_t *len);
+
+/** Consumes data previously returned by ph_stm_peek()
+ *
+ * Discards `count` bytes from the front of the read buffer.  `count`
+ * must not exceed the length returned by the preceding peek.
+ */
+void ph_stm_consume(ph_stream_t *stm, uint64_t count);
+
 /** Writes data from the provided memory buffer
  *
  * Returns false on error. errno is set accordingly, and ph_stm_errno() can
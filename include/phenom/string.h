@@ -162,6 +162,11 @@ struct ph_string {
   char *buf;
   ph_string_t *slice;
   bool onstack;
+  // set on the strings returned by ph_string_intern(); they are never
+  // freed, so reference counting skips them
+  bool interned;
+  // for an interned string, the hash that ph_ht_string_key_def uses
+  uint32_t hval;
 };
 
 #define PH_STRING_STATIC       PH_MEMTYPE_INVALID
@@ -170,21 +175,21 @@ struct ph_string {
 #define PH_STRING_DECLARE_GROW(name, size, mt) \
   char _str_buf_grow_##name[size]; \
   ph_string_t name = { 1, PH_STRING_GROW_MT(mt), 0, size, \
-    _str_buf_grow_##name, 0, true }
+    _str_buf_grow_##name, 0, true, false, 0 }
 
 #define PH_STRING_DECLARE_STACK(name, size) \
   char _str_buf_static_##name[size]; \
   ph_string_t name = { 1, PH_STRING_STATIC, 0, size, \
-    _str_buf_static_##name, 0, true }
+    _str_buf_static_##name, 0, true, false, 0 }
 
 #define PH_STRING_DECLARE_STATIC(name, cstr) \
   ph_string_t name = { 1, PH_STRING_STATIC, sizeof(cstr)-1, \
-    sizeof(cstr), (char*)cstr, 0, true }
+    sizeof(cstr), (char*)cstr, 0, true, false, 0 }
 
 #define PH_STRING_DECLARE_STATIC_CSTR_INNER(name, cstr, len) \
   uint32_t len = strlen(cstr); \
   ph_string_t name = { 1, PH_STRING_STATIC, len, \
-    len + 1, (char*)cstr, 0, true }
+    len + 1, (char*)cstr, 0, true, false, 0 }
 #define PH_STRING_DECLARE_STATIC_CSTR(name, cstr) \
   PH_STRING_DECLARE_STATIC_CSTR_INNER(name, cstr, ph_defs_gen_symbol(len))
 
@@ -257,11 +262,63 @@ ph_string_t *ph_string_make_cstr(ph_memtype_t mt, const char *str);
 ph_string_t *ph_string_make_empty(ph_memtype_t mt,
     uint32_t size);
 
+/** Make a new string by copying a buffer into an arena
+ *
+ * Both the string object and its buffer are allocated from `arena`
+ * and are released when the arena is reset or destroyed; releasing
+ * the final reference on the string does not free anything.
+ *
+ * The buffer is sized to hold exactly `len` bytes plus a NUL
+ * terminator that is not counted in the length of the string.
+ * Appending to the string will clamp in the same way as for
+ * a `PH_STRING_STATIC` string.
+ */
+ph_string_t *ph_string_make_arena(ph_arena_t *arena,
+    const char *buf, uint32_t len);
+
+/** Return the interned string with the given contents
+ *
+ * libPhenom keeps a process-wide table of interned strings, which is
+ * meant for the keys of objects: a program that handles millions of
+ * records typically sees the same few hundred keys over and over.
+ * Each distinct key is then a single string, shared by every object
+ * that uses it, rather than an allocation per copy.
+ * The JSON loaders only use it when they are passed
+ * `PH_JSON_INTERN_KEYS`.
+ *
+ * An interned string is never freed and must not be modified.
+ * ph_string_addref() and ph_string_delref() do nothing to it, so it
+ * can be shared between threads without contending on its reference
+ * count, and it can be treated like any other string.  It also
+ * carries its hash, so hash tables keyed by it don't need to hash it
+ * again.  Because there is only one interned string with any given
+ * contents, ph_string_equal() only has to compare the pointers when
+ * both of its arguments are interned.
+ *
+ * Any thread may call this; the table is read without locking, under
+ * the protection of the calling thread's epoch (see
+ * ph_thread_epoch_begin()).  Callers that intern many strings in a
+ * row, such as the JSON loader, can enter an epoch around the whole
+ * batch to make each lookup cheaper.
+ *
+ * So that the table cannot grow without bound, strings longer than
+ * `PH_STRING_INTERN_MAX_LEN` bytes are not interned, and neither is
+ * anything once the table holds `PH_STRING_INTERN_MAX_COUNT` strings.
+ * In those cases, and if memory runs out, this returns NULL; callers
+ * should then make an ordinary string instead.
+ */
+ph_string_t *ph_string_intern(const char *buf, uint32_t len);
+
+#define PH_STRING_INTERN_MAX_LEN    128
+#define PH_STRING_INTERN_MAX_COUNT  65536
+
 /** Add a reference to a string
  */
 static inline void ph_string_addref(ph_string_t *str)
 {
-  ph_refcnt_add(&str->ref);
+  if (!str->interned) {
+    ph_refcnt_add(&str->ref);
+  }
 }
 
 /** Release a reference to a string
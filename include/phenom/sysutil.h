@@ -136,8 +136,67 @@ const char *ph_strerror_r(int errval, char *buf, size_t len);
 void ph_hash_bytes_murmur(const void *key, const int len,
     const uint32_t seed, void *out);
 
+/** Fast 64-bit hash of a byte string
+ *
+ * Much quicker than murmur for short keys.  The result depends on a
+ * seed that is chosen at random when the process starts, which makes it
+ * hard for an attacker to pick keys that collide in our hash tables.
+ * Use ph_hash_bytes_seeded() or ph_hash_bytes_murmur() if the hash needs
+ * to be the same in every process.
+ */
+uint64_t ph_hash_bytes(const void *key, size_t len);
+
+/** Fast 64-bit hash of a byte string, using the given seed */
+uint64_t ph_hash_bytes_seeded(const void *key, size_t len, uint64_t seed);
+
 void ph_debug_console_start(const char *unix_sock_path);
 
+/** Serve counters over HTTP in the Prometheus text format
+ *
+ * Starts a listener on `addr` that answers `GET /metrics` with the
+ * output of ph_counter_write_prometheus().  Connections that stay idle
+ * for ten seconds are closed.  Requires that the NBIO subsystem has
+ * been initialized.
+ */
+ph_result_t ph_counter_exporter_start(const ph_sockaddr_t *addr);
+
+/** Push counter deltas to a statsd server over UDP
+ *
+ * Every `interval_ms` milliseconds, the change in each counter since
+ * the previous push is sent to `addr` as a statsd counter named
+ * `prefix.scope.slot`; counters that did not change are skipped.
+ * For histogram slots, the number of values recorded in the interval
+ * is sent as a counter and the p50, p99 and p999 of those values are
+ * sent as gauges.  `prefix` may be NULL.
+ */
+ph_result_t ph_counter_statsd_start(const ph_sockaddr_t *addr,
+    uint32_t interval_ms, const char *prefix);
+
+/** Enables or disables lock contention profiling
+ *
+ * While enabled, acquisitions of phenom's internal locks (the job pool,
+ * timer wheel, stream, log and configuration locks) are counted in
+ * counter scopes named `locks.<name>`.  Acquisitions that had to wait are
+ * also counted as contended; the wait is recorded in the `wait_ns`
+ * histogram and charged to the call site that waited.
+ *
+ * Profiling can also be enabled by setting `$.locks.profile` to true
+ * in the configuration.  It is compiled out entirely when phenom is
+ * configured with `--disable-lock-profiling`.
+ */
+void ph_lock_prof_enable(bool enable);
+
+/** Returns true if lock contention profiling is enabled */
+bool ph_lock_prof_is_enabled(void);
+
+/** Writes a lock contention report to a stream
+ *
+ * Lists each lock class that has been acquired while profiling was
+ * enabled, with its contention rate, wait percentiles and the call
+ * sites that waited longest.
+ */
+bool ph_lock_prof_dump(ph_stream_t *stm);
+
 #ifdef __cplusplus
 }
 #endif
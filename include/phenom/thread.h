@@ -33,6 +33,8 @@ struct ph_thread;
 struct ph_job;
 struct ph_thread_pool;
 struct ph_nbio_emitter;
+struct ph_mem_magazine_cache;
+struct ph_counter_block_table;
 
 typedef struct ph_thread ph_thread_t;
 
@@ -48,10 +50,20 @@ struct ph_thread {
   struct timeval now;
 
   ck_epoch_record_t epoch_record;
-  ck_hs_t counter_hs;
+  // counter blocks for this thread, indexed by scope id
+  struct ph_counter_block_table *counter_blocks;
   // linkage so that a stat reader can find all counters
   ck_stack_entry_t thread_linkage;
 
+  // per-memtype magazines for slab backed memtypes
+  struct ph_mem_magazine_cache **mem_cache;
+  // bytes reserved from memory limits, indexed by limit id
+  int64_t *mem_grant;
+  // bytes left until the next heap profile sample, and the state
+  // of the generator used to pick the sample points
+  int64_t mem_prof_countdown;
+  uint64_t mem_prof_seed;
+
   // OS level representation
   pthread_t thr;
 
@@ -197,6 +209,9 @@ uint32_t ph_thread_emitter_affinity(void);
 
 void ph_counter_tear_down_thread(ph_thread_t *thr);
 void ph_counter_init_thread(ph_thread_t *thr);
+void ph_counter_fold_thread(ph_thread_t *thr);
+void ph_mem_flush_thread(ph_thread_t *thr);
+void ph_mem_thread_idle(ph_thread_t *thr);
 extern ck_stack_t ph_thread_all_threads;
 
 #ifdef __cplusplus
@@ -278,7 +278,9 @@ ph_var_unpack(root, &err, 0, "{s?i, s?[ii]}",
  * The query `$.one.two[2]` produces the value `"c"`, while the
  * query `$.one.two[3].lemon` produces the value `"cake"`.
  *
- * Use ph_var_jsonpath_get() to issue JSONPath style queries.
+ * Use ph_var_jsonpath_get() to issue JSONPath style queries.  A query
+ * that is run repeatedly can be parsed once with ph_var_path_compile()
+ * and then run with ph_var_path_get().
  */
 
 #ifndef PHENOM_VARIANT_H
@@ -306,6 +308,11 @@ typedef enum {
   PH_VAR_NULL
 } ph_variant_type_t;
 
+struct ph_var_kv {
+  ph_string_t *key;
+  struct ph_variant *val;
+};
+
 struct ph_variant {
   ph_refcnt_t ref;
   ph_variant_type_t type;
@@ -316,8 +323,28 @@ struct ph_variant {
     struct {
       uint32_t len, alloc;
       struct ph_variant **arr;
+      // if non-NULL, arr is allocated from this arena
+      ph_arena_t *arena;
+      // Non-NULL for an array from ph_json_load_lazy() until all of its
+      // elements have been built
+      struct ph_var_lazy *lazy;
     } aval;
-    ph_ht_t oval;
+    struct {
+      // A small object keeps its pairs in p.kv, sorted by key, with NULL
+      // keys where pairs were deleted.  Past a few pairs, they all move
+      // into p.ht for good, and promoted is set.
+      uint16_t len, count, alloc;
+      bool keep_sorted;
+      bool promoted;
+      union {
+        struct ph_var_kv *kv;
+        ph_ht_t *ht;
+      } p;
+      // if non-NULL, kv and ht are allocated from this arena
+      ph_arena_t *arena;
+      // as for arrays
+      struct ph_var_lazy *lazy;
+    } oval;
   } u;
 };
 
@@ -461,6 +488,55 @@ static inline bool ph_var_is_string(ph_variant_t *var) {
  */
 ph_variant_t *ph_var_array(uint32_t nelems);
 
+/** Construct variant values in an arena
+ *
+ * These behave like ph_var_int(), ph_var_double() and ph_var_array()
+ * except that the storage comes from `arena`.  The arena holds a
+ * reference on each value that it hands out; that reference is
+ * implicitly dropped, and the storage reclaimed, when the arena is
+ * reset or destroyed, so the values are never freed individually.
+ *
+ * An arena array grows by taking a larger region from the arena.
+ * Its elements should be arena, boolean or null values: any heap
+ * allocated value that is appended to an arena array will be leaked
+ * when the arena is released, as the array is never walked.
+ */
+ph_variant_t *ph_var_int_arena(ph_arena_t *arena, int64_t ival);
+ph_variant_t *ph_var_double_arena(ph_arena_t *arena, double dval);
+ph_variant_t *ph_var_array_arena(ph_arena_t *arena, uint32_t nelems);
+
+/** Construct a string variant in an arena
+ *
+ * Copies `len` bytes from `buf` into a string allocated with
+ * ph_string_make_arena() and wraps it in an arena variant.
+ */
+ph_variant_t *ph_var_string_arena(ph_arena_t *arena,
+    const char *buf, uint32_t len);
+
+/** Construct an object variant in an arena
+ *
+ * Like ph_var_object(), but the object and its hash table are allocated
+ * from `arena`, as described for ph_var_int_arena().  Its values should
+ * likewise be arena, boolean or null values, and its keys should be made
+ * with ph_string_make_arena().  An arena object cannot be kept sorted.
+ */
+ph_variant_t *ph_var_object_arena(ph_arena_t *arena, uint32_t nelems);
+
+/** Make an arena container own its arena
+ *
+ * `var` must be an array or object constructed in an arena, and the
+ * caller must hold a reference to it.  The reference that the arena
+ * held on `var` is dropped, so that when the last reference to `var`
+ * is released the whole arena is destroyed with it, in one step,
+ * however many values were built there.  This turns the arena into a
+ * document: all of the values in it are only valid while `var` is
+ * held, and should be treated as read only, since anything that
+ * replaces them leaves the old storage in the arena.
+ *
+ * Returns `PH_ERR` if `var` is not an arena array or object.
+ */
+ph_result_t ph_var_own_arena(ph_variant_t *var);
+
 /** Returns the number of elements in the variant array.
  *
  * Returns 0 if the variant is not an array.
@@ -499,22 +575,24 @@ ph_result_t ph_var_array_append(ph_variant_t *arr, ph_variant_t *val);
  */
 ph_result_t ph_var_array_append_claim(ph_variant_t *arr, ph_variant_t *val);
 
+// ph_var_array_get() for anything but a fully built array
+ph_variant_t *_ph_var_array_get_slow(ph_variant_t *arr, uint32_t pos);
+
 /** Get array element at a given position
  *
  * Returns the array element, borrowing its reference (addref is not
  * called).
  */
-static inline ph_variant_t *ph_var_array_get(ph_variant_t *arr, uint32_t pos)
+static ph_always_inline ph_variant_t *ph_var_array_get(ph_variant_t *arr,
+    uint32_t pos)
 {
-  switch (arr->type) {
-    case PH_VAR_ARRAY:
-      if (pos >= arr->u.aval.len) {
-        return NULL;
-      }
-      return arr->u.aval.arr[pos];
-    default:
-      return NULL;
+  if (arr->type != PH_VAR_ARRAY || arr->u.aval.lazy) {
+    return _ph_var_array_get_slow(arr, pos);
+  }
+  if (pos >= arr->u.aval.len) {
+    return NULL;
   }
+  return arr->u.aval.arr[pos];
 }
 
 /** Set array element at a given position to val, and claim its reference.
@@ -541,6 +619,12 @@ ph_result_t ph_var_array_set(ph_variant_t *arr, uint32_t pos,
  *
  * It is pre-sized to hold the specified number of elements, but is
  * initially empty.
+ *
+ * An object with only a few keys keeps them in a small sorted array,
+ * which is searched linearly; as it grows, they are moved into a hash
+ * table.  This is invisible to callers, except that the keys of a small
+ * object are iterated in sorted order, and that setting a key while
+ * iterating an object is undefined, even if the key exists.
  */
 ph_variant_t *ph_var_object(uint32_t nelems);
 
@@ -550,6 +634,9 @@ static inline bool ph_var_is_object(ph_variant_t *var) {
 }
 
 /** Returns the number of key/value pairs in an object
+ *
+ * Returns 0 if the object was loaded lazily and there wasn't enough
+ * memory to build the rest of it.
  */
 uint32_t ph_var_object_size(ph_variant_t *var);
 
@@ -590,7 +677,10 @@ ph_variant_t *ph_var_object_get_cstr(ph_variant_t *obj, const char *key);
 
 /** Begin iterating an object value
  *
- * Delegates to ph_ht_iter_first()
+ * Delegates to ph_ht_iter_first() once the object has grown into a
+ * hash table.  Deleting the current key while iterating is safe.
+ * Returns false, as for an empty object, if the object was loaded
+ * lazily and there wasn't enough memory to build the rest of it.
  */
 bool ph_var_object_iter_first(ph_variant_t *obj, ph_ht_iter_t *iter,
     ph_string_t **key, ph_variant_t **val);
@@ -600,11 +690,21 @@ bool ph_var_object_iter_first(ph_variant_t *obj, ph_ht_iter_t *iter,
 bool ph_var_object_iter_next(ph_variant_t *obj, ph_ht_iter_t *iter,
     ph_string_t **key, ph_variant_t **val);
 
+/** Keep the keys of an object in order
+ *
+ * Objects that are often walked in key order, for instance when they are
+ * dumped with `PH_JSON_SORT_KEYS`, can maintain an ordered index of their
+ * keys so that ordered iteration neither sorts nor allocates.  Setting
+ * and deleting keys becomes somewhat slower.  See ph_ht_keep_ordered().
+ */
+ph_result_t ph_var_object_keep_sorted(ph_variant_t *obj);
+
 /** Begin iterating an object value in key order
  *
  * Delegates to ph_ht_ordered_iter_first().
  * You must call ph_var_object_ordered_iter_end() to release the iterator
- * when you have finished iterating.
+ * when you have finished iterating.  As with ph_var_object_iter_first(),
+ * returns false if a lazily loaded object couldn't be built.
  */
 bool ph_var_object_ordered_iter_first(ph_variant_t *obj,
     ph_ht_ordered_iter_t *iter,
@@ -696,6 +796,31 @@ ph_result_t ph_var_vunpack(ph_variant_t *root, ph_var_err_t *error,
  */
 ph_variant_t *ph_var_jsonpath_get(ph_variant_t *var, const char *path);
 
+/** A compiled JSONPath style expression */
+typedef struct ph_var_path ph_var_path_t;
+
+/** Compile a JSONPath style expression
+ *
+ * Parses `path` once into a list of steps, so that it can be evaluated
+ * many times by ph_var_path_get() without being parsed again.  Object
+ * keys in the steps are interned, see ph_string_intern().
+ *
+ * Returns NULL if the expression is malformed or memory is exhausted.
+ * Release the result with ph_var_path_free().
+ */
+ph_var_path_t *ph_var_path_compile(const char *path);
+
+/** Evaluate a compiled JSONPath style expression
+ *
+ * Produces the same result as passing the original expression to
+ * ph_var_jsonpath_get(): a borrowed reference on the matching element
+ * if found, else a NULL pointer.
+ */
+ph_variant_t *ph_var_path_get(ph_variant_t *var, ph_var_path_t *path);
+
+/** Release a compiled JSONPath style expression */
+void ph_var_path_free(ph_var_path_t *path);
+
 #ifdef __cplusplus
 }
 #endif
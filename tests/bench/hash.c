@@ -0,0 +1,164 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phenom/sysutil.h"
+#include "phenom/hashtable.h"
+#include "phenom/string.h"
+#include "phenom/log.h"
+#include "phenom/memory.h"
+#include <sysexits.h>
+
+/* Compares ph_hash_bytes() against murmur across key lengths, and the
+ * two string key definitions on short-key ph_ht lookups, which is what
+ * variant objects spend their time doing. */
+
+static ph_memtype_def_t mt_def = { "bench", "string", 0, 0 };
+static ph_memtype_t mt_string;
+
+static uint32_t iterations = 2000000;
+static uint32_t num_keys = 64;
+
+// Keeps the compiler from discarding the hashes
+static volatile uint64_t sink;
+
+static double elapsed(struct timeval *start)
+{
+  struct timeval end, diff;
+
+  gettimeofday(&end, NULL);
+  timersub(&end, start, &diff);
+  return diff.tv_sec + (diff.tv_usec / 1000000.0);
+}
+
+static void bench_lengths(void)
+{
+  static const uint32_t lengths[] = { 4, 8, 16, 32, 64, 256, 1024 };
+  char buf[1024];
+  struct timeval start;
+  double murmur, wy;
+  uint64_t acc, h[2];
+  uint32_t i, n, l;
+
+  for (i = 0; i < sizeof(buf); i++) {
+    buf[i] = (char)(i * 31);
+  }
+
+  for (l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+    // Keep the number of bytes hashed roughly constant
+    n = iterations / (1 + lengths[l] / 16);
+
+    acc = 0;
+    gettimeofday(&start, NULL);
+    for (i = 0; i < n; i++) {
+      buf[0] = (char)i;
+      ph_hash_bytes_murmur(buf, lengths[l], 0, h);
+      acc += h[0];
+    }
+    murmur = elapsed(&start);
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < n; i++) {
+      buf[0] = (char)i;
+      acc += ph_hash_bytes(buf, lengths[l]);
+    }
+    wy = elapsed(&start);
+    sink = acc;
+
+    ph_log(PH_LOG_INFO, "len %4" PRIu32 ": murmur %6.1f ns  "
+        "ph_hash_bytes %6.1f ns  (%.2fx)",
+        lengths[l], murmur * 1e9 / n, wy * 1e9 / n,
+        wy > 0 ? murmur / wy : 0.0);
+  }
+}
+
+static double bench_lookups(struct ph_ht_key_def *kdef)
+{
+  ph_string_t **keys;
+  ph_ht_t ht;
+  struct timeval start;
+  uint32_t i, hits = 0;
+  double t;
+
+  keys = calloc(num_keys, sizeof(*keys));
+  ph_ht_init(&ht, num_keys, kdef, &ph_ht_ptr_val_def);
+  for (i = 0; i < num_keys; i++) {
+    // short keys like the ones typically found in JSON objects
+    keys[i] = ph_string_make_printf(mt_string, 16, "key%" PRIu32, i);
+    ph_ht_set(&ht, &keys[i], &keys[i]);
+  }
+
+  gettimeofday(&start, NULL);
+  for (i = 0; i < iterations; i++) {
+    if (ph_ht_get(&ht, &keys[i % num_keys])) {
+      hits++;
+    }
+  }
+  t = elapsed(&start);
+  sink = hits;
+
+  ph_ht_destroy(&ht);
+  for (i = 0; i < num_keys; i++) {
+    ph_string_delref(keys[i]);
+  }
+  free(keys);
+
+  return t * 1e9 / iterations;
+}
+
+int main(int argc, char **argv)
+{
+  int c;
+  double murmur, wy;
+
+  while ((c = getopt(argc, argv, "n:k:")) != -1) {
+    switch (c) {
+      case 'n':
+        iterations = atoi(optarg);
+        break;
+      case 'k':
+        num_keys = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr,
+            "-n NUMBER   specify number of iterations (default %" PRIu32 ")\n",
+            iterations);
+        fprintf(stderr,
+            "-k NUMBER   specify number of table keys (default %" PRIu32 ")\n",
+            num_keys);
+        exit(EX_USAGE);
+    }
+  }
+  if (iterations == 0 || num_keys == 0) {
+    fprintf(stderr, "-n and -k must be positive\n");
+    exit(EX_USAGE);
+  }
+
+  ph_library_init();
+  ph_log_level_set(PH_LOG_INFO);
+  mt_string = ph_memtype_register(&mt_def);
+
+  bench_lengths();
+
+  murmur = bench_lookups(&ph_ht_string_murmur_key_def);
+  wy = bench_lookups(&ph_ht_string_key_def);
+  ph_log(PH_LOG_INFO, "ph_ht_get, %" PRIu32 " short string keys: "
+      "murmur %.1f ns  ph_hash_bytes %.1f ns", num_keys, murmur, wy);
+
+  return EX_OK;
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -16,6 +16,8 @@
 
 #include "phenom/sysutil.h"
 #include "phenom/counter.h"
+#include "phenom/stream.h"
+#include "phenom/socket.h"
 #include "tap.h"
 #include <ck_pr.h>
 
@@ -230,6 +232,315 @@ static void concurrentCounters(void)
       ph_counter_scope_get(data.scope, data.slot));
 }
 
+// define enough scopes that the per-thread block table has to grow
+// while we hold blocks from before the growth
+static void manyScopes(void)
+{
+  int i, num_scopes = 200, good = 0;
+  ph_counter_scope_t *scopes[num_scopes];
+  ph_counter_block_t *first;
+  char name[32];
+
+  for (i = 0; i < num_scopes; i++) {
+    snprintf(name, sizeof(name), "testManyScopes%d", i);
+    scopes[i] = ph_counter_scope_define(NULL, name, 1);
+    ph_counter_scope_register_counter(scopes[i], "dummy");
+  }
+
+  first = ph_counter_block_open(scopes[0]);
+  is_true(first != NULL);
+
+  for (i = 0; i < num_scopes; i++) {
+    ph_counter_scope_add(scopes[i], 0, i);
+  }
+  ph_counter_block_add(first, 0, 7);
+
+  for (i = 0; i < num_scopes; i++) {
+    int64_t expect = i ? i : 7;
+    if (ph_counter_scope_get(scopes[i], 0) == expect) {
+      good++;
+    }
+  }
+  is(num_scopes, good);
+
+  ph_counter_block_delref(first);
+  for (i = 0; i < num_scopes; i++) {
+    ph_counter_scope_delref(scopes[i]);
+  }
+}
+static void histograms(void)
+{
+  ph_counter_scope_t *scope;
+  ph_counter_block_t *block;
+  ph_counter_histogram_t *hist;
+  ph_counter_histogram_spec_t spec = { 1000000, 7 };
+  uint8_t plain, lat, coarse;
+  int64_t view_slots[4];
+  int i;
+
+  scope = ph_counter_scope_define(NULL, "testHistograms", 4);
+  plain = ph_counter_scope_register_counter(scope, "plain");
+  lat = ph_counter_scope_register_histogram(scope, "latency", &spec);
+  coarse = ph_counter_scope_register_histogram(scope, "coarse", NULL);
+  is(1, lat);
+  is(2, coarse);
+  is_true(ph_counter_scope_is_histogram(scope, lat));
+  is_true(!ph_counter_scope_is_histogram(scope, plain));
+  is_true(ph_counter_scope_get_histogram(scope, plain) == NULL);
+
+  // nothing recorded yet
+  hist = ph_counter_scope_get_histogram(scope, lat);
+  is(0, ph_counter_histogram_count(hist));
+  is(0, ph_counter_histogram_percentile(hist, 50));
+  ph_counter_histogram_free(hist);
+
+  block = ph_counter_block_open(scope);
+  for (i = 1; i <= 1000; i++) {
+    ph_counter_block_record(block, lat, i);
+  }
+  ph_counter_scope_record(scope, coarse, 5000000);
+  ph_counter_block_delref(block);
+
+  is(3, ph_counter_scope_get_view(scope, 4, view_slots, NULL));
+  is(1000, view_slots[lat]);
+
+  hist = ph_counter_scope_get_histogram(scope, lat);
+  is(1000, ph_counter_histogram_count(hist));
+  is(500500, ph_counter_histogram_sum(hist));
+  is(1, ph_counter_histogram_min(hist));
+  is(1000, ph_counter_histogram_max(hist));
+  // 7 bits of precision is within 1%
+  is_true(labs(ph_counter_histogram_percentile(hist, 50) - 500) <= 5);
+  is_true(labs(ph_counter_histogram_percentile(hist, 99) - 990) <= 10);
+  is(1000, ph_counter_histogram_percentile(hist, 100));
+  is(1, ph_counter_histogram_percentile(hist, 0));
+  ph_counter_histogram_free(hist);
+
+  hist = ph_counter_scope_get_histogram(scope, coarse);
+  is(1, ph_counter_histogram_count(hist));
+  is(5000000, ph_counter_histogram_percentile(hist, 50));
+  ph_counter_histogram_free(hist);
+
+  ph_counter_scope_delref(scope);
+}
+static void *record_and_exit(void *ptr)
+{
+  ph_counter_scope_t *scope = (ph_counter_scope_t*)ptr;
+
+  ph_library_init();
+  ph_counter_scope_add(scope, 0, 10);
+  ph_counter_scope_record(scope, 1, 100);
+
+  return NULL;
+}
+
+// values from threads that have exited are folded into the scope
+// and show up in a snapshot along with those of live threads
+static void snapshotAndFold(void)
+{
+  ph_counter_scope_t *scope;
+  ph_counter_snapshot_t *snap;
+  ph_counter_histogram_t *hist;
+  pthread_t thr;
+  void *unused;
+  int64_t view_slots[2];
+  uint32_t i, found = 0;
+
+  scope = ph_counter_scope_define(NULL, "testSnapshot", 2);
+  ph_counter_scope_register_counter(scope, "count");
+  ph_counter_scope_register_histogram(scope, "hist", NULL);
+
+  pthread_create(&thr, NULL, record_and_exit, scope);
+  pthread_join(thr, &unused);
+
+  ph_counter_scope_add(scope, 0, 1);
+  ph_counter_scope_record(scope, 1, 300);
+
+  is(11, ph_counter_scope_get(scope, 0));
+  is(2, ph_counter_scope_get(scope, 1));
+
+  hist = ph_counter_scope_get_histogram(scope, 1);
+  is(400, ph_counter_histogram_sum(hist));
+  is(100, ph_counter_histogram_min(hist));
+  ph_counter_histogram_free(hist);
+
+  snap = ph_counter_snapshot_all();
+  is_true(snap != NULL);
+  for (i = 0; i < ph_counter_snapshot_num_scopes(snap); i++) {
+    if (ph_counter_snapshot_get_scope(snap, i) != scope) {
+      continue;
+    }
+    found++;
+    is(2, ph_counter_snapshot_get_view(snap, i, 2, view_slots, NULL));
+    is(11, view_slots[0]);
+    is(2, view_slots[1]);
+    is_true(ph_counter_snapshot_get_histogram(snap, i, 0) == NULL);
+    hist = ph_counter_snapshot_get_histogram(snap, i, 1);
+    is(300, ph_counter_histogram_max(hist));
+  }
+  is(1, found);
+  ph_counter_snapshot_free(snap);
+
+  // Just the scopes that were asked for
+  snap = ph_counter_snapshot_scopes(&scope, 1);
+  is(1, ph_counter_snapshot_num_scopes(snap));
+  is_true(ph_counter_snapshot_get_scope(snap, 0) == scope);
+  is(2, ph_counter_snapshot_get_view(snap, 0, 2, view_slots, NULL));
+  is(11, view_slots[0]);
+  ph_counter_snapshot_free(snap);
+
+  ph_counter_scope_delref(scope);
+}
+static bool has_line(ph_string_t *str, const char *line)
+{
+  return memmem(str->buf, str->len, line, strlen(line)) != NULL;
+}
+
+static void prometheusFormat(void)
+{
+  ph_counter_scope_t *scope, *kid;
+  ph_counter_histogram_t *hist;
+  ph_string_t *str;
+  ph_stream_t *stm;
+  ph_sockaddr_t addr;
+  const char *p;
+  uint32_t n;
+  ph_memtype_def_t def = { "test", "prom", 0, 0 };
+  ph_memtype_t mt = ph_memtype_register(&def);
+
+  scope = ph_counter_scope_define(NULL, "testProm", 2);
+  kid = ph_counter_scope_define(scope, "kid-1", 1);
+  ph_counter_scope_register_counter(scope, "sent");
+  ph_counter_scope_register_histogram(scope, "lat", NULL);
+  ph_counter_scope_register_counter(kid, "n");
+
+  ph_counter_scope_add(scope, 0, 42);
+  ph_counter_scope_add(kid, 0, -3);
+  ph_counter_scope_record(scope, 1, 10);
+  ph_counter_scope_record(scope, 1, 10);
+  ph_counter_scope_record(scope, 1, 100);
+
+  str = ph_string_make_empty(mt, 16384);
+  stm = ph_stm_string_open(str);
+  ok(ph_counter_write_prometheus(stm), "wrote metrics");
+  ph_stm_flush(stm);
+  ph_stm_close(stm);
+
+  ok(has_line(str, "# TYPE testProm_sent untyped\ntestProm_sent 42\n"),
+      "plain counter");
+  ok(has_line(str, "\ntestProm_kid_1_n -3\n"), "names are sanitized");
+  ok(has_line(str, "# TYPE testProm_lat histogram\n"
+        "testProm_lat_bucket{le=\"0\"} 0\n"), "empty buckets are written");
+  ok(has_line(str, "\ntestProm_lat_bucket{le=\"10\"} 2\n"
+        "testProm_lat_bucket{le=\"11\"} 2\n"), "cumulative buckets");
+  ok(has_line(str, "\ntestProm_lat_bucket{le=\"101\"} 3\n"), "last value");
+  ok(has_line(str, "testProm_lat_bucket{le=\"+Inf\"} 3\n"
+        "testProm_lat_sum 120\n"
+        "testProm_lat_count 3\n"), "histogram totals");
+
+  // The same series every scrape, whichever buckets are populated
+  hist = ph_counter_scope_get_histogram(scope, 1);
+  for (p = str->buf, n = 0;
+      (p = memmem(p, str->len - (p - str->buf), "testProm_lat_bucket{", 20));
+      p++) {
+    n++;
+  }
+  is(n, ph_counter_histogram_num_buckets(hist) + 1);
+  ph_counter_histogram_free(hist);
+  ok(has_line(str, "\nmemory_"), "includes memory counters");
+
+  ph_string_delref(str);
+  ph_counter_scope_delref(kid);
+  ph_counter_scope_delref(scope);
+
+  // 192.0.2.0/24 is reserved for documentation, so it is never local
+  ph_sockaddr_set_v4(&addr, "192.0.2.1", 9102);
+  is(ph_counter_exporter_start(&addr), PH_ERR);
+}
+static void rates(void)
+{
+  ph_counter_scope_t *scope;
+  ph_counter_rate_entry_t top[4];
+  double rate;
+
+  scope = ph_counter_scope_define(NULL, "testRates", 2);
+  ph_counter_scope_register_counter(scope, "moving");
+  ph_counter_scope_register_counter(scope, "still");
+
+  is(0, ph_counter_scope_get_rate(scope, 0, 1));
+  is(PH_OK, ph_counter_scope_track_rate(scope));
+
+  ph_counter_rate_sample();
+  ph_counter_scope_add(scope, 0, 100);
+  usleep(50000);
+  ph_counter_rate_sample();
+
+  // 100 in ~50ms; allow generous slop for a loaded machine
+  rate = ph_counter_scope_get_rate(scope, 0, 1);
+  ok(rate > 500 && rate <= 2100, "rate %f", rate);
+  is(rate, ph_counter_scope_get_rate(scope, 0, 60));
+  is(0, ph_counter_scope_get_rate(scope, 1, 1));
+
+  is(1, ph_counter_rate_top(top, 4));
+  is_string("testRates", top[0].scope_name);
+  is_string("moving", top[0].slot_name);
+
+  ph_counter_scope_delref(scope);
+}
+
+static void *lock_stream(void *ptr)
+{
+  ph_stream_t *stm = ptr;
+
+  ph_library_init();
+  ph_stm_lock(stm);
+  ph_stm_unlock(stm);
+
+  return NULL;
+}
+
+// a stream lock held while another thread wants it is contended
+static void lockProfiling(void)
+{
+  ph_counter_scope_t *scope;
+  ph_counter_histogram_t *hist;
+  ph_string_t *str;
+  ph_stream_t *stm;
+  pthread_t thr;
+  void *unused;
+  ph_memtype_def_t def = { "test", "locks", 0, 0 };
+  ph_memtype_t mt = ph_memtype_register(&def);
+
+  str = ph_string_make_empty(mt, 16384);
+  stm = ph_stm_string_open(str);
+
+  ph_lock_prof_enable(true);
+  is_true(ph_lock_prof_is_enabled());
+
+  ph_stm_lock(stm);
+  pthread_create(&thr, NULL, lock_stream, stm);
+  usleep(20000);
+  ph_stm_unlock(stm);
+  pthread_join(thr, &unused);
+
+  scope = ph_counter_scope_resolve(NULL, "locks.stream");
+  is_true(scope != NULL);
+  ok(ph_counter_scope_get(scope, 0) >= 2, "counted acquisitions");
+  ok(ph_counter_scope_get(scope, 1) >= 1, "counted contention");
+  hist = ph_counter_scope_get_histogram(scope, 2);
+  ok(ph_counter_histogram_max(hist) >= 10000000, "waited for the holder");
+  ph_counter_histogram_free(hist);
+  ph_counter_scope_delref(scope);
+
+  ph_lock_prof_enable(false);
+  ok(ph_lock_prof_dump(stm), "dumped");
+  ph_stm_flush(stm);
+  ph_stm_close(stm);
+  ok(has_line(str, "\r\nstream "), "lists the stream lock");
+  ok(has_line(str, "corelib/streams/make.c:"), "lists the call site");
+
+  ph_string_delref(str);
+}
 
 int main(int argc, char** argv)
 {
@@ -237,11 +548,17 @@ int main(int argc, char** argv)
   ph_unused_parameter(argv);
 
   ph_library_init();
-  plan_tests(39);
+  plan_tests(101);
 
   ph_assert(true, "always true");
   basicCounterFunctionality();
   concurrentCounters();
+  manyScopes();
+  histograms();
+  snapshotAndFold();
+  prometheusFormat();
+  rates();
+  lockProfiling();
 
   return exit_status();
 }
@@ -1,6 +1,8 @@
 #include "phenom/sysutil.h"
 #include "phenom/string.h"
 #include "phenom/hashtable.h"
+#include "phenom/cht.h"
+#include "phenom/btree.h"
 #include "tap.h"
 
 static ph_memtype_def_t mt_def = { "test", "misc", 0, 0 };
@@ -53,6 +55,349 @@ static void load_data(ph_ht_t *ht, uint32_t howmany)
   free(data);
 }
 
+static uint32_t u32_hash(const void *key)
+{
+  // deliberately weak, so that keys share control byte tags
+  return *(uint32_t*)key;
+}
+
+static struct ph_ht_key_def u32_key_def = {
+  sizeof(uint32_t),
+  u32_hash,
+  NULL,
+  NULL,
+  NULL
+};
+
+static struct ph_ht_val_def u32_val_def = {
+  sizeof(uint32_t),
+  NULL,
+  NULL
+};
+
+// deleting and re-adding keys leaves deleted slots behind; the table
+// must keep finding everything and not grow without bound
+static void churn(void)
+{
+  ph_ht_t ht;
+  uint32_t i, key, missing = 0, wrong = 0;
+  uint32_t *val;
+
+  ok(ph_ht_init(&ht, 100, &u32_key_def, &u32_val_def) == PH_OK, "init");
+  is(128, ht.cur.table_size);
+
+  for (i = 0; i < 100; i++) {
+    key = i * 128;
+    ph_ht_set(&ht, &key, &i);
+  }
+  is(128, ht.cur.table_size);
+
+  for (i = 100; i < 20000; i++) {
+    key = (i - 100) * 128;
+    ph_ht_del(&ht, &key);
+    key = i * 128;
+    ph_ht_set(&ht, &key, &i);
+  }
+  is(100, ph_ht_size(&ht));
+  ok(ht.cur.table_size <= 256, "table_size %" PRIu64, ht.cur.table_size);
+
+  for (i = 19900; i < 20000; i++) {
+    key = i * 128;
+    val = ph_ht_get(&ht, &key);
+    if (!val) {
+      missing++;
+    } else if (*val != i) {
+      wrong++;
+    }
+  }
+  is(0, missing);
+  is(0, wrong);
+  key = 0;
+  is(0, ph_ht_get(&ht, &key));
+
+  ph_ht_destroy(&ht);
+}
+
+// growing moves elements across a few at a time; everything must stay
+// visible while both tables are live
+static void incrementalResize(void)
+{
+  ph_ht_iter_t iter_check;
+  ph_ht_t ht;
+  uint32_t i, key, missing = 0, migrating = 0, size, seen = 0;
+  struct ph_ht_migration *mig;
+  uint64_t pos;
+  void *val, *kp;
+
+  ok(ph_ht_init(&ht, 1, &u32_key_def, &u32_val_def) == PH_OK, "init");
+
+  for (i = 0; i < 4096; i++) {
+    key = i * 7919;
+    ph_ht_set(&ht, &key, &i);
+    if (ht.mig) {
+      migrating++;
+    }
+    // every 64th key goes away again, sometimes from the old table
+    if (i % 64 == 63) {
+      key = (i - 32) * 7919;
+      ph_ht_del(&ht, &key);
+    }
+  }
+  ok(migrating > 0, "saw %" PRIu32 " inserts during a resize", migrating);
+  is(4096 - 64, ph_ht_size(&ht));
+
+  for (i = 0; i < 4096; i++) {
+    key = i * 7919;
+    val = ph_ht_get(&ht, &key);
+    if ((val == NULL) != (i % 64 == 31)) {
+      missing++;
+    }
+  }
+  is(0, missing);
+
+  // Catch the table part way through another resize
+  for (i = 4096; !ht.mig; i++) {
+    key = i * 7919;
+    ph_ht_set(&ht, &key, &i);
+  }
+  mig = ht.mig;
+  pos = ht.mig->pos;
+  size = ph_ht_size(&ht);
+
+  // Iterating sees both tables, and neither it nor deleting the
+  // current element moves anything
+  if (ph_ht_iter_first(&ht, &iter_check, &kp, NULL)) do {
+    if (seen++ % 2 == 0) {
+      key = *(uint32_t*)kp;
+      ph_ht_del(&ht, &key);
+    }
+  } while (ph_ht_iter_next(&ht, &iter_check, &kp, NULL));
+  is(size, seen);
+  is(size - (seen + 1) / 2, ph_ht_size(&ht));
+  ok(ht.mig == mig && ht.mig->pos == pos, "iterating moved nothing");
+
+  // Inserting moves elements across, which halts an iteration
+  // rather than letting it skip them
+  is_true(ph_ht_iter_first(&ht, &iter_check, NULL, NULL));
+  size = ht.mig->nelems;
+  for (i = 1; ht.mig && ht.mig->nelems == size; i++) {
+    key = i * 7907;
+    ph_ht_set(&ht, &key, &i);
+  }
+  ok(!ph_ht_iter_next(&ht, &iter_check, NULL, NULL), "iteration halted");
+
+  ph_ht_destroy(&ht);
+}
+
+#define CHT_KEYS 256
+static ph_cht_t cht;
+static uint32_t cht_done = 0;
+
+// values for key k are always k plus a multiple of CHT_KEYS
+static void *cht_reader(void *arg)
+{
+  uint32_t key, *val, bad = 0, lookups = 0;
+
+  ph_unused_parameter(arg);
+  ph_library_init();
+
+  while (!ck_pr_load_32(&cht_done)) {
+    ph_thread_epoch_begin();
+    for (key = 0; key < CHT_KEYS; key++) {
+      val = ph_cht_get(&cht, &key);
+      if (!val || *val % CHT_KEYS != key) {
+        bad++;
+      }
+      lookups++;
+    }
+    ph_thread_epoch_end();
+  }
+
+  return (void*)(intptr_t)(bad ? -1 : (intptr_t)lookups);
+}
+
+static void concurrentMap(void)
+{
+  pthread_t readers[4];
+  uint32_t i, key, val;
+  void *res;
+  intptr_t failed = 0;
+
+  is(PH_OK, ph_cht_init(&cht, 16, &u32_key_def, &u32_val_def));
+  for (key = 0; key < CHT_KEYS; key++) {
+    ph_cht_set(&cht, &key, &key);
+  }
+  is(CHT_KEYS, ph_cht_size(&cht));
+  key = 1;
+  is(PH_EXISTS, ph_cht_set(&cht, &key, &key));
+
+  for (i = 0; i < 4; i++) {
+    pthread_create(&readers[i], NULL, cht_reader, NULL);
+  }
+  // replace values while the readers look at them
+  for (i = 1; i < 200; i++) {
+    for (key = 0; key < CHT_KEYS; key++) {
+      val = key + (i * CHT_KEYS);
+      ph_cht_replace(&cht, &key, &val);
+    }
+  }
+  ck_pr_store_32(&cht_done, 1);
+  for (i = 0; i < 4; i++) {
+    pthread_join(readers[i], &res);
+    if ((intptr_t)res <= 0) {
+      failed++;
+    }
+  }
+  is(0, failed);
+
+  key = 7;
+  is(PH_OK, ph_cht_lookup(&cht, &key, &val));
+  is(7 + (199 * CHT_KEYS), val);
+  is(PH_OK, ph_cht_del(&cht, &key));
+  is(PH_NOENT, ph_cht_lookup(&cht, &key, &val));
+  is(CHT_KEYS - 1, ph_cht_size(&cht));
+
+  ph_thread_epoch_barrier();
+  ph_cht_destroy(&cht);
+}
+
+static int u32_compare(const void *a, const void *b)
+{
+  uint32_t A = *(uint32_t*)a, B = *(uint32_t*)b;
+
+  if (A < B) {
+    return -1;
+  }
+  return A > B ? 1 : 0;
+}
+
+static struct ph_ht_key_def u32_ordered_key_def = {
+  sizeof(uint32_t),
+  u32_hash,
+  u32_compare,
+  NULL,
+  NULL
+};
+
+// Returns the number of elements, or 0 if they were out of order
+static uint32_t count_in_order(ph_btree_t *tree)
+{
+  ph_btree_iter_t iter;
+  uint32_t *key, *val, n = 0, prev = 0;
+
+  if (ph_btree_iter_first(tree, &iter, (void**)&key, (void**)&val)) do {
+    if ((n && *key <= prev) || *val != *key * 2) {
+      return 0;
+    }
+    prev = *key;
+    n++;
+  } while (ph_btree_iter_next(tree, &iter, (void**)&key, (void**)&val));
+
+  return n;
+}
+
+static void hashBytes(void)
+{
+  char buf[64];
+  uint64_t hashes[sizeof(buf) + 1];
+  uint32_t i, j, dups = 0;
+
+  memset(buf, 'a', sizeof(buf));
+  is(ph_hash_bytes(buf, 17), ph_hash_bytes(buf, 17));
+  ok(ph_hash_bytes_seeded(buf, 17, 1) != ph_hash_bytes_seeded(buf, 17, 2),
+      "seed changes the hash");
+  is(ph_hash_bytes_seeded("hello", 5, 42),
+      ph_hash_bytes_seeded("hello", 5, 42));
+
+  // Every prefix length must hash differently, including the short
+  // keys that take the overlapping read paths
+  for (i = 0; i <= sizeof(buf); i++) {
+    hashes[i] = ph_hash_bytes(buf, i);
+    for (j = 0; j < i; j++) {
+      if (hashes[j] == hashes[i]) {
+        dups++;
+      }
+    }
+  }
+  is(dups, 0);
+
+  // A single flipped bit anywhere in the key changes the hash
+  dups = 0;
+  for (i = 0; i < sizeof(buf) * 8; i++) {
+    buf[i / 8] ^= 1 << (i % 8);
+    if (ph_hash_bytes(buf, sizeof(buf)) == hashes[sizeof(buf)]) {
+      dups++;
+    }
+    buf[i / 8] ^= 1 << (i % 8);
+  }
+  is(dups, 0);
+}
+
+#define BTREE_KEYS 5000
+static void orderedMap(void)
+{
+  ph_btree_t tree;
+  ph_btree_iter_t iter;
+  uint32_t i, key, val, n, *kp, *vp;
+
+  is(PH_OK, ph_btree_init(&tree, &u32_ordered_key_def, &u32_val_def));
+  ok(!ph_btree_iter_first(&tree, &iter, NULL, NULL), "empty");
+
+  // even keys, inserted out of order, so that splits happen all over
+  for (i = 0; i < BTREE_KEYS; i++) {
+    key = ((i * 7919) % BTREE_KEYS) * 2;
+    val = key * 2;
+    if (ph_btree_set(&tree, &key, &val) != PH_OK) {
+      break;
+    }
+  }
+  is(BTREE_KEYS, ph_btree_size(&tree));
+  ok(tree.height > 1, "tree has interior levels");
+  is(BTREE_KEYS, count_in_order(&tree));
+
+  key = 1234;
+  vp = ph_btree_get(&tree, &key);
+  ok(vp && *vp == 2468, "get");
+  val = 0;
+  is(PH_EXISTS, ph_btree_set(&tree, &key, &val));
+  key = 1235;
+  is(PH_NOENT, ph_btree_lookup(&tree, &key, &val, false));
+
+  // keys in [1001, 1201)
+  n = 0;
+  key = 1001;
+  if (ph_btree_lower_bound(&tree, &iter, &key, (void**)&kp, (void**)&vp)) do {
+    if (*kp >= 1201) {
+      break;
+    }
+    n++;
+  } while (ph_btree_iter_next(&tree, &iter, (void**)&kp, (void**)&vp));
+  is(100, n);
+  key = (BTREE_KEYS * 2) - 1;
+  ok(!ph_btree_lower_bound(&tree, &iter, &key, NULL, NULL), "past the end");
+
+  for (key = 0; key < BTREE_KEYS * 2; key += 2) {
+    if (key % 3 && ph_btree_del(&tree, &key) != PH_OK) {
+      break;
+    }
+  }
+  n = count_in_order(&tree);
+  is(ph_btree_size(&tree), n);
+  is((BTREE_KEYS + 2) / 3, n);
+
+  for (key = 0; key < BTREE_KEYS * 2; key += 6) {
+    ph_btree_del(&tree, &key);
+  }
+  is(0, ph_btree_size(&tree));
+  ok(tree.root == NULL, "all nodes released");
+
+  key = 4;
+  val = 8;
+  is(PH_OK, ph_btree_set(&tree, &key, &val));
+  is(1, count_in_order(&tree));
+  ph_btree_destroy(&tree);
+}
+
 int main(int argc, char **argv)
 {
   ph_ht_t ht;
@@ -64,7 +409,7 @@ int main(int argc, char **argv)
   ph_unused_parameter(argv);
 
   ph_library_init();
-  plan_tests(221);
+  plan_tests(303);
 
   mt_misc = ph_memtype_register(&mt_def);
 
@@ -153,12 +498,21 @@ int main(int argc, char **argv)
   load_data(&ht, 8);
   load_data(&ht, 16);
   load_data(&ht, 64);
+
+  is(PH_OK, ph_ht_keep_ordered(&ht));
+  load_data(&ht, 16);
   // to test extreme size, uncomment this.  It is too expensive to run
   // as a unit test
   // load_data(&ht, 100000000);
 
   ph_ht_destroy(&ht);
 
+  churn();
+  incrementalResize();
+  concurrentMap();
+  orderedMap();
+  hashBytes();
+
   return exit_status();
 }
 
@@ -18,6 +18,12 @@
 #include "phenom/counter.h"
 #include "phenom/sysutil.h"
 #include "phenom/printf.h"
+#include "phenom/thread.h"
+#include "phenom/string.h"
+#include "phenom/hook.h"
+#include "phenom/json.h"
+#include "phenom/configuration.h"
+#include "phenom/stream.h"
 #include "tap.h"
 
 static void dump_mem_stats(void)
@@ -51,6 +57,455 @@ struct widget {
   int aval;
 };
 
+#define NUM_SLAB_WIDGETS 300
+static ph_memtype_t mt_slab;
+
+static void *free_widgets(void *arg)
+{
+  struct widget **widgets = arg;
+  int i;
+
+  for (i = 0; i < NUM_SLAB_WIDGETS / 2; i++) {
+    ph_mem_free(mt_slab, widgets[i]);
+  }
+  return NULL;
+}
+
+static void test_slab(void)
+{
+  ph_memtype_def_t def = {
+    "memtest1", "slab", sizeof(struct widget),
+    PH_MEM_FLAGS_ZERO|PH_MEM_FLAGS_SLAB
+  };
+  struct widget *widgets[NUM_SLAB_WIDGETS];
+  ph_mem_stats_t st;
+  ph_thread_t *thr;
+  int i, bad = 0;
+
+  mt_slab = ph_memtype_register(&def);
+  is_true(mt_slab != PH_MEMTYPE_INVALID);
+
+  for (i = 0; i < NUM_SLAB_WIDGETS; i++) {
+    widgets[i] = ph_mem_alloc(mt_slab);
+    if (!widgets[i] || widgets[i]->aval != 0) {
+      bad++;
+      continue;
+    }
+    widgets[i]->aval = i;
+  }
+  is(0, bad);
+
+  for (i = 0; i < NUM_SLAB_WIDGETS; i++) {
+    if (widgets[i]->aval != i) {
+      bad++;
+    }
+  }
+  is(0, bad);
+
+  ph_mem_stat(mt_slab, &st);
+  is(NUM_SLAB_WIDGETS, st.allocs);
+  is(NUM_SLAB_WIDGETS * sizeof(struct widget), st.bytes);
+  is(0, st.frees);
+
+  // Free half of them from another thread
+  thr = ph_thread_spawn(free_widgets, widgets);
+  ph_thread_join(thr, NULL);
+
+  ph_mem_stat(mt_slab, &st);
+  is(NUM_SLAB_WIDGETS / 2, st.frees);
+  is((NUM_SLAB_WIDGETS / 2) * sizeof(struct widget), st.bytes);
+
+  for (i = NUM_SLAB_WIDGETS / 2; i < NUM_SLAB_WIDGETS; i++) {
+    ph_mem_free(mt_slab, widgets[i]);
+  }
+
+  ph_mem_stat(mt_slab, &st);
+  is(NUM_SLAB_WIDGETS, st.allocs);
+  is(NUM_SLAB_WIDGETS, st.frees);
+  is(0, st.bytes);
+
+  // The items returned by the other thread can be handed out again,
+  // and still honor PH_MEM_FLAGS_ZERO
+  for (i = 0; i < NUM_SLAB_WIDGETS; i++) {
+    widgets[i] = ph_mem_alloc(mt_slab);
+    if (!widgets[i] || widgets[i]->aval != 0) {
+      bad++;
+    }
+  }
+  is(0, bad);
+  for (i = 0; i < NUM_SLAB_WIDGETS; i++) {
+    ph_mem_free(mt_slab, widgets[i]);
+  }
+
+  ph_mem_stat(mt_slab, &st);
+  is(2 * NUM_SLAB_WIDGETS, st.allocs);
+  is(0, st.bytes);
+}
+
+#define RECYCLE_ALLOCS 10
+#define RECYCLE_ROUNDS 4
+
+static void *alloc_widgets(void *arg)
+{
+  struct widget **widgets = arg;
+  int i;
+
+  for (i = 0; i < RECYCLE_ALLOCS; i++) {
+    widgets[i] = ph_mem_alloc(mt_slab);
+  }
+  return ph_thread_self();
+}
+
+static void test_slab_recycle(void)
+{
+  struct widget *widgets[RECYCLE_ROUNDS * RECYCLE_ALLOCS];
+  ph_mem_stats_t st;
+  ph_thread_t *thr;
+  void *rec, *prev = NULL;
+  bool recycled = false;
+  int i;
+
+  // Each thread exits before the next starts, so the later ones get the
+  // records of the earlier ones; their counts must not go astray
+  for (i = 0; i < RECYCLE_ROUNDS; i++) {
+    thr = ph_thread_spawn(alloc_widgets, widgets + (i * RECYCLE_ALLOCS));
+    ph_thread_join(thr, &rec);
+    if (rec == prev) {
+      recycled = true;
+    }
+    prev = rec;
+  }
+  ok(recycled, "a thread record was recycled");
+
+  ph_mem_stat(mt_slab, &st);
+  is(2 * NUM_SLAB_WIDGETS + RECYCLE_ROUNDS * RECYCLE_ALLOCS, st.allocs);
+  is(RECYCLE_ROUNDS * RECYCLE_ALLOCS * sizeof(struct widget), st.bytes);
+
+  for (i = 0; i < RECYCLE_ROUNDS * RECYCLE_ALLOCS; i++) {
+    ph_mem_free(mt_slab, widgets[i]);
+  }
+  ph_mem_stat(mt_slab, &st);
+  is(0, st.bytes);
+}
+
+static void test_arena(void)
+{
+  ph_memtype_def_t def = { "memtest1", "arena", 0, 0 };
+  ph_memtype_t mt = ph_memtype_register(&def);
+  ph_arena_t *arena;
+  ph_mem_stats_t st;
+  ph_string_t *str;
+  char *a, *b, *big;
+
+  arena = ph_arena_new(mt, 1024);
+  ok(arena, "made arena");
+
+  a = ph_arena_alloc(arena, 3);
+  b = ph_arena_alloc(arena, 5);
+  is_true(((uintptr_t)a & 15) == 0);
+  is_true(((uintptr_t)b & 15) == 0);
+  is(16, b - a);
+  is(32, ph_arena_bytes(arena));
+
+  ph_mem_stat(mt, &st);
+  is(1, st.allocs);
+  is(1024, st.bytes);
+
+  // Large allocations get their own chunk and leave the current one be
+  big = ph_arena_alloc(arena, 4000);
+  memset(big, 'x', 4000);
+  is_true(ph_arena_alloc(arena, 16) == b + 16);
+
+  str = ph_string_make_arena(arena, "hello", 5);
+  ok(ph_string_equal_cstr(str, "hello"), "arena string");
+  is(0, str->buf[str->len]);
+  ph_string_addref(str);
+  ph_string_delref(str);
+  ph_string_delref(str);
+
+  // Only the first chunk survives a reset
+  ph_arena_reset(arena);
+  is(0, ph_arena_bytes(arena));
+  ph_mem_stat(mt, &st);
+  is(1024, st.bytes);
+  is_true(ph_arena_alloc(arena, 8) == a);
+
+  ph_arena_destroy(arena);
+  ph_mem_stat(mt, &st);
+  is(0, st.bytes);
+  is(st.allocs, st.frees);
+}
+
+static struct {
+  int calls;
+  ph_memtype_t mt;
+  bool facility, exceeded;
+} soft_hits;
+
+static void soft_limit_hook(ph_hook_invocation_t *inv, void *closure,
+    uint8_t nargs, void **args)
+{
+  ph_unused_parameter(inv);
+  ph_unused_parameter(closure);
+  ph_unused_parameter(nargs);
+
+  soft_hits.calls++;
+  soft_hits.mt = *(ph_memtype_t*)args[0];
+  soft_hits.facility = *(bool*)args[1];
+  soft_hits.exceeded = *(bool*)args[2];
+}
+
+static void test_limits(void)
+{
+  ph_memtype_def_t def = { "memtest1", "limited", 0, 0 };
+  ph_memtype_def_t fac_defs[] = {
+    { "memtest2", "one", 0, 0 },
+    { "memtest2", "two", 0, 0 },
+  };
+  ph_memtype_def_t late_def = { "memtest2", "late", 0, 0 };
+  ph_memtype_t mt = ph_memtype_register(&def);
+  ph_memtype_t fac[2], late;
+  ph_mem_stats_t st;
+  ph_variant_t *cfg;
+  char *a, *b;
+
+  is(PH_OK, ph_hook_register_cstr(PH_MEM_SOFT_LIMIT_HOOK_NAME,
+        soft_limit_hook, NULL, 0, NULL));
+  is(PH_OK, ph_mem_set_limit(mt, 50000, 100000));
+
+  a = ph_mem_alloc_size(mt, 40000);
+  ok(a, "under the soft limit");
+  is(0, soft_hits.calls);
+
+  b = ph_mem_alloc_size(mt, 20000);
+  ok(b, "over the soft limit");
+  is(1, soft_hits.calls);
+  is(mt, soft_hits.mt);
+  is_true(!soft_hits.facility);
+  is_true(soft_hits.exceeded);
+
+  ok(ph_mem_alloc_size(mt, 50000) == NULL, "hard limit fails alloc");
+  ok(ph_mem_realloc(mt, a, 100000) == NULL, "hard limit fails realloc");
+  ph_mem_stat(mt, &st);
+  is(2, st.oom);
+  is(60000, st.bytes);
+  is(50000, st.soft_limit);
+  is(100000, st.hard_limit);
+
+  ph_mem_free(mt, a);
+  ph_mem_free(mt, b);
+  is(2, soft_hits.calls);
+  is_true(!soft_hits.exceeded);
+
+  // Facility limits cover all of the memtypes in the facility
+  ph_memtype_register_block(2, fac_defs, fac);
+  is(PH_OK, ph_mem_set_facility_limit("memtest2", 0, 10000));
+  a = ph_mem_alloc_size(fac[0], 6000);
+  ok(a, "under facility limit");
+  ok(ph_mem_alloc_size(fac[1], 6000) == NULL, "over facility limit");
+
+  // including those registered later on
+  late = ph_memtype_register(&late_def);
+  ok(ph_mem_alloc_size(late, 6000) == NULL, "late memtype is limited");
+  ph_mem_free(fac[0], a);
+  a = ph_mem_alloc_size(late, 6000);
+  ok(a, "room again after free");
+  ph_mem_free(late, a);
+
+  cfg = ph_json_load_cstr(
+      "{\"memory\": {\"limits\": {\"memtest2/late\": {\"hard\": 100}}}}",
+      0, NULL);
+  ph_config_set_global(cfg);
+  ph_var_delref(cfg);
+  ph_mem_stat(late, &st);
+  is(100, st.hard_limit);
+  ok(ph_mem_alloc_size(late, 200) == NULL, "configured limit applies");
+
+  // Dropping it from the configuration lifts it, but leaves the limits
+  // set through the API alone
+  cfg = ph_json_load_cstr("{}", 0, NULL);
+  ph_config_set_global(cfg);
+  ph_var_delref(cfg);
+  ph_mem_stat(late, &st);
+  is(0, st.hard_limit);
+  a = ph_mem_alloc_size(late, 200);
+  ok(a, "unconfigured limit is lifted");
+  ph_mem_free(late, a);
+  ph_mem_stat(mt, &st);
+  is(100000, st.hard_limit);
+}
+
+#define IDLE_THREADS 20
+
+static ph_memtype_t mt_idle;
+static uint32_t idle_phase, idle_count;
+
+static void idle_wait(uint32_t phase)
+{
+  ck_pr_inc_32(&idle_count);
+  while (ck_pr_load_32(&idle_phase) < phase) {
+    usleep(1000);
+  }
+}
+
+static void *hold_grant(void *arg)
+{
+  ph_unused_parameter(arg);
+
+  ph_mem_free(mt_idle, ph_mem_alloc_size(mt_idle, 10));
+  idle_wait(1);
+  ph_mem_thread_idle(ph_thread_self());
+  idle_wait(2);
+  return NULL;
+}
+
+// Each thread keeps a reservation against the limit, which it must
+// give back once it goes idle
+static void test_idle_grants(void)
+{
+  ph_memtype_def_t def = { "memtest1", "idle", 0, 0 };
+  ph_thread_t *thr[IDLE_THREADS];
+  char *a;
+  int i;
+
+  mt_idle = ph_memtype_register(&def);
+  is(PH_OK, ph_mem_set_limit(mt_idle, 0, 32000));
+
+  for (i = 0; i < IDLE_THREADS; i++) {
+    thr[i] = ph_thread_spawn(hold_grant, NULL);
+  }
+  while (ck_pr_load_32(&idle_count) < IDLE_THREADS) {
+    usleep(1000);
+  }
+  ok(ph_mem_alloc_size(mt_idle, 20000) == NULL,
+      "reservations held by other threads count");
+
+  ck_pr_store_32(&idle_phase, 1);
+  while (ck_pr_load_32(&idle_count) < 2 * IDLE_THREADS) {
+    usleep(1000);
+  }
+  a = ph_mem_alloc_size(mt_idle, 20000);
+  ok(a, "idle threads gave their reservations back");
+  ph_mem_free(mt_idle, a);
+
+  ck_pr_store_32(&idle_phase, 2);
+  for (i = 0; i < IDLE_THREADS; i++) {
+    ph_thread_join(thr[i], NULL);
+  }
+}
+
+#define CHURN_THREADS 4
+
+static ph_memtype_t mt_churn;
+static bool churning;
+
+static void *churn(void *arg)
+{
+  void *ptrs[8];
+  int i;
+
+  ph_unused_parameter(arg);
+  while (ck_pr_load_8((uint8_t*)&churning)) {
+    for (i = 0; i < 8; i++) {
+      ptrs[i] = ph_mem_alloc_size(mt_churn, 100);
+    }
+    for (i = 0; i < 8; i++) {
+      ph_mem_free(mt_churn, ptrs[i]);
+    }
+  }
+  return NULL;
+}
+
+// A limit set while the memtype is busy must count what was already in
+// use, and must not lose track of what is freed while it is being set
+static void test_limit_while_busy(void)
+{
+  ph_memtype_def_t def = { "memtest1", "busy", 0, 0 };
+  ph_thread_t *thr[CHURN_THREADS];
+  char *old, *a, *b;
+  int i;
+
+  mt_churn = ph_memtype_register(&def);
+  old = ph_mem_alloc_size(mt_churn, 80000);
+
+  churning = true;
+  for (i = 0; i < CHURN_THREADS; i++) {
+    thr[i] = ph_thread_spawn(churn, NULL);
+  }
+  usleep(10000);
+  is(PH_OK, ph_mem_set_limit(mt_churn, 0, 100000));
+  usleep(10000);
+  ck_pr_store_8((uint8_t*)&churning, false);
+  for (i = 0; i < CHURN_THREADS; i++) {
+    ph_thread_join(thr[i], NULL);
+  }
+
+  a = ph_mem_alloc_size(mt_churn, 10000);
+  ok(a, "room under the limit");
+  ok(ph_mem_alloc_size(mt_churn, 15000) == NULL,
+      "memory from before the limit counts against it");
+  ph_mem_free(mt_churn, old);
+  ph_mem_free(mt_churn, a);
+
+  b = ph_mem_alloc_size(mt_churn, 90000);
+  ok(b, "freeing it makes room");
+  ph_mem_free(mt_churn, b);
+}
+
+static void test_prof(void)
+{
+  ph_memtype_def_t defs[] = {
+    { "memtest1", "sampled", 0, 0 },
+    { "memtest1", "profile", 0, 0 },
+    { "memtest1", "resized", 0, 0 },
+  };
+  ph_memtype_t mt[3];
+  ph_string_t *str;
+  ph_stream_t *stm;
+  void *ptrs[10], *moved;
+  int i;
+  const char *expect = "# memtest1/sampled\n5: 500 [10: 1000] @";
+  const char *resized = "# memtest1/resized\n0: 0 [1: 100] @";
+
+  ph_memtype_register_block(3, defs, mt);
+
+  // Sample every allocation so that the counts are predictable
+  ph_mem_prof_set_rate(1);
+  is(1, ph_mem_prof_get_rate());
+
+  for (i = 0; i < 10; i++) {
+    ptrs[i] = ph_mem_alloc_size(mt[0], 100);
+  }
+  moved = ph_mem_alloc_size(mt[2], 100);
+  ph_mem_prof_set_rate(0);
+  // The sample is released along with the old block
+  moved = ph_mem_realloc(mt[2], moved, 64 * 1024);
+  for (i = 0; i < 5; i++) {
+    ph_mem_free(mt[0], ptrs[i]);
+  }
+
+  str = ph_string_make_empty(mt[1], 16384);
+  stm = ph_stm_string_open(str);
+  ok(ph_mem_prof_dump(stm), "dumped profile");
+  ph_stm_flush(stm);
+  ph_stm_close(stm);
+
+  ok(str->len > 0 && !memcmp(str->buf, "heap profile: ", 14),
+      "pprof header");
+  ok(memmem(str->buf, str->len, expect, strlen(expect)) != NULL,
+      "live and cumulative samples for our stack");
+  ok(memmem(str->buf, str->len, resized, strlen(resized)) != NULL,
+      "realloc forgets the old block");
+  ok(memmem(str->buf, str->len, "MAPPED_LIBRARIES:", 17) != NULL,
+      "has maps");
+  ph_string_delref(str);
+  ph_mem_free(mt[2], moved);
+
+  for (i = 5; i < 10; i++) {
+    ph_mem_free(mt[0], ptrs[i]);
+  }
+}
+
 int main(int argc, char** argv)
 {
   uint32_t i;
@@ -59,7 +514,7 @@ int main(int argc, char** argv)
   ph_unused_parameter(argv);
 
   ph_library_init();
-  plan_tests(46);
+  plan_tests(119);
 
   ph_memtype_def_t defs[] = {
     { "memtest1", "widget", sizeof(struct widget), PH_MEM_FLAGS_ZERO },
@@ -160,6 +615,14 @@ int main(int argc, char** argv)
   is(3, st.frees);
   is(1, st.reallocs);
 
+  test_slab();
+  test_slab_recycle();
+  test_arena();
+  test_limits();
+  test_limit_while_busy();
+  test_idle_grants();
+  test_prof();
+
   dump_mem_stats();
 
   return exit_status();
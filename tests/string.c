@@ -17,6 +17,7 @@
 #include "phenom/sysutil.h"
 #include "phenom/string.h"
 #include "phenom/stream.h"
+#include "phenom/thread.h"
 #include "tap.h"
 
 static ph_memtype_def_t mt_def = { "test", "misc", 0, 0 };
@@ -205,6 +206,68 @@ static void string_stream_tests(void)
   ph_string_delref(str);
 }
 
+#define INTERN_KEYS 200
+
+static void *intern_keys(void *arg)
+{
+  ph_string_t **out = arg;
+  char name[16];
+  int i;
+
+  for (i = 0; i < INTERN_KEYS; i++) {
+    snprintf(name, sizeof(name), "key%d", i);
+    out[i] = ph_string_intern(name, strlen(name));
+  }
+  return NULL;
+}
+
+static void intern_tests(void)
+{
+  static ph_string_t *keys[4][INTERN_KEYS];
+  PH_STRING_DECLARE_STATIC(plain, "interned");
+  char longkey[PH_STRING_INTERN_MAX_LEN + 1];
+  ph_thread_t *thr[4];
+  ph_string_t *a, *b;
+  int i, j, mismatched = 0;
+
+  a = ph_string_intern("interned", 8);
+  b = ph_string_intern("interned!", 8);
+  ok(a && a == b, "same contents, same string");
+  ok(a->interned, "flagged as interned");
+  is(a->buf[8], '\0');
+  ok(ph_string_equal(a, &plain), "equals an ordinary string");
+  ok(!ph_string_equal(a, ph_string_intern("other", 5)), "unequal keys");
+
+  // Reference counting doesn't touch it
+  ph_string_addref(a);
+  is(a->ref, 1);
+  ph_string_delref(a);
+  ph_string_delref(a);
+  is(a->ref, 1);
+  ok(ph_string_equal_cstr(a, "interned"), "still valid");
+
+  memset(longkey, 'x', sizeof(longkey));
+  ok(ph_string_intern(longkey, sizeof(longkey)) == NULL, "too long to intern");
+  ok(ph_string_intern(longkey, sizeof(longkey) - 1) != NULL,
+      "longest that can be interned");
+
+  // Threads racing to intern the same keys all get the same strings
+  for (i = 0; i < 4; i++) {
+    thr[i] = ph_thread_spawn(intern_keys, keys[i]);
+  }
+  for (i = 0; i < 4; i++) {
+    ph_thread_join(thr[i], NULL);
+  }
+  for (i = 0; i < INTERN_KEYS; i++) {
+    for (j = 0; j < 4; j++) {
+      if (!keys[j][i] || keys[j][i] != keys[0][i]) {
+        mismatched++;
+      }
+    }
+  }
+  is(mismatched, 0);
+}
+
 int main(int argc, char **argv)
 {
   ph_string_t *str, *str2;
@@ -213,11 +276,12 @@ int main(int argc, char **argv)
   ph_unused_parameter(argv);
 
   ph_library_init();
-  plan_tests(122);
+  plan_tests(133);
 
   mt_misc = ph_memtype_register(&mt_def);
 
   stack_tests();
+  intern_tests();
 
   // Tests reallocation
   str = ph_string_make_empty(mt_misc, 16);